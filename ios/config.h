@@ -67,6 +67,7 @@
 #define ENABLE_INOTIFY 0
 #define CONFIG_REALPATH 1
 #define ENABLE_REALPATH 1
+#define ENABLE_MMAP 1
 #define ENABLE_EMU_THREAD_SPECIFICS 0
 #define ENABLE_LIBFONTCONFIG 0
 #define ENABLE_SQLITE_VFS 0
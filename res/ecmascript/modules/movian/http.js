@@ -103,3 +103,16 @@ exports.request = function(url, ctrl, callback) {
   var res = io.httpReq(url, ctrl || {});
   return new HttpResponse(res);
 }
+
+
+/**
+ * Open connections in the background to the hosts of the given URL(s)
+ * so that requests which follow soon can skip DNS, TCP and TLS setup
+ */
+exports.prewarm = function(urls) {
+  var io = require('native/io');
+  if(!(urls instanceof Array))
+    urls = [urls];
+  for(var i = 0; i < urls.length; i++)
+    io.httpPrewarm(urls[i]);
+}
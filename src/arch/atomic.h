@@ -58,6 +58,12 @@ atomic_set(atomic_t *a, int v)
   a->v = v;
 }
 
+static inline int
+atomic_cas(atomic_t *a, int oldval, int newval)
+{
+  return __sync_bool_compare_and_swap(&a->v, oldval, newval);
+}
+
 #elif defined(_MSC_VER)
 
 #include <Windows.h>
@@ -97,6 +103,12 @@ atomic_set(atomic_t *a, int v)
   a->v = v;
 }
 
+static __inline int
+atomic_cas(atomic_t *a, int oldval, int newval)
+{
+  return InterlockedCompareExchange(&a->v, newval, oldval) == oldval;
+}
+
 #else
 #error Missing atomic ops
 #endif
@@ -119,6 +119,20 @@ audio_init(void)
   audio_mastervol_init();
   audio_class = audio_driver_init(asettings);
 
+  settings_create_separator(asettings,
+			    _p("Music playback"));
+
+  setting_create(SETTING_INT, asettings,
+                 SETTINGS_INITIAL_UPDATE,
+                 SETTING_TITLE(_p("Open next track before end (gapless)")),
+                 SETTING_RANGE(0, 10),
+                 SETTING_VALUE(3),
+                 SETTING_UNIT_CSTR("s"),
+                 SETTING_ZERO_TEXT(_p("Off")),
+                 SETTING_WRITE_INT(&gconf.audio_gapless_preload),
+                 SETTING_STORE("audio2", "gaplesspreload"),
+                 NULL);
+
   settings_create_separator(asettings,
 			    _p("Video playback"));
 
@@ -613,6 +627,25 @@ audio_process_audio(audio_decoder_t *ad, media_buf_t *mb)
 }
 
 
+/**
+ * Log for how long the decoder had nothing to decode. Between tracks
+ * this is an upper bound of the audible gap (the output device
+ * buffers a bit)
+ */
+static void
+audio_report_dry(audio_decoder_t *ad)
+{
+  const int64_t d = arch_get_ts() - ad->ad_dry_since;
+  ad->ad_dry_since = 0;
+
+  if(d > 10000000 || ad->ad_out_sample_rate == 0)
+    return; // Was idle, not an underrun
+
+  TRACE(TRACE_DEBUG, "Audio", "Decoder ran dry for %d samples (%dms)",
+        (int)(d * ad->ad_out_sample_rate / 1000000), (int)(d / 1000));
+}
+
+
 /**
  *
  */
@@ -679,12 +712,16 @@ audio_decode_thread(void *aux)
       TAILQ_REMOVE(&mq->mq_q_ctrl, ctrl, mb_link);
       mb = ctrl;
     } else if(data != NULL && avail < ad->ad_tile_size) {
+      if(ad->ad_dry_since)
+        audio_report_dry(ad);
       TAILQ_REMOVE(&mq->mq_q_data, data, mb_link);
       mp_check_underrun(mp);
       mb = data;
       if(mb->mb_dts != PTS_UNSET)
         mq->mq_last_deq_dts = mb->mb_dts;
     } else {
+      if(data == NULL && !ad->ad_paused && ad->ad_dry_since == 0)
+        ad->ad_dry_since = arch_get_ts();
       hts_cond_wait(&mq->mq_avail, &mp->mp_mutex);
       continue;
     }
@@ -742,6 +779,7 @@ audio_decode_thread(void *aux)
 
       case MB_CTRL_PAUSE:
 	ad->ad_paused = 1;
+        ad->ad_dry_since = 0;
 	if(ac->ac_pause)
 	  ac->ac_pause(ad);
 	break;
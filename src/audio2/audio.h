@@ -83,6 +83,8 @@ typedef struct audio_decoder {
 
   int ad_paused;
 
+  int64_t ad_dry_since; // When decoder ran out of data (0 if it has data)
+
   int ad_in_codec_id;
   int ad_in_sample_rate;
   enum AVSampleFormat ad_in_sample_format;
@@ -76,6 +76,11 @@ typedef struct bt_global {
 
   uint64_t btg_disk_avail;
 
+  int btg_hash_queue_len;
+  int btg_hash_threads;
+  uint64_t btg_hashed_bytes;
+  int64_t btg_hash_time;    // Sum of time spent hashing (µs)
+
 } bt_global_t;
 
 extern bt_global_t btg;
@@ -313,6 +318,7 @@ typedef struct torrent_piece {
   uint8_t tp_disk_fail     : 1;
   uint8_t tp_load_req      : 1;
   uint8_t tp_loadfail      : 1;
+  uint8_t tp_hash_queued   : 1;
 
   struct torrent_fh_list tp_active_fh;
 
@@ -553,7 +559,7 @@ void torrent_io_do_requests(torrent_t *to);
 void torrent_receive_block(torrent_block_t *tb, const void *buf,
                            int begin, int len, torrent_t *to, peer_t *p);
 
-void torrent_hash_wakeup(void);
+void torrent_hash_enqueue(torrent_t *to, torrent_piece_t *tp);
 
 int torrent_parse_infodict(torrent_t *to, struct htsmsg *info,
                            char *errbuf, size_t errlen);
@@ -273,7 +273,7 @@ torrent_read_from_disk(torrent_t *to, torrent_piece_t *tp)
   if(ok) {
     tp->tp_complete = 1;
     tp->tp_on_disk = 1;
-    torrent_hash_wakeup();
+    torrent_hash_enqueue(to, tp);
   } else {
     tp->tp_loadfail = 1;
     to->to_loadfail = 1;
@@ -45,7 +45,22 @@ struct torrent_list torrents;
 static int torrent_pendings_signal;
 static int torrent_boot_periodic_signal;
 static int torrent_metainfo_signal;
-static int torrent_hash_thread_running;
+
+/**
+ * Pieces waiting to be verified. Fed when a piece completes and
+ * drained by up to TORRENT_HASH_THREADS threads
+ */
+#define TORRENT_HASH_THREADS 4
+
+typedef struct torrent_hash_job {
+  TAILQ_ENTRY(torrent_hash_job) thj_link;
+  torrent_t *thj_torrent;
+  torrent_piece_t *thj_piece;
+} torrent_hash_job_t;
+
+static TAILQ_HEAD(, torrent_hash_job) torrent_hash_queue =
+  TAILQ_HEAD_INITIALIZER(torrent_hash_queue);
+static int torrent_hash_threads_idle;
 
 hts_cond_t torrent_piece_hash_needed_cond;
 hts_cond_t torrent_piece_io_needed_cond;
@@ -490,7 +505,7 @@ torrent_receive_block(torrent_block_t *tb, const void *buf,
     // Piece complete
 
     tp->tp_complete = 1;
-    torrent_hash_wakeup();
+    torrent_hash_enqueue(to, tp);
   }
   torrent_io_do_requests(to);
 }
@@ -1657,25 +1672,22 @@ torrent_boot_periodic(void)
 
 
 /**
- *
+ * Called with the job's references held, consumes them
  */
 static void
 torrent_piece_verify_hash(torrent_t *to, torrent_piece_t *tp)
 {
   uint8_t digest[20];
-  sha1_decl(shactx);
-
-  torrent_retain(to);
-  tp->tp_refcount++;
 
   hts_mutex_unlock(&bittorrent_mutex);
   int64_t ts = arch_get_ts();
-  sha1_init(shactx);
-  sha1_update(shactx, tp->tp_data, tp->tp_piece_length);
-  sha1_final(shactx, digest);
+  sha1_digest(digest, tp->tp_data, tp->tp_piece_length);
   ts = arch_get_ts() - ts;
   hts_mutex_lock(&bittorrent_mutex);
 
+  btg.btg_hashed_bytes += tp->tp_piece_length;
+  btg.btg_hash_time += ts;
+
   tp->tp_hash_computed = 1;
 
 
@@ -1712,54 +1724,137 @@ torrent_piece_verify_hash(torrent_t *to, torrent_piece_t *tp)
 static void *
 bt_hash_thread(void *aux)
 {
-  torrent_t *to;
+  torrent_hash_job_t *thj;
 
   hts_mutex_lock(&bittorrent_mutex);
 
   while(1) {
 
-  restart:
-
-    LIST_FOREACH(to, &torrents, to_link) {
-      torrent_piece_t *tp;
-      TAILQ_FOREACH(tp, &to->to_active_pieces, tp_link) {
-	if(tp->tp_complete && !tp->tp_hash_computed) {
-	  torrent_piece_verify_hash(to, tp);
-          /**
-           * 'to' may be invalid here because we have unlocked so restart
-           * from begining
-           */
-	  goto restart;
-	}
-      }
+    if((thj = TAILQ_FIRST(&torrent_hash_queue)) == NULL) {
+      torrent_hash_threads_idle++;
+      int timeout = hts_cond_wait_timeout(&torrent_piece_hash_needed_cond,
+                                          &bittorrent_mutex, 60000);
+      torrent_hash_threads_idle--;
+      if(timeout && TAILQ_FIRST(&torrent_hash_queue) == NULL)
+        break;
+      continue;
     }
 
-    if(hts_cond_wait_timeout(&torrent_piece_hash_needed_cond,
-			     &bittorrent_mutex, 60000))
-      break;
+    TAILQ_REMOVE(&torrent_hash_queue, thj, thj_link);
+    btg.btg_hash_queue_len--;
+
+    torrent_piece_t *tp = thj->thj_piece;
+    torrent_t *to = thj->thj_torrent;
+    free(thj);
+
+    tp->tp_hash_queued = 0;
+    torrent_piece_verify_hash(to, tp);
   }
 
-  torrent_hash_thread_running = 0;
+  btg.btg_hash_threads--;
   hts_mutex_unlock(&bittorrent_mutex);
   return NULL;
 }
 
 
 /**
+ * Queue a completed piece for verification
  *
+ * bittorrent_mutex must be held
  */
 void
-torrent_hash_wakeup(void)
+torrent_hash_enqueue(torrent_t *to, torrent_piece_t *tp)
 {
-  if(!torrent_hash_thread_running) {
-    torrent_hash_thread_running = 1;
+  if(tp->tp_hash_queued)
+    return;
+
+  torrent_hash_job_t *thj = malloc(sizeof(torrent_hash_job_t));
+  torrent_retain(to);
+  tp->tp_refcount++;
+  tp->tp_hash_queued = 1;
+  thj->thj_torrent = to;
+  thj->thj_piece = tp;
+  TAILQ_INSERT_TAIL(&torrent_hash_queue, thj, thj_link);
+  btg.btg_hash_queue_len++;
+
+  if(torrent_hash_threads_idle > 0) {
+    hts_cond_signal(&torrent_piece_hash_needed_cond);
+  } else if(btg.btg_hash_threads < MIN(TORRENT_HASH_THREADS,
+                                        MAX(gconf.concurrency, 1))) {
+    btg.btg_hash_threads++;
     hts_thread_create_detached("bthasher", bt_hash_thread, NULL,
 			       THREAD_PRIO_BGTASK);
   }
-  hts_cond_signal(&torrent_piece_hash_needed_cond);
 }
 
 
+#ifdef BITTORRENT_HASH_BENCHMARK
+
+#define BITTORRENT_BENCH_PIECES      128
+#define BITTORRENT_BENCH_PIECE_SIZE  (1024 * 1024)
+
+/**
+ * Push a number of pieces through the hash queue and measure how
+ * fast they get verified
+ */
+static void
+torrent_hash_benchmark(void)
+{
+  torrent_t *to = calloc(1, sizeof(torrent_t));
+  torrent_piece_t *pieces[BITTORRENT_BENCH_PIECES];
+
+  to->to_title = strdup("benchmark");
+  to->to_refcount = 1;
+  to->to_piece_hashes = malloc(BITTORRENT_BENCH_PIECES * 20);
+
+  for(int i = 0; i < BITTORRENT_BENCH_PIECES; i++) {
+    torrent_piece_t *tp = calloc(1, sizeof(torrent_piece_t));
+    tp->tp_index = i;
+    tp->tp_refcount = 1;
+    tp->tp_piece_length = BITTORRENT_BENCH_PIECE_SIZE;
+    tp->tp_data = malloc(BITTORRENT_BENCH_PIECE_SIZE);
+    for(int j = 0; j < BITTORRENT_BENCH_PIECE_SIZE; j++)
+      tp->tp_data[j] = i + j * 7;
+    LIST_INIT(&tp->tp_peers);
+
+    sha1_digest(to->to_piece_hashes + i * 20, tp->tp_data,
+                tp->tp_piece_length);
+    pieces[i] = tp;
+  }
+
+  hts_mutex_lock(&bittorrent_mutex);
+  int64_t ts = arch_get_ts();
+
+  for(int i = 0; i < BITTORRENT_BENCH_PIECES; i++)
+    torrent_hash_enqueue(to, pieces[i]);
+
+  int ok = 0;
+  for(int i = 0; i < BITTORRENT_BENCH_PIECES; i++) {
+    while(!pieces[i]->tp_hash_computed)
+      hts_cond_wait(&torrent_piece_verified_cond, &bittorrent_mutex);
+    ok += pieces[i]->tp_hash_ok;
+  }
+
+  ts = arch_get_ts() - ts;
+
+  TRACE(TRACE_INFO, "BITTORRENT",
+        "Hash benchmark: %d/%d pieces OK, %.1f MB/s using %d threads (%s)",
+        ok, BITTORRENT_BENCH_PIECES,
+        (double)BITTORRENT_BENCH_PIECES * BITTORRENT_BENCH_PIECE_SIZE / ts,
+        btg.btg_hash_threads, sha1_digest_impl());
+
+  for(int i = 0; i < BITTORRENT_BENCH_PIECES; i++)
+    torrent_piece_release(pieces[i]);
+  hts_mutex_unlock(&bittorrent_mutex);
+
+  free(to->to_piece_hashes);
+  free(to->to_title);
+  free(to);
+}
+
+#endif
+
+
 /**
  *
  */
@@ -1828,6 +1923,9 @@ torrent_asyncio_init(void)
   torrent_settings_init();
   hts_mutex_unlock(&bittorrent_mutex);
 
+#ifdef BITTORRENT_HASH_BENCHMARK
+  torrent_hash_benchmark();
+#endif
 }
 
 INITME(INIT_GROUP_ASYNCIO, torrent_asyncio_init, NULL, 0);
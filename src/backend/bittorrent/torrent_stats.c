@@ -204,6 +204,13 @@ torrent_dump_http(http_connection_t *hc, const char *remain, void *opaque,
 
   hts_mutex_lock(&bittorrent_mutex);
 
+  htsbuf_qprintf(&out, "Hashing: %d pieces queued, %d threads, "
+                 "%"PRId64" bytes verified at %.1f MB/s per thread\n\n",
+                 btg.btg_hash_queue_len, btg.btg_hash_threads,
+                 btg.btg_hashed_bytes,
+                 btg.btg_hash_time ?
+                 (double)btg.btg_hashed_bytes / btg.btg_hash_time : 0);
+
   LIST_FOREACH(to, &torrents, to_link)
     torrent_dump(to, &out, show_requests);
 
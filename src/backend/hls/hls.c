@@ -157,6 +157,8 @@ segment_destroy(hls_segment_t *hs)
 
   if(hs->hs_fh != NULL)
     fa_close(hs->hs_fh);
+  hs->hs_fh = NULL;
+  hls_segment_prefetch_drop(hs);
 
   TAILQ_REMOVE(&hs->hs_variant->hv_segments, hs, hs_link);
   free(hs->hs_url);
@@ -614,8 +616,23 @@ hls_segment_open(hls_segment_t *hs)
 
   if(hs->hs_byte_offset != -1)
     flags &= ~FA_STREAMING;
-  
-  fh = fa_open_ex(hs->hs_url, errbuf, sizeof(errbuf), flags, &foe);
+
+  fh = hls_segment_prefetch_open(hs, &foe.foe_protocol_error);
+
+  if(fh != NULL) {
+    HLS_TRACE(h, "Using prefetched %s (sequence %d)", hs->hs_url, hs->hs_seq);
+  } else if(foe.foe_protocol_error == 403 || foe.foe_protocol_error == 404) {
+    // Prefetch already found out that the segment is not accessible
+  } else {
+    fh = fa_open_ex(hs->hs_url, errbuf, sizeof(errbuf), flags, &foe);
+
+    if(fh != NULL) {
+      fa_set_read_timeout(fh, 3000);
+
+      if(hs->hs_byte_size != -1 && hs->hs_byte_offset != -1)
+        fh = fa_slice_open(fh, hs->hs_byte_offset, hs->hs_byte_size);
+    }
+  }
 
   if(fh == NULL) {
 
@@ -633,11 +650,6 @@ hls_segment_open(hls_segment_t *hs)
     }
   }
 
-  fa_set_read_timeout(fh, 3000);
-
-  if(hs->hs_byte_size != -1 && hs->hs_byte_offset != -1)
-    fh = fa_slice_open(fh, hs->hs_byte_offset, hs->hs_byte_size);
-
   hs->hs_size = fa_fsize(fh);
 
   switch(hs->hs_crypto) {
@@ -653,6 +665,7 @@ hls_segment_open(hls_segment_t *hs)
 	TRACE(TRACE_ERROR, "HLS", "Unable to load key file %s",
 	      rstr_get(hs->hs_key_url));
 	fa_close(fh);
+        hls_segment_prefetch_drop(hs);
         return HLS_ERROR_SEGMENT_BAD_KEY;
       }
       rstr_set(&hv->hv_key_url, hs->hs_key_url);
@@ -663,6 +676,8 @@ hls_segment_open(hls_segment_t *hs)
   hs->hs_fh = fh;
   HLS_TRACE(h, "Opened %s (sequence %d) ranges:[%d + %d] OK",
             hs->hs_url, hs->hs_seq, hs->hs_byte_offset, hs->hs_byte_size);
+
+  hls_variant_prefetch(hv, hs);
   return 0;
 }
 
@@ -678,42 +693,59 @@ hls_segment_close(hls_segment_t *hs)
 
   hls_demuxer_t *hd = hs->hs_variant->hv_demuxer;
   hls_t *h = hd->hd_hls;
+  int64_t bw;
 
-  if(hs->hs_blocked_counter == h->h_blocked) {
+  if(hs->hs_prefetched) {
+    // Time spent reading from memory says nothing about the network
+    if(!hls_segment_prefetch_bandwidth(hs, &bw))
+      hls_demuxer_update_bw(hd, bw);
+  } else if(hs->hs_blocked_counter == h->h_blocked) {
     int64_t ts = arch_get_ts() - hs->hs_open_time;
     if(ts > 1000) {
-      int64_t bw = 8000000LL * hs->hs_size / ts;
-      bw = MIN(100000000, bw);
-
-
-      int low_buffer = h->h_mp->mp_buffer_delay < 5000000;
-      const char *delta;
-      if(hd->hd_bw == 0) {
-        hd->hd_bw = bw;
-        delta = "Initial";
-      } else if(bw < hd->hd_bw) {
-        delta = "Decrease";
-        if(low_buffer)
-          hd->hd_bw = (hd->hd_bw + bw) / 2;
-        else
-          hd->hd_bw = (hd->hd_bw * 7 + bw) / 8;
-      } else {
-        delta = "Increase";
-        hd->hd_bw = (hd->hd_bw + bw) / 2;
-      }
-      HLS_TRACE(h, "Estimated bandwidth updated %d bps "
-                "(most recent segment %d bps) "
-                "buffer: %ds (%s) delta: %s\n",
-                hd->hd_bw, (int)bw,
-                (int)(h->h_mp->mp_buffer_delay / 1000000),
-                low_buffer ? "Low" : "OK",
-                delta);
-      hd->hd_bw_updated = 1;
+      bw = 8000000LL * hs->hs_size / ts;
+      hls_demuxer_update_bw(hd, bw);
     }
   }
 
   fa_close(hs->hs_fh);
   hs->hs_fh = NULL;
+  hls_segment_prefetch_drop(hs);
+}
+
+
+/**
+ *
+ */
+void
+hls_demuxer_update_bw(hls_demuxer_t *hd, int64_t bw)
+{
+  hls_t *h = hd->hd_hls;
+
+  bw = MIN(100000000, bw);
+
+  int low_buffer = h->h_mp->mp_buffer_delay < 5000000;
+  const char *delta;
+  if(hd->hd_bw == 0) {
+    hd->hd_bw = bw;
+    delta = "Initial";
+  } else if(bw < hd->hd_bw) {
+    delta = "Decrease";
+    if(low_buffer)
+      hd->hd_bw = (hd->hd_bw + bw) / 2;
+    else
+      hd->hd_bw = (hd->hd_bw * 7 + bw) / 8;
+  } else {
+    delta = "Increase";
+    hd->hd_bw = (hd->hd_bw + bw) / 2;
+  }
+  HLS_TRACE(h, "Estimated bandwidth updated %d bps "
+            "(most recent segment %d bps) "
+            "buffer: %ds (%s) delta: %s\n",
+            hd->hd_bw, (int)bw,
+            (int)(h->h_mp->mp_buffer_delay / 1000000),
+            low_buffer ? "Low" : "OK",
+            delta);
+  hd->hd_bw_updated = 1;
 }
 
 
@@ -844,6 +876,7 @@ hls_variant_close(hls_variant_t *hv)
     hls_segment_close(hv->hv_current_seg);
     hv->hv_current_seg = NULL;
   }
+  hls_variant_prefetch_cancel(hv);
 }
 
 
@@ -1325,6 +1358,18 @@ enqueue_buffer(media_pipe_t *mp, media_queue_t *mq, media_buf_t *mb,
     hts_cond_wait(&mp->mp_backpressure, &mp->mp_mutex);
   }
 
+  // Count number of times the player ran dry during playback
+  if(mp->mp_buffer_current == 0) {
+    if(h->h_rebuffer_armed) {
+      h->h_rebuffer_armed = 0;
+      h->h_rebuffers++;
+      TRACE(TRACE_DEBUG, "HLS", "Rebuffering (%d times so far)",
+            h->h_rebuffers);
+    }
+  } else {
+    h->h_rebuffer_armed = 1;
+  }
+
   if(unlikely(mq->mq_seektarget != AV_NOPTS_VALUE)) {
     int64_t ts = mb->mb_user_time;
     if(ts < mq->mq_seektarget) {
@@ -1513,8 +1558,11 @@ hls_demuxer_seek(media_pipe_t *mp, hls_demuxer_t *hd, int64_t pos)
 {
   hd->hd_seek_to_segment = pos;
 
-  if(hd->hd_current != NULL && hd->hd_current->hv_demuxer_flush)
-    hd->hd_current->hv_demuxer_flush(hd->hd_current);
+  if(hd->hd_current != NULL) {
+    hls_variant_prefetch_cancel(hd->hd_current);
+    if(hd->hd_current->hv_demuxer_flush)
+      hd->hd_current->hv_demuxer_flush(hd->hd_current);
+  }
 
   hls_free_mbp(mp, &hd->hd_mb);
 }
@@ -1688,6 +1736,7 @@ hls_seek(hls_t *h, int64_t ts)
 
   mp->mp_video.mq_demuxer_flags &= ~HLS_QUEUE_KEYFRAME_SEEN;
   mp->mp_audio.mq_demuxer_flags &= ~HLS_QUEUE_KEYFRAME_SEEN;
+  h->h_rebuffer_armed = 0;
 }
 
 
@@ -1709,6 +1758,9 @@ hls_play(hls_t *h, media_pipe_t *mp, char *errbuf, size_t errlen,
   h->h_enqueued_something = 0;
 
   h->h_playback_priority = va->priority;
+  h->h_start_time = arch_get_ts();
+  h->h_rebuffers = 0;
+  h->h_rebuffer_armed = 0;
 
   mp->mp_video.mq_stream = 0;
   mp->mp_audio.mq_stream = 1;
@@ -1818,6 +1870,8 @@ hls_play(hls_t *h, media_pipe_t *mp, char *errbuf, size_t errlen,
         if(loading) {
           prop_set(mp->mp_prop_root, "loading", PROP_SET_INT, 0);
           loading = 0;
+          TRACE(TRACE_DEBUG, "HLS", "Startup time %d ms",
+                (int)((arch_get_ts() - h->h_start_time) / 1000));
         }
       }
     }
@@ -1842,6 +1896,9 @@ hls_play(hls_t *h, media_pipe_t *mp, char *errbuf, size_t errlen,
 			      0);
     }
   }
+  TRACE(TRACE_DEBUG, "HLS", "Playback ended after %d s, %d rebuffers",
+        (int)((arch_get_ts() - h->h_start_time) / 1000000), h->h_rebuffers);
+
   // Shutdown
 
   mp_event_set_callback(mp, NULL, NULL);
@@ -2144,6 +2201,7 @@ hls_demuxer_init(hls_demuxer_t *hd, hls_t *h, const char *type)
   hd->hd_seek_to_segment = PTS_UNSET;
   hd->hd_last_dts = PTS_UNSET;
   hd->hd_cancellable = cancellable_create();
+  hd->hd_prefetcher = hls_prefetcher_create();
 }
 
 
@@ -2158,6 +2216,7 @@ hls_demuxer_close(media_pipe_t *mp, hls_demuxer_t *hd)
     media_codec_deref(hd->hd_audio_codec);
   hls_free_mbp(mp, &hd->hd_mb);
   cancellable_release(hd->hd_cancellable);
+  hls_prefetcher_release(hd->hd_prefetcher);
 }
 
 /**
@@ -40,6 +40,9 @@ LIST_HEAD(hls_audio_track_list, hls_audio_track);
 #define HLS_CRYPTO_NONE   0
 #define HLS_CRYPTO_AES128 1
 
+typedef struct hls_prefetch hls_prefetch_t;
+typedef struct hls_prefetcher hls_prefetcher_t;
+
 
 /**
  *
@@ -82,6 +85,9 @@ typedef struct hls_segment {
 
   fa_handle_t *hs_fh;
 
+  hls_prefetch_t *hs_prefetch;  // Content being (or already) downloaded
+  char hs_prefetched;           // hs_fh reads from hs_prefetch
+
   int64_t hs_open_time;
   int hs_blocked_counter;
 
@@ -219,6 +225,8 @@ typedef struct hls_demuxer {
 
   int64_t hd_last_dts;
 
+  hls_prefetcher_t *hd_prefetcher;
+
 } hls_demuxer_t;
 
 LIST_HEAD(hls_discontinuity_segment_list, hls_discontinuity_segment);
@@ -257,6 +265,11 @@ typedef struct hls {
 
   hls_error_t h_last_error;
 
+  // Playback quality stats
+  int64_t h_start_time;
+  int h_rebuffers;
+  char h_rebuffer_armed;
+
 } hls_t;
 
 
@@ -298,6 +311,25 @@ hls_segment_t *hv_find_segment_by_seq(hls_variant_t *hv, int seq);
 
 void hls_bad_variant(hls_variant_t *hv, hls_error_t err);
 
+void hls_demuxer_update_bw(hls_demuxer_t *hd, int64_t bw);
+
+// Segment prefetcher
+
+hls_prefetcher_t *hls_prefetcher_create(void);
+
+void hls_prefetcher_release(hls_prefetcher_t *hpf);
+
+void hls_variant_prefetch(hls_variant_t *hv, hls_segment_t *current);
+
+void hls_variant_prefetch_cancel(hls_variant_t *hv);
+
+void hls_segment_prefetch_drop(hls_segment_t *hs);
+
+fa_handle_t *hls_segment_prefetch_open(hls_segment_t *hs,
+                                       int *protocol_error);
+
+int hls_segment_prefetch_bandwidth(hls_segment_t *hs, int64_t *bw);
+
 // TS demuxer
 
 media_buf_t *hls_ts_demuxer_read(hls_demuxer_t *hd);
@@ -0,0 +1,433 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <assert.h>
+#include <string.h>
+
+#include "main.h"
+#include "media/media.h"
+#include "fileaccess/fileaccess.h"
+#include "misc/cancellable.h"
+#include "misc/minmax.h"
+#include "backend/backend.h"
+#include "video/video_settings.h"
+#include "hls.h"
+
+/**
+ * Segment prefetcher
+ *
+ * While a segment is demuxed the following segments of the same variant
+ * are downloaded into memory by separate threads. That hides connection
+ * setup and time-to-first-byte on high latency CDNs.
+ *
+ * Each demuxer has a prefetcher that keeps track of how much memory is
+ * used and for how long any download has been in progress. The latter
+ * gives us the aggregated bandwidth when several segments are fetched
+ * in parallel.
+ */
+
+#define HLS_PREFETCH_READ_SIZE (64 * 1024)
+
+struct hls_prefetcher {
+  hts_mutex_t hpf_mutex;
+  hts_cond_t hpf_cond;
+  int hpf_refcount;
+
+  int64_t hpf_limit;      // Max bytes held in memory
+  int64_t hpf_buffered;   // Bytes currently held in memory
+
+  int hpf_active;         // Number of downloads in progress
+  int64_t hpf_busy_since;
+  int64_t hpf_busy_time;  // Total time with at least one active download
+  int64_t hpf_bytes;      // Total bytes downloaded
+
+  int64_t hpf_sample_time;
+  int64_t hpf_sample_bytes;
+};
+
+
+typedef enum {
+  HP_RUNNING,
+  HP_DONE,
+  HP_FAILED,
+} hls_prefetch_state_t;
+
+
+struct hls_prefetch {
+  hls_prefetcher_t *hp_hpf;
+  int hp_refcount;        // Protected by hpf_mutex
+
+  char *hp_url;
+  int hp_byte_offset;
+  int hp_byte_size;
+
+  cancellable_t *hp_cancellable;
+
+  hls_prefetch_state_t hp_state;
+  int hp_protocol_error;
+
+  uint8_t *hp_data;
+  size_t hp_size;
+  size_t hp_allocated;
+};
+
+
+/**
+ *
+ */
+hls_prefetcher_t *
+hls_prefetcher_create(void)
+{
+  hls_prefetcher_t *hpf = calloc(1, sizeof(hls_prefetcher_t));
+  hts_mutex_init(&hpf->hpf_mutex);
+  hts_cond_init(&hpf->hpf_cond, &hpf->hpf_mutex);
+  hpf->hpf_refcount = 1;
+  hpf->hpf_limit = (int64_t)video_settings.video_buffer_size * 1000000 / 4;
+  return hpf;
+}
+
+
+/**
+ * hpf_mutex must be held, will be unlocked
+ */
+static void
+hls_prefetcher_release_locked(hls_prefetcher_t *hpf)
+{
+  hpf->hpf_refcount--;
+  if(hpf->hpf_refcount > 0) {
+    hts_mutex_unlock(&hpf->hpf_mutex);
+    return;
+  }
+  hts_mutex_unlock(&hpf->hpf_mutex);
+  hts_cond_destroy(&hpf->hpf_cond);
+  hts_mutex_destroy(&hpf->hpf_mutex);
+  free(hpf);
+}
+
+
+/**
+ *
+ */
+void
+hls_prefetcher_release(hls_prefetcher_t *hpf)
+{
+  hts_mutex_lock(&hpf->hpf_mutex);
+  hls_prefetcher_release_locked(hpf);
+}
+
+
+/**
+ * hpf_mutex must be held, will be unlocked
+ */
+static void
+hls_prefetch_release_locked(hls_prefetch_t *hp)
+{
+  hls_prefetcher_t *hpf = hp->hp_hpf;
+
+  hp->hp_refcount--;
+  if(hp->hp_refcount > 0) {
+    hts_mutex_unlock(&hpf->hpf_mutex);
+    return;
+  }
+
+  hpf->hpf_buffered -= hp->hp_allocated;
+  free(hp->hp_data);
+  free(hp->hp_url);
+  cancellable_release(hp->hp_cancellable);
+  free(hp);
+  hls_prefetcher_release_locked(hpf);
+}
+
+
+/**
+ * Make room for more data, fails if the prefetcher is over budget
+ */
+static int
+hls_prefetch_grow(hls_prefetch_t *hp, size_t size)
+{
+  hls_prefetcher_t *hpf = hp->hp_hpf;
+
+  if(size <= hp->hp_allocated)
+    return 0;
+
+  size = MAX(size, hp->hp_allocated * 2);
+
+  hts_mutex_lock(&hpf->hpf_mutex);
+  const int64_t delta = size - hp->hp_allocated;
+  if(hpf->hpf_buffered + delta > hpf->hpf_limit) {
+    hts_mutex_unlock(&hpf->hpf_mutex);
+    return -1;
+  }
+  hpf->hpf_buffered += delta;
+  hts_mutex_unlock(&hpf->hpf_mutex);
+
+  void *data = realloc(hp->hp_data, size);
+  if(data == NULL) {
+    hts_mutex_lock(&hpf->hpf_mutex);
+    hpf->hpf_buffered -= delta;
+    hts_mutex_unlock(&hpf->hpf_mutex);
+    return -1;
+  }
+  hp->hp_data = data;
+  hp->hp_allocated = size;
+  return 0;
+}
+
+
+/**
+ * Keep track of time during which at least one download is running
+ */
+static void
+hls_prefetch_account(hls_prefetcher_t *hpf, int delta)
+{
+  const int64_t now = arch_get_ts();
+
+  if(delta > 0 && hpf->hpf_active++ == 0)
+    hpf->hpf_busy_since = now;
+
+  if(delta < 0 && --hpf->hpf_active == 0)
+    hpf->hpf_busy_time += now - hpf->hpf_busy_since;
+}
+
+
+/**
+ *
+ */
+static int
+hls_prefetch_download(hls_prefetch_t *hp)
+{
+  fa_open_extra_t foe = {0};
+  char errbuf[256];
+
+  foe.foe_open_timeout = 3000;
+  foe.foe_cancellable = hp->hp_cancellable;
+
+  fa_handle_t *fh = fa_open_ex(hp->hp_url, errbuf, sizeof(errbuf),
+                               FA_BUFFERED_BIG, &foe);
+  if(fh == NULL) {
+    hp->hp_protocol_error = foe.foe_protocol_error;
+    return -1;
+  }
+
+  fa_set_read_timeout(fh, 3000);
+
+  if(hp->hp_byte_size != -1 && hp->hp_byte_offset != -1)
+    fh = fa_slice_open(fh, hp->hp_byte_offset, hp->hp_byte_size);
+
+  int64_t size = fa_fsize(fh);
+  if(hls_prefetch_grow(hp, size > 0 ? size : HLS_PREFETCH_READ_SIZE)) {
+    fa_close(fh);
+    return -1;
+  }
+
+  while(1) {
+    if(hp->hp_size == hp->hp_allocated &&
+       hls_prefetch_grow(hp, hp->hp_size + HLS_PREFETCH_READ_SIZE))
+      break;
+
+    int r = fa_read(fh, hp->hp_data + hp->hp_size,
+                    hp->hp_allocated - hp->hp_size);
+
+    if(r == 0) {
+      fa_close(fh);
+      return 0;
+    }
+
+    if(r < 0 || cancellable_is_cancelled(hp->hp_cancellable))
+      break;
+
+    hp->hp_size += r;
+
+    hts_mutex_lock(&hp->hp_hpf->hpf_mutex);
+    hp->hp_hpf->hpf_bytes += r;
+    hts_mutex_unlock(&hp->hp_hpf->hpf_mutex);
+  }
+
+  fa_close(fh);
+  return -1;
+}
+
+
+/**
+ *
+ */
+static void *
+hls_prefetch_thread(void *aux)
+{
+  hls_prefetch_t *hp = aux;
+  hls_prefetcher_t *hpf = hp->hp_hpf;
+
+  int err = hls_prefetch_download(hp);
+
+  hts_mutex_lock(&hpf->hpf_mutex);
+  hls_prefetch_account(hpf, -1);
+  hp->hp_state = err ? HP_FAILED : HP_DONE;
+  hts_cond_broadcast(&hpf->hpf_cond);
+  hls_prefetch_release_locked(hp);
+  return NULL;
+}
+
+
+/**
+ * Start prefetching the segments following 'current'
+ */
+void
+hls_variant_prefetch(hls_variant_t *hv, hls_segment_t *current)
+{
+  hls_demuxer_t *hd = hv->hv_demuxer;
+  hls_prefetcher_t *hpf = hd->hd_prefetcher;
+  const hls_t *h = hd->hd_hls;
+  hls_segment_t *hs = current;
+
+  for(int i = 0; i < video_settings.hls_prefetch_segments; i++) {
+
+    if((hs = TAILQ_NEXT(hs, hs_link)) == NULL)
+      break;
+
+    if(hs->hs_prefetch != NULL || hs->hs_fh != NULL || hs->hs_permanent_error)
+      continue;
+
+    hts_mutex_lock(&hpf->hpf_mutex);
+    if(hpf->hpf_buffered >= hpf->hpf_limit) {
+      hts_mutex_unlock(&hpf->hpf_mutex);
+      break;
+    }
+
+    hls_prefetch_t *hp = calloc(1, sizeof(hls_prefetch_t));
+    hp->hp_hpf = hpf;
+    hp->hp_refcount = 2; // One for segment, one for thread
+    hp->hp_url = strdup(hs->hs_url);
+    hp->hp_byte_offset = hs->hs_byte_offset;
+    hp->hp_byte_size = hs->hs_byte_size;
+    hp->hp_cancellable = cancellable_create();
+    hp->hp_state = HP_RUNNING;
+    hpf->hpf_refcount++;
+    hls_prefetch_account(hpf, 1);
+    hts_mutex_unlock(&hpf->hpf_mutex);
+
+    hs->hs_prefetch = hp;
+
+    HLS_TRACE(h, "%s: Prefetching sequence %d", hd->hd_type, hs->hs_seq);
+
+    hts_thread_create_detached("hlsprefetch", hls_prefetch_thread, hp,
+                               THREAD_PRIO_DEMUXER);
+  }
+}
+
+
+/**
+ * Cancel download (if still running) and drop prefetched data
+ */
+void
+hls_segment_prefetch_drop(hls_segment_t *hs)
+{
+  hls_prefetch_t *hp = hs->hs_prefetch;
+
+  if(hp == NULL)
+    return;
+
+  assert(!hs->hs_prefetched || hs->hs_fh == NULL);
+
+  hs->hs_prefetch = NULL;
+  hs->hs_prefetched = 0;
+  cancellable_cancel(hp->hp_cancellable);
+  hts_mutex_lock(&hp->hp_hpf->hpf_mutex);
+  hls_prefetch_release_locked(hp);
+}
+
+
+/**
+ * Drop all prefetched segments that are not currently open. Used when
+ * switching variant or seeking
+ */
+void
+hls_variant_prefetch_cancel(hls_variant_t *hv)
+{
+  hls_segment_t *hs;
+
+  TAILQ_FOREACH(hs, &hv->hv_segments, hs_link)
+    if(hs->hs_fh == NULL)
+      hls_segment_prefetch_drop(hs);
+}
+
+
+/**
+ * Open a prefetched segment. Waits for the download to finish
+ *
+ * Returns NULL if segment was not prefetched or the download failed.
+ */
+fa_handle_t *
+hls_segment_prefetch_open(hls_segment_t *hs, int *protocol_error)
+{
+  hls_prefetch_t *hp = hs->hs_prefetch;
+  hls_demuxer_t *hd = hs->hs_variant->hv_demuxer;
+
+  if(hp == NULL)
+    return NULL;
+
+  hls_prefetcher_t *hpf = hp->hp_hpf;
+
+  hts_mutex_lock(&hpf->hpf_mutex);
+  while(hp->hp_state == HP_RUNNING &&
+        !cancellable_is_cancelled(hd->hd_cancellable))
+    hts_cond_wait_timeout(&hpf->hpf_cond, &hpf->hpf_mutex, 100);
+
+  const hls_prefetch_state_t state = hp->hp_state;
+  *protocol_error = hp->hp_protocol_error;
+  hts_mutex_unlock(&hpf->hpf_mutex);
+
+  if(state != HP_DONE) {
+    hls_segment_prefetch_drop(hs);
+    return NULL;
+  }
+
+  hs->hs_prefetched = 1;
+  return memfile_make(hp->hp_data, hp->hp_size);
+}
+
+
+/**
+ * Compute aggregated download bandwidth since last call
+ *
+ * Returns -1 if not enough data has been collected
+ */
+int
+hls_segment_prefetch_bandwidth(hls_segment_t *hs, int64_t *bw)
+{
+  hls_prefetcher_t *hpf = hs->hs_variant->hv_demuxer->hd_prefetcher;
+  int r = -1;
+
+  hts_mutex_lock(&hpf->hpf_mutex);
+
+  int64_t busy = hpf->hpf_busy_time;
+  if(hpf->hpf_active)
+    busy += arch_get_ts() - hpf->hpf_busy_since;
+
+  const int64_t t = busy - hpf->hpf_sample_time;
+  const int64_t bytes = hpf->hpf_bytes - hpf->hpf_sample_bytes;
+
+  if(t > 1000) {
+    *bw = 8000000LL * bytes / t;
+    hpf->hpf_sample_time = busy;
+    hpf->hpf_sample_bytes = hpf->hpf_bytes;
+    r = 0;
+  }
+  hts_mutex_unlock(&hpf->hpf_mutex);
+  return r;
+}
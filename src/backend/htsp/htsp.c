@@ -43,6 +43,7 @@
 #include "fileaccess/fa_video.h"
 #include "usage.h"
 #include "misc/minmax.h"
+#include "misc/average.h"
 
 #define EPG_TAIL 20          // How many EPG entries to keep per channel
 
@@ -147,6 +148,7 @@ typedef struct htsp_connection {
 typedef struct htsp_msg {
   htsmsg_t *hm_msg;
   int hm_error;
+  int hm_abandoned;  // Nobody is waiting, drop reply when it arrives
   uint32_t hm_seq;
   TAILQ_ENTRY(htsp_msg) hm_link;
 } htsp_msg_t;
@@ -190,13 +192,18 @@ static void htsp_subscriptionStatus(htsp_connection_t *hc, htsmsg_t *m);
 static void htsp_queueStatus(htsp_connection_t *hc, htsmsg_t *m);
 static void htsp_signalStatus(htsp_connection_t *hc, htsmsg_t *m);
 static void htsp_mux_input(htsp_connection_t *hc, htsmsg_t *m);
+static int htsp_mux_input_raw(htsp_connection_t *hc, buf_t *b);
 
 static htsmsg_t *htsp_reqreply(htsp_connection_t *hc, htsmsg_t *m);
 
 
 
-static htsmsg_t *
-htsp_recv(htsp_connection_t *hc)
+/**
+ * Read one message from the wire. The buffer is followed by zeroed
+ * padding so binary fields can be handed to the decoders as is
+ */
+static buf_t *
+htsp_recv_buf(htsp_connection_t *hc)
 {
   tcpcon_t *tc = hc->hc_tc;
   uint8_t len[4];
@@ -209,20 +216,19 @@ htsp_recv(htsp_connection_t *hc)
   if(l > 16 * 1024 * 1024)
     return NULL;
 
-  buf_t *buf = buf_create(l);
+  buf_t *buf = buf_create(l + FF_INPUT_BUFFER_PADDING_SIZE);
 
   if(buf == NULL)
     return NULL;
 
-  htsmsg_t *m;
   if(tcp_read_data(tc, buf_str(buf), l, NULL, NULL) < 0) {
-    m = NULL;
-  } else {
-    m = htsmsg_binary_deserialize(buf);
+    buf_release(buf);
+    return NULL;
   }
 
-  buf_release(buf);
-  return m;
+  memset(buf_str(buf) + l, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+  buf->b_size = l;
+  return buf;
 }
 
 
@@ -230,32 +236,32 @@ htsp_recv(htsp_connection_t *hc)
  *
  */
 static htsmsg_t *
-htsp_reqreply(htsp_connection_t *hc, htsmsg_t *m)
+htsp_recv(htsp_connection_t *hc)
+{
+  buf_t *buf = htsp_recv_buf(hc);
+  if(buf == NULL)
+    return NULL;
+
+  htsmsg_t *m = htsmsg_binary_deserialize(buf);
+  buf_release(buf);
+  return m;
+}
+
+
+/**
+ * Add username and digest to an outgoing message.
+ * Returns -1 if user rejected the authentication request
+ */
+static int
+htsp_add_credentials(htsp_connection_t *hc, htsmsg_t *m, int retry)
 {
-  void *buf;
-  size_t len;
-  uint32_t seq;
   int r;
-  tcpcon_t *tc = hc->hc_tc;
-  uint32_t noaccess;
-  htsmsg_t *reply;
-  htsp_msg_t *hm = NULL;
-  int retry = 0;
   char id[100];
   char *username;
   char *password;
   sha1_decl(shactx);
   uint8_t d[20];
 
-  if(tc == NULL)
-    return NULL;
-
-  /* Generate a sequence number for our message */
-  seq = atomic_add_and_fetch(&hc->hc_seq_generator, 1);
-  htsmsg_add_u32(m, "seq", seq);
-
- again:
-
   snprintf(id, sizeof(id), "htsp://%s:%d", hc->hc_hostname, hc->hc_port);
 
   r = keyring_lookup(id, &username, &password, NULL, NULL,
@@ -265,7 +271,7 @@ htsp_reqreply(htsp_connection_t *hc, htsmsg_t *m)
 
   if(r == -1) {
     /* User rejected */
-    return NULL;
+    return -1;
   }
 
   if(r == 0) {
@@ -287,6 +293,36 @@ htsp_reqreply(htsp_connection_t *hc, htsmsg_t *m)
     free(username);
     free(password);
   }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static htsmsg_t *
+htsp_reqreply(htsp_connection_t *hc, htsmsg_t *m)
+{
+  void *buf;
+  size_t len;
+  uint32_t seq;
+  tcpcon_t *tc = hc->hc_tc;
+  uint32_t noaccess;
+  htsmsg_t *reply;
+  htsp_msg_t *hm = NULL;
+  int retry = 0;
+
+  if(tc == NULL)
+    return NULL;
+
+  /* Generate a sequence number for our message */
+  seq = atomic_add_and_fetch(&hc->hc_seq_generator, 1);
+  htsmsg_add_u32(m, "seq", seq);
+
+ again:
+
+  if(htsp_add_credentials(hc, m, retry))
+    return NULL;
 
   if(htsmsg_binary_serialize(m, &buf, &len, -1) < 0) {
     htsmsg_release(m);
@@ -300,6 +336,7 @@ htsp_reqreply(htsp_connection_t *hc, htsmsg_t *m)
     hm->hm_msg = NULL;
     hm->hm_seq = seq;
     hm->hm_error = 0;
+    hm->hm_abandoned = 0;
     hts_mutex_lock(&hc->hc_rpc_mutex);
     TAILQ_INSERT_TAIL(&hc->hc_rpc_queue, hm, hm_link);
     hts_mutex_unlock(&hc->hc_rpc_mutex);
@@ -324,7 +361,6 @@ htsp_reqreply(htsp_connection_t *hc, htsmsg_t *m)
     hts_mutex_lock(&hc->hc_rpc_mutex);
     while(1) {
       if(hm->hm_error != 0) {
-	r = hm->hm_error;
 	TAILQ_REMOVE(&hc->hc_rpc_queue, hm, hm_link);
 	hts_mutex_unlock(&hc->hc_rpc_mutex);
 	free(hm);
@@ -363,6 +399,127 @@ htsp_reqreply(htsp_connection_t *hc, htsmsg_t *m)
 }
 
 
+/**
+ * Send a request without waiting for the reply. Only possible once the
+ * connection is in async mode. The reply is collected with
+ * htsp_wait_reply() or ignored with htsp_abandon_reply()
+ */
+static htsp_msg_t *
+htsp_send_request(htsp_connection_t *hc, htsmsg_t *m)
+{
+  void *buf;
+  size_t len;
+  tcpcon_t *tc = hc->hc_tc;
+  htsp_msg_t *hm;
+
+  if(tc == NULL || !hc->hc_is_async || htsp_add_credentials(hc, m, 0)) {
+    htsmsg_release(m);
+    return NULL;
+  }
+
+  hm = malloc(sizeof(htsp_msg_t));
+  hm->hm_msg = NULL;
+  hm->hm_seq = atomic_add_and_fetch(&hc->hc_seq_generator, 1);
+  hm->hm_error = 0;
+  hm->hm_abandoned = 0;
+
+  htsmsg_add_u32(m, "seq", hm->hm_seq);
+
+  if(htsmsg_binary_serialize(m, &buf, &len, -1) < 0) {
+    htsmsg_release(m);
+    free(hm);
+    return NULL;
+  }
+  htsmsg_release(m);
+
+  hts_mutex_lock(&hc->hc_rpc_mutex);
+  TAILQ_INSERT_TAIL(&hc->hc_rpc_queue, hm, hm_link);
+  hts_mutex_unlock(&hc->hc_rpc_mutex);
+
+  if(tcp_write_data(tc, buf, len)) {
+    free(buf);
+    hts_mutex_lock(&hc->hc_rpc_mutex);
+    TAILQ_REMOVE(&hc->hc_rpc_queue, hm, hm_link);
+    hts_mutex_unlock(&hc->hc_rpc_mutex);
+    free(hm);
+    return NULL;
+  }
+  free(buf);
+  return hm;
+}
+
+
+/**
+ * Wait for reply to a request sent with htsp_send_request().
+ * 'hm' is always consumed. Replies asking for authentication are
+ * returned as errors, caller is expected to retry with htsp_reqreply()
+ */
+static htsmsg_t *
+htsp_wait_reply(htsp_connection_t *hc, htsp_msg_t *hm, int *waited)
+{
+  htsmsg_t *reply;
+  uint32_t noaccess;
+
+  hts_mutex_lock(&hc->hc_rpc_mutex);
+
+  if(waited != NULL)
+    *waited = hm->hm_msg == NULL && hm->hm_error == 0;
+
+  while(hm->hm_msg == NULL && hm->hm_error == 0)
+    hts_cond_wait(&hc->hc_rpc_cond, &hc->hc_rpc_mutex);
+
+  TAILQ_REMOVE(&hc->hc_rpc_queue, hm, hm_link);
+  hts_mutex_unlock(&hc->hc_rpc_mutex);
+
+  reply = hm->hm_msg;
+  free(hm);
+
+  if(reply != NULL &&
+     !htsmsg_get_u32(reply, "noaccess", &noaccess) && noaccess) {
+    htsmsg_release(reply);
+    return NULL;
+  }
+  return reply;
+}
+
+
+/**
+ * Returns non-zero if reply to 'hm' has arrived (or failed)
+ */
+static int
+htsp_reply_ready(htsp_connection_t *hc, htsp_msg_t *hm)
+{
+  hts_mutex_lock(&hc->hc_rpc_mutex);
+  int r = hm->hm_msg != NULL || hm->hm_error != 0;
+  hts_mutex_unlock(&hc->hc_rpc_mutex);
+  return r;
+}
+
+
+/**
+ * We're no longer interested in the reply to 'hm'
+ */
+static void
+htsp_abandon_reply(htsp_connection_t *hc, htsp_msg_t *hm)
+{
+  hts_mutex_lock(&hc->hc_rpc_mutex);
+
+  if(hm->hm_msg == NULL && hm->hm_error == 0) {
+    // Still in flight, htsp_msg_dispatch() will free it once it arrives
+    hm->hm_abandoned = 1;
+    hm = NULL;
+  } else {
+    TAILQ_REMOVE(&hc->hc_rpc_queue, hm, hm_link);
+  }
+  hts_mutex_unlock(&hc->hc_rpc_mutex);
+
+  if(hm != NULL) {
+    htsmsg_release(hm->hm_msg);
+    free(hm);
+  }
+}
+
+
 /**
  *
  */
@@ -1071,12 +1228,18 @@ htsp_worker_thread(void *aux)
 static void
 htsp_dispatch_disconnect(htsp_connection_t *hc)
 {
-  htsp_msg_t *hm;
+  htsp_msg_t *hm, *next;
   htsp_subscription_t *hs;
 
   hts_mutex_lock(&hc->hc_rpc_mutex);
 
-  TAILQ_FOREACH(hm, &hc->hc_rpc_queue, hm_link) {
+  for(hm = TAILQ_FIRST(&hc->hc_rpc_queue); hm != NULL; hm = next) {
+    next = TAILQ_NEXT(hm, hm_link);
+    if(hm->hm_abandoned) {
+      TAILQ_REMOVE(&hc->hc_rpc_queue, hm, hm_link);
+      free(hm);
+      continue;
+    }
     hm->hm_error = 1;
     hts_cond_broadcast(&hc->hc_rpc_cond);
   }
@@ -1119,7 +1282,10 @@ htsp_msg_dispatch(htsp_connection_t *hc, htsmsg_t *m)
       if(seq == hm->hm_seq)
 	break;
 
-    if(hm != NULL) {
+    if(hm != NULL && hm->hm_abandoned) {
+      TAILQ_REMOVE(&hc->hc_rpc_queue, hm, hm_link);
+      free(hm);
+    } else if(hm != NULL) {
       hm->hm_msg = m;
       hts_cond_broadcast(&hc->hc_rpc_cond);
       m = NULL;
@@ -1151,6 +1317,35 @@ htsp_msg_dispatch(htsp_connection_t *hc, htsmsg_t *m)
 }
 
 
+/**
+ * Receive and dispatch messages until connection fails
+ */
+static void
+htsp_input_loop(htsp_connection_t *hc)
+{
+  htsmsg_t *m;
+
+  while(1) {
+    buf_t *b = htsp_recv_buf(hc);
+    if(b == NULL)
+      break;
+
+    if(!htsp_mux_input_raw(hc, b)) {
+      buf_release(b);
+      continue;
+    }
+
+    m = htsmsg_binary_deserialize(b);
+    buf_release(b);
+    if(m == NULL)
+      break;
+
+    if(htsp_msg_dispatch(hc, m))
+      break;
+  }
+}
+
+
 /**
  *
  */
@@ -1172,14 +1367,7 @@ htsp_thread(void *aux)
 
     hc->hc_is_async = 1;
 
-    while(1) {
-
-      if((m = htsp_recv(hc)) == NULL)
-	break;
-
-      if(htsp_msg_dispatch(hc, m))
-	break;
-    }
+    htsp_input_loop(hc);
 
     TRACE(TRACE_ERROR, "HTSP", "Disconnected from %s:%d",
 	  hc->hc_hostname, hc->hc_port);
@@ -1921,6 +2109,26 @@ htsp_free_streams(htsp_subscription_t *hs)
 
 
 
+#define HTSP_READAHEAD_CHUNK      (128 * 1024)
+#define HTSP_READAHEAD_MIN_WINDOW 2
+#define HTSP_READAHEAD_MAX_WINDOW 32
+
+/**
+ * A fileRead request that has been sent ahead of the read position
+ */
+typedef struct htsp_file_chunk {
+  TAILQ_ENTRY(htsp_file_chunk) hfc_link;
+  int64_t hfc_offset;
+  size_t hfc_size;          // Requested size
+  htsp_msg_t *hfc_hm;       // Non-NULL while reply has not been collected
+  htsmsg_t *hfc_reply;
+  const uint8_t *hfc_data;
+  size_t hfc_datalen;
+} htsp_file_chunk_t;
+
+TAILQ_HEAD(htsp_file_chunk_queue, htsp_file_chunk);
+
+
 typedef struct htsp_file {
   fa_handle_t h;
   htsp_connection_t *hf_hc;
@@ -1928,6 +2136,15 @@ typedef struct htsp_file {
   int64_t hf_pos;
   int64_t hf_file_size;
   int hf_mtime;
+
+  struct htsp_file_chunk_queue hf_chunks; // Contiguous, ordered by offset
+  int hf_num_chunks;
+  int hf_window;            // Max number of chunks in flight
+
+  int64_t hf_bytes_read;
+  average_t hf_read_rate;
+  prop_t *hf_stats_speed;
+  prop_t *hf_stats_window;
 } htsp_file_t;
 
 
@@ -1953,62 +2170,201 @@ htsp_file_update_meta(htsp_file_t *hf)
 /**
  *
  */
-static int64_t
-htsp_file_seek(fa_handle_t *fh, int64_t pos, int whence, int lazy)
+static void
+htsp_file_chunk_destroy(htsp_file_t *hf, htsp_file_chunk_t *hfc)
 {
-  htsp_file_t *hf = (htsp_file_t *)fh;
-  int64_t np;
+  TAILQ_REMOVE(&hf->hf_chunks, hfc, hfc_link);
+  hf->hf_num_chunks--;
+  if(hfc->hfc_hm != NULL)
+    htsp_abandon_reply(hf->hf_hc, hfc->hfc_hm);
+  htsmsg_release(hfc->hfc_reply);
+  free(hfc);
+}
 
-  switch(whence) {
-  case SEEK_SET:
-    np = pos;
-    break;
 
-  case SEEK_CUR:
-    np = hf->hf_pos + pos;
-    break;
+/**
+ * Cancel all outstanding read-ahead
+ */
+static void
+htsp_file_flush(htsp_file_t *hf)
+{
+  htsp_file_chunk_t *hfc;
+  while((hfc = TAILQ_FIRST(&hf->hf_chunks)) != NULL)
+    htsp_file_chunk_destroy(hf, hfc);
+}
 
-  case SEEK_END:
-    htsp_file_update_meta(hf);
-    np = hf->hf_file_size + pos;
-    break;
 
-  default:
-    return -1;
+/**
+ * Drop chunks we've read past. If the read position is outside the
+ * window (ie, we seeked) everything is cancelled
+ */
+static void
+htsp_file_trim(htsp_file_t *hf)
+{
+  htsp_file_chunk_t *first = TAILQ_FIRST(&hf->hf_chunks);
+  htsp_file_chunk_t *last = TAILQ_LAST(&hf->hf_chunks, htsp_file_chunk_queue);
+
+  if(first == NULL)
+    return;
+
+  if(hf->hf_pos < first->hfc_offset ||
+     hf->hf_pos >= last->hfc_offset + last->hfc_size) {
+    htsp_file_flush(hf);
+    return;
   }
 
-  if(np < 0)
-    return -1;
-  hf->hf_pos = np;
-  return np;
+  while((first = TAILQ_FIRST(&hf->hf_chunks)) != NULL &&
+        hf->hf_pos >= first->hfc_offset + first->hfc_size)
+    htsp_file_chunk_destroy(hf, first);
 }
 
 
 /**
- *
+ * Keep 'hf_window' requests in flight ahead of the read position.
+ * Returns -1 if nothing could be sent
  */
-static int64_t
-htsp_file_fsize(fa_handle_t *fh)
+static int
+htsp_file_fill(htsp_file_t *hf)
 {
-  htsp_file_t *hf = (htsp_file_t *)fh;
-  htsp_file_update_meta(hf);
-  return hf->hf_file_size;
+  htsp_file_chunk_t *last;
+
+  while(hf->hf_num_chunks < hf->hf_window) {
+    last = TAILQ_LAST(&hf->hf_chunks, htsp_file_chunk_queue);
+    const int64_t offset = last ? last->hfc_offset + last->hfc_size :
+      hf->hf_pos;
+
+    // Don't read-ahead past what we know of the file. The first chunk
+    // is always requested though, the recording may still be growing
+    if(last != NULL && offset >= hf->hf_file_size)
+      break;
+
+    htsmsg_t *m = htsmsg_create_map();
+    htsmsg_add_str(m, "method", "fileRead");
+    htsmsg_add_u32(m, "id", hf->hf_id);
+    htsmsg_add_s64(m, "offset", offset);
+    htsmsg_add_u32(m, "size", HTSP_READAHEAD_CHUNK);
+
+    htsp_msg_t *hm = htsp_send_request(hf->hf_hc, m);
+    if(hm == NULL)
+      break;
+
+    htsp_file_chunk_t *hfc = calloc(1, sizeof(htsp_file_chunk_t));
+    hfc->hfc_offset = offset;
+    hfc->hfc_size = HTSP_READAHEAD_CHUNK;
+    hfc->hfc_hm = hm;
+    TAILQ_INSERT_TAIL(&hf->hf_chunks, hfc, hfc_link);
+    hf->hf_num_chunks++;
+  }
+  return TAILQ_FIRST(&hf->hf_chunks) == NULL ? -1 : 0;
 }
 
 
 /**
- *
+ * Collect reply for the first chunk in the window and adapt window size.
+ * If we had to wait for it the network is not keeping up, so open the
+ * window up. If everything in the window has already arrived we're
+ * asking for more than we need, so shrink it
  */
 static int
-htsp_file_read(fa_handle_t *handle, void *buf, size_t size)
+htsp_file_chunk_wait(htsp_file_t *hf, htsp_file_chunk_t *hfc)
 {
-  htsp_file_t *hf = (htsp_file_t *)handle;
-  htsmsg_t *m = htsmsg_create_map();
+  htsp_connection_t *hc = hf->hf_hc;
+  int waited;
 
-  htsmsg_add_str(m, "method", "fileRead");
-  htsmsg_add_u32(m, "id", hf->hf_id);
-  htsmsg_add_s64(m, "offset", hf->hf_pos);
-  htsmsg_add_u32(m, "size", size);
+  if(hfc->hfc_hm == NULL)
+    return 0;
+
+  hfc->hfc_reply = htsp_wait_reply(hc, hfc->hfc_hm, &waited);
+  hfc->hfc_hm = NULL;
+
+  if(hfc->hfc_reply == NULL)
+    return -1;
+
+  if(htsmsg_get_bin(hfc->hfc_reply, "data", (const void **)&hfc->hfc_data,
+                    &hfc->hfc_datalen))
+    return -1;
+
+  hfc->hfc_datalen = MIN(hfc->hfc_datalen, hfc->hfc_size); // Be sure
+
+  if(waited) {
+    hf->hf_window = MIN(hf->hf_window * 2, HTSP_READAHEAD_MAX_WINDOW);
+  } else {
+    htsp_file_chunk_t *last =
+      TAILQ_LAST(&hf->hf_chunks, htsp_file_chunk_queue);
+    if(last != hfc && last->hfc_hm != NULL &&
+       htsp_reply_ready(hc, last->hfc_hm))
+      hf->hf_window = MAX(hf->hf_window - 1, HTSP_READAHEAD_MIN_WINDOW);
+  }
+
+  if(hfc->hfc_datalen < hfc->hfc_size) {
+    // Short read (end of file). Anything requested after this is bogus
+    htsp_file_chunk_t *n;
+    while((n = TAILQ_NEXT(hfc, hfc_link)) != NULL)
+      htsp_file_chunk_destroy(hf, n);
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int64_t
+htsp_file_seek(fa_handle_t *fh, int64_t pos, int whence, int lazy)
+{
+  htsp_file_t *hf = (htsp_file_t *)fh;
+  int64_t np;
+
+  switch(whence) {
+  case SEEK_SET:
+    np = pos;
+    break;
+
+  case SEEK_CUR:
+    np = hf->hf_pos + pos;
+    break;
+
+  case SEEK_END:
+    htsp_file_update_meta(hf);
+    np = hf->hf_file_size + pos;
+    break;
+
+  default:
+    return -1;
+  }
+
+  if(np < 0)
+    return -1;
+  hf->hf_pos = np;
+  htsp_file_trim(hf);
+  return np;
+}
+
+
+/**
+ *
+ */
+static int64_t
+htsp_file_fsize(fa_handle_t *fh)
+{
+  htsp_file_t *hf = (htsp_file_t *)fh;
+  htsp_file_update_meta(hf);
+  return hf->hf_file_size;
+}
+
+
+/**
+ * One request at a time, used when connection is not in async mode
+ */
+static int
+htsp_file_read_sync(htsp_file_t *hf, void *buf, size_t size)
+{
+  htsmsg_t *m = htsmsg_create_map();
+
+  htsmsg_add_str(m, "method", "fileRead");
+  htsmsg_add_u32(m, "id", hf->hf_id);
+  htsmsg_add_s64(m, "offset", hf->hf_pos);
+  htsmsg_add_u32(m, "size", size);
 
   if((m = htsp_reqreply(hf->hf_hc, m)) == NULL)
     return -1;
@@ -2027,6 +2383,71 @@ htsp_file_read(fa_handle_t *handle, void *buf, size_t size)
 }
 
 
+/**
+ *
+ */
+static int
+htsp_file_read_ahead(htsp_file_t *hf, void *buf, size_t size)
+{
+  htsp_file_chunk_t *hfc;
+  size_t total = 0;
+
+  while(total < size) {
+    htsp_file_trim(hf);
+
+    if(htsp_file_fill(hf))
+      break;
+
+    hfc = TAILQ_FIRST(&hf->hf_chunks);
+    if(htsp_file_chunk_wait(hf, hfc)) {
+      htsp_file_flush(hf);
+      if(total > 0)
+        break;
+      return htsp_file_read_sync(hf, buf, size);
+    }
+
+    const size_t offset = hf->hf_pos - hfc->hfc_offset;
+    if(offset >= hfc->hfc_datalen) {
+      // End of file, forget about it so we ask again next time
+      htsp_file_flush(hf);
+      break;
+    }
+
+    const size_t r = MIN(hfc->hfc_datalen - offset, size - total);
+    memcpy((uint8_t *)buf + total, hfc->hfc_data + offset, r);
+    total += r;
+    hf->hf_pos += r;
+  }
+  return total;
+}
+
+
+/**
+ *
+ */
+static int
+htsp_file_read(fa_handle_t *handle, void *buf, size_t size)
+{
+  htsp_file_t *hf = (htsp_file_t *)handle;
+  int r;
+
+  if(hf->hf_hc->hc_is_async)
+    r = htsp_file_read_ahead(hf, buf, size);
+  else
+    r = htsp_file_read_sync(hf, buf, size);
+
+  if(r <= 0 || hf->hf_stats_speed == NULL)
+    return r;
+
+  hf->hf_bytes_read += r;
+  time_t now = time(NULL);
+  average_fill(&hf->hf_read_rate, now, hf->hf_bytes_read);
+  prop_set_int(hf->hf_stats_speed, average_read(&hf->hf_read_rate, now) / 125);
+  prop_set_int(hf->hf_stats_window, hf->hf_window);
+  return r;
+}
+
+
 /**
  *
  */
@@ -2035,6 +2456,12 @@ htsp_file_close(fa_handle_t *fh)
 {
   htsp_file_t *hf = (htsp_file_t *)fh;
 
+  htsp_file_flush(hf);
+  prop_ref_dec(hf->hf_stats_speed);
+  prop_ref_dec(hf->hf_stats_window);
+  hf->hf_stats_speed = NULL;
+  hf->hf_stats_window = NULL;
+
   htsmsg_t *m = htsmsg_create_map();
   htsmsg_add_str(m, "method", "fileClose");
   htsmsg_add_u32(m, "id", hf->hf_id);
@@ -2062,6 +2489,47 @@ static fa_protocol_t fa_protocol_htsp = {
 };
 
 
+/**
+ *
+ */
+static htsp_file_t *
+htsp_file_create(htsp_connection_t *hc, htsmsg_t *m)
+{
+  htsp_file_t *hf = calloc(1, sizeof(htsp_file_t));
+  hf->h.fh_proto = &fa_protocol_htsp;
+
+  htsmsg_get_s64(m, "size", &hf->hf_file_size);
+  htsmsg_get_s32(m, "mtime", &hf->hf_mtime);
+  htsmsg_get_s32(m, "id", &hf->hf_id);
+  hf->hf_hc = hc;
+  TAILQ_INIT(&hf->hf_chunks);
+  hf->hf_window = HTSP_READAHEAD_MIN_WINDOW;
+  return hf;
+}
+
+
+/**
+ * Expose read throughput and read-ahead window in playback stats
+ */
+static void
+htsp_file_set_stats(htsp_file_t *hf, prop_t *stats)
+{
+  hf->hf_stats_speed = prop_create_r(stats, "bitrate");
+  prop_set(stats, "bitrateValid", PROP_SET_INT, 1);
+
+  prop_t *info = prop_create_r(stats, "infoNodes");
+  prop_t *node = prop_create_r(info, NULL);
+
+  prop_t *title = prop_create_r(node, "title");
+  prop_link(_p("Read-ahead requests"), title);
+  prop_ref_dec(title);
+
+  hf->hf_stats_window = prop_create_r(node, "info");
+  prop_ref_dec(node);
+  prop_ref_dec(info);
+}
+
+
 /**
  *
  */
@@ -2083,13 +2551,9 @@ be_htsp_playdvr(const char *url, media_pipe_t *mp,
     return NULL;
   }
 
-  htsp_file_t *hf = calloc(1, sizeof(htsp_file_t));
-  hf->h.fh_proto = &fa_protocol_htsp;
-
-  htsmsg_get_s64(m, "size", &hf->hf_file_size);
-  htsmsg_get_s32(m, "mtime", &hf->hf_mtime);
-  htsmsg_get_s32(m, "id", &hf->hf_id);
-  hf->hf_hc = hc;
+  htsp_file_t *hf = htsp_file_create(hc, m);
+  htsmsg_release(m);
+  htsp_file_set_stats(hf, mp->mp_prop_io);
 
   video_args_t va = *va0;
   va.flags |= BACKEND_VIDEO_NO_SUBTITLE_SCAN;
@@ -2165,14 +2629,10 @@ be_htsp_playvideo(const char *url, media_pipe_t *mp,
  * Leaves 'hc_subscription_mutex' locked if we successfully find a subscription
  */
 static htsp_subscription_t *
-htsp_find_subscription_by_msg(htsp_connection_t *hc, htsmsg_t *m)
+htsp_find_subscription(htsp_connection_t *hc, uint32_t sid)
 {
-  uint32_t sid;
   htsp_subscription_t *hs;
 
-  if(htsmsg_get_u32(m, "subscriptionId", &sid))
-    return NULL;
-
   hts_mutex_lock(&hc->hc_subscription_mutex);
   LIST_FOREACH(hs, &hc->hc_subscriptions, hs_link)
     if(hs->hs_sid == sid)
@@ -2184,25 +2644,49 @@ htsp_find_subscription_by_msg(htsp_connection_t *hc, htsmsg_t *m)
 
 
 /**
- * Transport input
+ * Leaves 'hc_subscription_mutex' locked if we successfully find a subscription
+ */
+static htsp_subscription_t *
+htsp_find_subscription_by_msg(htsp_connection_t *hc, htsmsg_t *m)
+{
+  uint32_t sid;
+
+  if(htsmsg_get_u32(m, "subscriptionId", &sid))
+    return NULL;
+
+  return htsp_find_subscription(hc, sid);
+}
+
+
+/**
+ * The fields of a muxpkt message we care about
+ */
+typedef struct htsp_muxpkt {
+  uint32_t hmp_sid;
+  uint32_t hmp_stream;
+  uint32_t hmp_duration;
+  int64_t hmp_pts;
+  int64_t hmp_dts;
+  const uint8_t *hmp_payload;
+  size_t hmp_payload_len;
+} htsp_muxpkt_t;
+
+
+/**
+ * Deliver packet to the media pipe. If 'backing' is set the payload
+ * is referenced from it, otherwise copied
  */
 static void
-htsp_mux_input(htsp_connection_t *hc, htsmsg_t *m)
+htsp_mux_deliver(htsp_connection_t *hc, const htsp_muxpkt_t *hmp,
+                 buf_t *backing)
 {
   htsp_subscription_t *hs;
   htsp_subscription_stream_t *hss;
-  uint32_t stream;
+  const uint32_t stream = hmp->hmp_stream;
   media_pipe_t *mp;
-  const void *bin;
-  size_t binlen;
   media_buf_t *mb;
-  int64_t timeshift;
-
-  if(htsmsg_get_u32(m, "stream", &stream)  ||
-     htsmsg_get_bin(m, "payload", &bin, &binlen))
-    return;
 
-  if((hs = htsp_find_subscription_by_msg(hc, m)) == NULL)
+  if((hs = htsp_find_subscription(hc, hmp->hmp_sid)) == NULL)
     return;
 
   mp = hs->hs_mp;
@@ -2216,33 +2700,24 @@ htsp_mux_input(htsp_connection_t *hc, htsmsg_t *m)
 
     if(hss != NULL) {
 
-      mb = media_buf_alloc_unlocked(mp, binlen);
+      if(backing != NULL) {
+        mb = media_buf_from_buf_unlocked(mp, backing, hmp->hmp_payload,
+                                         hmp->hmp_payload_len);
+      } else {
+        mb = media_buf_alloc_unlocked(mp, hmp->hmp_payload_len);
+        memcpy(mb->mb_data, hmp->hmp_payload, hmp->hmp_payload_len);
+        mb->mb_size = hmp->hmp_payload_len;
+      }
+
       mb->mb_data_type = hss->hss_data_type;
       mb->mb_stream = hss->hss_index;
-
-      uint32_t u32;
-
-      if(htsmsg_get_u32(m, "duration", &u32))
-	mb->mb_duration = 0;
-      else
-        mb->mb_duration = u32;
-
-      if(htsmsg_get_s64(m, "dts", &mb->mb_dts))
-	mb->mb_dts = PTS_UNSET;
-
-      if(htsmsg_get_s64(m, "pts", &mb->mb_pts))
-	mb->mb_pts = PTS_UNSET;
-
-      if(htsmsg_get_s64(m, "timeshift", &timeshift))
-	timeshift = 0;
+      mb->mb_duration = hmp->hmp_duration;
+      mb->mb_dts = hmp->hmp_dts;
+      mb->mb_pts = hmp->hmp_pts;
 
       if(hss->hss_cw != NULL)
 	mb->mb_cw = media_codec_ref(hss->hss_cw);
 
-      memcpy(mb->mb_data, bin, binlen);
-
-      mb->mb_size = binlen;
-
       if(mb->mb_data_type == MB_SUBTITLE)
 	mb->mb_font_context = 0;
 
@@ -2256,6 +2731,150 @@ htsp_mux_input(htsp_connection_t *hc, htsmsg_t *m)
 }
 
 
+/**
+ * Transport input
+ */
+static void
+htsp_mux_input(htsp_connection_t *hc, htsmsg_t *m)
+{
+  htsp_muxpkt_t hmp;
+  const void *bin;
+  size_t binlen;
+  uint32_t u32;
+
+  if(htsmsg_get_u32(m, "subscriptionId", &hmp.hmp_sid) ||
+     htsmsg_get_u32(m, "stream", &hmp.hmp_stream)  ||
+     htsmsg_get_bin(m, "payload", &bin, &binlen))
+    return;
+
+  hmp.hmp_payload = bin;
+  hmp.hmp_payload_len = binlen;
+
+  hmp.hmp_duration = htsmsg_get_u32(m, "duration", &u32) ? 0 : u32;
+
+  if(htsmsg_get_s64(m, "dts", &hmp.hmp_dts))
+    hmp.hmp_dts = PTS_UNSET;
+
+  if(htsmsg_get_s64(m, "pts", &hmp.hmp_pts))
+    hmp.hmp_pts = PTS_UNSET;
+
+  htsp_mux_deliver(hc, &hmp, NULL);
+}
+
+
+/**
+ * Parse a muxpkt directly from the wire format without building a
+ * htsmsg. Returns -1 if this is something else (or something we don't
+ * understand), the caller then takes the generic path
+ */
+static int
+htsp_muxpkt_parse(htsp_muxpkt_t *hmp, const uint8_t *buf, size_t len)
+{
+  int is_muxpkt = 0;
+  int have_sid = 0;
+  int have_stream = 0;
+
+  hmp->hmp_payload = NULL;
+  hmp->hmp_payload_len = 0;
+  hmp->hmp_duration = 0;
+  hmp->hmp_pts = PTS_UNSET;
+  hmp->hmp_dts = PTS_UNSET;
+
+#define FIELD_IS(str) \
+  (namelen == sizeof(str) - 1 && !memcmp(name, str, sizeof(str) - 1))
+
+  while(len > 5) {
+    const unsigned int type    = buf[0];
+    const unsigned int namelen = buf[1];
+    const uint32_t datalen = (buf[2] << 24) | (buf[3] << 16) |
+                             (buf[4] << 8)  | buf[5];
+    buf += 6;
+    len -= 6;
+
+    if(len < namelen + datalen)
+      return -1;
+
+    const char *name = (const char *)buf;
+    const uint8_t *data = buf + namelen;
+    buf += namelen + datalen;
+    len -= namelen + datalen;
+
+    switch(type) {
+    case HMF_STR:
+      if(FIELD_IS("method")) {
+        if(datalen != 6 || memcmp(data, "muxpkt", 6))
+          return -1;
+        is_muxpkt = 1;
+      }
+      break;
+
+    case HMF_BIN:
+      if(FIELD_IS("payload")) {
+        hmp->hmp_payload = data;
+        hmp->hmp_payload_len = datalen;
+      }
+      break;
+
+    case HMF_S64:
+      if(datalen > 8)
+        return -1;
+
+      uint64_t u64 = 0;
+      for(int i = datalen - 1; i >= 0; i--)
+        u64 = (u64 << 8) | data[i];
+
+      if(FIELD_IS("subscriptionId")) {
+        hmp->hmp_sid = u64;
+        have_sid = u64 <= UINT32_MAX;
+      } else if(FIELD_IS("stream")) {
+        hmp->hmp_stream = u64;
+        have_stream = u64 <= UINT32_MAX;
+      } else if(FIELD_IS("pts")) {
+        hmp->hmp_pts = u64;
+      } else if(FIELD_IS("dts")) {
+        hmp->hmp_dts = u64;
+      } else if(FIELD_IS("duration")) {
+        hmp->hmp_duration = u64 <= UINT32_MAX ? u64 : 0;
+      }
+      break;
+
+    case HMF_MAP:
+    case HMF_LIST:
+      break;
+
+    default:
+      return -1;
+    }
+  }
+#undef FIELD_IS
+
+  return is_muxpkt && have_sid && have_stream &&
+    hmp->hmp_payload != NULL ? 0 : -1;
+}
+
+
+/**
+ * Fast path for transport input. Returns 0 if 'b' was a muxpkt and has
+ * been consumed, -1 if it should be deserialized as usual
+ */
+static int
+htsp_mux_input_raw(htsp_connection_t *hc, buf_t *b)
+{
+  htsp_muxpkt_t hmp;
+
+  if(htsp_muxpkt_parse(&hmp, buf_data(b), buf_len(b)))
+    return -1;
+
+  // All fields are parsed, so it's fine to clobber whatever comes after
+  // the payload with the padding the decoders want
+  memset((uint8_t *)hmp.hmp_payload + hmp.hmp_payload_len, 0,
+         FF_INPUT_BUFFER_PADDING_SIZE);
+
+  htsp_mux_deliver(hc, &hmp, b);
+  return 0;
+}
+
+
 /**
  *
  */
@@ -2556,6 +3175,342 @@ be_htsp_canhandle(const char *url)
 }
 
 
+#ifdef HTSP_BENCHMARK
+
+#define HTSP_BENCH_PACKETS      20000
+#define HTSP_BENCH_PAYLOAD_SIZE (48 * 1024)
+
+/**
+ * Synthesize a stream of muxpkts roughly the size of a high bitrate
+ * HEVC service, in the same length-prefixed form as on the wire
+ */
+static uint8_t *
+htsp_benchmark_synth(size_t *lenp)
+{
+  uint8_t *payload = malloc(HTSP_BENCH_PAYLOAD_SIZE);
+  uint8_t *out = NULL;
+  size_t outlen = 0;
+
+  for(int i = 0; i < HTSP_BENCH_PAYLOAD_SIZE; i++)
+    payload[i] = rand();
+
+  for(int i = 0; i < HTSP_BENCH_PACKETS; i++) {
+    htsmsg_t *m = htsmsg_create_map();
+    void *data;
+    size_t len;
+    htsmsg_add_str(m, "method", "muxpkt");
+    htsmsg_add_u32(m, "subscriptionId", 1);
+    htsmsg_add_u32(m, "frametype", 'P');
+    htsmsg_add_u32(m, "stream", 1 + (i & 1));
+    htsmsg_add_s64(m, "dts", i * 1800LL);
+    htsmsg_add_s64(m, "pts", i * 1800LL + 3600);
+    htsmsg_add_u32(m, "duration", 1800);
+    htsmsg_add_bin(m, "payload", payload,
+                   HTSP_BENCH_PAYLOAD_SIZE - (rand() & 0x3fff));
+    htsmsg_binary_serialize(m, &data, &len, -1);
+    htsmsg_release(m);
+
+    out = realloc(out, outlen + len);
+    memcpy(out + outlen, data, len);
+    outlen += len;
+    free(data);
+  }
+  free(payload);
+  *lenp = outlen;
+  return out;
+}
+
+
+/**
+ * Replay a captured HTSP stream (the raw server to client TCP payload
+ * given by $HTSP_BENCHMARK_CAPTURE) or a synthesized one through the
+ * generic and the muxpkt fast path and report packets/sec
+ */
+static void
+htsp_benchmark(void)
+{
+  const char *path = getenv("HTSP_BENCHMARK_CAPTURE");
+  uint8_t *stream = NULL;
+  size_t streamlen = 0;
+
+  if(path != NULL) {
+    FILE *fp = fopen(path, "rb");
+    if(fp != NULL) {
+      fseek(fp, 0, SEEK_END);
+      streamlen = ftell(fp);
+      fseek(fp, 0, SEEK_SET);
+      stream = malloc(streamlen);
+      if(fread(stream, 1, streamlen, fp) != streamlen)
+        streamlen = 0;
+      fclose(fp);
+    }
+  }
+
+  if(streamlen == 0) {
+    free(stream);
+    stream = htsp_benchmark_synth(&streamlen);
+  }
+
+  for(int fast = 0; fast < 2; fast++) {
+    int64_t ts = arch_get_ts();
+    int packets = 0;
+    size_t off = 0;
+
+    while(off + 4 <= streamlen) {
+      const uint8_t *p = stream + off;
+      const uint32_t l = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+      if(off + 4 + l > streamlen)
+        break;
+      off += 4 + l;
+
+      // Same as htsp_recv_buf() minus the socket
+      buf_t *b = buf_create(l + FF_INPUT_BUFFER_PADDING_SIZE);
+      memcpy(buf_str(b), p + 4, l);
+      memset(buf_str(b) + l, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+      b->b_size = l;
+
+      htsp_muxpkt_t hmp;
+
+      if(fast && !htsp_muxpkt_parse(&hmp, buf_data(b), buf_len(b))) {
+        // Stands in for the reference media_buf_from_buf_unlocked() takes
+        buf_t *ref = buf_retain(b);
+        buf_release(ref);
+        packets++;
+      } else {
+        htsmsg_t *m = htsmsg_binary_deserialize(b);
+        const char *method;
+        const void *bin;
+        size_t binlen;
+        if(m != NULL && (method = htsmsg_get_str(m, "method")) != NULL &&
+           !strcmp(method, "muxpkt") &&
+           !htsmsg_get_u32(m, "subscriptionId", &hmp.hmp_sid) &&
+           !htsmsg_get_u32(m, "stream", &hmp.hmp_stream) &&
+           !htsmsg_get_bin(m, "payload", &bin, &binlen)) {
+          htsmsg_get_s64(m, "dts", &hmp.hmp_dts);
+          htsmsg_get_s64(m, "pts", &hmp.hmp_pts);
+          htsmsg_get_u32(m, "duration", &hmp.hmp_duration);
+          void *copy = malloc(binlen + FF_INPUT_BUFFER_PADDING_SIZE);
+          memcpy(copy, bin, binlen);
+          free(copy);
+          packets++;
+        }
+        htsmsg_release(m);
+      }
+      buf_release(b);
+    }
+
+    ts = arch_get_ts() - ts;
+    printf("htsp: %s path: %d muxpkts in %d ms, %.0f packets/s\n",
+           fast ? "fast" : "generic", packets, (int)(ts / 1000),
+           ts ? packets * 1000000.0 / ts : 0);
+  }
+  free(stream);
+}
+
+
+#include <sys/socket.h>
+
+#define HTSP_STUB_FILE_SIZE (8 * 1024 * 1024)
+#define HTSP_STUB_RTT       10000 // µs
+
+/**
+ * A reply from the stub server waiting for its simulated RTT to pass
+ */
+typedef struct htsp_stub_reply {
+  TAILQ_ENTRY(htsp_stub_reply) hsr_link;
+  int64_t hsr_deadline;
+  void *hsr_data;
+  size_t hsr_len;
+} htsp_stub_reply_t;
+
+TAILQ_HEAD(htsp_stub_reply_queue, htsp_stub_reply);
+
+typedef struct htsp_stub {
+  tcpcon_t *hst_tc;
+  hts_mutex_t hst_mutex;
+  hts_cond_t hst_cond;
+  struct htsp_stub_reply_queue hst_replies;
+} htsp_stub_t;
+
+
+static uint8_t
+htsp_stub_byte(int64_t offset)
+{
+  return offset * 7 + (offset >> 16);
+}
+
+
+/**
+ * Answer fileRead requests from a fake recording
+ */
+static void *
+htsp_stub_rx_thread(void *aux)
+{
+  htsp_stub_t *hst = aux;
+  uint8_t len[4];
+
+  while(!tcp_read_data(hst->hst_tc, len, 4, NULL, NULL)) {
+    const uint32_t l = (len[0] << 24) | (len[1] << 16) | (len[2] << 8) | len[3];
+    buf_t *b = buf_create(l);
+    if(tcp_read_data(hst->hst_tc, buf_str(b), l, NULL, NULL))
+      break;
+    htsmsg_t *m = htsmsg_binary_deserialize(b);
+    buf_release(b);
+
+    uint32_t seq = 0, size = 0;
+    int64_t offset = 0;
+    htsmsg_get_u32(m, "seq", &seq);
+    htsmsg_get_u32(m, "size", &size);
+    htsmsg_get_s64(m, "offset", &offset);
+    htsmsg_release(m);
+
+    if(offset > HTSP_STUB_FILE_SIZE)
+      offset = HTSP_STUB_FILE_SIZE;
+    size = MIN(size, HTSP_STUB_FILE_SIZE - offset);
+    uint8_t *data = malloc(size + 1);
+    for(int i = 0; i < size; i++)
+      data[i] = htsp_stub_byte(offset + i);
+
+    m = htsmsg_create_map();
+    htsmsg_add_u32(m, "seq", seq);
+    htsmsg_add_bin(m, "data", data, size);
+    free(data);
+
+    htsp_stub_reply_t *hsr = calloc(1, sizeof(htsp_stub_reply_t));
+    hsr->hsr_deadline = arch_get_ts() + HTSP_STUB_RTT;
+    htsmsg_binary_serialize(m, &hsr->hsr_data, &hsr->hsr_len, -1);
+    htsmsg_release(m);
+
+    hts_mutex_lock(&hst->hst_mutex);
+    TAILQ_INSERT_TAIL(&hst->hst_replies, hsr, hsr_link);
+    hts_cond_signal(&hst->hst_cond);
+    hts_mutex_unlock(&hst->hst_mutex);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void *
+htsp_stub_tx_thread(void *aux)
+{
+  htsp_stub_t *hst = aux;
+  htsp_stub_reply_t *hsr;
+
+  hts_mutex_lock(&hst->hst_mutex);
+  while(1) {
+    if((hsr = TAILQ_FIRST(&hst->hst_replies)) == NULL) {
+      hts_cond_wait(&hst->hst_cond, &hst->hst_mutex);
+      continue;
+    }
+    TAILQ_REMOVE(&hst->hst_replies, hsr, hsr_link);
+    hts_mutex_unlock(&hst->hst_mutex);
+
+    int64_t delay = hsr->hsr_deadline - arch_get_ts();
+    if(delay > 0)
+      usleep(delay);
+    tcp_write_data(hst->hst_tc, hsr->hsr_data, hsr->hsr_len);
+    free(hsr->hsr_data);
+    free(hsr);
+
+    hts_mutex_lock(&hst->hst_mutex);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void *
+htsp_stub_client_thread(void *aux)
+{
+  htsp_input_loop(aux);
+  return NULL;
+}
+
+
+/**
+ * Read a file from a local stub server with 10ms RTT, one request at a
+ * time and with read-ahead, then seek around and verify contents
+ */
+static void
+htsp_readahead_benchmark(void)
+{
+  int sv[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    return;
+
+  htsp_stub_t *hst = calloc(1, sizeof(htsp_stub_t));
+  hst->hst_tc = tcp_from_fd(sv[1]);
+  hts_mutex_init(&hst->hst_mutex);
+  hts_cond_init(&hst->hst_cond, &hst->hst_mutex);
+  TAILQ_INIT(&hst->hst_replies);
+
+  htsp_connection_t *hc = calloc(1, sizeof(htsp_connection_t));
+  hc->hc_hostname = strdup("stub");
+  hc->hc_tc = tcp_from_fd(sv[0]);
+  hts_mutex_init(&hc->hc_rpc_mutex);
+  hts_cond_init(&hc->hc_rpc_cond, &hc->hc_rpc_mutex);
+  TAILQ_INIT(&hc->hc_rpc_queue);
+  hts_mutex_init(&hc->hc_worker_mutex);
+  hts_cond_init(&hc->hc_worker_cond, &hc->hc_worker_mutex);
+  TAILQ_INIT(&hc->hc_worker_queue);
+  hts_mutex_init(&hc->hc_subscription_mutex);
+  hc->hc_is_async = 1;
+
+  hts_thread_create_detached("HTSP stub rx", htsp_stub_rx_thread, hst,
+                             THREAD_PRIO_BGTASK);
+  hts_thread_create_detached("HTSP stub tx", htsp_stub_tx_thread, hst,
+                             THREAD_PRIO_BGTASK);
+  hts_thread_create_detached("HTSP stub client", htsp_stub_client_thread, hc,
+                             THREAD_PRIO_BGTASK);
+
+  htsmsg_t *m = htsmsg_create_map();
+  htsmsg_add_s64(m, "size", HTSP_STUB_FILE_SIZE);
+  htsp_file_t *hf = htsp_file_create(hc, m);
+  htsmsg_release(m);
+
+  const size_t bs = 32768;
+  uint8_t *buf = malloc(bs);
+  int errors = 0;
+
+  for(int readahead = 0; readahead < 2; readahead++) {
+    int64_t ts = arch_get_ts();
+    int r;
+    htsp_file_seek(&hf->h, 0, SEEK_SET, 0);
+
+    while((r = readahead ? htsp_file_read(&hf->h, buf, bs) :
+           htsp_file_read_sync(hf, buf, bs)) > 0) {
+      for(int i = 0; i < r; i++)
+        errors += buf[i] != htsp_stub_byte(hf->hf_pos - r + i);
+    }
+
+    ts = arch_get_ts() - ts;
+    printf("htsp: %s: %d kB/s (window %d)\n",
+           readahead ? "read-ahead" : "sync", (int)
+           ((int64_t)HTSP_STUB_FILE_SIZE * 1000 / 1024 / MAX(ts / 1000, 1)),
+           hf->hf_window);
+  }
+
+  // Seek around while requests are in flight
+  for(int i = 0; i < 100; i++) {
+    int64_t pos = rand() % HTSP_STUB_FILE_SIZE;
+    htsp_file_seek(&hf->h, pos, SEEK_SET, 0);
+    int r = htsp_file_read(&hf->h, buf, bs);
+    for(int j = 0; j < r; j++)
+      errors += buf[j] != htsp_stub_byte(pos + j);
+  }
+
+  printf("htsp: read-ahead verify: %d errors\n", errors);
+  htsp_file_flush(hf);
+  free(buf);
+}
+#endif
+
+
 /**
  *
  */
@@ -2563,6 +3518,10 @@ static int
 htsp_init(void)
 {
   hts_mutex_init(&htsp_global_mutex);
+#ifdef HTSP_BENCHMARK
+  htsp_benchmark();
+  htsp_readahead_benchmark();
+#endif
   return 0;
 }
 
@@ -22,6 +22,14 @@
 #include <errno.h>
 #include <unistd.h>
 
+#include "config.h"
+
+#if ENABLE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
 #include "main.h"
 #include "blobcache.h"
 #include "misc/pool.h"
@@ -39,12 +47,21 @@
 
 // Flags
 
+#define BC2_MAGIC_09      0x62630209
 #define BC2_MAGIC_07      0x62630207
 #define BC2_MAGIC_06      0x62630206
 #define BC2_MAGIC_05      0x62630205
 
+TAILQ_HEAD(blobcache_item_queue, blobcache_item);
+LIST_HEAD(blobcache_item_list, blobcache_item);
+
 typedef struct blobcache_item {
   struct blobcache_item *bi_link;
+  TAILQ_ENTRY(blobcache_item) bi_clock_link;
+  LIST_ENTRY(blobcache_item) bi_dirty_link;
+  TAILQ_ENTRY(blobcache_item) bi_hot_link;
+  buf_t *bi_pending; // Content not yet written to disk
+  buf_t *bi_hot;     // Copy in RAM (hot tier)
   char *bi_etag;
   uint64_t bi_key_hash;
   uint64_t bi_content_hash;
@@ -52,8 +69,11 @@ typedef struct blobcache_item {
   uint32_t bi_expiry;
   uint32_t bi_modtime;
   uint32_t bi_size;
+  uint32_t bi_slot;  // Record in index file, 0 if not assigned yet
   uint8_t bi_content_type_len;
   uint8_t bi_flags;
+  uint8_t bi_clock;
+  uint8_t bi_dirty;
 } blobcache_item_t;
 
 typedef struct blobcache_diskitem_06 {
@@ -82,6 +102,46 @@ typedef struct blobcache_diskitem_07 {
 } __attribute__((packed)) blobcache_diskitem_07_t;
 
 
+/**
+ * Format 09 is an array of fixed size records that is updated in place.
+ * Record 0 holds the header. Etags that don't fit in the item's record
+ * continue in overflow records chained from di_etag_slot. Overflow
+ * records carry the key hash of their item and BC2_DF_ETAG_OVERFLOW.
+ *
+ * di_etaglen is the full length of the etag in the item record and the
+ * number of bytes held in the record itself for overflow records
+ */
+#define BC2_RECORD_SIZE 128
+#define BC2_ETAG_MAX    (BC2_RECORD_SIZE - 43)
+#define BC2_ETAG_OVERFLOW_MAX ((255 + BC2_ETAG_MAX - 1) / BC2_ETAG_MAX - 1)
+
+#define BC2_DF_ETAG_OVERFLOW 0x80
+
+typedef struct blobcache_diskitem_09 {
+  uint64_t di_key_hash; // 0 == Unused record
+  uint64_t di_content_hash;
+  uint32_t di_lastaccess;
+  uint32_t di_expiry;
+  uint32_t di_modtime;
+  uint32_t di_size;
+  uint32_t di_check;
+  uint32_t di_etag_slot; // Next record holding the etag, 0 if none
+  uint8_t di_flags;
+  uint8_t di_etaglen;
+  uint8_t di_content_type_len;
+  uint8_t di_etag[BC2_ETAG_MAX];
+} __attribute__((packed)) blobcache_diskitem_09_t;
+
+typedef struct blobcache_diskheader_09 {
+  uint32_t dh_magic;
+  uint32_t dh_records;
+  uint32_t dh_timestamp;
+} __attribute__((packed)) blobcache_diskheader_09_t;
+
+static_assert(sizeof(blobcache_diskitem_09_t) == BC2_RECORD_SIZE,
+              "blobcache_diskitem_09 has wrong size");
+
+
 TAILQ_HEAD(blobcache_flush_queue, blobcache_flush);
 
 typedef struct blobcache_flush {
@@ -91,15 +151,52 @@ typedef struct blobcache_flush {
 } blobcache_flush_t;
 
 
-
-#define ITEM_HASH_SIZE 256
-#define ITEM_HASH_MASK (ITEM_HASH_SIZE - 1)
-
-static blobcache_item_t *hashvector[ITEM_HASH_SIZE];
+/**
+ * The item index is split into stripes, each with its own lock, hash
+ * table and CLOCK ring for eviction. Global state (flush queue, bcstate)
+ * is protected by cache_lock. Lock order is stripe -> cache_lock
+ *
+ * Items are marked with bi_clock when accessed. The eviction hand moves
+ * round-robin over the stripes and within a stripe takes items from the
+ * head of the ring. Items with bi_clock set get it decremented and are
+ * moved to the tail instead. Important items get a higher bi_clock so
+ * they survive more sweeps
+ */
+#define BC_STRIPES         16
+#define BC_CLOCK_NORMAL    1
+#define BC_CLOCK_IMPORTANT 3
+
+typedef struct blobcache_stripe {
+  hts_mutex_t bs_mutex;
+  blobcache_item_t **bs_buckets;
+  unsigned int bs_mask;
+  unsigned int bs_count;
+  uint64_t bs_size;
+  struct blobcache_item_queue bs_clock;
+  struct blobcache_item_list bs_dirty;
+  uint32_t *bs_dead_slots; // Index records to clear on next save
+  int bs_num_dead;
+  int bs_dead_capacity;
+  pool_t *bs_pool;
+
+  struct blobcache_item_queue bs_hot; // LRU, most recent first
+  size_t bs_hot_size;
+
+  // Statistics
+  unsigned int bs_hits_pending;
+  unsigned int bs_hits_hot;
+  unsigned int bs_hits_mapped;
+  unsigned int bs_hits_read;
+  unsigned int bs_misses;
+  uint64_t bs_bytes_copied;
+  uint64_t bs_bytes_mapped;
+} blobcache_stripe_t;
+
+static blobcache_stripe_t stripes[BC_STRIPES];
 
 static struct blobcache_flush_queue flush_queue;
 
-static pool_t *item_pool;
+static pool_t *flush_pool;
 static hts_mutex_t cache_lock;
 static hts_cond_t cache_cond;
 static hts_thread_t bcthread;
@@ -111,12 +208,97 @@ static enum {
 
 static int loaded_cache_is_from;
 
-static int index_dirty;
+static atomic_t index_dirty;
+
+static unsigned int prune_hand;
 
 #define BLOB_CACHE_MINSIZE   (10 * 1000 * 1000)
 #define BLOB_CACHE_MAXSIZE (1000 * 1000 * 1000)
 
-static uint64_t current_cache_size;
+/**
+ * Blobs up to this size may be kept in RAM (the hot tier). Larger blobs
+ * are mapped from disk when ENABLE_MMAP is set
+ */
+#define BLOBCACHE_HOT_MAX_ITEM (64 * 1024)
+
+static size_t hot_tier_size; // Per stripe
+
+
+/**
+ * The index file. Only touched by the flush thread once we're running
+ */
+#define INDEX_INITIAL_RECORDS   4096
+#define INDEX_RECORDS_PER_PAGE  32
+
+static uint8_t *index_map;
+static uint32_t index_capacity;   // Number of records (incl. header)
+static uint32_t index_hwm;        // First never used record
+static uint32_t *index_free;
+static int index_num_free;
+static int index_free_capacity;
+static int legacy_index_loaded;
+
+#if ENABLE_MMAP
+static int index_fd = -1;
+#else
+static fa_handle_t *index_fh;
+static uint8_t *index_dirty_pages;
+#endif
+
+
+/**
+ *
+ */
+static blobcache_stripe_t *
+bc_stripe(uint64_t dk)
+{
+  return &stripes[dk & (BC_STRIPES - 1)];
+}
+
+
+/**
+ *
+ */
+static unsigned int
+bc_bucket(const blobcache_stripe_t *bs, uint64_t dk)
+{
+  return (dk / BC_STRIPES) & bs->bs_mask;
+}
+
+
+/**
+ *
+ */
+static uint64_t
+blobcache_size(void)
+{
+  uint64_t size = 0;
+  for(int i = 0; i < BC_STRIPES; i++) {
+    blobcache_stripe_t *bs = &stripes[i];
+    hts_mutex_lock(&bs->bs_mutex);
+    size += bs->bs_size;
+    hts_mutex_unlock(&bs->bs_mutex);
+  }
+  return size;
+}
+
+
+/**
+ *
+ */
+static int
+blobcache_items(void)
+{
+  int items = 0;
+  for(int i = 0; i < BC_STRIPES; i++) {
+    blobcache_stripe_t *bs = &stripes[i];
+    hts_mutex_lock(&bs->bs_mutex);
+    items += bs->bs_count;
+    hts_mutex_unlock(&bs->bs_mutex);
+  }
+  return items;
+}
+
 
 /**
  *
@@ -129,7 +311,7 @@ blobcache_compute_maxsize(void)
 
   snprintf(path, sizeof(path), "%s", gconf.cache_path);
   if(!fa_fsinfo(path, &ffi)) {
-    uint64_t avail = ffi.ffi_avail + current_cache_size;
+    uint64_t avail = ffi.ffi_avail + blobcache_size();
     avail = MAX(BLOB_CACHE_MINSIZE, MIN(avail / 10, BLOB_CACHE_MAXSIZE));
     return avail;
   }
@@ -181,91 +363,541 @@ make_filename(char *buf, size_t len, uint64_t hash, int for_write)
 }
 
 
+/**
+ * Assume stripe is locked
+ */
+static blobcache_item_t *
+lookup_item(blobcache_stripe_t *bs, uint64_t dk)
+{
+  blobcache_item_t *p;
+  for(p = bs->bs_buckets[bc_bucket(bs, dk)]; p != NULL; p = p->bi_link)
+    if(p->bi_key_hash == dk)
+      return p;
+  return NULL;
+}
+
+
 /**
  *
  */
 static void
-save_index(void)
+stripe_grow(blobcache_stripe_t *bs)
 {
-  char errbuf[512];
-  char filename[PATH_MAX];
-  uint8_t *out, *base;
-  int i;
-  blobcache_item_t *p;
-  blobcache_diskitem_07_t *di;
-  size_t siz;
+  unsigned int oldsize = bs->bs_mask + 1;
+  blobcache_item_t **old = bs->bs_buckets;
+  blobcache_item_t *p, *next;
+
+  bs->bs_mask = oldsize * 2 - 1;
+  bs->bs_buckets = calloc(oldsize * 2, sizeof(blobcache_item_t *));
+
+  for(int i = 0; i < oldsize; i++) {
+    for(p = old[i]; p != NULL; p = next) {
+      next = p->bi_link;
+      unsigned int b = bc_bucket(bs, p->bi_key_hash);
+      p->bi_link = bs->bs_buckets[b];
+      bs->bs_buckets[b] = p;
+    }
+  }
+  free(old);
+}
+
+
+/**
+ *
+ */
+static void
+item_set_clock(blobcache_item_t *p)
+{
+  p->bi_clock = p->bi_flags & BLOBCACHE_IMPORTANT_ITEM ?
+    BC_CLOCK_IMPORTANT : BC_CLOCK_NORMAL;
+}
+
+
+/**
+ * Queue item for writing to the index file
+ */
+static void
+item_touch(blobcache_stripe_t *bs, blobcache_item_t *p)
+{
+  if(!p->bi_dirty) {
+    p->bi_dirty = 1;
+    LIST_INSERT_HEAD(&bs->bs_dirty, p, bi_dirty_link);
+  }
+  atomic_set(&index_dirty, 1);
+}
+
+
+/**
+ *
+ */
+static blobcache_item_t *
+item_create(blobcache_stripe_t *bs, uint64_t dk)
+{
+  blobcache_item_t *p = pool_get(bs->bs_pool);
+  memset(p, 0, sizeof(blobcache_item_t));
+  p->bi_key_hash = dk;
+
+  unsigned int b = bc_bucket(bs, dk);
+  p->bi_link = bs->bs_buckets[b];
+  bs->bs_buckets[b] = p;
+  TAILQ_INSERT_TAIL(&bs->bs_clock, p, bi_clock_link);
+
+  bs->bs_count++;
+  if(bs->bs_count > bs->bs_mask)
+    stripe_grow(bs);
+  return p;
+}
 
-  if(!index_dirty)
+
+/**
+ *
+ */
+static void
+hot_drop(blobcache_stripe_t *bs, blobcache_item_t *p)
+{
+  if(p->bi_hot == NULL)
     return;
+  TAILQ_REMOVE(&bs->bs_hot, p, bi_hot_link);
+  bs->bs_hot_size -= p->bi_hot->b_size;
+  buf_release(p->bi_hot);
+  p->bi_hot = NULL;
+}
 
-  snprintf(filename, sizeof(filename), "%s/bc2/index.dat", gconf.cache_path);
 
-  fa_handle_t *fh = fa_open_ex(filename, errbuf, sizeof(errbuf),
-                               FA_WRITE, NULL);
-  if(fh == NULL) {
-    TRACE(TRACE_ERROR, "blobcache", "Unable to write index %s -- %s",
-          filename, errbuf);
+/**
+ *
+ */
+static void
+hot_trim(blobcache_stripe_t *bs, size_t limit)
+{
+  blobcache_item_t *p;
+  while(bs->bs_hot_size > limit &&
+        (p = TAILQ_LAST(&bs->bs_hot, blobcache_item_queue)) != NULL)
+    hot_drop(bs, p);
+}
+
+
+/**
+ * Keep a copy of a small blob in RAM. The buffer must not be modified
+ * once handed over
+ */
+static void
+hot_insert(blobcache_stripe_t *bs, blobcache_item_t *p, buf_t *b)
+{
+  if(b->b_size > BLOBCACHE_HOT_MAX_ITEM || b->b_size > hot_tier_size)
     return;
+
+  hot_drop(bs, p);
+  p->bi_hot = buf_retain(b);
+  TAILQ_INSERT_HEAD(&bs->bs_hot, p, bi_hot_link);
+  bs->bs_hot_size += b->b_size;
+  hot_trim(bs, hot_tier_size);
+}
+
+
+/**
+ *
+ */
+static void
+set_hot_tier_size(void *opaque, int value)
+{
+  hot_tier_size = (size_t)value * 1000000 / BC_STRIPES;
+
+  for(int i = 0; i < BC_STRIPES; i++) {
+    blobcache_stripe_t *bs = &stripes[i];
+    hts_mutex_lock(&bs->bs_mutex);
+    hot_trim(bs, hot_tier_size);
+    hts_mutex_unlock(&bs->bs_mutex);
   }
+}
 
-  int items = 0;
-  siz = 12 + 20;
 
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      siz += sizeof(blobcache_diskitem_07_t);
-      siz += p->bi_etag ? strlen(p->bi_etag) : 0;
-      items++;
+/**
+ * Remove item from stripe and free it. Does not touch the cached file
+ */
+static void
+item_destroy(blobcache_stripe_t *bs, blobcache_item_t *p)
+{
+  blobcache_item_t **q = &bs->bs_buckets[bc_bucket(bs, p->bi_key_hash)];
+  while(*q != p)
+    q = &(*q)->bi_link;
+  *q = p->bi_link;
+
+  TAILQ_REMOVE(&bs->bs_clock, p, bi_clock_link);
+  if(p->bi_dirty)
+    LIST_REMOVE(p, bi_dirty_link);
+
+  if(p->bi_slot) {
+    if(bs->bs_num_dead == bs->bs_dead_capacity) {
+      bs->bs_dead_capacity = MAX(16, bs->bs_dead_capacity * 2);
+      bs->bs_dead_slots = realloc(bs->bs_dead_slots,
+                                  bs->bs_dead_capacity * sizeof(uint32_t));
     }
+    bs->bs_dead_slots[bs->bs_num_dead++] = p->bi_slot;
+    atomic_set(&index_dirty, 1);
   }
 
-  base = out = mymalloc(siz);
-  if(out == NULL) {
-    fa_close(fh);
-    return;
+  bs->bs_count--;
+  bs->bs_size -= p->bi_size;
+
+  if(p->bi_pending != NULL)
+    buf_release(p->bi_pending);
+  hot_drop(bs, p);
+  free(p->bi_etag);
+  pool_put(bs->bs_pool, p);
+}
+
+
+/**
+ *
+ */
+static void
+prune_item(blobcache_stripe_t *bs, blobcache_item_t *p)
+{
+  char filename[PATH_MAX];
+  make_filename(filename, sizeof(filename), p->bi_key_hash, 0);
+  fa_unlink(filename, NULL, 0);
+  item_destroy(bs, p);
+}
+
+
+/**
+ *
+ */
+static blobcache_diskitem_09_t *
+index_record(uint32_t slot)
+{
+  return (blobcache_diskitem_09_t *)(index_map + slot * BC2_RECORD_SIZE);
+}
+
+
+/**
+ *
+ */
+static uint32_t
+index_record_check(blobcache_diskitem_09_t *di)
+{
+  const uint32_t saved = di->di_check;
+  di->di_check = 0;
+  uint32_t check = MurHash3_32(di, sizeof(blobcache_diskitem_09_t), 0);
+  di->di_check = saved;
+  return check;
+}
+
+
+/**
+ *
+ */
+static void
+index_mark_dirty(uint32_t slot)
+{
+#if !ENABLE_MMAP
+  index_dirty_pages[slot / INDEX_RECORDS_PER_PAGE] = 1;
+#endif
+}
+
+
+/**
+ *
+ */
+static void
+index_write_header(void)
+{
+  blobcache_diskheader_09_t *dh = (blobcache_diskheader_09_t *)index_map;
+  dh->dh_magic = BC2_MAGIC_09;
+  dh->dh_records = index_capacity;
+  dh->dh_timestamp = time(NULL);
+  index_mark_dirty(0);
+}
+
+
+/**
+ * Resize the index file to 'records' records
+ */
+static int
+index_resize(uint32_t records)
+{
+  const size_t oldsize = (size_t)index_capacity * BC2_RECORD_SIZE;
+  const size_t newsize = (size_t)records * BC2_RECORD_SIZE;
+
+#if ENABLE_MMAP
+  if(ftruncate(index_fd, newsize))
+    return -1;
+
+  void *m = mmap(NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 index_fd, 0);
+  if(m == MAP_FAILED)
+    return -1;
+
+  if(index_map != NULL)
+    munmap(index_map, oldsize);
+#else
+  if(index_fh != NULL && fa_ftruncate(index_fh, newsize))
+    return -1;
+
+  void *m = realloc(index_map, newsize);
+  if(m == NULL)
+    return -1;
+  memset(m + oldsize, 0, newsize - oldsize);
+
+  const int oldpages = index_capacity / INDEX_RECORDS_PER_PAGE;
+  const int newpages = records / INDEX_RECORDS_PER_PAGE;
+  index_dirty_pages = realloc(index_dirty_pages, newpages);
+  memset(index_dirty_pages + oldpages, 1, newpages - oldpages);
+#endif
+
+  index_map = m;
+  index_capacity = records;
+  index_write_header();
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+index_free_slot(uint32_t slot)
+{
+  if(index_num_free == index_free_capacity) {
+    index_free_capacity = MAX(256, index_free_capacity * 2);
+    index_free = realloc(index_free, index_free_capacity * sizeof(uint32_t));
   }
-  *(uint32_t *)out = BC2_MAGIC_07;
-  out += 4;
-  *(uint32_t *)out = items;
-  out += 4;
-  *(uint32_t *)out = time(NULL);
-  out += 4;
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      const int etaglen = p->bi_etag ? strlen(p->bi_etag) : 0;
-      di = (blobcache_diskitem_07_t *)out;
-      di->di_key_hash     = p->bi_key_hash;
-      di->di_content_hash = p->bi_content_hash;
-      di->di_lastaccess   = p->bi_lastaccess;
-      di->di_expiry       = p->bi_expiry;
-      di->di_modtime      = p->bi_modtime;
-      di->di_size         = p->bi_size;
-      di->di_flags        = p->bi_flags;
-      di->di_etaglen      = etaglen;
-      di->di_content_type_len = p->bi_content_type_len;
-      out += sizeof(blobcache_diskitem_07_t);
-      if(etaglen) {
-	memcpy(out, p->bi_etag, etaglen);
-	out += etaglen;
-      }
+  index_free[index_num_free++] = slot;
+}
+
+
+/**
+ * Returns 0 if no record can be allocated
+ */
+static uint32_t
+index_alloc_slot(void)
+{
+  if(index_map == NULL)
+    return 0;
+
+  if(index_num_free > 0)
+    return index_free[--index_num_free];
+
+  if(index_hwm == index_capacity && index_resize(index_capacity * 2)) {
+    TRACE(TRACE_ERROR, "blobcache", "Unable to grow index to %d items",
+          index_capacity * 2);
+    return 0;
+  }
+  return index_hwm++;
+}
+
+
+/**
+ *
+ */
+static void
+index_release_slot(uint32_t slot)
+{
+  memset(index_record(slot), 0, sizeof(blobcache_diskitem_09_t));
+  index_mark_dirty(slot);
+  index_free_slot(slot);
+}
+
+
+/**
+ * Release the etag overflow records of the item record in 'slot'
+ */
+static void
+index_free_etag(uint32_t slot)
+{
+  blobcache_diskitem_09_t *di = index_record(slot);
+  const uint64_t key_hash = di->di_key_hash;
+  uint32_t next = di->di_etag_slot;
+
+  di->di_etag_slot = 0;
+
+  while(next != 0 && next < index_capacity) {
+    di = index_record(next);
+    if(di->di_key_hash != key_hash || !(di->di_flags & BC2_DF_ETAG_OVERFLOW))
+      break;
+    const uint32_t cur = next;
+    next = di->di_etag_slot;
+    index_release_slot(cur);
+  }
+}
+
 
+/**
+ * Returns 1 if no records could be allocated for the etag
+ */
+static int
+index_write_item(const blobcache_item_t *p)
+{
+  const int etaglen = p->bi_etag ? strlen(p->bi_etag) : 0;
+  uint32_t chain[BC2_ETAG_OVERFLOW_MAX];
+  int len = etaglen;
+  int n = 0;
+
+  index_free_etag(p->bi_slot);
+
+  // Allocate before taking pointers into the map, it may be resized
+  while(n * BC2_ETAG_MAX + BC2_ETAG_MAX < len) {
+    if((chain[n] = index_alloc_slot()) == 0) {
+      while(n > 0)
+        index_free_slot(chain[--n]);
+      len = 0;
+      break;
     }
+    n++;
   }
 
-  sha1_decl(shactx);
-  sha1_init(shactx);
-  sha1_update(shactx, base, siz - 20);
-  sha1_final(shactx, out);
+  blobcache_diskitem_09_t *di = index_record(p->bi_slot);
+
+  memset(di, 0, sizeof(blobcache_diskitem_09_t));
+  di->di_key_hash         = p->bi_key_hash;
+  di->di_content_hash     = p->bi_content_hash;
+  di->di_lastaccess       = p->bi_lastaccess;
+  di->di_expiry           = p->bi_expiry;
+  di->di_modtime          = p->bi_modtime;
+  di->di_size             = p->bi_size;
+  di->di_flags            = p->bi_flags;
+  di->di_content_type_len = p->bi_content_type_len;
+  di->di_etaglen          = len;
+  di->di_etag_slot        = n ? chain[0] : 0;
+  memcpy(di->di_etag, p->bi_etag, MIN(len, BC2_ETAG_MAX));
+  di->di_check = index_record_check(di);
+  index_mark_dirty(p->bi_slot);
+
+  for(int i = 0; i < n; i++) {
+    const int offset = (i + 1) * BC2_ETAG_MAX;
+    di = index_record(chain[i]);
+    memset(di, 0, sizeof(blobcache_diskitem_09_t));
+    di->di_key_hash  = p->bi_key_hash;
+    di->di_flags     = BC2_DF_ETAG_OVERFLOW;
+    di->di_etaglen   = MIN(len - offset, BC2_ETAG_MAX);
+    di->di_etag_slot = i + 1 < n ? chain[i + 1] : 0;
+    memcpy(di->di_etag, p->bi_etag + offset, di->di_etaglen);
+    di->di_check = index_record_check(di);
+    index_mark_dirty(chain[i]);
+  }
+  return len != etaglen;
+}
 
-  if(fa_write(fh, base, siz) != siz) {
-    TRACE(TRACE_INFO, "blobcache", "Unable to store index file %s -- %s",
-	  filename, strerror(errno));
-  } else {
-    index_dirty = 0;
+
+/**
+ *
+ */
+static void
+index_clear_slot(uint32_t slot)
+{
+  index_free_etag(slot);
+  index_release_slot(slot);
+}
+
+
+/**
+ * Push changes to disk
+ */
+static void
+index_sync(void)
+{
+#if ENABLE_MMAP
+  msync(index_map, (size_t)index_capacity * BC2_RECORD_SIZE, MS_ASYNC);
+#else
+  const int pages = index_capacity / INDEX_RECORDS_PER_PAGE;
+  const int pagesize = INDEX_RECORDS_PER_PAGE * BC2_RECORD_SIZE;
+
+  for(int i = 0; i < pages; i++) {
+    if(!index_dirty_pages[i])
+      continue;
+    if(fa_seek(index_fh, (int64_t)i * pagesize, SEEK_SET) < 0 ||
+       fa_write(index_fh, index_map + i * pagesize, pagesize) != pagesize) {
+      TRACE(TRACE_INFO, "blobcache", "Unable to write index -- %s",
+            strerror(errno));
+      return;
+    }
+    index_dirty_pages[i] = 0;
   }
+#endif
+}
 
-  free(base);
-  fa_close(fh);
+
+/**
+ * Write all modified items to the index file
+ */
+static void
+save_index(void)
+{
+  blobcache_item_t *p;
+
+  if(!atomic_get(&index_dirty) || index_map == NULL)
+    return;
+
+  atomic_set(&index_dirty, 0);
+
+  unsigned int hits_pending = 0, hits_hot = 0, hits_mapped = 0;
+  unsigned int hits_read = 0, misses = 0, long_etags = 0;
+  uint64_t bytes_copied = 0, bytes_mapped = 0;
+  size_t hot_size = 0;
+
+  for(int i = 0; i < BC_STRIPES; i++) {
+    blobcache_stripe_t *bs = &stripes[i];
+    hts_mutex_lock(&bs->bs_mutex);
+
+    hits_pending += bs->bs_hits_pending;
+    hits_hot     += bs->bs_hits_hot;
+    hits_mapped  += bs->bs_hits_mapped;
+    hits_read    += bs->bs_hits_read;
+    misses       += bs->bs_misses;
+    bytes_copied += bs->bs_bytes_copied;
+    bytes_mapped += bs->bs_bytes_mapped;
+    hot_size     += bs->bs_hot_size;
+
+    while((p = LIST_FIRST(&bs->bs_dirty)) != NULL) {
+      if(p->bi_slot == 0 && (p->bi_slot = index_alloc_slot()) == 0)
+        break;
+      LIST_REMOVE(p, bi_dirty_link);
+      p->bi_dirty = 0;
+      long_etags += index_write_item(p);
+    }
+
+    for(int j = 0; j < bs->bs_num_dead; j++)
+      index_clear_slot(bs->bs_dead_slots[j]);
+    bs->bs_num_dead = 0;
+
+    hts_mutex_unlock(&bs->bs_mutex);
+  }
+
+  index_sync();
+
+  TRACE(TRACE_DEBUG, "blobcache",
+        "Hits: %u pending, %u in RAM, %u mapped, %u read. %u misses. "
+        "%.2f MB read, %.2f MB mapped, %.2f MB in RAM",
+        hits_pending, hits_hot, hits_mapped, hits_read, misses,
+        bytes_copied / 1000000.0, bytes_mapped / 1000000.0,
+        hot_size / 1000000.0);
+
+  if(long_etags)
+    TRACE(TRACE_DEBUG, "blobcache",
+          "%u etags were only kept in memory, index is full", long_etags);
+
+  if(legacy_index_loaded) {
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/bc2/index.dat",
+             gconf.cache_path);
+    fa_unlink(filename, NULL, 0);
+    legacy_index_loaded = 0;
+  }
+}
+
+
+/**
+ * Insert an item read from an index file
+ */
+static blobcache_item_t *
+load_item(uint64_t key_hash)
+{
+  blobcache_stripe_t *bs = bc_stripe(key_hash);
+
+  if(lookup_item(bs, key_hash) != NULL)
+    return NULL;
+  return item_create(bs, key_hash);
 }
 
 
@@ -273,7 +905,25 @@ save_index(void)
  *
  */
 static void
-load_index(void)
+load_item_done(blobcache_item_t *p, uint32_t now)
+{
+  blobcache_stripe_t *bs = bc_stripe(p->bi_key_hash);
+  bs->bs_size += p->bi_size;
+
+  // Only give items used during the last day a second chance
+  if(now - p->bi_lastaccess < 86400)
+    item_set_clock(p);
+  else if(p->bi_flags & BLOBCACHE_IMPORTANT_ITEM)
+    p->bi_clock = BC_CLOCK_IMPORTANT - 1;
+}
+
+
+/**
+ * Load an index in format 07 or older. Items will be written to the
+ * new index file on first save
+ */
+static void
+load_legacy_index(void)
 {
   char errbuf[512];
   char filename[PATH_MAX];
@@ -282,6 +932,7 @@ load_index(void)
   int i;
   blobcache_item_t *p;
   uint8_t digest[20];
+  const uint32_t now = time(NULL);
 
   snprintf(filename, sizeof(filename), "%s/bc2/index.dat", gconf.cache_path);
 
@@ -333,9 +984,8 @@ load_index(void)
 
   switch(magic) {
   case BC2_MAGIC_06:
-    TRACE(TRACE_INFO, "blobcache", "Upgrading from older format 0x%08x", magic);
-    // FALLTHRU
   case BC2_MAGIC_07:
+    TRACE(TRACE_INFO, "blobcache", "Upgrading from older format 0x%08x", magic);
     loaded_cache_is_from = *(uint32_t *)in;
     in += 4;
     break;
@@ -350,9 +1000,12 @@ load_index(void)
     return;
   }
 
+  legacy_index_loaded = 1;
 
   for(i = 0; i < items; i++) {
-    p = pool_get(item_pool);
+    uint64_t key_hash = *(const uint64_t *)in;
+
+    p = load_item(key_hash);
     int etaglen;
 
     switch(magic) {
@@ -360,7 +1013,10 @@ load_index(void)
     case BC2_MAGIC_06: {
       const blobcache_diskitem_06_t *di = (blobcache_diskitem_06_t *)in;
 
-      p->bi_key_hash         = di->di_key_hash;
+      etaglen = di->di_etaglen;
+      in += sizeof(blobcache_diskitem_06_t);
+      if(p == NULL)
+        break;
       p->bi_content_hash     = di->di_content_hash;
       p->bi_lastaccess       = di->di_lastaccess;
       p->bi_expiry           = di->di_expiry;
@@ -368,15 +1024,16 @@ load_index(void)
       p->bi_size             = di->di_size;
       p->bi_content_type_len = di->di_content_type_len;
       p->bi_flags            = 0;
-      etaglen                = di->di_etaglen;
-      in += sizeof(blobcache_diskitem_06_t);
     }
       break;
 
     case BC2_MAGIC_07: {
       const blobcache_diskitem_07_t *di = (blobcache_diskitem_07_t *)in;
 
-      p->bi_key_hash         = di->di_key_hash;
+      etaglen = di->di_etaglen;
+      in += sizeof(blobcache_diskitem_07_t);
+      if(p == NULL)
+        break;
       p->bi_content_hash     = di->di_content_hash;
       p->bi_lastaccess       = di->di_lastaccess;
       p->bi_expiry           = di->di_expiry;
@@ -384,30 +1041,248 @@ load_index(void)
       p->bi_size             = di->di_size;
       p->bi_content_type_len = di->di_content_type_len;
       p->bi_flags            = di->di_flags;
-      etaglen                = di->di_etaglen;
-      in += sizeof(blobcache_diskitem_07_t);
     }
       break;
     default:
       abort(); // Prevent compilers whining about etaglen not initialized
     }
 
-    if(etaglen) {
-      p->bi_etag = malloc(etaglen+1);
-      memcpy(p->bi_etag, in, etaglen);
-      p->bi_etag[etaglen] = 0;
-      in += etaglen;
-    } else {
-      p->bi_etag = NULL;
+    if(p != NULL) {
+      if(etaglen) {
+        p->bi_etag = malloc(etaglen+1);
+        memcpy(p->bi_etag, in, etaglen);
+        p->bi_etag[etaglen] = 0;
+      }
+      load_item_done(p, now);
+      item_touch(bc_stripe(key_hash), p);
     }
-    p->bi_link = hashvector[p->bi_key_hash & ITEM_HASH_MASK];
-    hashvector[p->bi_key_hash & ITEM_HASH_MASK] = p;
-    current_cache_size += p->bi_size;
+    in += etaglen;
   }
   free(base);
 }
 
 
+/**
+ * Open (or create) the index file and map it
+ *
+ * Returns 1 if a new index file was created
+ */
+static int
+index_open(const char *filename)
+{
+  blobcache_diskheader_09_t dh = {0};
+  int64_t size;
+
+#if ENABLE_MMAP
+  index_fd = open(filename, O_RDWR | O_CREAT, 0666);
+  if(index_fd == -1)
+    return -1;
+
+  struct stat st;
+  size = fstat(index_fd, &st) ? 0 : st.st_size;
+
+  if(size >= sizeof(dh) && pread(index_fd, &dh, sizeof(dh), 0) != sizeof(dh))
+    dh.dh_magic = 0;
+#else
+  index_fh = fa_open_ex(filename, NULL, 0, FA_WRITE | FA_APPEND, NULL);
+  if(index_fh == NULL)
+    return -1;
+
+  size = fa_fsize(index_fh);
+
+  if(size >= sizeof(dh) && (fa_seek(index_fh, 0, SEEK_SET) != 0 ||
+                            fa_read(index_fh, &dh, sizeof(dh)) != sizeof(dh)))
+    dh.dh_magic = 0;
+#endif
+
+  if(dh.dh_magic != BC2_MAGIC_09 || dh.dh_records < 1 ||
+     (int64_t)dh.dh_records * BC2_RECORD_SIZE != size ||
+     dh.dh_records % INDEX_RECORDS_PER_PAGE) {
+
+    if(size)
+      TRACE(TRACE_INFO, "blobcache", "Index file invalid, recreating");
+    dh.dh_records = 0;
+#if ENABLE_MMAP
+    if(ftruncate(index_fd, 0))
+      return -1;
+#else
+    if(fa_ftruncate(index_fh, 0))
+      return -1;
+#endif
+    return index_resize(INDEX_INITIAL_RECORDS) ? -1 : 1;
+  }
+
+  loaded_cache_is_from = dh.dh_timestamp;
+
+#if ENABLE_MMAP
+  index_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   index_fd, 0);
+  if(index_map == MAP_FAILED) {
+    index_map = NULL;
+    return -1;
+  }
+#else
+  index_map = mymalloc(size);
+  if(index_map == NULL)
+    return -1;
+  if(fa_seek(index_fh, 0, SEEK_SET) != 0 ||
+     fa_read(index_fh, index_map, size) != size) {
+    free(index_map);
+    index_map = NULL;
+    return -1;
+  }
+  index_dirty_pages = calloc(1, dh.dh_records / INDEX_RECORDS_PER_PAGE);
+#endif
+  index_capacity = dh.dh_records;
+  return 0;
+}
+
+
+/**
+ * Reassemble the etag of the item record 'di' into 'out' (at least 256
+ * bytes). The overflow records used are stored in 'chain'
+ *
+ * Returns the number of overflow records or -1 if the chain is broken
+ */
+static int
+index_read_etag(blobcache_diskitem_09_t *di, char *out, uint32_t *chain)
+{
+  const int len = di->di_etaglen;
+  int got = MIN(len, BC2_ETAG_MAX);
+  uint32_t next = di->di_etag_slot;
+  int n = 0;
+
+  memcpy(out, di->di_etag, got);
+
+  while(got < len) {
+    if(next == 0 || next >= index_capacity || n == BC2_ETAG_OVERFLOW_MAX)
+      return -1;
+
+    blobcache_diskitem_09_t *ov = index_record(next);
+    if(ov->di_key_hash != di->di_key_hash ||
+       !(ov->di_flags & BC2_DF_ETAG_OVERFLOW) ||
+       ov->di_check != index_record_check(ov) ||
+       ov->di_etaglen == 0 || ov->di_etaglen > len - got)
+      return -1;
+
+    memcpy(out + got, ov->di_etag, ov->di_etaglen);
+    got += ov->di_etaglen;
+    chain[n++] = next;
+    next = ov->di_etag_slot;
+  }
+  out[len] = 0;
+  return n;
+}
+
+
+/**
+ *
+ */
+static void
+load_index(void)
+{
+  char filename[PATH_MAX];
+  char etag[256];
+  uint32_t chain[BC2_ETAG_OVERFLOW_MAX];
+  blobcache_item_t *p;
+  const uint32_t now = time(NULL);
+  uint32_t slot;
+  int n;
+
+  snprintf(filename, sizeof(filename), "%s/bc2/index.map", gconf.cache_path);
+
+  index_hwm = 1;
+
+  switch(index_open(filename)) {
+  case 0:
+    break;
+  case 1:
+    load_legacy_index();
+    return;
+  default:
+    TRACE(TRACE_ERROR, "blobcache", "Unable to open index %s", filename);
+    index_map = NULL;
+    return;
+  }
+
+  // Overflow records that are part of a loaded item's etag
+  uint8_t *claimed = calloc(1, index_capacity);
+
+  for(slot = 1; slot < index_capacity; slot++) {
+    blobcache_diskitem_09_t *di = index_record(slot);
+    if(di->di_key_hash == 0 || di->di_flags & BC2_DF_ETAG_OVERFLOW)
+      continue;
+
+    if(di->di_check != index_record_check(di) ||
+       (n = index_read_etag(di, etag, chain)) < 0 ||
+       (p = load_item(di->di_key_hash)) == NULL) {
+      memset(di, 0, sizeof(blobcache_diskitem_09_t));
+      index_mark_dirty(slot);
+      continue;
+    }
+
+    for(int i = 0; i < n; i++)
+      claimed[chain[i]] = 1;
+
+    p->bi_slot             = slot;
+    p->bi_content_hash     = di->di_content_hash;
+    p->bi_lastaccess       = di->di_lastaccess;
+    p->bi_expiry           = di->di_expiry;
+    p->bi_modtime          = di->di_modtime;
+    p->bi_size             = di->di_size;
+    p->bi_content_type_len = di->di_content_type_len;
+    p->bi_flags            = di->di_flags;
+    if(di->di_etaglen)
+      p->bi_etag = strdup(etag);
+    load_item_done(p, now);
+  }
+
+  for(slot = 1; slot < index_capacity; slot++) {
+    blobcache_diskitem_09_t *di = index_record(slot);
+    if(di->di_key_hash == 0)
+      continue;
+    if(di->di_flags & BC2_DF_ETAG_OVERFLOW && !claimed[slot]) {
+      memset(di, 0, sizeof(blobcache_diskitem_09_t));
+      index_mark_dirty(slot);
+      continue;
+    }
+    index_hwm = slot + 1;
+  }
+  free(claimed);
+
+  for(slot = index_hwm - 1; slot > 0; slot--)
+    if(index_record(slot)->di_key_hash == 0)
+      index_free_slot(slot);
+
+  TRACE(TRACE_DEBUG, "blobcache", "Index has %d records, %d free",
+        index_hwm - 1, index_num_free);
+}
+
+
+/**
+ *
+ */
+static void
+index_close(void)
+{
+  if(index_map == NULL)
+    return;
+#if ENABLE_MMAP
+  msync(index_map, (size_t)index_capacity * BC2_RECORD_SIZE, MS_SYNC);
+  munmap(index_map, (size_t)index_capacity * BC2_RECORD_SIZE);
+  close(index_fd);
+  index_fd = -1;
+#else
+  free(index_map);
+  free(index_dirty_pages);
+  index_dirty_pages = NULL;
+  fa_close(index_fh);
+  index_fh = NULL;
+#endif
+  index_map = NULL;
+}
+
+
 /**
  *
  */
@@ -419,6 +1294,7 @@ blobcache_put(const char *key, const char *stash, buf_t *b,
   uint64_t dk = digest_key(key, stash);
   uint64_t dc = digest_content(b->b_ptr, b->b_size);
   uint32_t now = time(NULL);
+  blobcache_stripe_t *bs = bc_stripe(dk);
   blobcache_item_t *p;
 
   if(etag != NULL && strlen(etag) > 255)
@@ -426,66 +1302,173 @@ blobcache_put(const char *key, const char *stash, buf_t *b,
 
   bcprintf("cache: Writing %s ... ", key);
 
-  hts_mutex_lock(&cache_lock);
   if(bcstate != BLOBCACHE_RUN) {
     bcprintf("Cache not running\n");
-    hts_mutex_unlock(&cache_lock);
     return 0;
   }
 
-  for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-    if(p->bi_key_hash == dk)
-      break;
+  hts_mutex_lock(&bs->bs_mutex);
+
+  p = lookup_item(bs, dk);
+
+  if(p != NULL && p->bi_content_hash == dc && p->bi_size == b->b_size) {
+    p->bi_modtime = mtime;
+    p->bi_expiry = now + maxage;
+    p->bi_lastaccess = now;
+    p->bi_flags = flags;
+    mystrset(&p->bi_etag, etag);
+    item_set_clock(p);
+    item_touch(bs, p);
+    hts_mutex_unlock(&bs->bs_mutex);
+    bcprintf("Already in\n");
+    return 1;
+  }
+
+  bcprintf("Ok\n");
+
+  if(p == NULL)
+    p = item_create(bs, dk);
+
+  int64_t expiry = (int64_t)maxage + now;
+
+  p->bi_modtime = mtime;
+  mystrset(&p->bi_etag, etag);
+  p->bi_expiry = MIN(INT32_MAX, expiry);
+  p->bi_lastaccess = now;
+  p->bi_content_hash = dc;
+  bs->bs_size -= p->bi_size;
+  p->bi_size = b->b_size;
+  bs->bs_size += p->bi_size;
+  p->bi_content_type_len = b->b_content_type ?
+    strlen(rstr_get(b->b_content_type)) : 0;
+  p->bi_flags = flags;
+  item_set_clock(p);
+  item_touch(bs, p);
+
+  if(p->bi_pending != NULL)
+    buf_release(p->bi_pending);
+  p->bi_pending = buf_retain(b);
+  hot_drop(bs, p);
+
+  hts_mutex_unlock(&bs->bs_mutex);
+
+  hts_mutex_lock(&cache_lock);
+  blobcache_flush_t *bf = pool_get(flush_pool);
+  bf->bf_key_hash = dk;
+  bf->bf_buf = buf_retain(b);
+  TAILQ_INSERT_TAIL(&flush_queue, bf, bf_link);
+  hts_cond_signal(&cache_cond);
+  hts_mutex_unlock(&cache_lock);
+  return 0;
+}
+
+
+/**
+ * Return a reference to an immutable in-RAM blob. Buffers from
+ * buf_create() are NUL terminated so a pad of one byte is free
+ */
+static buf_t *
+blob_share(buf_t *src, int pad)
+{
+  if(src->b_ptr == src->b_content && pad <= 1)
+    return buf_retain(src);
+
+  buf_t *b = buf_create(src->b_size + pad);
+  if(b == NULL)
+    return NULL;
+  b->b_size = src->b_size;
+  memcpy(b->b_ptr, src->b_ptr, src->b_size);
+  memset(b->b_ptr + src->b_size, 0, pad);
+  b->b_content_type = rstr_dup(src->b_content_type);
+  return b;
+}
+
+
+#if ENABLE_MMAP
+
+/**
+ * Blobs handed out as private file mappings. buf_t only gives us the
+ * data pointer back on release so we need to remember the mapping
+ */
+typedef struct blob_mapping {
+  LIST_ENTRY(blob_mapping) bm_link;
+  void *bm_ptr;
+  void *bm_base;
+  size_t bm_len;
+} blob_mapping_t;
+
+static LIST_HEAD(, blob_mapping) blob_mappings;
+static hts_mutex_t blob_mapping_mutex;
+static size_t page_size;
+
+
+/**
+ *
+ */
+static void
+blob_unmap(void *ptr)
+{
+  blob_mapping_t *bm;
+
+  hts_mutex_lock(&blob_mapping_mutex);
+  LIST_FOREACH(bm, &blob_mappings, bm_link)
+    if(bm->bm_ptr == ptr)
+      break;
+  assert(bm != NULL);
+  LIST_REMOVE(bm, bm_link);
+  hts_mutex_unlock(&blob_mapping_mutex);
+
+  munmap(bm->bm_base, bm->bm_len);
+  free(bm);
+}
+
+
+/**
+ * Check if a blob can be mapped. The content type is stored in front of
+ * the payload and the padding must fit in the zero filled tail of the
+ * last page
+ */
+static int
+blob_mappable(uint32_t size, int content_type_len, int pad)
+{
+  const size_t len = (size_t)size + content_type_len;
+  const size_t tail = len % page_size;
 
-  hts_cond_signal(&cache_cond);
-  index_dirty = 1;
+  return size > BLOBCACHE_HOT_MAX_ITEM &&
+    content_type_len < page_size && tail && page_size - tail > pad;
+}
 
-  if(p != NULL && p->bi_content_hash == dc && p->bi_size == b->b_size) {
-    p->bi_modtime = mtime;
-    p->bi_expiry = now + maxage;
-    p->bi_lastaccess = now;
-    p->bi_flags = flags;
-    mystrset(&p->bi_etag, etag);
-    hts_mutex_unlock(&cache_lock);
-    bcprintf("Already in\n");
-    return 1;
-  }
 
-  bcprintf("Ok\n");
+/**
+ * Map a blob from disk. Mapping is private and writable so the returned
+ * buffer behaves like any other buf_t (copy on write)
+ */
+static buf_t *
+blob_map(int fd, uint32_t size, int content_type_len)
+{
+  const size_t len = (size_t)size + content_type_len;
+  uint8_t *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
 
-  blobcache_flush_t *bf = pool_get(item_pool);
-  bf->bf_key_hash = dk;
-  bf->bf_buf = buf_retain(b);
-  TAILQ_INSERT_TAIL(&flush_queue, bf, bf_link);
-  hts_cond_signal(&cache_cond);
+  if(base == MAP_FAILED)
+    return NULL;
 
-  if(p == NULL) {
-    p = pool_get(item_pool);
-    p->bi_key_hash = dk;
-    p->bi_size = 0;
-    p->bi_content_type_len = 0;
-    p->bi_link = hashvector[dk & ITEM_HASH_MASK];
-    p->bi_etag = NULL;
-    hashvector[dk & ITEM_HASH_MASK] = p;
-  }
+  blob_mapping_t *bm = malloc(sizeof(blob_mapping_t));
+  bm->bm_base = base;
+  bm->bm_len = len;
+  bm->bm_ptr = base + content_type_len;
 
-  int64_t expiry = (int64_t)maxage + now;
+  hts_mutex_lock(&blob_mapping_mutex);
+  LIST_INSERT_HEAD(&blob_mappings, bm, bm_link);
+  hts_mutex_unlock(&blob_mapping_mutex);
 
-  p->bi_modtime = mtime;
-  mystrset(&p->bi_etag, etag);
-  p->bi_expiry = MIN(INT32_MAX, expiry);
-  p->bi_lastaccess = now;
-  p->bi_content_hash = dc;
-  current_cache_size -= p->bi_size;
-  p->bi_size = b->b_size;
-  current_cache_size += p->bi_size;
-  p->bi_content_type_len = b->b_content_type ?
-    strlen(rstr_get(b->b_content_type)) : 0;
-  p->bi_flags = flags;
-  hts_mutex_unlock(&cache_lock);
-  return 0;
+  buf_t *b = buf_create_and_adopt(size, bm->bm_ptr, blob_unmap);
+  if(content_type_len)
+    b->b_content_type = rstr_allocl((const char *)base, content_type_len);
+  return b;
 }
 
+#endif
+
 
 /**
  *
@@ -495,26 +1478,26 @@ blobcache_get(const char *key, const char *stash, int pad,
 	      int *ignore_expiry, char **etagp, time_t *mtimep)
 {
   uint64_t dk = digest_key(key, stash);
-  blobcache_item_t *p, **q;
+  blobcache_stripe_t *bs = bc_stripe(dk);
+  blobcache_item_t *p;
   char filename[PATH_MAX];
   uint32_t now;
 
   bcprintf("cache: Reading %s ... ", key);
 
-  hts_mutex_lock(&cache_lock);
-
   if(bcstate == BLOBCACHE_STOPPING) {
-    bcprintf("Cache stopped ... ");
-    p = NULL;
-  } else {
-    for(q = &hashvector[dk & ITEM_HASH_MASK]; (p = *q); q = &p->bi_link)
-      if(p->bi_key_hash == dk)
-	break;
+    bcprintf("Cache stopped\n");
+    return NULL;
   }
 
+  hts_mutex_lock(&bs->bs_mutex);
+
+  p = lookup_item(bs, dk);
+
   if(p == NULL) {
     bcprintf("Item not found\n");
-    hts_mutex_unlock(&cache_lock);
+    bs->bs_misses++;
+    hts_mutex_unlock(&bs->bs_mutex);
     return NULL;
   }
 
@@ -531,33 +1514,59 @@ blobcache_get(const char *key, const char *stash, int pad,
   if(expired && ignore_expiry == NULL)
     goto bad;
 
-  blobcache_flush_t *bf;
   buf_t *b = NULL;
   fa_handle_t *fh = NULL;
-  TAILQ_FOREACH_REVERSE(bf, &flush_queue, blobcache_flush_queue, bf_link) {
-    if(bf->bf_key_hash == p->bi_key_hash) {
-      // Item is not yet written to disk
-      b = buf_retain(bf->bf_buf);
-      break;
-    }
-  }
-
-  if(b == NULL) {
+#if ENABLE_MMAP
+  int fd = -1;
+#endif
+
+  if(p->bi_pending != NULL) {
+    // Item is not yet written to disk
+    b = blob_share(p->bi_pending, pad);
+    bs->bs_hits_pending++;
+  } else if(p->bi_hot != NULL) {
+    b = blob_share(p->bi_hot, pad);
+    TAILQ_REMOVE(&bs->bs_hot, p, bi_hot_link);
+    TAILQ_INSERT_HEAD(&bs->bs_hot, p, bi_hot_link);
+    bs->bs_hits_hot++;
+  } else {
     make_filename(filename, sizeof(filename), p->bi_key_hash, 0);
-    fh = fa_open(filename, NULL, 0);
-    if(fh == NULL) {
-    bad:
-      *q = p->bi_link;
-      pool_put(item_pool, p);
-      hts_mutex_unlock(&cache_lock);
-      return NULL;
-    }
+#if ENABLE_MMAP
+    if(blob_mappable(p->bi_size, p->bi_content_type_len, pad)) {
+      struct stat st;
+      fd = open(filename, O_RDONLY);
+      if(fd == -1)
+        goto bad;
+
+      if(fstat(fd, &st) ||
+         st.st_size != p->bi_size + p->bi_content_type_len) {
+        close(fd);
+        fa_unlink(filename, NULL, 0);
+        goto bad;
+      }
+      bs->bs_hits_mapped++;
+      bs->bs_bytes_mapped += p->bi_size;
+    } else
+#endif
+    {
+      fh = fa_open(filename, NULL, 0);
+      if(fh == NULL) {
+      bad:
+        item_destroy(bs, p);
+        bs->bs_misses++;
+        hts_mutex_unlock(&bs->bs_mutex);
+        return NULL;
+      }
 
-    int64_t size = fa_fsize(fh);
+      int64_t fsize = fa_fsize(fh);
 
-    if(size != p->bi_size + p->bi_content_type_len) {
-      fa_unlink(filename, NULL, 0);
-      goto bad;
+      if(fsize != p->bi_size + p->bi_content_type_len) {
+        fa_close(fh);
+        fa_unlink(filename, NULL, 0);
+        goto bad;
+      }
+      bs->bs_hits_read++;
+      bs->bs_bytes_copied += p->bi_size;
     }
   }
 
@@ -568,41 +1577,66 @@ blobcache_get(const char *key, const char *stash, int pad,
     *etagp = p->bi_etag ? strdup(p->bi_etag) : NULL;
 
   // Only mark lastaccess if clock is good
-  if(bcstate == BLOBCACHE_RUN)
+  if(bcstate == BLOBCACHE_RUN) {
     p->bi_lastaccess = now;
-
-  index_dirty = 1; // We don't deem it important enough to wakeup on get
+    item_touch(bs, p); // We don't deem it important enough to wakeup on get
+  }
+  item_set_clock(p);
 
   if(ignore_expiry != NULL)
     *ignore_expiry = expired;
 
-  hts_mutex_unlock(&cache_lock);
+  const uint32_t size = p->bi_size;
+  const int content_type_len = p->bi_content_type_len;
+  const uint64_t content_hash = p->bi_content_hash;
 
-  if(b == NULL) {
+  hts_mutex_unlock(&bs->bs_mutex);
 
-    b = buf_create(p->bi_size + pad);
-    if(b == NULL) {
-      fa_close(fh);
-      return NULL;
-    }
-    b->b_size = p->bi_size; // Get rid of padding in reported length
-    if(p->bi_content_type_len) {
-      b->b_content_type = rstr_allocl(NULL, p->bi_content_type_len);
-      if(fa_read(fh, rstr_data(b->b_content_type), p->bi_content_type_len) !=
-	 p->bi_content_type_len) {
-	buf_release(b);
-	fa_close(fh);
-	return NULL;
-      }
-    }
+#if ENABLE_MMAP
+  if(fd != -1) {
+    b = blob_map(fd, size, content_type_len);
+    close(fd);
+    return b;
+  }
+#endif
 
-    if(fa_read(fh, b->b_ptr, p->bi_size) != p->bi_size) {
+  if(fh == NULL)
+    return b;
+
+  b = buf_create(size + pad);
+  if(b == NULL) {
+    fa_close(fh);
+    return NULL;
+  }
+  b->b_size = size; // Get rid of padding in reported length
+  if(content_type_len) {
+    b->b_content_type = rstr_allocl(NULL, content_type_len);
+    if(fa_read(fh, rstr_data(b->b_content_type), content_type_len) !=
+       content_type_len) {
       buf_release(b);
       fa_close(fh);
       return NULL;
     }
-    memset(b->b_ptr + p->bi_size, 0, pad);
+  }
+
+  if(fa_read(fh, b->b_ptr, size) != size) {
+    buf_release(b);
     fa_close(fh);
+    return NULL;
+  }
+  memset(b->b_ptr + size, 0, pad);
+  fa_close(fh);
+
+  if(size <= BLOBCACHE_HOT_MAX_ITEM && hot_tier_size) {
+    // Promote to hot tier unless the item changed while we were reading
+    buf_t *h = pad ? blob_share(b, 0) : buf_retain(b);
+    hts_mutex_lock(&bs->bs_mutex);
+    p = lookup_item(bs, dk);
+    if(h != NULL && p != NULL && p->bi_content_hash == content_hash &&
+       p->bi_pending == NULL && p->bi_hot == NULL)
+      hot_insert(bs, p, h);
+    hts_mutex_unlock(&bs->bs_mutex);
+    buf_release(h);
   }
   return b;
 }
@@ -615,21 +1649,20 @@ blobcache_get(const char *key, const char *stash, int pad,
  *
  */
 int
-blobcache_get_meta(const char *key, const char *stash, 
+blobcache_get_meta(const char *key, const char *stash,
 		   char **etagp, time_t *mtimep)
 {
   uint64_t dk = digest_key(key, stash);
+  blobcache_stripe_t *bs = bc_stripe(dk);
   blobcache_item_t *p;
   int r;
-  hts_mutex_lock(&cache_lock);
 
-  if(bcstate == BLOBCACHE_STOPPING) {
-    p = NULL;
-  } else {
-    for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-      if(p->bi_key_hash == dk)
-	break;
-  }
+  if(bcstate == BLOBCACHE_STOPPING)
+    return -1;
+
+  hts_mutex_lock(&bs->bs_mutex);
+
+  p = lookup_item(bs, dk);
 
   if(p != NULL) {
     r = 0;
@@ -644,24 +1677,11 @@ blobcache_get_meta(const char *key, const char *stash,
     r = -1;
   }
 
-  hts_mutex_unlock(&cache_lock);
+  hts_mutex_unlock(&bs->bs_mutex);
   return r;
 }
 
 
-/**
- * Assume we're locked
- */
-static blobcache_item_t *
-lookup_item(uint64_t dk)
-{
-  blobcache_item_t *p;
-  for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-    if(p->bi_key_hash == dk)
-      return p;
-  return NULL;
-}
-
 /**
  *
  */
@@ -695,14 +1715,19 @@ prune_stale(void)
 	    snprintf(path3, sizeof(path3), "%s/bc2/%s/%s",
 		     gconf.cache_path, n1, n2);
 
-            hts_mutex_lock(&cache_lock);
+	    if(strlen(n2) != 16 || sscanf(n2, "%016"PRIx64, &k) != 1) {
+	      TRACE(TRACE_DEBUG, "blobcache", "Removed stale file %s", path3);
+	      fa_unlink(path3, NULL, 0);
+              continue;
+            }
 
-	    if(sscanf(n2, "%016"PRIx64, &k) != 1 ||
-	       lookup_item(k) == NULL) {
+            blobcache_stripe_t *bs = bc_stripe(k);
+            hts_mutex_lock(&bs->bs_mutex);
+	    if(lookup_item(bs, k) == NULL) {
 	      TRACE(TRACE_DEBUG, "blobcache", "Removed stale file %s", path3);
 	      fa_unlink(path3, NULL, 0);
 	    }
-            hts_mutex_unlock(&cache_lock);
+            hts_mutex_unlock(&bs->bs_mutex);
 	  }
 	}
         fa_dir_free(d2);
@@ -715,20 +1740,6 @@ prune_stale(void)
 
 
 
-/**
- *
- */
-static void
-prune_item(blobcache_item_t *p)
-{
-  char filename[PATH_MAX];
-  make_filename(filename, sizeof(filename), p->bi_key_hash, 0);
-  fa_unlink(filename, NULL, 0);
-  pool_put(item_pool, p);
-}
-
-
-
 /**
  *
  */
@@ -736,41 +1747,42 @@ void
 blobcache_evict(const char *key, const char *stash)
 {
   uint64_t dk = digest_key(key, stash);
+  blobcache_stripe_t *bs = bc_stripe(dk);
 
-  hts_mutex_lock(&cache_lock);
-  if(bcstate == BLOBCACHE_RUN) {
-    blobcache_item_t *p, **q;
-    q = &hashvector[dk & ITEM_HASH_MASK];
-    while((p = *q) != NULL) {
-      if(p->bi_key_hash == dk) {
-        current_cache_size -= p->bi_size;
-        *q = p->bi_link;
-        prune_item(p);
-        break;
-      }
-      q = &p->bi_link;
-    }
-  }
-  hts_mutex_unlock(&cache_lock);
+  if(bcstate != BLOBCACHE_RUN)
+    return;
+
+  hts_mutex_lock(&bs->bs_mutex);
+  blobcache_item_t *p = lookup_item(bs, dk);
+  if(p != NULL)
+    prune_item(bs, p);
+  hts_mutex_unlock(&bs->bs_mutex);
 }
 
 
 /**
+ * Advance the clock hand of a stripe until we find an item to evict
  *
+ * Assume stripe is locked
  */
-static int
-accesstimecmp(const void *A, const void *B)
+static blobcache_item_t *
+clock_sweep(blobcache_stripe_t *bs)
 {
-  const blobcache_item_t *a = *(const blobcache_item_t **)A;
-  const blobcache_item_t *b = *(const blobcache_item_t **)B;
+  blobcache_item_t *p;
+  int n = bs->bs_count * (BC_CLOCK_IMPORTANT + 1);
 
-  const int a_imp = !!(a->bi_flags & BLOBCACHE_IMPORTANT_ITEM);
-  const int b_imp = !!(b->bi_flags & BLOBCACHE_IMPORTANT_ITEM);
+  while(n-- > 0 && (p = TAILQ_FIRST(&bs->bs_clock)) != NULL) {
+
+    if(p->bi_pending == NULL && p->bi_clock == 0)
+      return p;
 
-  if(a_imp != b_imp)
-    return a_imp - b_imp;
+    if(p->bi_clock > 0)
+      p->bi_clock--;
 
-  return a->bi_lastaccess - b->bi_lastaccess;
+    TAILQ_REMOVE(&bs->bs_clock, p, bi_clock_link);
+    TAILQ_INSERT_TAIL(&bs->bs_clock, p, bi_clock_link);
+  }
+  return NULL;
 }
 
 
@@ -780,43 +1792,23 @@ accesstimecmp(const void *A, const void *B)
 static void
 prune_to_size(uint64_t maxsize)
 {
-  int i, tot = 0, j = 0;
-  blobcache_item_t *p, **sv;
-
-  for(i = 0; i < ITEM_HASH_SIZE; i++)
-    for(p = hashvector[i]; p != NULL; p = p->bi_link)
-      tot++;
-
-  sv = malloc(sizeof(blobcache_item_t *) * tot);
-  current_cache_size = 0;
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      sv[j++] = p;
-      current_cache_size += p->bi_size;
+  uint64_t size = blobcache_size();
+  int misses = 0;
+
+  while(size > maxsize && misses < BC_STRIPES) {
+    blobcache_stripe_t *bs = &stripes[prune_hand++ % BC_STRIPES];
+
+    hts_mutex_lock(&bs->bs_mutex);
+    blobcache_item_t *p = clock_sweep(bs);
+    if(p != NULL) {
+      size -= p->bi_size;
+      prune_item(bs, p);
+      misses = 0;
+    } else {
+      misses++;
     }
-    hashvector[i] = NULL;
-  }
-
-  assert(j == tot);
-
-  qsort(sv, j, sizeof(blobcache_item_t *), accesstimecmp);
-  for(i = 0; i < j; i++) {
-    p = sv[i];
-    if(current_cache_size < maxsize)
-      break;
-    current_cache_size -= p->bi_size;
-    prune_item(p);
-    index_dirty = 1;
-  }
-
-  for(; i < j; i++) {
-    p = sv[i];
-    p->bi_link = hashvector[p->bi_key_hash & ITEM_HASH_MASK];
-    hashvector[p->bi_key_hash & ITEM_HASH_MASK] = p;
+    hts_mutex_unlock(&bs->bs_mutex);
   }
-
-  free(sv);
-  save_index();
 }
 
 
@@ -847,26 +1839,78 @@ blobcache_prune_old(void)
 static void
 cache_clear(void *opaque, prop_event_t event, ...)
 {
-  int i;
-  blobcache_item_t *p, *n;
-
-  hts_mutex_lock(&cache_lock);
+  blobcache_item_t *p;
 
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = n) {
-      n = p->bi_link;
-      prune_item(p);
-      index_dirty = 1;
-    }
-    hashvector[i] = NULL;
+  for(int i = 0; i < BC_STRIPES; i++) {
+    blobcache_stripe_t *bs = &stripes[i];
+    hts_mutex_lock(&bs->bs_mutex);
+    while((p = TAILQ_FIRST(&bs->bs_clock)) != NULL)
+      prune_item(bs, p);
+    hts_mutex_unlock(&bs->bs_mutex);
   }
-  current_cache_size = 0;
-  save_index();
+
+  hts_mutex_lock(&cache_lock);
+  hts_cond_signal(&cache_cond);
   hts_mutex_unlock(&cache_lock);
   notify_add(NULL, NOTIFY_INFO, NULL, 3, _("Cache cleared"));
 }
 
 
+/**
+ * Write blob to disk unless it has been replaced or evicted
+ */
+static void
+flush_item(blobcache_flush_t *bf)
+{
+  blobcache_stripe_t *bs = bc_stripe(bf->bf_key_hash);
+  blobcache_item_t *p;
+  buf_t *b = bf->bf_buf;
+
+  hts_mutex_lock(&bs->bs_mutex);
+  p = lookup_item(bs, bf->bf_key_hash);
+  int wanted = p != NULL && p->bi_pending == b;
+  hts_mutex_unlock(&bs->bs_mutex);
+
+  if(!wanted)
+    return;
+
+  char filename[PATH_MAX];
+  char tmpname[PATH_MAX];
+  make_filename(filename, sizeof(filename), bf->bf_key_hash, 1);
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+  // Write to a temporary file and rename it in place. Blobs handed out
+  // as mappings keep referring to the old file
+  fa_handle_t *fh = fa_open_ex(tmpname, NULL, 0, FA_WRITE, NULL);
+  if(fh != NULL) {
+    int err = 0;
+
+    if(b->b_content_type != NULL) {
+      const char *str = rstr_get(b->b_content_type);
+      size_t len = strlen(str);
+      if(fa_write(fh, str, len) != len)
+        err = 1;
+    }
+
+    if(!err && fa_write(fh, b->b_ptr, b->b_size) != b->b_size)
+      err = 1;
+
+    fa_close(fh);
+
+    if(err || fa_rename(tmpname, filename, NULL, 0))
+      fa_unlink(tmpname, NULL, 0);
+  }
+
+  hts_mutex_lock(&bs->bs_mutex);
+  p = lookup_item(bs, bf->bf_key_hash);
+  if(p != NULL && p->bi_pending == b) {
+    p->bi_pending = NULL;
+    hot_insert(bs, p, b);
+    buf_release(b);
+  }
+  hts_mutex_unlock(&bs->bs_mutex);
+}
+
 
 /**
  *
@@ -882,15 +1926,17 @@ flushthread(void *aux)
 
   uint64_t maxsize = blobcache_compute_maxsize();
 
-  hts_mutex_lock(&cache_lock);
   prune_to_size(maxsize);
+  save_index();
 
   TRACE(TRACE_INFO, "blobcache",
 	"Initialized: %d items consuming %.2f MB "
         "(out of maximum %.2f MB) on disk in %s/bc2",
-	pool_num(item_pool), current_cache_size / 1000000.0,
+	blobcache_items(), blobcache_size() / 1000000.0,
         maxsize / 1000000.0, gconf.cache_path);
 
+  hts_mutex_lock(&cache_lock);
+
   // First make sure clock is valid
   while(bcstate == BLOBCACHE_RUN_BAD_CLOCK) {
     time_t now;
@@ -909,9 +1955,12 @@ flushthread(void *aux)
 
     if((bf = TAILQ_FIRST(&flush_queue)) == NULL) {
 
-      if(index_dirty) {
-        if(hts_cond_wait_timeout(&cache_cond, &cache_lock, 5000))
+      if(atomic_get(&index_dirty)) {
+        if(hts_cond_wait_timeout(&cache_cond, &cache_lock, 5000)) {
+          hts_mutex_unlock(&cache_lock);
           save_index();
+          hts_mutex_lock(&cache_lock);
+        }
       } else {
         hts_cond_wait(&cache_cond, &cache_lock);
       }
@@ -919,44 +1968,176 @@ flushthread(void *aux)
     }
 
     hts_mutex_unlock(&cache_lock);
-    char filename[PATH_MAX];
-    make_filename(filename, sizeof(filename), bf->bf_key_hash, 1);
-    buf_t *b = bf->bf_buf;
-
-    fa_handle_t *fh = fa_open_ex(filename, NULL, 0, FA_WRITE, NULL);
-    if(fh != NULL) {
 
-      if(b->b_content_type != NULL) {
-	const char *str = rstr_get(b->b_content_type);
-	size_t len = strlen(str);
-	if(fa_write(fh, str, len) != len)
-	  fa_unlink(filename, NULL, 0);
-      }
+    flush_item(bf);
 
-      if(fa_write(fh, b->b_ptr, b->b_size) != b->b_size)
-        fa_unlink(filename, NULL, 0);
+    uint64_t maxsize = blobcache_compute_maxsize();
+    prune_to_size(maxsize);
 
-      fa_close(fh);
-    }
     hts_mutex_lock(&cache_lock);
 
     assert(TAILQ_FIRST(&flush_queue) == bf);
     TAILQ_REMOVE(&flush_queue, bf, bf_link);
     buf_release(bf->bf_buf);
-    pool_put(item_pool, bf);
+    pool_put(flush_pool, bf);
+  }
+  hts_mutex_unlock(&cache_lock);
+  save_index();
+  index_close();
+  return NULL;
+}
 
-    uint64_t maxsize = blobcache_compute_maxsize();
 
-    if(maxsize < current_cache_size)
-      prune_to_size(maxsize);
+#ifdef BLOBCACHE_BENCHMARK
+
+#define BLOBCACHE_BENCH_THREADS 8
+#define BLOBCACHE_BENCH_KEYS    10000
+#define BLOBCACHE_BENCH_OPS     100000
+
+static void *
+blobcache_bench_thread(void *aux)
+{
+  intptr_t id = (intptr_t)aux;
+  char key[64];
+  unsigned int seed = id;
+  buf_t *b = buf_create_and_copy(4, "data");
+
+  for(int i = 0; i < BLOBCACHE_BENCH_OPS; i++) {
+    seed = seed * 1103515245 + 12345;
+    snprintf(key, sizeof(key), "bench:%d", (seed >> 8) % BLOBCACHE_BENCH_KEYS);
+
+    if((seed >> 4) % 10 == 0) {
+      blobcache_put(key, "benchmark", b, 3600, NULL, 0, 0);
+    } else {
+      buf_t *r = blobcache_get(key, "benchmark", 0, NULL, NULL, NULL);
+      if(r != NULL)
+        buf_release(r);
+    }
   }
-  save_index();
-  hts_mutex_unlock(&cache_lock);
+  buf_release(b);
   return NULL;
 }
 
-static_assert(sizeof(blobcache_flush_t) <= sizeof(blobcache_item_t),
-              "blobcache_flush too big");
+
+/**
+ * Measure get/put throughput on the index. Items never leave the flush
+ * queue so this does not touch the disk
+ */
+static void
+blobcache_benchmark(void)
+{
+  hts_thread_t tids[BLOBCACHE_BENCH_THREADS];
+  char key[64];
+
+  int saved_state = bcstate;
+  bcstate = BLOBCACHE_RUN;
+
+  for(int threads = 1; threads <= BLOBCACHE_BENCH_THREADS; threads *= 2) {
+    int64_t ts = arch_get_ts();
+
+    for(intptr_t i = 0; i < threads; i++)
+      hts_thread_create_joinable("bcbench", &tids[i],
+                                 blobcache_bench_thread, (void *)i,
+                                 THREAD_PRIO_BGTASK);
+    for(int i = 0; i < threads; i++)
+      hts_thread_join(&tids[i]);
+
+    ts = arch_get_ts() - ts;
+    TRACE(TRACE_INFO, "blobcache", "Benchmark: %d threads: %.2f M ops/s",
+          threads, threads * BLOBCACHE_BENCH_OPS / (double)ts);
+  }
+
+  for(int i = 0; i < BLOBCACHE_BENCH_KEYS; i++) {
+    snprintf(key, sizeof(key), "bench:%d", i);
+    blobcache_evict(key, "benchmark");
+  }
+
+  blobcache_flush_t *bf;
+  while((bf = TAILQ_FIRST(&flush_queue)) != NULL) {
+    TAILQ_REMOVE(&flush_queue, bf, bf_link);
+    buf_release(bf->bf_buf);
+    pool_put(flush_pool, bf);
+  }
+  bcstate = saved_state;
+}
+#endif
+
+
+#ifdef BLOBCACHE_TEST
+
+/**
+ * Drop all items from memory and load them back from the index file
+ */
+static void
+blobcache_test_reload(void)
+{
+  blobcache_flush_t *bf;
+  blobcache_item_t *p;
+
+  while((bf = TAILQ_FIRST(&flush_queue)) != NULL) {
+    TAILQ_REMOVE(&flush_queue, bf, bf_link);
+    flush_item(bf);
+    buf_release(bf->bf_buf);
+    pool_put(flush_pool, bf);
+  }
+
+  save_index();
+  index_close();
+
+  for(int i = 0; i < BC_STRIPES; i++) {
+    blobcache_stripe_t *bs = &stripes[i];
+    hts_mutex_lock(&bs->bs_mutex);
+    while((p = TAILQ_FIRST(&bs->bs_clock)) != NULL)
+      item_destroy(bs, p);
+    bs->bs_num_dead = 0; // The records are still valid on disk
+    hts_mutex_unlock(&bs->bs_mutex);
+  }
+  index_num_free = 0;
+
+  load_index();
+}
+
+
+/**
+ * Etags longer than what fits in an index record must survive a restart
+ */
+static void
+blobcache_test(void)
+{
+  char etag[201];
+  char *out = NULL;
+  buf_t *b = buf_create_and_copy(4, "data");
+
+  int saved_state = bcstate;
+  bcstate = BLOBCACHE_RUN;
+
+  for(int i = 0; i < 200; i++)
+    etag[i] = 'a' + i % 26;
+  etag[200] = 0;
+
+  blobcache_evict("test:etag", "blobcachetest");
+  blobcache_put("test:etag", "blobcachetest", b, 3600, etag, 0, 0);
+  buf_release(b);
+
+  blobcache_test_reload();
+
+  b = blobcache_get("test:etag", "blobcachetest", 0, NULL, &out, NULL);
+  if(b == NULL || out == NULL || strcmp(out, etag)) {
+    TRACE(TRACE_ERROR, "blobcache", "Etag test failed, got %s",
+          out ?: "no etag");
+    exit(1);
+  }
+  TRACE(TRACE_INFO, "blobcache", "Etag test: %d byte etag reloaded",
+        (int)strlen(out));
+
+  buf_release(b);
+  free(out);
+  blobcache_evict("test:etag", "blobcachetest");
+  save_index();
+  bcstate = saved_state;
+}
+#endif
+
 
 /**
  *
@@ -978,11 +2159,43 @@ blobcache_init(void)
 
   hts_mutex_init(&cache_lock);
   hts_cond_init(&cache_cond, &cache_lock);
-  item_pool = pool_create("blobcacheitems", sizeof(blobcache_item_t), 0);
-
+  flush_pool = pool_create("blobcacheflush", sizeof(blobcache_flush_t), 0);
+#if ENABLE_MMAP
+  hts_mutex_init(&blob_mapping_mutex);
+  page_size = sysconf(_SC_PAGESIZE);
+#endif
+
+  for(int i = 0; i < BC_STRIPES; i++) {
+    blobcache_stripe_t *bs = &stripes[i];
+    hts_mutex_init(&bs->bs_mutex);
+    bs->bs_mask = 255;
+    bs->bs_buckets = calloc(bs->bs_mask + 1, sizeof(blobcache_item_t *));
+    TAILQ_INIT(&bs->bs_clock);
+    LIST_INIT(&bs->bs_dirty);
+    TAILQ_INIT(&bs->bs_hot);
+    bs->bs_pool = pool_create("blobcacheitems", sizeof(blobcache_item_t), 0);
+  }
 
   load_index();
 
+#ifdef BLOBCACHE_BENCHMARK
+  blobcache_benchmark();
+#endif
+
+#ifdef BLOBCACHE_TEST
+  blobcache_test();
+#endif
+
+  setting_create(SETTING_INT, setting_get_dir("general:misc"),
+                 SETTINGS_INITIAL_UPDATE,
+                 SETTING_TITLE(_p("In-memory cache for small files")),
+                 SETTING_STORE("blobcache", "hottiersize"),
+                 SETTING_CALLBACK(set_hot_tier_size, NULL),
+                 SETTING_VALUE(8),
+                 SETTING_RANGE(0, 64),
+                 SETTING_UNIT_CSTR("MB"),
+                 SETTING_ZERO_TEXT(_p("Off")),
+                 NULL);
 
   prop_t *dir = setting_get_dir("general:resets");
   settings_create_action(dir, _p("Clear cached files"),
@@ -25,6 +25,9 @@
 #include "htsmsg/htsmsg.h"
 #include "ecmascript.h"
 #include "misc/minmax.h"
+#include "misc/sha.h"
+#include "misc/str.h"
+#include "blobcache.h"
 
 static int es_num_contexts;
 static struct es_context_list es_contexts;
@@ -315,6 +318,162 @@ es_resource_destroy_duk(duk_context *ctx)
 }
 
 
+/**
+ * Compiled functions are cached as Duktape bytecode. The key covers
+ * the source, filename, compile flags and engine version so any change
+ * to those simply misses the cache
+ */
+#define ES_BYTECODE_STASH  "esbytecode"
+#define ES_BYTECODE_MAXAGE (86400 * 30)
+#define ES_BYTECODE_MAGIC  0x65736263
+
+/**
+ * duk_load_function() trusts its input completely so the dump is
+ * stored behind a header that is verified before anything is loaded
+ */
+typedef struct es_bytecode_header {
+  uint32_t magic;
+  uint32_t length;
+  uint8_t digest[20];
+} es_bytecode_header_t;
+
+
+/**
+ *
+ */
+static void
+es_bytecode_digest(uint8_t *digest, const void *data, size_t len)
+{
+  sha1_decl(shactx);
+  sha1_init(shactx);
+  sha1_update(shactx, data, len);
+  sha1_final(shactx, digest);
+}
+
+
+/**
+ * Return the dump in b or NULL if the header does not match
+ */
+static const void *
+es_bytecode_verify(buf_t *b, size_t *lenp)
+{
+  const es_bytecode_header_t *h = buf_data(b);
+  uint8_t digest[20];
+
+  if(buf_len(b) < sizeof(es_bytecode_header_t))
+    return NULL;
+
+  const size_t len = buf_len(b) - sizeof(es_bytecode_header_t);
+
+  if(h->magic != ES_BYTECODE_MAGIC || h->length != len)
+    return NULL;
+
+  es_bytecode_digest(digest, h + 1, len);
+  if(memcmp(digest, h->digest, sizeof(digest)))
+    return NULL;
+
+  *lenp = len;
+  return h + 1;
+}
+
+static void
+es_bytecode_key(char *key, size_t keylen, const char *filename,
+                buf_t *src, int flags)
+{
+  uint8_t digest[20];
+  char hdr[128];
+
+  snprintf(hdr, sizeof(hdr), "%ld:%s:%d:%s",
+           (long)DUK_VERSION, appversion, flags, filename);
+
+  sha1_decl(shactx);
+  sha1_init(shactx);
+  sha1_update(shactx, (const uint8_t *)hdr, strlen(hdr) + 1);
+  sha1_update(shactx, buf_data(src), buf_len(src));
+  sha1_final(shactx, digest);
+  bin2hex(key, keylen, digest, sizeof(digest));
+}
+
+
+/**
+ *
+ */
+static duk_ret_t
+es_load_function(duk_context *ctx)
+{
+  duk_load_function(ctx);
+  return 1;
+}
+
+
+/**
+ * Push compiled function for src. With DUK_COMPILE_FUNCTION the source
+ * is wrapped as a CommonJS module function.
+ *
+ * Returns 0 with the function on the stack, otherwise the error
+ */
+static int
+es_compile_cached(es_context_t *ec, duk_context *ctx, const char *filename,
+                  buf_t *src, int flags)
+{
+  char key[41];
+  duk_size_t size;
+
+  es_bytecode_key(key, sizeof(key), filename, src, flags);
+
+  buf_t *b = blobcache_get(key, ES_BYTECODE_STASH, 0, NULL, NULL, NULL);
+  if(b != NULL) {
+    size_t len;
+    const void *dump = es_bytecode_verify(b, &len);
+
+    if(dump == NULL) {
+      es_debug(ec, "Ignoring cached bytecode for %s -- Bad header", filename);
+      buf_release(b);
+      blobcache_evict(key, ES_BYTECODE_STASH);
+    } else {
+      void *ptr = duk_push_fixed_buffer(ctx, len);
+      memcpy(ptr, dump, len);
+      buf_release(b);
+
+      if(duk_safe_call(ctx, es_load_function, 1, 1) == DUK_EXEC_SUCCESS)
+        return 0;
+
+      es_debug(ec, "Ignoring cached bytecode for %s -- %s",
+               filename, duk_safe_to_string(ctx, -1));
+      duk_pop(ctx);
+      blobcache_evict(key, ES_BYTECODE_STASH);
+    }
+  }
+
+  if(flags & DUK_COMPILE_FUNCTION) {
+    duk_push_string(ctx, "function(require,exports,module){");
+    duk_push_lstring(ctx, buf_cstr(src), buf_len(src));
+    duk_push_string(ctx, "\n}");
+    duk_concat(ctx, 3);
+  } else {
+    duk_push_lstring(ctx, buf_cstr(src), buf_len(src));
+  }
+  duk_push_string(ctx, filename);
+
+  if(duk_pcompile(ctx, flags))
+    return -1;
+
+  duk_dup_top(ctx);
+  duk_dump_function(ctx);
+  const void *data = duk_get_buffer(ctx, -1, &size);
+  b = buf_create(sizeof(es_bytecode_header_t) + size);
+  es_bytecode_header_t *h = (es_bytecode_header_t *)b->b_ptr;
+  h->magic = ES_BYTECODE_MAGIC;
+  h->length = size;
+  es_bytecode_digest(h->digest, data, size);
+  memcpy(h + 1, data, size);
+  blobcache_put(key, ES_BYTECODE_STASH, b, ES_BYTECODE_MAXAGE, NULL, 0, 0);
+  buf_release(b);
+  duk_pop(ctx);
+  return 0;
+}
+
+
 /**
  *
  */
@@ -330,12 +489,10 @@ es_compile(duk_context *ctx)
   if(buf == NULL)
     duk_error(ctx, DUK_ERR_ERROR, "Unable to load %s -- %s", path, errbuf);
 
-  duk_push_lstring(ctx, buf_cstr(buf), buf_len(buf));
+  int rc = es_compile_cached(es_get(ctx), ctx, path, buf, 0);
   buf_release(buf);
-
-  duk_push_string(ctx, path);
-
-  duk_compile(ctx, 0);
+  if(rc)
+    duk_throw(ctx);
   return 1;
 }
 
@@ -393,13 +550,32 @@ tryload(duk_context *ctx, const char *path, const char *id, es_context_t *ec)
                        FA_LOAD_ERRBUF(errbuf, sizeof(errbuf)),
                        NULL);
 
-  if(buf != NULL) {
-    es_debug(ec, "Module %s loaded from %s", id, path);
-    duk_push_lstring(ctx, buf_cstr(buf), buf_len(buf));
-    buf_release(buf);
-    return 1;
-  }
-  return 0;
+  if(buf == NULL)
+    return 0;
+
+  es_debug(ec, "Module %s loaded from %s", id, path);
+
+  const char *resolved_id = duk_get_string(ctx, 0);
+  int rc = es_compile_cached(ec, ctx, resolved_id, buf, DUK_COMPILE_FUNCTION);
+  buf_release(buf);
+  if(rc)
+    duk_throw(ctx);
+
+  const char *name = strrchr(resolved_id, '/');
+  duk_push_string(ctx, "name");
+  duk_push_string(ctx, name ? name + 1 : resolved_id);
+  duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_FORCE);
+
+  // Run the module function here instead of returning the source to
+  // Duktape so we can use the bytecode cache
+
+  duk_dup(ctx, 2);                         // this = exports
+  duk_dup(ctx, 1);                         // require
+  duk_get_prop_string(ctx, 3, "exports");  // exports
+  duk_dup(ctx, 3);                         // module
+  duk_call_method(ctx, 3);
+  duk_pop(ctx);
+  return 1;
 }
 
 /**
@@ -444,13 +620,13 @@ es_modsearch(duk_context *ctx)
     fa_pathjoin(path, sizeof(path)-4, ec->ec_path, id);
     strcat(path, ".js");
     if(tryload(ctx, path, id, ec))
-      return 1;
+      return 0;
   }
 
   snprintf(path, sizeof(path),
            "dataroot://res/ecmascript/modules/%s.js", id);
   if(tryload(ctx, path, id, ec))
-    return 1;
+    return 0;
 
   duk_error(ctx, DUK_ERR_ERROR, "Can't find module %s", id);
 }
@@ -516,59 +692,6 @@ es_create_env(es_context_t *ec, const char *loaddir, const char *storage)
 }
 
 
-/**
- *
- */
-static void *
-es_mem_alloc(void *udata, duk_size_t size)
-{
-  es_context_t *ec = udata;
-  void *p = malloc(size);
-
-  if(p != NULL) {
-    ec->ec_mem_active += arch_malloc_size(p);
-    ec->ec_mem_peak = MAX(ec->ec_mem_peak, ec->ec_mem_active);
-  }
-  return p;
-}
-
-
-/**
- *
- */
-static void *
-es_mem_realloc(void *udata, void *ptr, duk_size_t size)
-{
-  es_context_t *ec = udata;
-  size_t prev = 0;
-
-  if(udata != NULL)
-    prev = arch_malloc_size(ptr);
-
-  ptr = realloc(ptr, size);
-  if(ptr != NULL) {
-    ec->ec_mem_active -= prev;
-    ec->ec_mem_active += arch_malloc_size(ptr);
-    ec->ec_mem_peak = MAX(ec->ec_mem_peak, ec->ec_mem_active);
-  }
-  return ptr;
-}
-
-
-/**
- *
- */
-static void
-es_mem_free(void *udata, void *ptr)
-{
-  es_context_t *ec = udata;
-  if(ptr == NULL)
-    return;
-  ec->ec_mem_active -= arch_malloc_size(ptr);
-  free(ptr);
-}
-
-
 /**
  *
  */
@@ -614,6 +737,7 @@ es_context_create(const char *id, int flags, const char *url,
 
   ec->ec_prop_dispatch_group = prop_dispatch_group_create();
 
+  ec->ec_arena = es_mem_arena_create();
   ec->ec_duk = duk_create_heap(es_mem_alloc, es_mem_realloc, es_mem_free,
                                ec, NULL);
 
@@ -743,11 +867,20 @@ es_context_end(es_context_t *ec, int do_gc, duk_context *ctx)
       duk_destroy_heap(ec->ec_duk);
       ec->ec_duk = NULL;
 
+      es_mem_arena_destroy(ec->ec_arena);
+      ec->ec_arena = NULL;
+
       prop_vec_destroy_entries(ec->ec_prop_unload_destroy);
       prop_vec_release(ec->ec_prop_unload_destroy);
 
       prop_dispatch_group_destroy(ec->ec_prop_dispatch_group);
 
+      for(int i = 0; i < ES_ATOM_CACHE_SIZE; i++) {
+        if(ec->ec_atom_cache[i] != NULL)
+          prop_atom_release(ec->ec_atom_cache[i]);
+        ec->ec_atom_cache[i] = NULL;
+      }
+
       TRACE(TRACE_DEBUG, rstr_get(ec->ec_id), "Unloaded");
     }
   }
@@ -832,11 +965,10 @@ es_load_and_compile(es_context_t *ec, const char *path, duk_context *ctx)
     return -1;
   }
 
-  duk_push_lstring(ctx, buf_cstr(buf), buf_len(buf));
+  int rc = es_compile_cached(ec, ctx, path, buf, 0);
   buf_release(buf);
-  duk_push_string(ctx, path);
 
-  if(duk_pcompile(ctx, 0)) {
+  if(rc) {
 
     TRACE(TRACE_ERROR, rstr_get(ec->ec_id), "Unable to compile %s -- %s",
           path, duk_safe_to_string(ctx, -1));
@@ -855,13 +987,23 @@ es_exec(es_context_t *ec, const char *path, duk_context *ctx)
 {
   int rc;
 
+  int64_t ts0 = arch_get_ts();
+
   if(es_load_and_compile(ec, path, ctx))
     return -1;
 
+  int64_t ts1 = arch_get_ts();
+
   rc = duk_pcall(ctx, 0);
   if(rc != 0)
     es_dump_err(ctx);
 
+  int64_t ts2 = arch_get_ts();
+
+  es_debug(ec, "%s: Compile:%dms Exec:%dms", path,
+           ((int)(ts1 - ts0)) / 1000,
+           ((int)(ts2 - ts1)) / 1000);
+
   duk_pop(ctx);
   return 0;
 }
@@ -874,7 +1016,7 @@ int
 ecmascript_plugin_load(const char *id, const char *url,
                        char *errbuf, size_t errlen,
                        int version, const char *manifest,
-                       int flags)
+                       int flags, size_t memlimit)
 {
   char storage[PATH_MAX];
 
@@ -884,6 +1026,9 @@ ecmascript_plugin_load(const char *id, const char *url,
   es_context_t *ec = es_context_create(id, flags | ECMASCRIPT_PLUGIN,
                                        url, storage);
 
+  if(memlimit)
+    ec->ec_mem_limit = memlimit;
+
   duk_context *ctx = es_context_begin(ec);
 
   duk_push_global_object(ctx);
@@ -1033,6 +1178,10 @@ ecmascript_plugin_unload(const char *id)
 static void
 ecmascript_init(void)
 {
+#ifdef ES_MEMORY_BENCHMARK
+  es_memory_benchmark();
+#endif
+
   if(gconf.load_ecmascript == NULL)
     return;
 
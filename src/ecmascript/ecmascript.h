@@ -41,6 +41,8 @@ LIST_HEAD(es_context_list, es_context);
 
 #define ECMASCRIPT_MAX_NATIVE_CLASSES 16
 
+#define ES_ATOM_CACHE_SIZE 64
+
 /**
  * Native class
  */
@@ -96,8 +98,11 @@ typedef struct es_context {
   // This include stuff such as filedescriptors, database handles, etc
   struct es_resource_list ec_resources_volatile;
 
+  struct es_mem_arena *ec_arena;
   size_t ec_mem_active;
   size_t ec_mem_peak;
+  size_t ec_mem_limit;   // 0 = unlimited
+  int ec_mem_limit_hit;
 
 
   struct htsmsg *ec_manifest; // plugin.json
@@ -110,6 +115,9 @@ typedef struct es_context {
 
   int ec_rooted_objects;
 
+  // Prop name atoms for recently used property names, see es_prop_atom()
+  struct prop_atom *ec_atom_cache[ES_ATOM_CACHE_SIZE];
+
 } es_context_t;
 
 
@@ -236,7 +244,7 @@ int ecmascript_context_lockmgr(void *ptr, lockmgr_op_t op);
 int ecmascript_plugin_load(const char *id, const char *fullpath,
                            char *errbuf, size_t errlen,
                            int version, const char *manifest,
-                           int flags);
+                           int flags, size_t memlimit);
 
 #define ECMASCRIPT_DEBUG                 0x1
 #define ECMASCRIPT_FILE_BYPASS_ACL_READ  0x2
@@ -246,6 +254,28 @@ int ecmascript_plugin_load(const char *id, const char *fullpath,
 void ecmascript_plugin_unload(const char *id);
 
 
+/**
+ * Memory management
+ */
+typedef struct es_mem_arena es_mem_arena_t;
+
+es_mem_arena_t *es_mem_arena_create(void);
+
+void es_mem_arena_destroy(es_mem_arena_t *a);
+
+void es_mem_arena_stats(es_mem_arena_t *a, int *slabs, int *large);
+
+void *es_mem_alloc(void *udata, duk_size_t size);
+
+void *es_mem_realloc(void *udata, void *ptr, duk_size_t size);
+
+void es_mem_free(void *udata, void *ptr);
+
+#ifdef ES_MEMORY_BENCHMARK
+void es_memory_benchmark(void);
+#endif
+
+
 /**
  * Misc support
  */
@@ -901,8 +901,20 @@ es_xmlrpc(duk_context *ctx)
   return 1;
 }
 
+/**
+ *
+ */
+static int
+es_http_prewarm(duk_context *ctx)
+{
+  http_client_prewarm(duk_require_string(ctx, 0));
+  return 0;
+}
+
+
 static const duk_function_list_entry fnlist_io[] = {
   { "httpReq",              es_http_req,              3 },
+  { "httpPrewarm",          es_http_prewarm,          1 },
   { "httpInspectorCreate",  es_http_inspector_create, 3 },
   { "probe",                es_probe,                 2 },
   { "xmlrpc",               es_xmlrpc,                DUK_VARARGS },
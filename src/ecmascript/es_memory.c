@@ -0,0 +1,609 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "misc/minmax.h"
+#include "ecmascript.h"
+
+/**
+ * Per context arena for Duktape heaps.
+ *
+ * Small allocations come from 8k slabs, each dedicated to one size
+ * class and with its own freelist. A slab that becomes empty is given
+ * back unless it is the only one in its class with free room, so a
+ * context that has shrunk after a peak does not keep the memory until
+ * it dies. Larger allocations go to malloc() but are linked to the
+ * arena. Every block has a header with its size class so accounting is
+ * O(1). All memory is released in one go when the context dies.
+ */
+
+#define ES_MEM_SLAB_SIZE   (8 * 1024)
+#define ES_MEM_MAX_SMALL   512
+#define ES_MEM_CLASS_LARGE 0xff
+
+static const uint16_t es_mem_class_size[] = {
+  16, 24, 32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512
+};
+
+#define ES_MEM_NUM_CLASSES ARRAYSIZE(es_mem_class_size)
+
+static uint8_t es_mem_class_map[ES_MEM_MAX_SMALL / 8 + 1];
+
+LIST_HEAD(es_mem_large_list, es_mem_large);
+LIST_HEAD(es_mem_slab_list, es_mem_slab);
+
+typedef struct es_mem_hdr {
+  uint32_t size;  // Small blocks: Offset of header from start of slab
+  uint32_t cls;
+} es_mem_hdr_t;
+
+typedef struct es_mem_large {
+  LIST_ENTRY(es_mem_large) link;
+  es_mem_hdr_t hdr;
+} es_mem_large_t;
+
+typedef struct es_mem_free {
+  struct es_mem_free *next;
+} es_mem_free_t;
+
+typedef struct es_mem_slab {
+  LIST_ENTRY(es_mem_slab) link;         // All slabs in arena
+  LIST_ENTRY(es_mem_slab) partial_link; // Slabs with free blocks
+  es_mem_free_t *freelist;
+  uint16_t used;     // Blocks handed out
+  uint16_t carved;   // Blocks ever carved out of the slab
+  uint16_t capacity;
+  uint8_t cls;
+  uint8_t partial;   // On partial list
+} __attribute__((aligned(8))) es_mem_slab_t;
+
+struct es_mem_arena {
+  struct es_mem_slab_list partial[ES_MEM_NUM_CLASSES];
+  struct es_mem_slab_list slabs;
+  struct es_mem_large_list large;
+  int num_slabs;
+};
+
+
+/**
+ *
+ */
+INITIALIZER(es_mem_init_classes)
+{
+  int c = 0;
+  for(int i = 0; i < ARRAYSIZE(es_mem_class_map); i++) {
+    while(es_mem_class_size[c] < i * 8)
+      c++;
+    es_mem_class_map[i] = c;
+  }
+}
+
+
+/**
+ *
+ */
+es_mem_arena_t *
+es_mem_arena_create(void)
+{
+  es_mem_arena_t *a = calloc(1, sizeof(es_mem_arena_t));
+  LIST_INIT(&a->slabs);
+  LIST_INIT(&a->large);
+  for(int i = 0; i < ES_MEM_NUM_CLASSES; i++)
+    LIST_INIT(&a->partial[i]);
+  return a;
+}
+
+
+/**
+ *
+ */
+void
+es_mem_arena_destroy(es_mem_arena_t *a)
+{
+  es_mem_slab_t *s;
+  es_mem_large_t *l;
+
+  while((s = LIST_FIRST(&a->slabs)) != NULL) {
+    LIST_REMOVE(s, link);
+    free(s);
+  }
+
+  while((l = LIST_FIRST(&a->large)) != NULL) {
+    LIST_REMOVE(l, link);
+    free(l);
+  }
+  free(a);
+}
+
+
+/**
+ *
+ */
+static size_t
+es_mem_block_size(const es_mem_hdr_t *h)
+{
+  return h->cls == ES_MEM_CLASS_LARGE ? h->size : es_mem_class_size[h->cls];
+}
+
+
+/**
+ *
+ */
+static es_mem_slab_t *
+es_mem_slab_create(es_mem_arena_t *a, int cls)
+{
+  es_mem_slab_t *s = malloc(ES_MEM_SLAB_SIZE);
+  if(s == NULL)
+    return NULL;
+
+  s->freelist = NULL;
+  s->used = 0;
+  s->carved = 0;
+  s->capacity = (ES_MEM_SLAB_SIZE - sizeof(es_mem_slab_t)) /
+    (sizeof(es_mem_hdr_t) + es_mem_class_size[cls]);
+  s->cls = cls;
+  s->partial = 1;
+  LIST_INSERT_HEAD(&a->slabs, s, link);
+  LIST_INSERT_HEAD(&a->partial[cls], s, partial_link);
+  a->num_slabs++;
+  return s;
+}
+
+
+/**
+ *
+ */
+static es_mem_hdr_t *
+es_mem_get_small(es_mem_arena_t *a, int cls)
+{
+  es_mem_slab_t *s = LIST_FIRST(&a->partial[cls]);
+  es_mem_hdr_t *h;
+
+  if(s == NULL && (s = es_mem_slab_create(a, cls)) == NULL)
+    return NULL;
+
+  if(s->freelist != NULL) {
+    h = (es_mem_hdr_t *)s->freelist - 1;
+    s->freelist = s->freelist->next;
+  } else {
+    const size_t offset = sizeof(es_mem_slab_t) +
+      s->carved * (sizeof(es_mem_hdr_t) + es_mem_class_size[cls]);
+    h = (es_mem_hdr_t *)((char *)s + offset);
+    h->size = offset;
+    h->cls = cls;
+    s->carved++;
+  }
+
+  if(++s->used == s->capacity) {
+    LIST_REMOVE(s, partial_link);
+    s->partial = 0;
+  }
+  return h;
+}
+
+
+/**
+ *
+ */
+static void
+es_mem_put_small(es_mem_arena_t *a, es_mem_hdr_t *h)
+{
+  es_mem_slab_t *s = (es_mem_slab_t *)((char *)h - h->size);
+  es_mem_free_t *f = (es_mem_free_t *)(h + 1);
+
+  f->next = s->freelist;
+  s->freelist = f;
+  s->used--;
+
+  if(!s->partial) {
+    LIST_INSERT_HEAD(&a->partial[s->cls], s, partial_link);
+    s->partial = 1;
+  }
+
+  if(s->used == 0 && (LIST_FIRST(&a->partial[s->cls]) != s ||
+                      LIST_NEXT(s, partial_link) != NULL)) {
+    LIST_REMOVE(s, partial_link);
+    LIST_REMOVE(s, link);
+    a->num_slabs--;
+    free(s);
+  }
+}
+
+
+/**
+ *
+ */
+static int
+es_mem_account(es_context_t *ec, size_t size)
+{
+  if(ec->ec_mem_limit && ec->ec_mem_active + size > ec->ec_mem_limit) {
+    // Duktape will run an emergency GC and retry before giving up
+    if(!ec->ec_mem_limit_hit)
+      TRACE(TRACE_ERROR, rstr_get(ec->ec_id),
+            "Heap limit of %zd MB (memoryLimit in plugin.json) reached, "
+            "allocations will fail", ec->ec_mem_limit >> 20);
+    ec->ec_mem_limit_hit = 1;
+    return -1;
+  }
+  ec->ec_mem_active += size;
+  ec->ec_mem_peak = MAX(ec->ec_mem_peak, ec->ec_mem_active);
+  return 0;
+}
+
+
+/**
+ *
+ */
+void *
+es_mem_alloc(void *udata, duk_size_t size)
+{
+  es_context_t *ec = udata;
+  es_mem_arena_t *a = ec->ec_arena;
+  es_mem_hdr_t *h;
+
+  if(size == 0)
+    return NULL;
+
+  if(size <= ES_MEM_MAX_SMALL) {
+    const int cls = es_mem_class_map[(size + 7) >> 3];
+    if(es_mem_account(ec, es_mem_class_size[cls]))
+      return NULL;
+    h = es_mem_get_small(a, cls);
+    if(h == NULL) {
+      ec->ec_mem_active -= es_mem_class_size[cls];
+      return NULL;
+    }
+    return h + 1;
+  }
+
+  if(es_mem_account(ec, size))
+    return NULL;
+
+  es_mem_large_t *l = malloc(sizeof(es_mem_large_t) + size);
+  if(l == NULL) {
+    ec->ec_mem_active -= size;
+    return NULL;
+  }
+  LIST_INSERT_HEAD(&a->large, l, link);
+  l->hdr.cls = ES_MEM_CLASS_LARGE;
+  l->hdr.size = size;
+  return &l->hdr + 1;
+}
+
+
+/**
+ *
+ */
+void
+es_mem_free(void *udata, void *ptr)
+{
+  es_context_t *ec = udata;
+  es_mem_arena_t *a = ec->ec_arena;
+
+  if(ptr == NULL)
+    return;
+
+  es_mem_hdr_t *h = (es_mem_hdr_t *)ptr - 1;
+  ec->ec_mem_active -= es_mem_block_size(h);
+
+  if(h->cls == ES_MEM_CLASS_LARGE) {
+    es_mem_large_t *l = (es_mem_large_t *)((char *)h -
+                                           offsetof(es_mem_large_t, hdr));
+    LIST_REMOVE(l, link);
+    free(l);
+    return;
+  }
+
+  es_mem_put_small(a, h);
+}
+
+
+/**
+ *
+ */
+void *
+es_mem_realloc(void *udata, void *ptr, duk_size_t size)
+{
+  es_context_t *ec = udata;
+
+  if(ptr == NULL)
+    return es_mem_alloc(udata, size);
+
+  if(size == 0) {
+    es_mem_free(udata, ptr);
+    return NULL;
+  }
+
+  es_mem_hdr_t *h = (es_mem_hdr_t *)ptr - 1;
+
+  if(h->cls == ES_MEM_CLASS_LARGE && size > ES_MEM_MAX_SMALL) {
+    const size_t prev = h->size;
+    if(size > prev && es_mem_account(ec, size - prev))
+      return NULL;
+
+    es_mem_large_t *l = (es_mem_large_t *)((char *)h -
+                                           offsetof(es_mem_large_t, hdr));
+    LIST_REMOVE(l, link);
+    es_mem_large_t *n = realloc(l, sizeof(es_mem_large_t) + size);
+    if(n == NULL) {
+      LIST_INSERT_HEAD(&ec->ec_arena->large, l, link);
+      if(size > prev)
+        ec->ec_mem_active -= size - prev;
+      return NULL;
+    }
+    LIST_INSERT_HEAD(&ec->ec_arena->large, n, link);
+    if(size < prev)
+      ec->ec_mem_active -= prev - size;
+    n->hdr.size = size;
+    return &n->hdr + 1;
+  }
+
+  const size_t prev = es_mem_block_size(h);
+
+  if(h->cls != ES_MEM_CLASS_LARGE && size <= prev &&
+     (h->cls == 0 || size > es_mem_class_size[h->cls - 1]))
+    return ptr; // Same size class
+
+  void *n = es_mem_alloc(udata, size);
+  if(n == NULL)
+    return NULL;
+  memcpy(n, ptr, MIN(size, prev));
+  es_mem_free(udata, ptr);
+  return n;
+}
+
+
+/**
+ *
+ */
+void
+es_mem_arena_stats(es_mem_arena_t *a, int *slabs, int *large)
+{
+  es_mem_large_t *l;
+  int n = 0;
+  LIST_FOREACH(l, &a->large, link)
+    n++;
+  *slabs = a->num_slabs;
+  *large = n;
+}
+
+
+#ifdef ES_MEMORY_BENCHMARK
+
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/wait.h>
+#endif
+#include "arch/arch.h"
+
+/**
+ * Mimics a plugin that churns through lots of short lived objects,
+ * strings and arrays (like parsing JSON responses and building item
+ * lists)
+ */
+static const char es_mem_churn_script[] =
+  "var keep = [];"
+  "for(var i = 0; i < 50000; i++) {"
+  "  var o = { title: 'Item ' + i, url: 'plugin:item:' + i,"
+  "            meta: { year: 1900 + (i % 120), tags: ['a', 'b', i] } };"
+  "  var s = JSON.stringify(o);"
+  "  var p = JSON.parse(s);"
+  "  if(i % 64 == 0) keep.push(p);"
+  "  if(keep.length > 500) keep.splice(0, 250);"
+  "}";
+
+/**
+ * A burst of objects that are all dropped again, like a plugin that
+ * parsed one huge response
+ */
+static const char es_mem_spike_script[] =
+  "var big = [];"
+  "for(var i = 0; i < 200000; i++)"
+  "  big.push({ title: 'Item ' + i, n: i });";
+
+
+static size_t
+es_mem_rss(void)
+{
+#ifdef __linux__
+  unsigned long size, rss;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if(f == NULL)
+    return 0;
+  if(fscanf(f, "%lu %lu", &size, &rss) != 2)
+    rss = 0;
+  fclose(f);
+  return rss * 4096;
+#else
+  return 0;
+#endif
+}
+
+
+/**
+ * The previous allocator, malloc() with arch_malloc_size() accounting
+ */
+static void *
+es_mem_bench_malloc(void *udata, duk_size_t size)
+{
+  es_context_t *ec = udata;
+  void *p = malloc(size);
+  if(p != NULL)
+    ec->ec_mem_active += arch_malloc_size(p);
+  return p;
+}
+
+static void *
+es_mem_bench_realloc(void *udata, void *ptr, duk_size_t size)
+{
+  es_context_t *ec = udata;
+  size_t prev = ptr ? arch_malloc_size(ptr) : 0;
+  ptr = realloc(ptr, size);
+  if(ptr != NULL) {
+    ec->ec_mem_active -= prev;
+    ec->ec_mem_active += arch_malloc_size(ptr);
+  }
+  return ptr;
+}
+
+static void
+es_mem_bench_free(void *udata, void *ptr)
+{
+  es_context_t *ec = udata;
+  if(ptr == NULL)
+    return;
+  ec->ec_mem_active -= arch_malloc_size(ptr);
+  free(ptr);
+}
+
+
+static void
+es_mem_bench_run(const char *name, duk_alloc_function a,
+                 duk_realloc_function r, duk_free_function f,
+                 es_context_t *ec)
+{
+  void *slots[4096] = {};
+  uint32_t x = 1;
+  const int ops = 10000000;
+  size_t rss0 = es_mem_rss();
+
+  // Raw allocator throughput, mostly small blocks
+
+  int64_t ts = arch_get_ts();
+  for(int i = 0; i < ops; i++) {
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    void **s = &slots[x & 4095];
+    if(*s != NULL) {
+      f(ec, *s);
+      *s = NULL;
+    } else {
+      size_t size = x & 0x1f0000 ? 8 + ((x >> 12) & 0xf8) : 600 + (x >> 20);
+      *s = a(ec, size);
+    }
+  }
+  for(int i = 0; i < 4096; i++)
+    f(ec, slots[i]);
+  int64_t raw = arch_get_ts() - ts;
+
+  // Script churn
+
+  ts = arch_get_ts();
+  for(int i = 0; i < 4; i++) {
+    duk_context *ctx = duk_create_heap(a, r, f, ec, NULL);
+    if(duk_peval_string(ctx, es_mem_churn_script))
+      TRACE(TRACE_ERROR, "ESMEM", "%s: %s", name,
+            duk_safe_to_string(ctx, -1));
+    duk_destroy_heap(ctx);
+  }
+  int64_t script = arch_get_ts() - ts;
+
+  TRACE(TRACE_INFO, "ESMEM",
+        "%-8s raw: %d Mops/s  script: %d ms  RSS growth: %zd kB",
+        name, (int)(ops / raw), (int)(script / 1000),
+        (es_mem_rss() - rss0) / 1024);
+}
+
+
+/**
+ * Memory still held by a live heap after a peak
+ */
+static void
+es_mem_bench_spike(const char *name, duk_alloc_function a,
+                   duk_realloc_function r, duk_free_function f,
+                   es_context_t *ec)
+{
+  duk_context *ctx = duk_create_heap(a, r, f, ec, NULL);
+  size_t rss0 = es_mem_rss();
+
+  if(duk_peval_string(ctx, es_mem_spike_script))
+    TRACE(TRACE_ERROR, "ESMEM", "%s: %s", name, duk_safe_to_string(ctx, -1));
+  duk_pop(ctx);
+  size_t rss1 = es_mem_rss();
+
+  // Refcounting releases the objects right away
+  duk_peval_string_noresult(ctx, "big = null;");
+  size_t rss2 = es_mem_rss();
+
+  duk_gc(ctx, 0);
+  duk_gc(ctx, 0);
+  size_t rss3 = es_mem_rss();
+
+  TRACE(TRACE_INFO, "ESMEM",
+        "%-8s spike RSS: %zd kB at peak, %zd kB after release, "
+        "%zd kB after GC (heap %zd kB)",
+        name, (rss1 - rss0) / 1024, (rss2 - rss0) / 1024,
+        (rss3 - rss0) / 1024, ec->ec_mem_active / 1024);
+  duk_destroy_heap(ctx);
+}
+
+
+/**
+ * On Linux each run is done in a child process so RSS is not skewed by
+ * memory the previous run left behind in the malloc heap
+ */
+static void
+es_mem_bench_isolated(int use_arena, int spike)
+{
+#ifdef __linux__
+  pid_t pid = fork();
+  if(pid == -1)
+    return;
+  if(pid != 0) {
+    waitpid(pid, NULL, 0);
+    return;
+  }
+#endif
+
+  es_context_t ec = {};
+  ec.ec_id = rstr_alloc("benchmark");
+
+  void (*run)(const char *, duk_alloc_function, duk_realloc_function,
+              duk_free_function, es_context_t *) =
+    spike ? es_mem_bench_spike : es_mem_bench_run;
+
+  if(use_arena) {
+    ec.ec_arena = es_mem_arena_create();
+    run("arena", es_mem_alloc, es_mem_realloc, es_mem_free, &ec);
+    es_mem_arena_destroy(ec.ec_arena);
+  } else {
+    run("malloc", es_mem_bench_malloc, es_mem_bench_realloc,
+        es_mem_bench_free, &ec);
+  }
+  rstr_release(ec.ec_id);
+
+#ifdef __linux__
+  _exit(0);
+#endif
+}
+
+
+void
+es_memory_benchmark(void)
+{
+  es_mem_bench_isolated(0, 0);
+  es_mem_bench_isolated(1, 0);
+  es_mem_bench_isolated(0, 1);
+  es_mem_bench_isolated(1, 1);
+}
+
+#endif
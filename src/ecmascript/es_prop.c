@@ -246,6 +246,34 @@ es_prop_get_value_duk(duk_context *ctx)
 }
 
 
+/**
+ * Resolve the property name at stack index 'idx' into an atom.
+ *
+ * Scripts tend to use the same handful of names over and over, so
+ * the context keeps the atoms of recently used names in a small cache
+ * keyed on duktape's interned string. The returned atom is borrowed
+ * from the cache and only valid until the next call
+ */
+static prop_atom_t *
+es_prop_atom(duk_context *ctx, int idx)
+{
+  es_context_t *ec = es_get(ctx);
+  const char *str = duk_require_string(ctx, idx);
+  const int slot = ((intptr_t)str >> 3) & (ES_ATOM_CACHE_SIZE - 1);
+  prop_atom_t *pa = ec->ec_atom_cache[slot];
+
+  // The string pointer may have been recycled, so compare contents
+  if(pa != NULL && !strcmp(prop_atom_str(pa), str))
+    return pa;
+
+  if(pa != NULL)
+    prop_atom_release(pa);
+  pa = prop_atom_get(str);
+  ec->ec_atom_cache[slot] = pa;
+  return pa;
+}
+
+
 /**
  *
  */
@@ -253,12 +281,12 @@ static int
 es_prop_get_child_duk(duk_context *ctx)
 {
   prop_t *p = es_stprop_get(ctx, 0);
-  const char *str = NULL;
+  prop_atom_t *name = NULL;
   int idx = 0;
   if(duk_is_number(ctx, 1)) {
     idx = duk_to_int(ctx, 1);
   } else {
-    str = duk_require_string(ctx, 1);
+    name = es_prop_atom(ctx, 1);
   }
 
   hts_mutex_lock(&prop_mutex);
@@ -268,8 +296,8 @@ es_prop_get_child_duk(duk_context *ctx)
     duk_error(ctx, ST_ERROR_PROP_ZOMBIE, NULL);
   }
 
-  if(str != NULL) {
-    p = prop_create0(p, str, NULL, 0);
+  if(name != NULL) {
+    p = prop_create_atom0(p, name, NULL);
   } else {
     prop_t *c;
     TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
@@ -344,15 +372,16 @@ static int
 es_prop_has_duk(duk_context *ctx)
 {
   prop_t *p = es_stprop_get(ctx, 0);
-  const char *name = duk_get_string(ctx, 1);
+  const char *name = prop_atom_str(es_prop_atom(ctx, 1));
   int yes = 0;
 
   hts_mutex_lock(&prop_mutex);
 
   if(p->hp_type == PROP_DIR) {
     prop_t *c;
+    // Names are interned, comparing pointers is enough
     TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
-      if(c->hp_name != NULL && !strcmp(c->hp_name, name)) {
+      if(c->hp_name == name) {
         yes = 1;
         break;
       }
@@ -412,29 +441,29 @@ static int
 es_prop_set_value_duk(duk_context *ctx)
 {
   prop_t *p = es_stprop_get(ctx, 0);
-  const char *str = duk_require_string(ctx, 1);
+  prop_atom_t *name = es_prop_atom(ctx, 1);
 
-  SETPRINTF("Set %s.%s to ", p->hp_name, str);
+  SETPRINTF("Set %s.%s to ", p->hp_name, prop_atom_str(name));
 
   if(duk_is_boolean(ctx, 2)) {
     SETPRINTF("%s", duk_get_boolean(ctx, 2) ? "true" : "false");
-    prop_set(p, str, PROP_SET_INT, duk_get_boolean(ctx, 2));
+    prop_set_atom(p, name, PROP_SET_INT, duk_get_boolean(ctx, 2));
   } else if(duk_is_number(ctx, 2)) {
     double dbl = duk_get_number(ctx, 2);
 
     if(ceil(dbl) == dbl && dbl <= INT32_MAX && dbl >= INT32_MIN) {
       SETPRINTF("%d", (int)dbl);
-      prop_set(p, str, PROP_SET_INT, (int)dbl);
+      prop_set_atom(p, name, PROP_SET_INT, (int)dbl);
     } else {
       SETPRINTF("%f", dbl);
-      prop_set(p, str, PROP_SET_FLOAT, dbl);
+      prop_set_atom(p, name, PROP_SET_FLOAT, dbl);
     }
   } else if(duk_is_string(ctx, 2)) {
     SETPRINTF("\"%s\"", duk_get_string(ctx, 2));
-    prop_set(p, str, PROP_SET_STRING, duk_get_string(ctx, 2));
+    prop_set_atom(p, name, PROP_SET_STRING, duk_get_string(ctx, 2));
   } else {
     SETPRINTF("(void)");
-    prop_set(p, str, PROP_SET_VOID);
+    prop_set_atom(p, name, PROP_SET_VOID);
   }
   SETPRINTF("\n");
   return 0;
@@ -448,10 +477,10 @@ static int
 es_prop_set_rich_str_duk(duk_context *ctx)
 {
   prop_t *p = es_stprop_get(ctx, 0);
-  const char *key = duk_require_string(ctx, 1);
+  prop_atom_t *key = es_prop_atom(ctx, 1);
   const char *richstr = duk_require_string(ctx, 2);
 
-  prop_t *c = prop_create_r(p, key);
+  prop_t *c = prop_create_atom_r(p, key);
   prop_set_string_ex(c, NULL, richstr, PROP_STR_RICH);
   prop_ref_dec(c);
   return 0;
@@ -64,6 +64,12 @@ dump_context(htsbuf_queue_t *out, es_context_t *ec)
 
   htsbuf_qprintf(out, "  Memory usage, current: %zd bytes, peak: %zd\n",
                  ec->ec_mem_active, ec->ec_mem_peak);
+  if(ec->ec_arena != NULL) {
+    int slabs, large;
+    es_mem_arena_stats(ec->ec_arena, &slabs, &large);
+    htsbuf_qprintf(out, "  Arena: %d slabs, %d large blocks, limit: %zd\n",
+                   slabs, large, ec->ec_mem_limit);
+  }
   htsbuf_qprintf(out, "  Rooted Ecmascript objects: %d\n",
                  ec->ec_rooted_objects);
 
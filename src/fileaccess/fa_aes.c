@@ -17,6 +17,8 @@
  *  This program is also available under a commercial proprietary license.
  *  For more information, contact andreas@lonelycoder.com
  */
+#include <string.h>
+
 #include <libavutil/aes.h>
 #include <libavutil/mem.h>
 
@@ -25,26 +27,322 @@
 #include "fa_proto.h"
 #include "misc/minmax.h"
 
-#define MAX_BUFFER_BLOCKS 150
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define AES_X86 1
+#include <wmmintrin.h>
+#else
+#define AES_X86 0
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#define AES_ARMV8 1
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#endif
+#else
+#define AES_ARMV8 0
+#endif
+
+#define MAX_BUFFER_BLOCKS 4096
 #define BLOCKSIZE 16
+#define ROUNDS 10
+
+struct aes_fh;
 
 /**
  *
  */
+typedef struct aes_impl {
+  const char *name;
+  int (*probe)(void);
+  void (*setkey)(struct aes_fh *a, const uint8_t *key);
+  void (*decrypt)(struct aes_fh *a, uint8_t *data, int blocks);
+} aes_impl_t;
+
+
+/**
+ * Ciphertext is read into buffer and decrypted in place.
+ * [rdptr, buffer + declen) is plaintext not yet returned to the caller,
+ * [buffer + declen, buffer + len) is ciphertext not yet decrypted.
+ */
 typedef struct aes_fh {
   fa_handle_t h;
   fa_handle_t *src;
+  const aes_impl_t *impl;
   uint8_t iv[16];
   struct AVAES *aes;
-  
-  uint8_t  inbuffer[BLOCKSIZE*MAX_BUFFER_BLOCKS];
-  uint8_t outbuffer[BLOCKSIZE*MAX_BUFFER_BLOCKS];
-  uint8_t *outptr;
-  int inlen, inlen_used, outlen, eof;
+  uint8_t dk[BLOCKSIZE * (ROUNDS + 1)];
+
+  uint8_t *rdptr;
+  int declen, len, eof;
+  uint8_t buffer[BLOCKSIZE*MAX_BUFFER_BLOCKS];
 
 } aes_fh_t;
 
 
+/**
+ * Expand an AES-128 key into the encryption key schedule
+ */
+static void
+aes128_expand_key(uint8_t *ek, const uint8_t *key)
+{
+  uint8_t sbox[256];
+  uint8_t p = 1, q = 1, rcon = 1;
+  int i, j;
+
+  do {
+    p = p ^ (uint8_t)(p << 1) ^ (p & 0x80 ? 0x1b : 0);
+    q ^= q << 1;
+    q ^= q << 2;
+    q ^= q << 4;
+    if(q & 0x80)
+      q ^= 0x09;
+    sbox[p] = 0x63 ^ q ^
+      (uint8_t)((q << 1) | (q >> 7)) ^ (uint8_t)((q << 2) | (q >> 6)) ^
+      (uint8_t)((q << 3) | (q >> 5)) ^ (uint8_t)((q << 4) | (q >> 4));
+  } while(p != 1);
+  sbox[0] = 0x63;
+
+  memcpy(ek, key, 16);
+  for(i = 16; i < BLOCKSIZE * (ROUNDS + 1); i += 4) {
+    uint8_t t[4];
+    memcpy(t, ek + i - 4, 4);
+    if((i & 15) == 0) {
+      const uint8_t t0 = t[0];
+      t[0] = sbox[t[1]] ^ rcon;
+      t[1] = sbox[t[2]];
+      t[2] = sbox[t[3]];
+      t[3] = sbox[t0];
+      rcon = (uint8_t)(rcon << 1) ^ (rcon & 0x80 ? 0x1b : 0);
+    }
+    for(j = 0; j < 4; j++)
+      ek[i + j] = ek[i - 16 + j] ^ t[j];
+  }
+}
+
+
+#if AES_X86
+
+/**
+ *
+ */
+static int
+aesni_probe(void)
+{
+  return __builtin_cpu_supports("aes");
+}
+
+
+/**
+ * Decryption keys for the equivalent inverse cipher
+ */
+__attribute__((target("aes,sse2"))) static void
+aesni_setkey(aes_fh_t *a, const uint8_t *key)
+{
+  uint8_t ek[BLOCKSIZE * (ROUNDS + 1)];
+  int i;
+  aes128_expand_key(ek, key);
+
+  _mm_storeu_si128((__m128i *)a->dk,
+                   _mm_loadu_si128((const __m128i *)(ek + 16 * ROUNDS)));
+  for(i = 1; i < ROUNDS; i++)
+    _mm_storeu_si128((__m128i *)(a->dk + 16 * i),
+                     _mm_aesimc_si128(_mm_loadu_si128((const __m128i *)
+                                                      (ek + 16 * (ROUNDS - i)))));
+  _mm_storeu_si128((__m128i *)(a->dk + 16 * ROUNDS),
+                   _mm_loadu_si128((const __m128i *)ek));
+}
+
+
+/**
+ * CBC decryption has no dependency between blocks, so four are kept
+ * in flight to hide the latency of AESDEC
+ */
+__attribute__((target("aes,sse2"))) static void
+aesni_decrypt(aes_fh_t *a, uint8_t *data, int blocks)
+{
+  __m128i k[ROUNDS + 1];
+  __m128i iv = _mm_loadu_si128((const __m128i *)a->iv);
+  int i;
+
+  for(i = 0; i <= ROUNDS; i++)
+    k[i] = _mm_loadu_si128((const __m128i *)(a->dk + 16 * i));
+
+  for(; blocks >= 4; blocks -= 4, data += 64) {
+    const __m128i c0 = _mm_loadu_si128((const __m128i *)(data +  0));
+    const __m128i c1 = _mm_loadu_si128((const __m128i *)(data + 16));
+    const __m128i c2 = _mm_loadu_si128((const __m128i *)(data + 32));
+    const __m128i c3 = _mm_loadu_si128((const __m128i *)(data + 48));
+    __m128i s0 = _mm_xor_si128(c0, k[0]);
+    __m128i s1 = _mm_xor_si128(c1, k[0]);
+    __m128i s2 = _mm_xor_si128(c2, k[0]);
+    __m128i s3 = _mm_xor_si128(c3, k[0]);
+    for(i = 1; i < ROUNDS; i++) {
+      s0 = _mm_aesdec_si128(s0, k[i]);
+      s1 = _mm_aesdec_si128(s1, k[i]);
+      s2 = _mm_aesdec_si128(s2, k[i]);
+      s3 = _mm_aesdec_si128(s3, k[i]);
+    }
+    s0 = _mm_aesdeclast_si128(s0, k[ROUNDS]);
+    s1 = _mm_aesdeclast_si128(s1, k[ROUNDS]);
+    s2 = _mm_aesdeclast_si128(s2, k[ROUNDS]);
+    s3 = _mm_aesdeclast_si128(s3, k[ROUNDS]);
+    _mm_storeu_si128((__m128i *)(data +  0), _mm_xor_si128(s0, iv));
+    _mm_storeu_si128((__m128i *)(data + 16), _mm_xor_si128(s1, c0));
+    _mm_storeu_si128((__m128i *)(data + 32), _mm_xor_si128(s2, c1));
+    _mm_storeu_si128((__m128i *)(data + 48), _mm_xor_si128(s3, c2));
+    iv = c3;
+  }
+
+  for(; blocks > 0; blocks--, data += 16) {
+    const __m128i c = _mm_loadu_si128((const __m128i *)data);
+    __m128i s = _mm_xor_si128(c, k[0]);
+    for(i = 1; i < ROUNDS; i++)
+      s = _mm_aesdec_si128(s, k[i]);
+    s = _mm_aesdeclast_si128(s, k[ROUNDS]);
+    _mm_storeu_si128((__m128i *)data, _mm_xor_si128(s, iv));
+    iv = c;
+  }
+  _mm_storeu_si128((__m128i *)a->iv, iv);
+}
+
+#endif
+
+
+#if AES_ARMV8
+
+/**
+ *
+ */
+static int
+armv8_probe(void)
+{
+#ifdef __linux__
+  return !!(getauxval(AT_HWCAP) & HWCAP_AES);
+#else
+  return 1;
+#endif
+}
+
+
+/**
+ * Decryption keys for the equivalent inverse cipher
+ */
+static void
+armv8_setkey(aes_fh_t *a, const uint8_t *key)
+{
+  uint8_t ek[BLOCKSIZE * (ROUNDS + 1)];
+  int i;
+  aes128_expand_key(ek, key);
+
+  vst1q_u8(a->dk, vld1q_u8(ek + 16 * ROUNDS));
+  for(i = 1; i < ROUNDS; i++)
+    vst1q_u8(a->dk + 16 * i, vaesimcq_u8(vld1q_u8(ek + 16 * (ROUNDS - i))));
+  vst1q_u8(a->dk + 16 * ROUNDS, vld1q_u8(ek));
+}
+
+
+/**
+ *
+ */
+static void
+armv8_decrypt(aes_fh_t *a, uint8_t *data, int blocks)
+{
+  uint8x16_t k[ROUNDS + 1];
+  uint8x16_t iv = vld1q_u8(a->iv);
+  int i;
+
+  for(i = 0; i <= ROUNDS; i++)
+    k[i] = vld1q_u8(a->dk + 16 * i);
+
+  for(; blocks >= 4; blocks -= 4, data += 64) {
+    const uint8x16_t c0 = vld1q_u8(data +  0);
+    const uint8x16_t c1 = vld1q_u8(data + 16);
+    const uint8x16_t c2 = vld1q_u8(data + 32);
+    const uint8x16_t c3 = vld1q_u8(data + 48);
+    uint8x16_t s0 = c0, s1 = c1, s2 = c2, s3 = c3;
+    for(i = 0; i < ROUNDS - 1; i++) {
+      s0 = vaesimcq_u8(vaesdq_u8(s0, k[i]));
+      s1 = vaesimcq_u8(vaesdq_u8(s1, k[i]));
+      s2 = vaesimcq_u8(vaesdq_u8(s2, k[i]));
+      s3 = vaesimcq_u8(vaesdq_u8(s3, k[i]));
+    }
+    s0 = veorq_u8(vaesdq_u8(s0, k[ROUNDS - 1]), k[ROUNDS]);
+    s1 = veorq_u8(vaesdq_u8(s1, k[ROUNDS - 1]), k[ROUNDS]);
+    s2 = veorq_u8(vaesdq_u8(s2, k[ROUNDS - 1]), k[ROUNDS]);
+    s3 = veorq_u8(vaesdq_u8(s3, k[ROUNDS - 1]), k[ROUNDS]);
+    vst1q_u8(data +  0, veorq_u8(s0, iv));
+    vst1q_u8(data + 16, veorq_u8(s1, c0));
+    vst1q_u8(data + 32, veorq_u8(s2, c1));
+    vst1q_u8(data + 48, veorq_u8(s3, c2));
+    iv = c3;
+  }
+
+  for(; blocks > 0; blocks--, data += 16) {
+    const uint8x16_t c = vld1q_u8(data);
+    uint8x16_t s = c;
+    for(i = 0; i < ROUNDS - 1; i++)
+      s = vaesimcq_u8(vaesdq_u8(s, k[i]));
+    s = veorq_u8(vaesdq_u8(s, k[ROUNDS - 1]), k[ROUNDS]);
+    vst1q_u8(data, veorq_u8(s, iv));
+    iv = c;
+  }
+  vst1q_u8(a->iv, iv);
+}
+
+#endif
+
+
+/**
+ *
+ */
+static int
+libav_probe(void)
+{
+  return 1;
+}
+
+
+/**
+ *
+ */
+static void
+libav_setkey(aes_fh_t *a, const uint8_t *key)
+{
+  a->aes = av_aes_alloc();
+  av_aes_init(a->aes, key, 128, 1);
+}
+
+
+/**
+ * av_aes_crypt() reads each source block before writing it back so
+ * decrypting in place is fine
+ */
+static void
+libav_decrypt(aes_fh_t *a, uint8_t *data, int blocks)
+{
+  av_aes_crypt(a->aes, data, data, blocks, a->iv, 1);
+}
+
+
+/**
+ * In order of preference
+ */
+static const aes_impl_t aes_impls[] = {
+#if AES_X86
+  { "AES-NI", aesni_probe, aesni_setkey, aesni_decrypt },
+#endif
+#if AES_ARMV8
+  { "ARMv8",  armv8_probe, armv8_setkey, armv8_decrypt },
+#endif
+  { "libav",  libav_probe, libav_setkey, libav_decrypt },
+};
+
+
 /**
  *
  */
@@ -91,45 +389,49 @@ aescbc_read(fa_handle_t *handle, void *buf, size_t size)
 
   while(1) {
 
-    if(a->outlen > 0) {
-      size = MIN(size, a->outlen);
-      memcpy(buf, a->outptr, size);
-      a->outptr += size;
-      a->outlen -= size;
+    const int avail = a->buffer + a->declen - a->rdptr;
+    if(avail > 0) {
+      size = MIN(size, avail);
+      memcpy(buf, a->rdptr, size);
+      a->rdptr += size;
       return size;
     }
 
-    while(a->inlen - a->inlen_used < 2 * BLOCKSIZE) {
-      int n = a->src->fh_proto->fap_read(a->src, a->inbuffer + a->inlen,
-					 sizeof(a->inbuffer) - a->inlen);
+    if(a->eof)
+      return 0;
+
+    a->len -= a->declen;
+    memmove(a->buffer, a->buffer + a->declen, a->len);
+    a->declen = 0;
+    a->rdptr = a->buffer;
+
+    do {
+      int n = a->src->fh_proto->fap_read(a->src, a->buffer + a->len,
+                                         sizeof(a->buffer) - a->len);
       if(n <= 0) {
 	a->eof = 1;
 	break;
       }
-      a->inlen += n;
-    }
+      a->len += n;
+    } while(a->len < 2 * BLOCKSIZE);
 
-    if((blocks = (a->inlen - a->inlen_used) / BLOCKSIZE) == 0)
-      return 0;
+    blocks = a->len / BLOCKSIZE;
 
+    // Hold back the last block until EOF, it may carry the padding
     if(!a->eof)
       blocks--;
 
-    av_aes_crypt(a->aes, a->outbuffer, a->inbuffer + a->inlen_used, blocks,
-                 a->iv, 1);
+    if(blocks == 0)
+      continue;
 
-    a->outlen = BLOCKSIZE * blocks;
-    a->outptr = a->outbuffer;
-    a->inlen_used += BLOCKSIZE * blocks;
+    a->impl->decrypt(a, a->buffer, blocks);
+    a->declen = BLOCKSIZE * blocks;
 
-    if(a->inlen_used >= sizeof(a->inbuffer) / 2) {
-      memmove(a->inbuffer, a->inbuffer + a->inlen_used,
-	      a->inlen - a->inlen_used);
-      a->inlen -= a->inlen_used;
-      a->inlen_used = 0;
+    if(a->eof) {
+      const int pad = a->buffer[a->declen - 1];
+      if(pad >= 1 && pad <= BLOCKSIZE)
+        a->declen -= pad;
     }
-    if(a->eof)
-      a->outlen -= a->outbuffer[a->outlen - 1];
   }
 }
 
@@ -149,15 +451,92 @@ static fa_protocol_t fa_protocol_aescbc = {
 /**
  *
  */
-fa_handle_t *
-fa_aescbc_open(fa_handle_t *fa, const uint8_t *iv, const uint8_t *key)
+static fa_handle_t *
+aescbc_open(fa_handle_t *fa, const uint8_t *iv, const uint8_t *key,
+            const aes_impl_t *impl)
 {
   aes_fh_t *a = calloc(1, sizeof(aes_fh_t));
   a->h.fh_proto = &fa_protocol_aescbc;
   a->src = fa;
+  a->impl = impl;
+  a->rdptr = a->buffer;
   memcpy(a->iv,  iv,  16);
-
-  a->aes = av_aes_alloc();
-  av_aes_init(a->aes, key, 128, 1);
+  impl->setkey(a, key);
   return &a->h;
 }
+
+
+/**
+ *
+ */
+fa_handle_t *
+fa_aescbc_open(fa_handle_t *fa, const uint8_t *iv, const uint8_t *key)
+{
+  static const aes_impl_t *impl;
+
+  if(impl == NULL) {
+    int i;
+    for(i = 0; !aes_impls[i].probe(); i++) {}
+    impl = &aes_impls[i];
+    TRACE(TRACE_DEBUG, "AES", "Using %s for AES-CBC decryption", impl->name);
+  }
+  return aescbc_open(fa, iv, key, impl);
+}
+
+
+#ifdef FA_AES_BENCHMARK
+#include <stdio.h>
+
+/**
+ * Decrypt a synthetic 16 MB stream with each available implementation
+ */
+void
+fa_aes_benchmark(void)
+{
+  const size_t size = 16 * 1024 * 1024;
+  uint8_t *src = malloc(size);
+  uint8_t *ref = malloc(size);
+  uint8_t *out = malloc(size);
+  uint8_t key[16], iv[16];
+  uint32_t x = 0x12345678;
+  size_t i;
+  int reflen = -1;
+
+  for(i = 0; i < size; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    src[i] = x;
+  }
+  memcpy(key, src, 16);
+  memcpy(iv, src + 16, 16);
+
+  for(i = 0; i < ARRAYSIZE(aes_impls); i++) {
+    const aes_impl_t *impl = &aes_impls[i];
+    if(!impl->probe())
+      continue;
+
+    fa_handle_t *fh = aescbc_open(memfile_make(src, size), iv, key, impl);
+    int len = 0, r;
+    int64_t ts = arch_get_ts();
+    while((r = fa_read(fh, out + len, MIN(65536, size - len))) > 0)
+      len += r;
+    ts = arch_get_ts() - ts;
+    fa_close(fh);
+
+    int ok = 1;
+    if(reflen == -1) {
+      memcpy(ref, out, len);
+      reflen = len;
+    } else {
+      ok = reflen == len && !memcmp(ref, out, len);
+    }
+    printf("fa_aes: %-8s %7.1f MB/s per core%s\n", impl->name,
+           (double)size / ts, ok ? "" : " (OUTPUT MISMATCH)");
+  }
+
+  free(src);
+  free(ref);
+  free(out);
+}
+#endif
@@ -135,6 +135,7 @@ be_file_playaudio(const char *url, media_pipe_t *mp,
   media_codec_t *cw;
   event_t *e;
   int registered_play = 0;
+  int audio_si = -1;
   uint8_t pb[4096];
   size_t psiz;
 
@@ -201,7 +202,19 @@ be_file_playaudio(const char *url, media_pipe_t *mp,
   mp_configure(mp, MP_CAN_SEEK | MP_CAN_PAUSE,
 	       MP_BUFFER_SHALLOW, fctx->duration, "tracks");
 
-  mp->mp_audio.mq_stream = -1;
+  /*
+   * If the previous track returned early (gapless) its tail is still
+   * in the queue. Keep the stream id so it's not dropped by the decoder
+   * and tag our packets with the same id
+   */
+  hts_mutex_lock(&mp->mp_mutex);
+  const int splice = mp->mp_gapless_preload &&
+    TAILQ_FIRST(&mp->mp_audio.mq_q_data) != NULL &&
+    mp->mp_audio.mq_stream != -1;
+  hts_mutex_unlock(&mp->mp_mutex);
+
+  if(!splice)
+    mp->mp_audio.mq_stream = -1;
   mp->mp_video.mq_stream = -1;
 
   fw = media_format_create(fctx);
@@ -214,9 +227,14 @@ be_file_playaudio(const char *url, media_pipe_t *mp,
       continue;
 
     cw = media_codec_create(ctx->codec_id, 0, fw, ctx, NULL, mp);
-    mp->mp_audio.mq_stream = i;
+    audio_si = i;
+    if(!splice)
+      mp->mp_audio.mq_stream = i;
     break;
   }
+
+  if(splice)
+    TRACE(TRACE_DEBUG, "Audio", "Appending %s to previous track", url);
   
   if(cw == NULL) {
     media_format_deref(fw);
@@ -270,7 +288,7 @@ be_file_playaudio(const char *url, media_pipe_t *mp,
 
       si = pkt.stream_index;
 
-      if(si != mp->mp_audio.mq_stream) {
+      if(si != audio_si) {
 	av_free_packet(&pkt);
 	continue;
       }
@@ -283,7 +301,7 @@ be_file_playaudio(const char *url, media_pipe_t *mp,
       mb->mb_duration = rescale(fctx, pkt.duration, si);
 
       mb->mb_cw = media_codec_ref(cw);
-      mb->mb_stream = pkt.stream_index;
+      mb->mb_stream = mp->mp_audio.mq_stream;
 
       if(mb->mb_pts != AV_NOPTS_VALUE) {
         const int64_t offset = fctx->start_time;
@@ -302,7 +320,10 @@ be_file_playaudio(const char *url, media_pipe_t *mp,
 
     if(mb == MB_SPECIAL_EOF) {
       // We have reached EOF, drain queues
-      e = mp_wait_for_empty_queues(mp);
+      if(mp->mp_gapless_preload)
+        e = mp_wait_for_audio_delay(mp, mp->mp_gapless_preload);
+      else
+        e = mp_wait_for_empty_queues(mp);
       
       if(e == NULL) {
 	e = event_create_type(EVENT_EOF);
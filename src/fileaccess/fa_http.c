@@ -43,6 +43,7 @@
 #include "misc/callout.h"
 #include "misc/average.h"
 #include "misc/minmax.h"
+#include "settings.h"
 
 #include "usage.h"
 
@@ -82,19 +83,50 @@ static int http_tokenize(char *buf, char **vec, int vecsize, int delimiter);
 
 
 /**
- * Connection parking
+ * Connection pool
+ *
+ * Connections are grouped per host (hostname, port, ssl) in a hash
+ * table. Each host keeps its own active and parked (idle keep-alive)
+ * connections. Parked connections are also on a global LRU list so we
+ * can cap the total number of idle sockets
  */
 TAILQ_HEAD(http_connection_queue ,http_connection);
+LIST_HEAD(http_host_list, http_host);
+
+#define HTTP_HOST_HASH_SIZE 64
+
+#define HTTP_MAX_PARKED_CONNECTIONS 32
+
+// Prewarmed connections that are not used within this time are closed
+#define HTTP_PREWARM_MAX_AGE 10
+
+typedef struct http_host {
+  LIST_ENTRY(http_host) hh_link;
+  char *hh_hostname;
+  int hh_port;
+  char hh_ssl;
 
+  struct http_connection_queue hh_active;
+  struct http_connection_queue hh_parked;
+  int hh_num_parked;
+} http_host_t;
+
+static struct http_host_list http_hosts[HTTP_HOST_HASH_SIZE];
 static struct http_connection_queue http_parked_connections;
-static struct http_connection_queue http_active_connections;
 static int http_num_parked_connections;
+static int http_num_hosts;
+static int http_max_idle_per_host = 4;
 
 static hts_mutex_t http_connections_mutex;
 static hts_cond_t http_connections_cond;
 static atomic_t http_connection_tally;
 static atomic_t http_file_tally;
 
+static atomic_t http_stat_connects;
+static atomic_t http_stat_reused;
+static atomic_t http_stat_tls_handshakes;
+static atomic_t http_stat_tls_resumed;
+
 typedef struct http_connection {
   atomic_t hc_refcount;
 
@@ -103,10 +135,13 @@ typedef struct http_connection {
   int hc_id;
   tcpcon_t *hc_tc;
 
-  TAILQ_ENTRY(http_connection) hc_link;
+  http_host_t *hc_host;
+  TAILQ_ENTRY(http_connection) hc_link;        // hh_active or hh_parked
+  TAILQ_ENTRY(http_connection) hc_parked_link; // http_parked_connections
 
   char hc_ssl;
   char hc_reused;
+  char hc_ssl_verified;
 
   atomic_t hc_inspecting;
 
@@ -303,6 +338,109 @@ http_connection_destroy(http_connection_t *hc, int dbg, const char *reason)
 
 
 
+/**
+ *
+ */
+static unsigned int
+http_host_hash(const char *hostname, int port, int ssl)
+{
+  unsigned int h = port * 2 + ssl;
+  while(*hostname)
+    h = h * 33 ^ (uint8_t)*hostname++;
+  return h % HTTP_HOST_HASH_SIZE;
+}
+
+
+/**
+ * Must be called with http_connections_mutex held
+ */
+static http_host_t *
+http_host_find(const char *hostname, int port, int ssl, int create)
+{
+  struct http_host_list *hl = &http_hosts[http_host_hash(hostname, port, ssl)];
+  http_host_t *hh;
+
+  LIST_FOREACH(hh, hl, hh_link)
+    if(hh->hh_port == port && hh->hh_ssl == ssl &&
+       !strcmp(hh->hh_hostname, hostname))
+      return hh;
+
+  if(!create)
+    return NULL;
+
+  hh = calloc(1, sizeof(http_host_t));
+  hh->hh_hostname = strdup(hostname);
+  hh->hh_port = port;
+  hh->hh_ssl = ssl;
+  TAILQ_INIT(&hh->hh_active);
+  TAILQ_INIT(&hh->hh_parked);
+  LIST_INSERT_HEAD(hl, hh, hh_link);
+  http_num_hosts++;
+  return hh;
+}
+
+
+/**
+ * Hosts without any connections are dropped
+ */
+static void
+http_host_maybe_destroy(http_host_t *hh)
+{
+  if(TAILQ_FIRST(&hh->hh_active) != NULL ||
+     TAILQ_FIRST(&hh->hh_parked) != NULL)
+    return;
+
+  LIST_REMOVE(hh, hh_link);
+  free(hh->hh_hostname);
+  free(hh);
+  http_num_hosts--;
+}
+
+
+/**
+ *
+ */
+static void
+http_connection_unpark(http_connection_t *hc)
+{
+  http_host_t *hh = hc->hc_host;
+  TAILQ_REMOVE(&hh->hh_parked, hc, hc_link);
+  TAILQ_REMOVE(&http_parked_connections, hc, hc_parked_link);
+  hh->hh_num_parked--;
+  http_num_parked_connections--;
+}
+
+
+/**
+ * Close a parked connection
+ */
+static void
+http_connection_evict(http_connection_t *hc, int dbg, const char *reason)
+{
+  http_host_t *hh = hc->hc_host;
+  http_connection_unpark(hc);
+  callout_disarm(&hc->hc_callout);
+  http_connection_destroy(hc, dbg, reason);
+  http_host_maybe_destroy(hh);
+}
+
+
+/**
+ * Remove a connection that won't be parked from its host
+ */
+static void
+http_connection_deactivate(http_connection_t *hc)
+{
+  http_host_t *hh = hc->hc_host;
+
+  hts_mutex_lock(&http_connections_mutex);
+  TAILQ_REMOVE(&hh->hh_active, hc, hc_link);
+  hts_cond_broadcast(&http_connections_cond);
+  http_host_maybe_destroy(hh);
+  hts_mutex_unlock(&http_connections_mutex);
+}
+
+
 /**
  *
  */
@@ -313,50 +451,48 @@ http_connection_get(const char *hostname, int port, int ssl,
                     int max_concurrent, int verify_ssl)
 {
   http_connection_t *hc;
+  http_host_t *hh;
   tcpcon_t *tc;
 
   hts_mutex_lock(&http_connections_mutex);
 
-  if(max_concurrent) {
+  while(1) {
+    // Host may have been destroyed while we waited, so lookup each time
+    hh = http_host_find(hostname, port, ssl, 1);
 
-    while(1) {
-      int num_concurrent = 0;
-      TAILQ_FOREACH(hc, &http_active_connections, hc_link) {
-        if(!strcmp(hc->hc_hostname, hostname) &&
-           hc->hc_port == port &&
-           hc->hc_ssl == ssl &&
-           atomic_get(&hc->hc_inspecting) == 0) {
-          num_concurrent++;
-        }
-      }
-      if(num_concurrent < max_concurrent)
-        break;
+    if(!max_concurrent)
+      break;
 
-      hts_cond_wait(&http_connections_cond, &http_connections_mutex);
+    int num_concurrent = 0;
+    TAILQ_FOREACH(hc, &hh->hh_active, hc_link) {
+      if(atomic_get(&hc->hc_inspecting) == 0)
+        num_concurrent++;
     }
+    if(num_concurrent < max_concurrent)
+      break;
+
+    hts_cond_wait(&http_connections_cond, &http_connections_mutex);
   }
 
   if(allow_reuse) {
 
-    time_t now;
-
-    time(&now);
-
-    TAILQ_FOREACH(hc, &http_parked_connections, hc_link) {
+    TAILQ_FOREACH(hc, &hh->hh_parked, hc_link) {
+      // Don't hand out an unverified connection to someone who cares
+      if(!verify_ssl || hc->hc_ssl_verified)
+        break;
+    }
 
-      if(!strcmp(hc->hc_hostname, hostname) && hc->hc_port == port &&
-         hc->hc_ssl == ssl) {
-        TAILQ_REMOVE(&http_parked_connections, hc, hc_link);
-        http_num_parked_connections--;
-        TAILQ_INSERT_TAIL(&http_active_connections, hc, hc_link);
-        callout_disarm(&hc->hc_callout);
-        hts_mutex_unlock(&http_connections_mutex);
-        HTTP_TRACE(dbg, "Reusing connection to %s:%d (cid=%d)",
-                   hc->hc_hostname, hc->hc_port, hc->hc_id);
-        hc->hc_reused = 1;
-        tcp_set_cancellable(hc->hc_tc, c);
-        return hc;
-      }
+    if(hc != NULL) {
+      http_connection_unpark(hc);
+      TAILQ_INSERT_TAIL(&hh->hh_active, hc, hc_link);
+      callout_disarm(&hc->hc_callout);
+      hts_mutex_unlock(&http_connections_mutex);
+      HTTP_TRACE(dbg, "Reusing connection to %s:%d (cid=%d)",
+                 hc->hc_hostname, hc->hc_port, hc->hc_id);
+      atomic_inc(&http_stat_reused);
+      hc->hc_reused = 1;
+      tcp_set_cancellable(hc->hc_tc, c);
+      return hc;
     }
   }
 
@@ -366,7 +502,9 @@ http_connection_get(const char *hostname, int port, int ssl,
   hc->hc_hostname = strdup(hostname);
   hc->hc_port = port;
   hc->hc_ssl = ssl;
-  TAILQ_INSERT_TAIL(&http_active_connections, hc, hc_link);
+  hc->hc_ssl_verified = ssl && verify_ssl;
+  hc->hc_host = hh;
+  TAILQ_INSERT_TAIL(&hh->hh_active, hc, hc_link);
 
   hts_mutex_unlock(&http_connections_mutex);
 
@@ -405,7 +543,15 @@ http_connection_get(const char *hostname, int port, int ssl,
     goto bad;
   }
 
-  HTTP_TRACE(dbg, "Connected to %s:%d (cid=%d)", hostname, port, id);
+  atomic_inc(&http_stat_connects);
+  if(ssl) {
+    atomic_inc(&http_stat_tls_handshakes);
+    if(tcp_ssl_resumed(tc))
+      atomic_inc(&http_stat_tls_resumed);
+  }
+
+  HTTP_TRACE(dbg, "Connected to %s:%d (cid=%d)%s", hostname, port, id,
+             tcp_ssl_resumed(tc) ? " TLS session resumed" : "");
 
   hc->hc_tc = tc;
   hc->hc_id = id;
@@ -416,8 +562,10 @@ http_connection_get(const char *hostname, int port, int ssl,
 
   hts_mutex_lock(&http_connections_mutex);
   hts_cond_broadcast(&http_connections_cond);
-  TAILQ_REMOVE(&http_active_connections, hc, hc_link);
+  TAILQ_REMOVE(&hh->hh_active, hc, hc_link);
+  http_host_maybe_destroy(hh);
   hts_mutex_unlock(&http_connections_mutex);
+  free(hc->hc_hostname);
   free(hc);
   return NULL;
 }
@@ -427,9 +575,10 @@ static void
 http_connection_ka_expired(struct callout *c, void *opaque)
 {
   http_connection_t *hc = opaque;
-  TAILQ_REMOVE(&http_parked_connections, hc, hc_link);
+  http_host_t *hh = hc->hc_host;
+  http_connection_unpark(hc);
   http_connection_destroy(hc, gconf.enable_http_debug, "Keep alive expired");
-  http_num_parked_connections--;
+  http_host_maybe_destroy(hh);
 }
 
 
@@ -440,9 +589,7 @@ static void
 http_connection_park(http_connection_t *hc, int dbg, int max_age,
                      const char *reason)
 {
-  time_t now;
-
-  time(&now);
+  http_host_t *hh = hc->hc_host;
 
   tcp_set_read_timeout(hc->hc_tc, 0);
   tcp_set_cancellable(hc->hc_tc, NULL);
@@ -455,23 +602,101 @@ http_connection_park(http_connection_t *hc, int dbg, int max_age,
   callout_arm_managed(&hc->hc_callout, http_connection_ka_expired,
                       hc, max_age * 1000000LL, http_connection_lockmgr);
 
-  TAILQ_REMOVE(&http_active_connections, hc, hc_link);
+  TAILQ_REMOVE(&hh->hh_active, hc, hc_link);
   hts_cond_broadcast(&http_connections_cond);
-  TAILQ_INSERT_TAIL(&http_parked_connections, hc, hc_link);
+  TAILQ_INSERT_TAIL(&hh->hh_parked, hc, hc_link);
+  TAILQ_INSERT_TAIL(&http_parked_connections, hc, hc_parked_link);
+  hh->hh_num_parked++;
+  http_num_parked_connections++;
 
-  while(http_num_parked_connections > 5) {
-    hc = TAILQ_FIRST(&http_parked_connections);
-    assert(hc != NULL);
-    TAILQ_REMOVE(&http_parked_connections, hc, hc_link);
-    http_connection_destroy(hc, dbg, "Too many idle connections");
-    http_num_parked_connections--;
-    callout_disarm(&hc->hc_callout);
-  }
+  // http_max_idle_per_host is at least 1 so this never empties the host
+  while(hh->hh_num_parked > http_max_idle_per_host)
+    http_connection_evict(TAILQ_FIRST(&hh->hh_parked), dbg,
+                          "Too many idle connections to host");
+
+  while(http_num_parked_connections > HTTP_MAX_PARKED_CONNECTIONS)
+    http_connection_evict(TAILQ_FIRST(&http_parked_connections), dbg,
+                          "Too many idle connections");
 
   hts_mutex_unlock(&http_connections_mutex);
 }
 
 
+/**
+ *
+ */
+typedef struct http_prewarm {
+  char *hp_hostname;
+  int hp_port;
+  int hp_ssl;
+} http_prewarm_t;
+
+
+/**
+ *
+ */
+static void
+http_prewarm_task(void *aux)
+{
+  http_prewarm_t *hp = aux;
+  const int dbg = gconf.enable_http_debug;
+  char errbuf[256];
+
+  hts_mutex_lock(&http_connections_mutex);
+  const int busy = http_host_find(hp->hp_hostname, hp->hp_port,
+                                  hp->hp_ssl, 0) != NULL;
+  hts_mutex_unlock(&http_connections_mutex);
+
+  if(!busy) {
+    http_connection_t *hc =
+      http_connection_get(hp->hp_hostname, hp->hp_port, hp->hp_ssl,
+                          errbuf, sizeof(errbuf), dbg, 10000, NULL, 0, 0,
+                          hp->hp_ssl);
+    if(hc != NULL)
+      http_connection_park(hc, dbg, HTTP_PREWARM_MAX_AGE, "Prewarmed");
+    else
+      HTTP_TRACE(dbg, "Unable to prewarm %s:%d -- %s",
+                 hp->hp_hostname, hp->hp_port, errbuf);
+  }
+  free(hp->hp_hostname);
+  free(hp);
+}
+
+
+/**
+ * Connect (DNS, TCP and TLS) to the host of the URL in the background
+ * and park the connection so that a request that follows soon can skip
+ * the setup. Nothing is done if we already have connections to the host
+ */
+void
+http_client_prewarm(const char *url)
+{
+  char hostname[HOSTNAME_MAX];
+  char proto[16];
+  int port;
+
+  if(gconf.disable_http_reuse)
+    return;
+
+  url_split(proto, sizeof(proto), NULL, 0, hostname, sizeof(hostname),
+            &port, NULL, 0, url);
+
+  const int ssl = !strcmp(proto, "https") || !strcmp(proto, "webdavs");
+  if(!ssl && strcmp(proto, "http") && strcmp(proto, "webdav"))
+    return;
+  if(!hostname[0])
+    return;
+  if(port < 0)
+    port = ssl ? 443 : 80;
+
+  http_prewarm_t *hp = malloc(sizeof(http_prewarm_t));
+  hp->hp_hostname = strdup(hostname);
+  hp->hp_port = port;
+  hp->hp_ssl = ssl;
+  task_run(http_prewarm_task, hp);
+}
+
+
 
 /**
  *
@@ -1416,10 +1641,7 @@ http_detach(http_file_t *hf, int reusable, const char *reason)
      !cancellable_is_cancelled(hf->hf_cancellable)) {
     http_connection_park(hf->hf_connection, hf->hf_debug, hf->hf_max_age, reason);
   } else {
-    hts_mutex_lock(&http_connections_mutex);
-    TAILQ_REMOVE(&http_active_connections, hf->hf_connection, hc_link);
-    hts_cond_broadcast(&http_connections_cond);
-    hts_mutex_unlock(&http_connections_mutex);
+    http_connection_deactivate(hf->hf_connection);
     http_connection_destroy(hf->hf_connection, hf->hf_debug, reason);
   }
   hf->hf_connection = NULL;
@@ -2379,13 +2601,69 @@ http_no_parking(fa_handle_t *fh)
 }
 
 
+/**
+ * Statistics exposed in global.system.http
+ */
+static prop_t *http_stats_connects;
+static prop_t *http_stats_reused;
+static prop_t *http_stats_reuse_ratio;
+static prop_t *http_stats_tls_handshakes;
+static prop_t *http_stats_tls_resumed;
+static prop_t *http_stats_idle;
+static prop_t *http_stats_hosts;
+
+
+/**
+ *
+ */
+static void
+http_stats_update(void)
+{
+  const int connects = atomic_get(&http_stat_connects);
+  const int reused = atomic_get(&http_stat_reused);
+
+  prop_set_int(http_stats_connects, connects);
+  prop_set_int(http_stats_reused, reused);
+  // Percentage of requests that did not need a new connection
+  prop_set_int(http_stats_reuse_ratio,
+               connects + reused ? 100 * reused / (connects + reused) : 0);
+  prop_set_int(http_stats_tls_handshakes,
+               atomic_get(&http_stat_tls_handshakes));
+  prop_set_int(http_stats_tls_resumed, atomic_get(&http_stat_tls_resumed));
+
+  hts_mutex_lock(&http_connections_mutex);
+  prop_set_int(http_stats_idle, http_num_parked_connections);
+  prop_set_int(http_stats_hosts, http_num_hosts);
+  hts_mutex_unlock(&http_connections_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+http_stats_init(void)
+{
+  prop_t *root = prop_create(prop_create(prop_get_global(), "system"),
+                             "http");
+
+  http_stats_connects       = prop_create(root, "connects");
+  http_stats_reused         = prop_create(root, "reused");
+  http_stats_reuse_ratio    = prop_create(root, "reuseRatio");
+  http_stats_tls_handshakes = prop_create(root, "tlsHandshakes");
+  http_stats_tls_resumed    = prop_create(root, "tlsResumed");
+  http_stats_idle           = prop_create(root, "idleConnections");
+  http_stats_hosts          = prop_create(root, "hosts");
+  callout_stats_register(http_stats_update);
+}
+
+
 /**
  *
  */
 static void
 http_init(void)
 {
-  TAILQ_INIT(&http_active_connections);
   TAILQ_INIT(&http_parked_connections);
   hts_mutex_init(&http_connections_mutex);
   hts_cond_init(&http_connections_cond, &http_connections_mutex);
@@ -2393,6 +2671,16 @@ http_init(void)
   hts_mutex_init(&http_cookies_mutex);
   hts_mutex_init(&http_auth_caches_mutex);
   load_cookies();
+
+  setting_create(SETTING_INT, gconf.settings_network, SETTINGS_INITIAL_UPDATE,
+                 SETTING_TITLE(_p("Idle HTTP connections per server")),
+                 SETTING_VALUE(4),
+                 SETTING_RANGE(1, 16),
+                 SETTING_WRITE_INT(&http_max_idle_per_host),
+                 SETTING_STORE("http", "maxidleperhost"),
+                 NULL);
+
+  http_stats_init();
 }
 
 /**
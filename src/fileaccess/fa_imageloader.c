@@ -51,7 +51,13 @@ static const uint8_t svgsig1[5] = {'<', '?', 'x', 'm', 'l'};
 static const uint8_t svgsig2[4] = {'<', 's', 'v', 'g'};
 
 #if ENABLE_LIBAV
-static hts_mutex_t image_from_video_mutex[2];
+static hts_mutex_t image_from_video_mutex;
+static hts_mutex_t thumb_encoder_mutex;
+static hts_mutex_t ifv_mutex;
+static hts_cond_t ifv_cond;
+static int ifv_pool_max;
+static hts_mutex_t thumb_sheet_mutex;
+static hts_cond_t thumb_sheet_cond;
 static AVCodecContext *thumbctx;
 static AVCodec *thumbcodec;
 static callout_t thumb_flush_callout;
@@ -68,8 +74,13 @@ void
 fa_imageloader_init(void)
 {
 #if ENABLE_LIBAV
-  hts_mutex_init(&image_from_video_mutex[0]);
-  hts_mutex_init(&image_from_video_mutex[1]);
+  hts_mutex_init(&image_from_video_mutex);
+  hts_mutex_init(&thumb_encoder_mutex);
+  hts_mutex_init(&ifv_mutex);
+  hts_cond_init(&ifv_cond, &ifv_mutex);
+  hts_mutex_init(&thumb_sheet_mutex);
+  hts_cond_init(&thumb_sheet_cond, &thumb_sheet_mutex);
+  ifv_pool_max = MAX(2, MIN(4, gconf.concurrency));
   thumbcodec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
 #endif
 }
@@ -320,57 +331,93 @@ fa_imageloader(const char *url, const struct image_meta *im,
 
 #if ENABLE_LIBAV
 
-static char *ifv_url;
-static AVFormatContext *ifv_fctx;
-static AVCodecContext *ifv_ctx;
-int ifv_stream;
+/**
+ * Decoders kept open for thumbnail extraction, keyed by URL
+ */
+typedef struct ifv {
+  LIST_ENTRY(ifv) ifv_link;
+  char *ifv_url;
+  AVFormatContext *ifv_fctx;
+  AVCodecContext *ifv_ctx;
+  int ifv_stream;
+  int ifv_busy;
+  int64_t ifv_last_use;
+} ifv_t;
 
-static void
-ifv_close(void)
-{
-  free(ifv_url);
-  ifv_url = NULL;
+LIST_HEAD(ifv_list, ifv);
 
-  if(ifv_ctx != NULL) {
-    avcodec_close(ifv_ctx);
-    ifv_ctx = NULL;
-  }
+static struct ifv_list ifv_pool;
+static int ifv_pool_count;
 
-  if(ifv_fctx != NULL) {
-    fa_libav_close_format(ifv_fctx, 0);
-    ifv_fctx = NULL;
-  }
+#define IFV_IDLE_TIMEOUT 5
+
+
+/**
+ *
+ */
+static void
+ifv_destroy(ifv_t *ifv)
+{
+  avcodec_close(ifv->ifv_ctx);
+  fa_libav_close_format(ifv->ifv_fctx, 0);
+  free(ifv->ifv_url);
+  free(ifv);
 }
 
+
 /**
  *
  */
 static void
 ifv_autoclose(callout_t *c, void *aux)
 {
-  if(hts_mutex_trylock(&image_from_video_mutex[1])) {
-    callout_arm(&thumb_flush_callout, ifv_autoclose, NULL, 5);
-  } else {
-    TRACE(TRACE_DEBUG, "Thumb", "Closing movie for thumb sources"); 
-    ifv_close();
-    hts_mutex_unlock(&image_from_video_mutex[1]);
+  struct ifv_list expired;
+  ifv_t *ifv, *next;
+  const int64_t now = arch_get_ts();
+
+  LIST_INIT(&expired);
+
+  hts_mutex_lock(&ifv_mutex);
+  for(ifv = LIST_FIRST(&ifv_pool); ifv != NULL; ifv = next) {
+    next = LIST_NEXT(ifv, ifv_link);
+    if(ifv->ifv_busy ||
+       now - ifv->ifv_last_use < IFV_IDLE_TIMEOUT * 1000000LL)
+      continue;
+    LIST_REMOVE(ifv, ifv_link);
+    LIST_INSERT_HEAD(&expired, ifv, ifv_link);
+    ifv_pool_count--;
+  }
+
+  if(LIST_FIRST(&ifv_pool) != NULL)
+    callout_arm(&thumb_flush_callout, ifv_autoclose, NULL, IFV_IDLE_TIMEOUT);
+  hts_cond_broadcast(&ifv_cond);
+  hts_mutex_unlock(&ifv_mutex);
+
+  while((ifv = LIST_FIRST(&expired)) != NULL) {
+    TRACE(TRACE_DEBUG, "Thumb", "Closing %s", ifv->ifv_url);
+    LIST_REMOVE(ifv, ifv_link);
+    ifv_destroy(ifv);
   }
 }
 
+
 /**
  *
  */
-static void
-write_thumb(const AVCodecContext *src, const AVFrame *sframe, 
-            int width, int height, const char *cacheid, time_t mtime)
+static buf_t *
+thumb_encode(AVFrame *frame, int width, int height)
 {
+  buf_t *b = NULL;
+
   if(thumbcodec == NULL)
-    return;
+    return NULL;
+
+  hts_mutex_lock(&thumb_encoder_mutex);
 
   AVCodecContext *ctx = thumbctx;
 
   if(ctx == NULL || ctx->width  != width || ctx->height != height) {
-    
+
     if(ctx != NULL) {
       avcodec_close(ctx);
       free(ctx);
@@ -388,36 +435,53 @@ write_thumb(const AVCodecContext *src, const AVFrame *sframe,
     if(avcodec_open2(ctx, thumbcodec, NULL) < 0) {
       TRACE(TRACE_ERROR, "THUMB", "Unable to open thumb encoder");
       thumbctx = NULL;
-      return;
+      hts_mutex_unlock(&thumb_encoder_mutex);
+      return NULL;
     }
     thumbctx = ctx;
   }
 
+  frame->pts = AV_NOPTS_VALUE;
+  AVPacket out;
+  memset(&out, 0, sizeof(AVPacket));
+  int got_packet;
+  int r = avcodec_encode_video2(ctx, &out, frame, &got_packet);
+  if(r >= 0 && got_packet) {
+    b = buf_create_and_adopt(out.size, out.data, &av_free);
+  } else {
+    assert(out.data == NULL);
+  }
+  hts_mutex_unlock(&thumb_encoder_mutex);
+  return b;
+}
+
+
+/**
+ *
+ */
+static void
+write_thumb(const AVCodecContext *src, const AVFrame *sframe,
+            int width, int height, const char *cacheid, time_t mtime)
+{
   AVFrame *oframe = av_frame_alloc();
 
-  avpicture_alloc((AVPicture *)oframe, ctx->pix_fmt, width, height);
-      
+  avpicture_alloc((AVPicture *)oframe, AV_PIX_FMT_YUVJ420P, width, height);
+
   struct SwsContext *sws;
   sws = sws_getContext(src->width, src->height, src->pix_fmt,
-                       width, height, ctx->pix_fmt, SWS_BILINEAR,
+                       width, height, AV_PIX_FMT_YUVJ420P, SWS_BILINEAR,
                        NULL, NULL, NULL);
 
   sws_scale(sws, (const uint8_t **)sframe->data, sframe->linesize,
             0, src->height, &oframe->data[0], &oframe->linesize[0]);
   sws_freeContext(sws);
 
-  oframe->pts = AV_NOPTS_VALUE;
-  AVPacket out;
-  memset(&out, 0, sizeof(AVPacket));
-  int got_packet;
-  int r = avcodec_encode_video2(ctx, &out, oframe, &got_packet);
-  if(r >= 0 && got_packet) {
-    buf_t *b = buf_create_and_adopt(out.size, out.data, &av_free);
+  buf_t *b = thumb_encode(oframe, width, height);
+  if(b != NULL) {
     blobcache_put(cacheid, "videothumb", b, INT32_MAX, NULL, mtime, 0);
     buf_release(b);
-  } else {
-    assert(out.data == NULL);
   }
+  avpicture_free((AVPicture *)oframe);
   av_frame_free(&oframe);
 }
 
@@ -462,112 +526,220 @@ thumb_from_attachment(const char *url, int64_t offset, int size,
 
 
 /**
- *
+ * Open url for thumbnail extraction. If sec is -1 and the file carries
+ * an embedded cover image that is returned in *imgp instead
  */
-static image_t *
-fa_image_from_video2(const char *url, const image_meta_t *im,
-		     const char *cacheid, char *errbuf, size_t errlen,
-		     int sec, time_t mtime, cancellable_t *c)
+static ifv_t *
+ifv_open(const char *url, int sec, const char *cacheid, time_t mtime,
+         image_t **imgp, char *errbuf, size_t errlen)
 {
-  image_t *img = NULL;
+  int i;
+  AVFormatContext *fctx;
+  fa_handle_t *fh = fa_open_ex(url, errbuf, errlen,
+                               FA_BUFFERED_BIG | FA_NON_INTERACTIVE,
+                               NULL);
 
-  if(ifv_url == NULL || strcmp(url, ifv_url)) {
-    // Need to open
-    int i;
-    AVFormatContext *fctx;
-    fa_handle_t *fh = fa_open_ex(url, errbuf, errlen,
-                                 FA_BUFFERED_BIG | FA_NON_INTERACTIVE,
-                                 NULL);
-
-    if(fh == NULL)
-      return NULL;
+  if(fh == NULL)
+    return NULL;
 
-    int strategy = fa_libav_get_strategy_for_file(fh);
+  int strategy = fa_libav_get_strategy_for_file(fh);
 
-    AVIOContext *avio = fa_libav_reopen(fh, 0);
+  AVIOContext *avio = fa_libav_reopen(fh, 0);
 
-    if((fctx = fa_libav_open_format(avio, url, NULL, 0, NULL,
-                                    strategy)) == NULL) {
-      fa_libav_close(avio);
-      snprintf(errbuf, errlen, "Unable to open format");
-      return NULL;
-    }
+  if((fctx = fa_libav_open_format(avio, url, NULL, 0, NULL,
+                                  strategy)) == NULL) {
+    fa_libav_close(avio);
+    snprintf(errbuf, errlen, "Unable to open format");
+    return NULL;
+  }
 
-    if(!strcmp(fctx->iformat->name, "avi"))
-      fctx->flags |= AVFMT_FLAG_GENPTS;
+  if(!strcmp(fctx->iformat->name, "avi"))
+    fctx->flags |= AVFMT_FLAG_GENPTS;
 
-    AVCodecContext *ctx = NULL;
-    int vstream = 0;
-    for(i = 0; i < fctx->nb_streams; i++) {
-      AVStream *st = fctx->streams[i];
-      AVCodecContext *c = st->codec;
-      AVDictionaryEntry *mt;
+  AVCodecContext *ctx = NULL;
+  int vstream = 0;
+  for(i = 0; i < fctx->nb_streams; i++) {
+    AVStream *st = fctx->streams[i];
+    AVCodecContext *c = st->codec;
+    AVDictionaryEntry *mt;
 
-      if(c == NULL)
-        continue;
+    if(c == NULL)
+      continue;
 
-      switch(c->codec_type) {
-      case AVMEDIA_TYPE_VIDEO:
-        if(ctx == NULL) {
-          vstream = i;
-          ctx = fctx->streams[i]->codec;
-        }
-        break;
+    switch(c->codec_type) {
+    case AVMEDIA_TYPE_VIDEO:
+      if(ctx == NULL) {
+        vstream = i;
+        ctx = fctx->streams[i]->codec;
+      }
+      break;
 
-      case AVMEDIA_TYPE_ATTACHMENT:
-        mt = av_dict_get(st->metadata, "mimetype", NULL, AV_DICT_IGNORE_SUFFIX);
-        if(sec == -1 && mt != NULL &&
-           (!strcmp(mt->value, "image/jpeg") ||
-            !strcmp(mt->value, "image/png"))) {
+    case AVMEDIA_TYPE_ATTACHMENT:
+      mt = av_dict_get(st->metadata, "mimetype", NULL, AV_DICT_IGNORE_SUFFIX);
+      if(sec == -1 && mt != NULL &&
+         (!strcmp(mt->value, "image/jpeg") ||
+          !strcmp(mt->value, "image/png"))) {
 #if ENABLE_LIBAV_ATTACHMENT_POINTER
-          int64_t offset = st->attached_offset;
-          int size = st->attached_size;
-          fa_libav_close_format(fctx, 0);/* Close here because it will be parked
-                                          * by fa_buffer (and thus reused)
-                                          */
-          return thumb_from_attachment(url, offset, size, errbuf, errlen,
-                                       cacheid, mtime);
+        int64_t offset = st->attached_offset;
+        int size = st->attached_size;
+        fa_libav_close_format(fctx, 0);/* Close here because it will be parked
+                                        * by fa_buffer (and thus reused)
+                                        */
+        *imgp = thumb_from_attachment(url, offset, size, errbuf, errlen,
+                                      cacheid, mtime);
 #else
-          buf_t *b = buf_create_and_adopt(st->codec->extradata_size,
-                                          st->codec->extradata,
-                                          (void *)&av_free);
-          st->codec->extradata = NULL;
-          st->codec->extradata_size = 0;
-          fa_libav_close_format(fctx, 0);
-          return thumb_from_buf(b, errbuf, errlen, cacheid, mtime);
+        buf_t *b = buf_create_and_adopt(st->codec->extradata_size,
+                                        st->codec->extradata,
+                                        (void *)&av_free);
+        st->codec->extradata = NULL;
+        st->codec->extradata_size = 0;
+        fa_libav_close_format(fctx, 0);
+        *imgp = thumb_from_buf(b, errbuf, errlen, cacheid, mtime);
 #endif
-        }
-        break;
-
-      default:
-        break;
+        return NULL;
       }
+      break;
+
+    default:
+      break;
     }
-    if(ctx == NULL) {
-      fa_libav_close_format(fctx, 0);
-      return NULL;
-    }
+  }
+  if(ctx == NULL) {
+    fa_libav_close_format(fctx, 0);
+    return NULL;
+  }
 
-    AVCodec *codec = avcodec_find_decoder(ctx->codec_id);
-    if(codec == NULL) {
-      fa_libav_close_format(fctx, 0);
-      snprintf(errbuf, errlen, "Unable to find codec");
-      return NULL;
+  AVCodec *codec = avcodec_find_decoder(ctx->codec_id);
+  if(codec == NULL) {
+    fa_libav_close_format(fctx, 0);
+    snprintf(errbuf, errlen, "Unable to find codec");
+    return NULL;
+  }
+
+  // Thumbnails are small, trade exactness for speed
+  ctx->flags2 |= CODEC_FLAG2_FAST;
+
+  if(avcodec_open2(ctx, codec, NULL) < 0) {
+    fa_libav_close_format(fctx, 0);
+    snprintf(errbuf, errlen, "Unable to open codec");
+    return NULL;
+  }
+
+  ifv_t *ifv = calloc(1, sizeof(ifv_t));
+  ifv->ifv_url = strdup(url);
+  ifv->ifv_fctx = fctx;
+  ifv->ifv_ctx = ctx;
+  ifv->ifv_stream = vstream;
+  return ifv;
+}
+
+
+/**
+ * Get exclusive use of a decoder for url. An idle decoder for the same
+ * URL is reused, otherwise a new one is opened. When the pool is full
+ * the least recently used idle decoder is closed to make room
+ */
+static ifv_t *
+ifv_acquire(const char *url, int sec, const char *cacheid, time_t mtime,
+            image_t **imgp, char *errbuf, size_t errlen)
+{
+  ifv_t *ifv, *victim;
+
+  hts_mutex_lock(&ifv_mutex);
+
+  while(1) {
+    LIST_FOREACH(ifv, &ifv_pool, ifv_link)
+      if(!ifv->ifv_busy && !strcmp(ifv->ifv_url, url))
+        break;
+
+    if(ifv != NULL) {
+      ifv->ifv_busy = 1;
+      hts_mutex_unlock(&ifv_mutex);
+      return ifv;
     }
 
-    if(avcodec_open2(ctx, codec, NULL) < 0) {
-      fa_libav_close_format(fctx, 0);
-      snprintf(errbuf, errlen, "Unable to open codec");
-      return NULL;
+    if(ifv_pool_count < ifv_pool_max)
+      break;
+
+    victim = NULL;
+    LIST_FOREACH(ifv, &ifv_pool, ifv_link)
+      if(!ifv->ifv_busy &&
+         (victim == NULL || ifv->ifv_last_use < victim->ifv_last_use))
+        victim = ifv;
+
+    if(victim != NULL) {
+      LIST_REMOVE(victim, ifv_link);
+      ifv_pool_count--;
+      hts_mutex_unlock(&ifv_mutex);
+      ifv_destroy(victim);
+      hts_mutex_lock(&ifv_mutex);
+      continue;
     }
 
-    ifv_close();
+    hts_cond_wait(&ifv_cond, &ifv_mutex);
+  }
+
+  // Reserve our slot while opening
+  ifv_pool_count++;
+  hts_mutex_unlock(&ifv_mutex);
+
+  ifv = ifv_open(url, sec, cacheid, mtime, imgp, errbuf, errlen);
+
+  hts_mutex_lock(&ifv_mutex);
+  if(ifv == NULL) {
+    ifv_pool_count--;
+    hts_cond_broadcast(&ifv_cond);
+  } else {
+    ifv->ifv_busy = 1;
+    LIST_INSERT_HEAD(&ifv_pool, ifv, ifv_link);
+  }
+  hts_mutex_unlock(&ifv_mutex);
+  return ifv;
+}
+
 
-    ifv_stream = vstream;
-    ifv_url = strdup(url);
-    ifv_fctx = fctx;
-    ifv_ctx = ctx;
+/**
+ * Give back a decoder. If the demuxer or decoder failed it is closed
+ */
+static void
+ifv_release(ifv_t *ifv, int failed)
+{
+  hts_mutex_lock(&ifv_mutex);
+  if(failed) {
+    LIST_REMOVE(ifv, ifv_link);
+    ifv_pool_count--;
+  } else {
+    avcodec_flush_buffers(ifv->ifv_ctx);
+    ifv->ifv_busy = 0;
+    ifv->ifv_last_use = arch_get_ts();
+    callout_arm(&thumb_flush_callout, ifv_autoclose, NULL, IFV_IDLE_TIMEOUT);
   }
+  hts_cond_broadcast(&ifv_cond);
+  hts_mutex_unlock(&ifv_mutex);
+
+  if(failed)
+    ifv_destroy(ifv);
+}
+
+
+/**
+ *
+ */
+static image_t *
+fa_image_from_video2(const char *url, const image_meta_t *im,
+		     const char *cacheid, char *errbuf, size_t errlen,
+		     int sec, time_t mtime, cancellable_t *c)
+{
+  image_t *img = NULL;
+  int failed = 0;
+
+  ifv_t *ifv = ifv_acquire(url, sec, cacheid, mtime, &img, errbuf, errlen);
+  if(ifv == NULL)
+    return img;
+
+  AVFormatContext *fctx = ifv->ifv_fctx;
+  AVCodecContext *ctx = ifv->ifv_ctx;
+  const int stream = ifv->ifv_stream;
 
   AVPacket pkt;
   AVFrame *frame = av_frame_alloc();
@@ -577,12 +749,12 @@ fa_image_from_video2(const char *url, const image_meta_t *im,
 
   int cnt = MAX_FRAME_SCAN;
 
-  AVStream *st = ifv_fctx->streams[ifv_stream];
+  AVStream *st = fctx->streams[stream];
 
   if(sec == -1) {
     // Automatically try to find a good frame
 
-    int duration_in_seconds = ifv_fctx->duration / 1000000;
+    int duration_in_seconds = fctx->duration / 1000000;
 
 
     sec = MAX(1, duration_in_seconds * 0.05); // 5% of duration
@@ -596,27 +768,28 @@ fa_image_from_video2(const char *url, const image_meta_t *im,
   int64_t ts = av_rescale(sec, st->time_base.den, st->time_base.num);
   int delayed_seek = 0;
 
-  if(ifv_ctx->codec_id == AV_CODEC_ID_RV40 ||
-     ifv_ctx->codec_id == AV_CODEC_ID_RV30) {
+  if(ctx->codec_id == AV_CODEC_ID_RV40 ||
+     ctx->codec_id == AV_CODEC_ID_RV30) {
     // Must decode one frame
     delayed_seek = 1;
   } else {
-    if(av_seek_frame(ifv_fctx, ifv_stream, ts, AVSEEK_FLAG_BACKWARD) < 0) {
-      ifv_close();
+    if(av_seek_frame(fctx, stream, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+      ifv_release(ifv, 1);
+      av_frame_free(&frame);
       snprintf(errbuf, errlen, "Unable to seek to %"PRId64, ts);
       return NULL;
     }
   }
 
-  avcodec_flush_buffers(ifv_ctx);
-  
+  avcodec_flush_buffers(ctx);
+
   int i = 0;
   while(1) {
     int r;
 
     i++;
-    
-    r = av_read_frame(ifv_fctx, &pkt);
+
+    r = av_read_frame(fctx, &pkt);
 
     if(r == AVERROR(EAGAIN))
       continue;
@@ -631,26 +804,26 @@ fa_image_from_video2(const char *url, const image_meta_t *im,
     }
 
     if(r != 0) {
-      ifv_close();
+      failed = 1;
       break;
     }
 
-    if(pkt.stream_index != ifv_stream) {
+    if(pkt.stream_index != stream) {
       av_free_packet(&pkt);
       continue;
     }
     cnt--;
     int want_pic = pkt.pts >= ts || cnt <= 0;
 
-    ifv_ctx->skip_frame = want_pic ? AVDISCARD_DEFAULT : AVDISCARD_NONREF;
+    ctx->skip_frame = want_pic ? AVDISCARD_DEFAULT : AVDISCARD_NONREF;
 
-    avcodec_decode_video2(ifv_ctx, frame, &got_pic, &pkt);
+    avcodec_decode_video2(ctx, frame, &got_pic, &pkt);
     av_free_packet(&pkt);
 
     if(delayed_seek) {
       delayed_seek = 0;
-      if(av_seek_frame(ifv_fctx, ifv_stream, ts, AVSEEK_FLAG_BACKWARD) < 0) {
-        ifv_close();
+      if(av_seek_frame(fctx, stream, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+        failed = 1;
         break;
       }
       continue;
@@ -672,10 +845,10 @@ fa_image_from_video2(const char *url, const image_meta_t *im,
       h = im->im_req_height;
     } else if(im->im_req_width != -1) {
       w = im->im_req_width;
-      h = im->im_req_width * ifv_ctx->height / ifv_ctx->width;
+      h = im->im_req_width * ctx->height / ctx->width;
 
     } else if(im->im_req_height != -1) {
-      w = im->im_req_height * ifv_ctx->width / ifv_ctx->height;
+      w = im->im_req_height * ctx->width / ctx->height;
       h = im->im_req_height;
     } else {
       w = im->im_req_width;
@@ -685,24 +858,22 @@ fa_image_from_video2(const char *url, const image_meta_t *im,
     pixmap_t *pm = pixmap_create(w, h, PIXMAP_BGR32, 0);
 
     if(pm == NULL) {
-      ifv_close();
+      failed = 1;
       snprintf(errbuf, errlen, "Out of memory");
-      av_free(frame);
-      return NULL;
+      break;
     }
 
     struct SwsContext *sws;
-    sws = sws_getContext(ifv_ctx->width, ifv_ctx->height, ifv_ctx->pix_fmt,
+    sws = sws_getContext(ctx->width, ctx->height, ctx->pix_fmt,
 			 w, h, AV_PIX_FMT_BGR32, SWS_BILINEAR,
                          NULL, NULL, NULL);
     if(sws == NULL) {
-      ifv_close();
+      failed = 1;
       snprintf(errbuf, errlen, "Scaling failed");
       pixmap_release(pm);
-      av_free(frame);
-      return NULL;
+      break;
     }
-    
+
     uint8_t *ptr[4] = {0,0,0,0};
     int strides[4] = {0,0,0,0};
 
@@ -710,11 +881,11 @@ fa_image_from_video2(const char *url, const image_meta_t *im,
     strides[0] = pm->pm_linesize;
 
     sws_scale(sws, (const uint8_t **)frame->data, frame->linesize,
-	      0, ifv_ctx->height, ptr, strides);
+	      0, ctx->height, ptr, strides);
 
     sws_freeContext(sws);
 
-    write_thumb(ifv_ctx, frame, w, h, cacheid, mtime);
+    write_thumb(ctx, frame, w, h, cacheid, mtime);
 
     img = image_create_from_pixmap(pm);
     pixmap_release(pm);
@@ -723,14 +894,452 @@ fa_image_from_video2(const char *url, const image_meta_t *im,
   }
 
   av_frame_free(&frame);
-  if(img == NULL)
-    snprintf(errbuf, errlen, "Frame not found (scanned %d)", 
+  if(img == NULL && !failed)
+    snprintf(errbuf, errlen, "Frame not found (scanned %d)",
 	     MAX_FRAME_SCAN - cnt);
 
-  if(ifv_ctx != NULL) {
-    avcodec_flush_buffers(ifv_ctx);
-    callout_arm(&thumb_flush_callout, ifv_autoclose, NULL, 5);
+  ifv_release(ifv, failed);
+  return img;
+}
+
+
+/**
+ * Seek index sprite sheets
+ *
+ * All the images of a seek index (one per minute, see build_index() in
+ * fa_video.c) are extracted in a single forward pass over the file and
+ * stored as one JPEG in the blobcache. The most recently used sheets are
+ * kept decoded in memory and tiles are cut out of them on request
+ */
+typedef struct thumb_sheet {
+  LIST_ENTRY(thumb_sheet) ts_link;
+  char *ts_id;
+  time_t ts_mtime;
+  int64_t ts_last_use;
+
+  enum {
+    TS_BUILDING,
+    TS_READY,
+    TS_FAILED,
+  } ts_state;
+
+  AVFrame *ts_frame;
+  int ts_tile_width;
+  int ts_tile_height;
+  int ts_items;
+
+} thumb_sheet_t;
+
+static LIST_HEAD(, thumb_sheet) thumb_sheets;
+
+#define THUMB_SHEET_COLUMNS  10
+#define THUMB_SHEET_INTERVAL 60  // Must match build_index()
+#define THUMB_SHEETS_IN_MEMORY 2
+
+
+/**
+ *
+ */
+static void
+thumb_sheet_destroy(thumb_sheet_t *ts)
+{
+  LIST_REMOVE(ts, ts_link);
+  av_frame_free(&ts->ts_frame);
+  free(ts->ts_id);
+  free(ts);
+}
+
+
+/**
+ * Drop least recently used sheets, called with thumb_sheet_mutex held
+ */
+static void
+thumb_sheet_trim(void)
+{
+  thumb_sheet_t *ts, *victim;
+  int cnt;
+
+  while(1) {
+    cnt = 0;
+    victim = NULL;
+    LIST_FOREACH(ts, &thumb_sheets, ts_link) {
+      if(ts->ts_state == TS_BUILDING)
+        continue;
+      cnt++;
+      if(victim == NULL || ts->ts_last_use < victim->ts_last_use)
+        victim = ts;
+    }
+    if(cnt <= THUMB_SHEETS_IN_MEMORY)
+      break;
+    thumb_sheet_destroy(victim);
+  }
+}
+
+
+/**
+ *
+ */
+static int
+thumb_sheet_tile_width(const image_meta_t *im)
+{
+  if(im->im_req_width < 100 && im->im_req_height < 100)
+    return 128;
+  if(im->im_req_width < 200 && im->im_req_height < 200)
+    return 192;
+  return 320;
+}
+
+
+/**
+ * Decode a sheet loaded from the blobcache
+ */
+static AVFrame *
+thumb_sheet_decode(buf_t *b)
+{
+  AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+  if(codec == NULL)
+    return NULL;
+
+  AVCodecContext *ctx = avcodec_alloc_context3(codec);
+  ctx->refcounted_frames = 1;
+  if(avcodec_open2(ctx, codec, NULL) < 0) {
+    av_free(ctx);
+    return NULL;
+  }
+
+  AVFrame *frame = av_frame_alloc();
+  AVPacket pkt;
+  int got_pic = 0;
+  av_init_packet(&pkt);
+  pkt.data = (void *)buf_data(b);
+  pkt.size = buf_size(b);
+
+  if(avcodec_decode_video2(ctx, frame, &got_pic, &pkt) < 0 || !got_pic ||
+     (frame->format != AV_PIX_FMT_YUVJ420P &&
+      frame->format != AV_PIX_FMT_YUV420P))
+    av_frame_free(&frame);
+
+  avcodec_close(ctx);
+  av_free(ctx);
+  return frame;
+}
+
+
+/**
+ * Extract one image per THUMB_SHEET_INTERVAL into a new sheet.
+ * Only keyframes are decoded and the loop filter is skipped
+ */
+static buf_t *
+thumb_sheet_build(ifv_t *ifv, thumb_sheet_t *ts, int tile_width,
+                  char *errbuf, size_t errlen, cancellable_t *c)
+{
+  AVFormatContext *fctx = ifv->ifv_fctx;
+  AVCodecContext *ctx = ifv->ifv_ctx;
+  const int stream = ifv->ifv_stream;
+  AVStream *st = fctx->streams[stream];
+  struct SwsContext *sws = NULL;
+  buf_t *b = NULL;
+  int i, filled = 0;
+
+  if(fctx->duration == AV_NOPTS_VALUE || ctx->width == 0) {
+    snprintf(errbuf, errlen, "Unknown duration");
+    return NULL;
+  }
+
+  const int items = 1 + fctx->duration / (THUMB_SHEET_INTERVAL * 1000000LL);
+  const int tw = tile_width;
+  const int th = MAX(2, (tw * ctx->height / ctx->width) & ~1);
+  const int cols = MIN(items, THUMB_SHEET_COLUMNS);
+  const int rows = (items + THUMB_SHEET_COLUMNS - 1) / THUMB_SHEET_COLUMNS;
+
+  if(rows * th > 65535) {
+    snprintf(errbuf, errlen, "Too many images");
+    return NULL;
+  }
+
+  AVFrame *sheet = av_frame_alloc();
+  if(avpicture_alloc((AVPicture *)sheet, AV_PIX_FMT_YUVJ420P,
+                     cols * tw, rows * th) < 0) {
+    av_frame_free(&sheet);
+    snprintf(errbuf, errlen, "Out of memory");
+    return NULL;
+  }
+  memset(sheet->data[0], 0,   sheet->linesize[0] * rows * th);
+  memset(sheet->data[1], 128, sheet->linesize[1] * rows * th / 2);
+  memset(sheet->data[2], 128, sheet->linesize[2] * rows * th / 2);
+
+  for(i = 0; i < fctx->nb_streams; i++)
+    if(i != stream)
+      fctx->streams[i]->discard = AVDISCARD_ALL;
+
+  ctx->skip_frame = AVDISCARD_NONKEY;
+  ctx->skip_loop_filter = AVDISCARD_ALL;
+
+  AVFrame *frame = av_frame_alloc();
+  const int64_t start = arch_get_ts();
+  const int64_t t0 = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+
+  for(i = 0; i < items; i++) {
+    AVPacket pkt;
+    int got_pic = 0, n, r;
+
+    if(cancellable_is_cancelled(c)) {
+      snprintf(errbuf, errlen, "Cancelled");
+      filled = 0;
+      break;
+    }
+
+    int64_t ts = t0 + av_rescale(i * THUMB_SHEET_INTERVAL,
+                                 st->time_base.den, st->time_base.num);
+
+    if(av_seek_frame(fctx, stream, ts, AVSEEK_FLAG_BACKWARD) < 0)
+      break;
+
+    avcodec_flush_buffers(ctx);
+
+    for(n = 0; n < 100 && !got_pic; n++) {
+      r = av_read_frame(fctx, &pkt);
+      if(r == AVERROR(EAGAIN))
+        continue;
+      if(r)
+        break;
+
+      if(pkt.stream_index == stream) {
+        const int key = pkt.flags & AV_PKT_FLAG_KEY;
+        avcodec_decode_video2(ctx, frame, &got_pic, &pkt);
+
+        if(!got_pic && key) {
+          // Drain decoders that delay output for reordering
+          av_free_packet(&pkt);
+          av_init_packet(&pkt);
+          pkt.data = NULL;
+          pkt.size = 0;
+          avcodec_decode_video2(ctx, frame, &got_pic, &pkt);
+        }
+      }
+      av_free_packet(&pkt);
+    }
+
+    if(!got_pic)
+      continue;
+
+    sws = sws_getCachedContext(sws, frame->width, frame->height,
+                               frame->format, tw, th, AV_PIX_FMT_YUVJ420P,
+                               SWS_BILINEAR, NULL, NULL, NULL);
+    if(sws == NULL)
+      break;
+
+    const int x = (i % THUMB_SHEET_COLUMNS) * tw;
+    const int y = (i / THUMB_SHEET_COLUMNS) * th;
+    uint8_t *dst[4] = {
+      sheet->data[0] + y     * sheet->linesize[0] + x,
+      sheet->data[1] + y / 2 * sheet->linesize[1] + x / 2,
+      sheet->data[2] + y / 2 * sheet->linesize[2] + x / 2,
+      NULL
+    };
+
+    sws_scale(sws, (const uint8_t **)frame->data, frame->linesize,
+              0, frame->height, dst, sheet->linesize);
+    filled++;
+  }
+
+  const int64_t elapsed = arch_get_ts() - start;
+
+  for(i = 0; i < fctx->nb_streams; i++)
+    fctx->streams[i]->discard = AVDISCARD_DEFAULT;
+  ctx->skip_frame = AVDISCARD_DEFAULT;
+  ctx->skip_loop_filter = AVDISCARD_DEFAULT;
+
+  sws_freeContext(sws);
+  av_frame_free(&frame);
+
+  if(filled > 0) {
+    TRACE(TRACE_DEBUG, "Thumb",
+          "Seek index for %s: %d of %d images in %d ms (%.1f images/s)",
+          ifv->ifv_url, filled, items, (int)(elapsed / 1000),
+          filled * 1000000.0 / MAX(elapsed, 1));
+
+    b = thumb_encode(sheet, cols * tw, rows * th);
+    if(b != NULL) {
+      ts->ts_tile_width  = tw;
+      ts->ts_tile_height = th;
+      ts->ts_items       = items;
+    } else {
+      snprintf(errbuf, errlen, "Unable to encode seek index");
+    }
+  } else if(!cancellable_is_cancelled(c)) {
+    snprintf(errbuf, errlen, "No images found");
+  }
+
+  avpicture_free((AVPicture *)sheet);
+  av_frame_free(&sheet);
+  return b;
+}
+
+
+/**
+ * Cut out one image, called with thumb_sheet_mutex held
+ */
+static image_t *
+thumb_sheet_tile(const thumb_sheet_t *ts, int idx, char *errbuf, size_t errlen)
+{
+  const AVFrame *f = ts->ts_frame;
+  const int tw = ts->ts_tile_width;
+  const int th = ts->ts_tile_height;
+  const int x = (idx % THUMB_SHEET_COLUMNS) * tw;
+  const int y = (idx / THUMB_SHEET_COLUMNS) * th;
+
+  if(idx >= ts->ts_items || x + tw > f->width || y + th > f->height) {
+    snprintf(errbuf, errlen, "No image at index %d", idx);
+    return NULL;
+  }
+
+  const uint8_t *src[4] = {
+    f->data[0] + y     * f->linesize[0] + x,
+    f->data[1] + y / 2 * f->linesize[1] + x / 2,
+    f->data[2] + y / 2 * f->linesize[2] + x / 2,
+    NULL
+  };
+
+  pixmap_t *pm = pixmap_create(tw, th, PIXMAP_BGR32, 0);
+  if(pm == NULL) {
+    snprintf(errbuf, errlen, "Out of memory");
+    return NULL;
+  }
+
+  struct SwsContext *sws;
+  sws = sws_getContext(tw, th, f->format, tw, th, AV_PIX_FMT_BGR32,
+                       SWS_BILINEAR, NULL, NULL, NULL);
+  if(sws == NULL) {
+    pixmap_release(pm);
+    snprintf(errbuf, errlen, "Scaling failed");
+    return NULL;
+  }
+
+  uint8_t *ptr[4] = {pm->pm_data, 0, 0, 0};
+  int strides[4] = {pm->pm_linesize, 0, 0, 0};
+  sws_scale(sws, src, f->linesize, 0, th, ptr, strides);
+  sws_freeContext(sws);
+
+  image_t *img = image_create_from_pixmap(pm);
+  pixmap_release(pm);
+  return img;
+}
+
+
+/**
+ * Returns an image for a seek index position. Sets *fallback if no
+ * sheet could be made and the caller should extract a single frame
+ */
+static image_t *
+fa_image_from_seekindex(const char *url, const image_meta_t *im,
+                        int idx, time_t mtime, int *cache_control,
+                        int *fallback, char *errbuf, size_t errlen,
+                        cancellable_t *c)
+{
+  char sheetid[512];
+  thumb_sheet_t *ts;
+  image_t *img = NULL;
+  const int tile_width = thumb_sheet_tile_width(im);
+
+  snprintf(sheetid, sizeof(sheetid), "%s-sheet-%d", url, tile_width);
+
+  hts_mutex_lock(&thumb_sheet_mutex);
+
+  while(1) {
+    LIST_FOREACH(ts, &thumb_sheets, ts_link)
+      if(!strcmp(ts->ts_id, sheetid))
+        break;
+
+    if(ts != NULL && ts->ts_state != TS_BUILDING && ts->ts_mtime != mtime) {
+      thumb_sheet_destroy(ts);
+      ts = NULL;
+    }
+
+    if(ts == NULL)
+      break;
+
+    switch(ts->ts_state) {
+    case TS_READY:
+      ts->ts_last_use = arch_get_ts();
+      img = thumb_sheet_tile(ts, idx, errbuf, errlen);
+      hts_mutex_unlock(&thumb_sheet_mutex);
+      return img;
+
+    case TS_FAILED:
+      hts_mutex_unlock(&thumb_sheet_mutex);
+      *fallback = 1;
+      return NULL;
+
+    case TS_BUILDING:
+      if(ONLY_CACHED(cache_control)) {
+        hts_mutex_unlock(&thumb_sheet_mutex);
+        snprintf(errbuf, errlen, "Not cached");
+        return NULL;
+      }
+      hts_cond_wait(&thumb_sheet_cond, &thumb_sheet_mutex);
+      break;
+    }
+  }
+
+  ts = calloc(1, sizeof(thumb_sheet_t));
+  ts->ts_id = strdup(sheetid);
+  ts->ts_mtime = mtime;
+  ts->ts_state = TS_BUILDING;
+  LIST_INSERT_HEAD(&thumb_sheets, ts, ts_link);
+  hts_mutex_unlock(&thumb_sheet_mutex);
+
+  AVFrame *frame = NULL;
+  char *etag = NULL;
+  time_t bmtime = 0;
+  int cancelled = 0;
+  buf_t *b = blobcache_get(sheetid, "videothumb", 0, 0, &etag, &bmtime);
+
+  if(b != NULL && bmtime == mtime && etag != NULL &&
+     sscanf(etag, "%d %d %d", &ts->ts_tile_width, &ts->ts_tile_height,
+            &ts->ts_items) == 3)
+    frame = thumb_sheet_decode(b);
+
+  buf_release(b);
+  free(etag);
+
+  if(frame == NULL && !ONLY_CACHED(cache_control)) {
+    ifv_t *ifv = ifv_acquire(url, 0, NULL, 0, NULL, errbuf, errlen);
+    if(ifv != NULL) {
+      b = thumb_sheet_build(ifv, ts, tile_width, errbuf, errlen, c);
+      ifv_release(ifv, 0);
+      if(b != NULL) {
+        char layout[64];
+        snprintf(layout, sizeof(layout), "%d %d %d",
+                 ts->ts_tile_width, ts->ts_tile_height, ts->ts_items);
+        blobcache_put(sheetid, "videothumb", b, INT32_MAX, layout, mtime, 0);
+        frame = thumb_sheet_decode(b);
+        buf_release(b);
+      }
+    }
+    cancelled = cancellable_is_cancelled(c);
   }
+
+  hts_mutex_lock(&thumb_sheet_mutex);
+  if(frame != NULL) {
+    ts->ts_frame = frame;
+    ts->ts_state = TS_READY;
+    ts->ts_last_use = arch_get_ts();
+    img = thumb_sheet_tile(ts, idx, errbuf, errlen);
+  } else if(cancelled || ONLY_CACHED(cache_control)) {
+    thumb_sheet_destroy(ts);
+    if(!cancelled)
+      snprintf(errbuf, errlen, "Not cached");
+  } else {
+    TRACE(TRACE_DEBUG, "Thumb", "No seek index images for %s -- %s",
+          url, errbuf);
+    ts->ts_state = TS_FAILED;
+    ts->ts_last_use = arch_get_ts();
+    *fallback = 1;
+  }
+  thumb_sheet_trim();
+  hts_cond_broadcast(&thumb_sheet_cond);
+  hts_mutex_unlock(&thumb_sheet_mutex);
   return img;
 }
 
@@ -760,19 +1369,28 @@ fa_image_from_video(const char *url0, const image_meta_t *im,
   else
     secs = atoi(tim);
 
-  hts_mutex_lock(&image_from_video_mutex[0]);
+  hts_mutex_lock(&image_from_video_mutex);
 
   if(strcmp(url, stated_url ?: "")) {
     free(stated_url);
     stated_url = NULL;
     if(fa_stat_ex(url, &fs, errbuf, errlen, FA_NON_INTERACTIVE)) {
-      hts_mutex_unlock(&image_from_video_mutex[0]);
+      hts_mutex_unlock(&image_from_video_mutex);
       return NULL;
     }
     stated_url = strdup(url);
   }
   stattime = fs.fs_mtime;
-  hts_mutex_unlock(&image_from_video_mutex[0]);
+  hts_mutex_unlock(&image_from_video_mutex);
+
+  if(secs >= 0 && secs % THUMB_SHEET_INTERVAL == 0) {
+    int fallback = 0;
+    img = fa_image_from_seekindex(url, im, secs / THUMB_SHEET_INTERVAL,
+                                  stattime, cache_control, &fallback,
+                                  errbuf, errlen, c);
+    if(!fallback)
+      return img;
+  }
 
   if(im->im_req_width < 100 && im->im_req_height < 100) {
     siz = "min";
@@ -796,10 +1414,8 @@ fa_image_from_video(const char *url0, const image_meta_t *im,
     return NULL;
   }
 
-  hts_mutex_lock(&image_from_video_mutex[1]);
   img = fa_image_from_video2(url, im, cacheid, errbuf, errlen,
                              secs, stattime, c);
-  hts_mutex_unlock(&image_from_video_mutex[1]);
   if(img != NULL)
     img->im_flags |= IMAGE_ADAPTED;
   return img;
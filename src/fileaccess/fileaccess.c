@@ -1441,6 +1441,10 @@ fileaccess_init(void)
   fa_indexer_init();
 #endif
 
+#ifdef FA_AES_BENCHMARK
+  fa_aes_benchmark();
+#endif
+
   prop_t *dir = setting_get_dir("general:filebrowse");
 
   setting_create(SETTING_BOOL, dir, SETTINGS_INITIAL_UPDATE,
@@ -376,6 +376,8 @@ FILE *fa_fopen(fa_handle_t *fh, int doclose);
 fa_handle_t *fa_aescbc_open(fa_handle_t *fa, const uint8_t *iv,
 			    const uint8_t *key);
 
+void fa_aes_benchmark(void);
+
 
 // Bandwidth limiter
 
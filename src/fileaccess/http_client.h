@@ -114,6 +114,8 @@ void http_req_release(http_req_aux_t *hra);
 
 http_req_aux_t *http_req_retain(http_req_aux_t *hra) attribute_unused_result;
 
+void http_client_prewarm(const char *url);
+
 int http_client_rawauth(http_request_inspection_t *hri, const char *str);
 
 void http_client_set_header(http_request_inspection_t *hri, const char *key,
@@ -23,13 +23,17 @@
 
 #include "config.h"
 #include "misc/md4.h"
+#include "misc/md5.h"
+#include "misc/sha.h"
 
 
-// We don't have wrappers for DES
+// We don't have wrappers for DES and AES
 #if ENABLE_OPENSSL
 #include <openssl/des.h>
+#include <openssl/aes.h>
 #elif ENABLE_POLARSSL
 #include "polarssl/des.h"
+#include "polarssl/aes.h"
 #elif ENABLE_COMMONCRYPTO
 #include <CommonCrypto/CommonCrypto.h>
 #else
@@ -47,6 +51,7 @@
 #include "misc/minmax.h"
 #include "misc/bytestream.h"
 #include "misc/endian.h"
+#include "arch/arch.h"
 
 // http://msdn.microsoft.com/en-us/library/ee442092.aspx
 
@@ -68,21 +73,29 @@ static hts_mutex_t smb_global_mutex;
 
 #define NBT_TIMEOUT 30000
 
+#define SMB2_MAX_READ_SIZE   (1024 * 1024)
+#define SMB2_MAX_READS       16
+#define SMB2_READAHEAD_SIZE  (4 * 1024 * 1024)
+#define SMB2_CREDITS_WANTED  64
+#define SMB2_MAX_COMPOUND    4
+
 /**
  *
  */
 typedef struct nbt_req {
   LIST_ENTRY(nbt_req) nr_link;
-  uint16_t nr_mid;
+  uint64_t nr_mid;
   void *nr_response;
   int nr_response_len;
   int nr_result;
+  int nr_discard;  // Nobody waits for reply, dispatcher frees request
   LIST_ENTRY(nbt_req) nr_multi_link;
-  int nr_offset;
+  int nr_offset;   // SMBv1: Offset in buffer, SMB2: Bytes consumed
   int nr_cnt;
   int nr_last;
   int nr_is_trans2;
   int nr_data_count;
+  uint64_t nr_pos; // SMB2: File offset of read
 } nbt_req_t;
 
 
@@ -116,6 +129,15 @@ typedef struct cifs_connection {
 
   hts_cond_t cc_cond;
 
+  /**
+   * cc_mutex protects the pending request list, SMB2 credits and
+   * message ids and serializes writes to the socket.
+   * Lock order is smb_global_mutex -> cc_mutex
+   */
+  hts_mutex_t cc_mutex;
+  hts_cond_t cc_req_cond;
+  char cc_dead;  // Dispatch thread has exited
+
   struct nbt_req_list cc_pending_nbt_requests;
 
   char cc_broken;
@@ -146,6 +168,18 @@ typedef struct cifs_connection {
   char *cc_native_lanman;
   char *cc_primary_domain;
 
+  // SMB2 and later
+
+  uint16_t cc_dialect;   // 0 if we talk SMBv1
+  uint8_t cc_signing_required;
+  uint8_t cc_signing;
+  uint8_t cc_signing_key[16];
+  uint32_t cc_capabilities;
+  uint32_t cc_max_read_size;
+  uint64_t cc_session_id;
+  uint64_t cc_message_id;
+  int cc_credits;
+
 } cifs_connection_t;
 
 
@@ -156,7 +190,7 @@ typedef struct cifs_connection {
 typedef struct cifs_tree {
   cifs_connection_t *ct_cc;  // We hold a ref in the connection too
   LIST_ENTRY(cifs_tree) ct_link;
-  int ct_tid;
+  uint32_t ct_tid;
 
   char *ct_share;
   int ct_refcount;
@@ -175,6 +209,7 @@ typedef struct cifs_tree {
 
 #include "nbt.h"
 #include "smbv1.h"
+#include "smbv2.h"
 
 /**
  *
@@ -348,6 +383,413 @@ lmresponse(uint8_t *out, const uint8_t *hash, const uint8_t *challenge)
 }
 
 
+/**
+ * HMAC-MD5 over two concatenated buffers
+ */
+static void
+hmac_md5(uint8_t *out, const uint8_t *key, int keylen,
+         const void *d1, int l1, const void *d2, int l2)
+{
+  uint8_t pad[64];
+  uint8_t inner[16];
+  md5_decl(ctx);
+
+  assert(keylen <= 64);
+
+  memset(pad, 0x36, 64);
+  for(int i = 0; i < keylen; i++)
+    pad[i] ^= key[i];
+
+  md5_init(ctx);
+  md5_update(ctx, pad, 64);
+  md5_update(ctx, d1, l1);
+  if(l2)
+    md5_update(ctx, d2, l2);
+  md5_final(ctx, inner);
+
+  memset(pad, 0x5c, 64);
+  for(int i = 0; i < keylen; i++)
+    pad[i] ^= key[i];
+
+  md5_init(ctx);
+  md5_update(ctx, pad, 64);
+  md5_update(ctx, inner, 16);
+  md5_final(ctx, out);
+}
+
+
+/**
+ * HMAC-SHA256
+ */
+static void
+hmac_sha256(uint8_t *out, const uint8_t *key, int keylen,
+            const void *data, int len)
+{
+  uint8_t pad[64];
+  uint8_t inner[32];
+  sha256_decl(ctx);
+
+  assert(keylen <= 64);
+
+  memset(pad, 0x36, 64);
+  for(int i = 0; i < keylen; i++)
+    pad[i] ^= key[i];
+
+  sha256_init(ctx);
+  sha256_update(ctx, pad, 64);
+  sha256_update(ctx, data, len);
+  sha256_final(ctx, inner);
+
+  memset(pad, 0x5c, 64);
+  for(int i = 0; i < keylen; i++)
+    pad[i] ^= key[i];
+
+  sha256_init(ctx);
+  sha256_update(ctx, pad, 64);
+  sha256_update(ctx, inner, 32);
+  sha256_final(ctx, out);
+}
+
+
+/**
+ * Expanded AES-128 encryption key
+ */
+#if ENABLE_OPENSSL
+typedef AES_KEY aes128_key_t;
+#elif ENABLE_POLARSSL
+typedef aes_context aes128_key_t;
+#elif ENABLE_COMMONCRYPTO
+typedef CCCryptorRef aes128_key_t;
+#else
+#error No crypto
+#endif
+
+
+/**
+ *
+ */
+static void
+aes128_key_init(aes128_key_t *k, const uint8_t *key)
+{
+#if ENABLE_OPENSSL
+  AES_set_encrypt_key(key, 128, k);
+#elif ENABLE_POLARSSL
+  aes_setkey_enc(k, key, 128);
+#elif ENABLE_COMMONCRYPTO
+  CCCryptorCreate(kCCEncrypt, kCCAlgorithmAES128, kCCOptionECBMode,
+                  key, 16, NULL, k);
+#endif
+}
+
+
+/**
+ *
+ */
+static void
+aes128_key_destroy(aes128_key_t *k)
+{
+#if ENABLE_COMMONCRYPTO
+  CCCryptorRelease(*k);
+#endif
+}
+
+
+/**
+ *
+ */
+static void
+aes128_encrypt_block(aes128_key_t *k, const uint8_t *in, uint8_t *out)
+{
+#if ENABLE_OPENSSL
+  AES_encrypt(in, out, k);
+#elif ENABLE_POLARSSL
+  aes_crypt_ecb(k, AES_ENCRYPT, in, out);
+#elif ENABLE_COMMONCRYPTO
+  size_t written;
+  CCCryptorUpdate(*k, in, 16, out, 16, &written);
+#endif
+}
+
+
+/**
+ *
+ */
+static void
+cmac_subkey(uint8_t *out, const uint8_t *in)
+{
+  const int carry = in[0] & 0x80;
+  for(int i = 0; i < 15; i++)
+    out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+  out[15] = in[15] << 1;
+  if(carry)
+    out[15] ^= 0x87;
+}
+
+
+/**
+ * AES-128-CMAC (RFC 4493), used for SMB 3.x signing
+ */
+static void
+aes_cmac(uint8_t *out, const uint8_t *key, const uint8_t *msg, size_t len)
+{
+  static const uint8_t zero[16];
+  uint8_t k1[16], k2[16], x[16], y[16];
+  size_t blocks = (len + 15) / 16;
+  int complete = blocks > 0 && (len & 15) == 0;
+  aes128_key_t k;
+
+  // Expand the key once, a message is signed with many blocks
+  aes128_key_init(&k, key);
+
+  aes128_encrypt_block(&k, zero, x);
+  cmac_subkey(k1, x);
+  cmac_subkey(k2, k1);
+
+  if(blocks == 0)
+    blocks = 1;
+
+  memset(x, 0, 16);
+  for(size_t i = 0; i < blocks - 1; i++) {
+    for(int j = 0; j < 16; j++)
+      y[j] = x[j] ^ msg[i * 16 + j];
+    aes128_encrypt_block(&k, y, x);
+  }
+
+  const uint8_t *last = msg + (blocks - 1) * 16;
+  const size_t rem = len - (blocks - 1) * 16;
+  uint8_t m[16];
+
+  if(complete) {
+    for(int j = 0; j < 16; j++)
+      m[j] = last[j] ^ k1[j];
+  } else {
+    memset(m, 0, 16);
+    memcpy(m, last, rem);
+    m[rem] = 0x80;
+    for(int j = 0; j < 16; j++)
+      m[j] ^= k2[j];
+  }
+
+  for(int j = 0; j < 16; j++)
+    y[j] = x[j] ^ m[j];
+  aes128_encrypt_block(&k, y, out);
+  aes128_key_destroy(&k);
+}
+
+
+/**
+ * SMB 3.0 signing key derivation (SP800-108 counter mode KDF)
+ */
+static void
+smb3_signing_key(uint8_t *out, const uint8_t *session_key)
+{
+  uint8_t input[29];
+  uint8_t digest[32];
+
+  wr32_be(input, 1);
+  memcpy(input + 4, "SMB2AESCMAC", 12);
+  input[16] = 0;
+  memcpy(input + 17, "SmbSign", 8);
+  wr32_be(input + 25, 128);
+
+  hmac_sha256(digest, session_key, 16, input, sizeof(input));
+  memcpy(out, digest, 16);
+}
+
+
+// http://msdn.microsoft.com/en-us/library/cc236621.aspx
+
+#define NTLMSSP_NEGOTIATE_UNICODE                  0x00000001
+#define NTLMSSP_REQUEST_TARGET                     0x00000004
+#define NTLMSSP_NEGOTIATE_SIGN                     0x00000010
+#define NTLMSSP_NEGOTIATE_NTLM                     0x00000200
+#define NTLMSSP_NEGOTIATE_ANONYMOUS                0x00000800
+#define NTLMSSP_NEGOTIATE_ALWAYS_SIGN              0x00008000
+#define NTLMSSP_NEGOTIATE_EXTENDED_SESSIONSECURITY 0x00080000
+#define NTLMSSP_NEGOTIATE_TARGET_INFO              0x00800000
+#define NTLMSSP_NEGOTIATE_128                      0x20000000
+
+#define NTLMSSP_CLIENT_FLAGS (NTLMSSP_NEGOTIATE_UNICODE |                \
+                              NTLMSSP_REQUEST_TARGET |                   \
+                              NTLMSSP_NEGOTIATE_SIGN |                   \
+                              NTLMSSP_NEGOTIATE_NTLM |                   \
+                              NTLMSSP_NEGOTIATE_ALWAYS_SIGN |            \
+                              NTLMSSP_NEGOTIATE_EXTENDED_SESSIONSECURITY | \
+                              NTLMSSP_NEGOTIATE_TARGET_INFO |            \
+                              NTLMSSP_NEGOTIATE_128)
+
+#define MSV_AV_TIMESTAMP 7
+
+/**
+ *
+ */
+static void
+ntlmssp_negotiate(uint8_t *out)
+{
+  memset(out, 0, 32);
+  memcpy(out, "NTLMSSP", 8);
+  wr32_le(out + 8, 1);
+  wr32_le(out + 12, NTLMSSP_CLIENT_FLAGS);
+  wr32_le(out + 20, 32);
+  wr32_le(out + 28, 32);
+}
+
+
+/**
+ *
+ */
+static void
+ntlmssp_field(uint8_t *msg, int field, int *offset, const void *data, int len)
+{
+  wr16_le(msg + field, len);
+  wr16_le(msg + field + 2, len);
+  wr32_le(msg + field + 4, *offset);
+  memcpy(msg + *offset, data, len);
+  *offset += len;
+}
+
+
+/**
+ * Append string in UTF-16LE without terminating zero, return length
+ */
+static int
+ntlmssp_ucs2(uint8_t *dst, const char *str, int upper)
+{
+  if(upper) {
+    char *s = mystrdupa(str);
+    for(char *p = s; *p; p++)
+      if(*p >= 'a' && *p <= 'z')
+        *p -= 32;
+    str = s;
+  }
+  size_t len = utf8_to_ucs2(NULL, str, 1);
+  uint8_t *tmp = alloca(len);
+  utf8_to_ucs2(tmp, str, 1);
+  len -= 2;
+  if(dst != NULL)
+    memcpy(dst, tmp, len);
+  return len;
+}
+
+
+/**
+ * Build NTLMv2 AUTHENTICATE_MESSAGE as a response to the server
+ * CHALLENGE_MESSAGE. If username is NULL we do anonymous login.
+ *
+ * Returns length of message (allocated and returned in *outp) or -1
+ * if the challenge is malformed. The session key is written to
+ * session_key (or cleared for anonymous logins)
+ */
+static int
+ntlmssp_authenticate(uint8_t **outp, uint8_t *session_key,
+                     const uint8_t *chl, int chllen,
+                     const char *username, const char *password,
+                     const char *domain)
+{
+  if(chllen < 48 || memcmp(chl, "NTLMSSP", 8) || rd32_le(chl + 8) != 2)
+    return -1;
+
+  const uint8_t *server_challenge = chl + 24;
+  const uint32_t flags = rd32_le(chl + 20) & NTLMSSP_CLIENT_FLAGS;
+  const int ti_len = rd16_le(chl + 40);
+  const int ti_off = rd32_le(chl + 44);
+
+  if(ti_off + ti_len > chllen)
+    return -1;
+
+  const uint8_t *ti = chl + ti_off;
+
+  memset(session_key, 0, 16);
+
+  if(domain == NULL)
+    domain = "";
+
+  int ulen = username ? ntlmssp_ucs2(NULL, username, 0) : 0;
+  int dlen = ntlmssp_ucs2(NULL, domain, 0);
+
+  int ntlen = 0;
+  int lmlen = 0;
+  uint8_t *nt = NULL;
+  uint8_t lm[24] = {0};
+
+  if(username == NULL) {
+    lmlen = 1;
+  } else {
+    uint8_t nthash[16];
+    uint8_t ntowf[16];
+    uint8_t proof[16];
+    uint8_t client_challenge[8];
+    int64_t ts = 0;
+
+    NTLM_hash(password ?: "", nthash);
+
+    int udlen = ntlmssp_ucs2(NULL, username, 1) + dlen;
+    uint8_t *ud = alloca(udlen);
+    ntlmssp_ucs2(ntlmssp_ucs2(ud, username, 1) + ud, domain, 0);
+    hmac_md5(ntowf, nthash, 16, ud, udlen, NULL, 0);
+
+    // Use server timestamp if given
+    for(int o = 0; o + 4 <= ti_len;) {
+      int id = rd16_le(ti + o);
+      int len = rd16_le(ti + o + 2);
+      if(id == 0 || o + 4 + len > ti_len)
+        break;
+      if(id == MSV_AV_TIMESTAMP && len == 8)
+        ts = rd64_le(ti + o + 4);
+      o += 4 + len;
+    }
+
+    if(ts == 0)
+      ts = (time(NULL) + 11644473600LL) * 10000000LL;
+
+    arch_get_random_bytes(client_challenge, 8);
+
+    ntlen = 16 + 28 + ti_len + 4;
+    nt = alloca(ntlen);
+    memset(nt, 0, ntlen);
+    uint8_t *blob = nt + 16;
+    blob[0] = 1;
+    blob[1] = 1;
+    wr64_le(blob + 8, ts);
+    memcpy(blob + 16, client_challenge, 8);
+    memcpy(blob + 28, ti, ti_len);
+
+    hmac_md5(proof, ntowf, 16, server_challenge, 8, blob, ntlen - 16);
+    memcpy(nt, proof, 16);
+
+    hmac_md5(lm, ntowf, 16, server_challenge, 8, client_challenge, 8);
+    memcpy(lm + 16, client_challenge, 8);
+    lmlen = 24;
+
+    hmac_md5(session_key, ntowf, 16, proof, 16, NULL, 0);
+  }
+
+  int total = 64 + dlen + ulen + lmlen + ntlen;
+  uint8_t *msg = calloc(1, total);
+  uint8_t *ud = alloca(dlen + ulen + 1);
+  int offset = 64;
+
+  memcpy(msg, "NTLMSSP", 8);
+  wr32_le(msg + 8, 3);
+
+  ntlmssp_ucs2(ud, domain, 0);
+  ntlmssp_field(msg, 28, &offset, ud, dlen);
+  if(username != NULL)
+    ntlmssp_ucs2(ud, username, 0);
+  ntlmssp_field(msg, 36, &offset, ud, ulen);
+  ntlmssp_field(msg, 44, &offset, NULL, 0);  // Workstation
+  ntlmssp_field(msg, 12, &offset, lm, lmlen);
+  ntlmssp_field(msg, 20, &offset, nt, ntlen);
+  ntlmssp_field(msg, 52, &offset, NULL, 0);  // Encrypted random session key
+  wr32_le(msg + 60, flags |
+          (username == NULL ? NTLMSSP_NEGOTIATE_ANONYMOUS : 0));
+
+  assert(offset == total);
+  *outp = msg;
+  return total;
+}
+
+
 /**
  *
  */
@@ -439,12 +881,13 @@ nbt_read(cifs_connection_t *cc, void **bufp, int *lenp)
  *
  */
 static int
-nbt_write(cifs_connection_t *cc, void *buf, int len)
+nbt_write_locked(cifs_connection_t *cc, void *buf, int len)
 {
   NBT_t *nbt = buf;
 
+  // Direct TCP transport uses 24 bit length, high bits goes in 'flags'
   nbt->msg = NBT_SESSION_MSG;
-  nbt->flags = 0;
+  nbt->flags = (len - 4) >> 16;
   wr16_be((void *)&nbt->length, len - 4);
   tcp_write_data(cc->cc_tc, buf, len);
   return 0;
@@ -454,53 +897,44 @@ nbt_write(cifs_connection_t *cc, void *buf, int len)
 /**
  *
  */
-static size_t
-utf8_to_smb(const cifs_connection_t *cc, uint8_t *dst, const char *src)
+static int
+nbt_write(cifs_connection_t *cc, void *buf, int len)
 {
-  size_t r;
-  if(cc->cc_unicode)
-    r = utf8_to_ucs2(dst, src, 1);
-  else
-    r = utf8_to_ascii(dst, src);
+  hts_mutex_lock(&cc->cc_mutex);
+  int r = nbt_write_locked(cc, buf, len);
+  hts_mutex_unlock(&cc->cc_mutex);
   return r;
 }
 
+
 /**
  *
  */
 static void
-cifs_maybe_destroy(cifs_connection_t *cc)
+smb2_init_header(const cifs_connection_t *cc, SMB2_t *h, int cmd, uint32_t tid)
 {
+  memcpy(h->protocol_id, "\xfeSMB", 4);
+  h->structure_size = htole_16(64);
+  h->command = htole_16(cmd);
+  h->process_id = htole_32(0xfeff);
+  h->tree_id = htole_32(tid);
+  h->session_id = htole_64(cc->cc_session_id);
+}
 
-  if(cc->cc_refcount > 0) {
-    hts_mutex_unlock(&smb_global_mutex);
-    return;
-  }
-
-  LIST_REMOVE(cc, cc_link);
-
-  // As we are unlinked noone can find us anymore, so it's safe to unlock now
-  hts_mutex_unlock(&smb_global_mutex);
-
-  if(cc->cc_tc != NULL) {
-    SMBTRACE("Disconnecting from %s:%d", cc->cc_hostname, cc->cc_port);
-    tcp_shutdown(cc->cc_tc);
-  }
-
-  if(cc->cc_thread)
-    hts_thread_join(&cc->cc_thread);
-
-  if(cc->cc_tc != NULL)
-    tcp_close(cc->cc_tc);
 
-  callout_disarm(&cc->cc_timer);
+/**
+ * Compute signature of a message, the signature field is cleared
+ */
+static void
+smb2_signature(const cifs_connection_t *cc, SMB2_t *h, int len,
+               uint8_t *digest)
+{
+  memset(h->signature, 0, sizeof(h->signature));
 
-  hts_cond_destroy(&cc->cc_cond);
-  free(cc->cc_hostname);
-  free(cc->cc_native_os);
-  free(cc->cc_native_lanman);
-  free(cc->cc_primary_domain);
-  free(cc);
+  if(cc->cc_dialect >= SMB2_DIALECT_0300)
+    aes_cmac(digest, cc->cc_signing_key, (const void *)h, len);
+  else
+    hmac_sha256(digest, cc->cc_signing_key, 16, h, len);
 }
 
 
@@ -508,75 +942,447 @@ cifs_maybe_destroy(cifs_connection_t *cc)
  *
  */
 static void
-cifs_release_connection(cifs_connection_t *cc)
+smb2_sign(const cifs_connection_t *cc, SMB2_t *h, int len)
 {
-  cc->cc_refcount--;
-  cifs_maybe_destroy(cc);
-}
+  uint8_t digest[32];
 
+  h->flags |= htole_32(SMB2_FLAGS_SIGNED);
+  smb2_signature(cc, h, len, digest);
+  memcpy(h->signature, digest, sizeof(h->signature));
+}
 
 
 /**
- *
+ * Returns 0 if response is correctly signed
  */
 static int
-smb_neg_proto(cifs_connection_t *cc, char *errbuf, size_t errlen)
+smb2_verify(const cifs_connection_t *cc, SMB2_t *h, int len)
 {
-  const char *dialect = "NT LM 0.12";
-  SMB_NEG_PROTOCOL_req_t *req;
-  SMB_NEG_PROTOCOL_reply_t *reply;
-  void *rbuf;
+  uint8_t received[16];
+  uint8_t digest[32];
+  uint8_t diff = 0;
 
-  int len = strlen(dialect) + 1;
-  int tlen = sizeof(SMB_NEG_PROTOCOL_req_t) + 1 + len;
+  if(!(h->flags & htole_32(SMB2_FLAGS_SIGNED)))
+    return -1;
 
-  req = alloca(tlen);
-  memset(req, 0, tlen);
+  memcpy(received, h->signature, sizeof(received));
+  smb2_signature(cc, h, len, digest);
+  memcpy(h->signature, received, sizeof(received));
 
-  smbv1_init_header(cc, &req->hdr, SMB_NEG_PROTOCOL,
-                    SMB_FLAGS_CASELESS_PATHNAMES, SMB_FLAGS2_32BIT_STATUS,
-                    0, 1);
+  for(int i = 0; i < sizeof(received); i++)
+    diff |= received[i] ^ digest[i];
+  return diff ? -1 : 0;
+}
 
-  req->wordcount = 0;
-  req->bytecount = htole_16(len + 1);
-  req->protos[0] = 2;
-  memcpy(req->protos + 1, dialect, len);
 
-  nbt_write(cc, req, tlen);
+/**
+ * Number of credits consumed by a request with the given payload size
+ */
+static int
+smb2_credit_charge(const cifs_connection_t *cc, int payload)
+{
+  if(!(cc->cc_capabilities & SMB2_GLOBAL_CAP_LARGE_MTU) || payload <= 0)
+    return 1;
+  return 1 + (payload - 1) / 65536;
+}
 
-  if(nbt_read(cc, &rbuf, &len)) {
-    snprintf(errbuf, errlen, "Socket read error during negotiation");
-    return -1;
-  }
-  reply = rbuf;
 
-  if(len < sizeof(SMB_NEG_PROTOCOL_reply_t) || reply->wordcount != 17) {
-    snprintf(errbuf, errlen, "Malformed response %d bytes during negotiation",
-	     len);
-    free(rbuf);
-    return -1;
+/**
+ * Assign message id and credits to a request (and sign it).
+ * Blocks until enough credits are available. cc_mutex must be held
+ */
+static int
+smb2_prepare_locked(cifs_connection_t *cc, SMB2_t *h, int len, int payload)
+{
+  const int charge = smb2_credit_charge(cc, payload);
+
+  while(cc->cc_credits < charge && !cc->cc_dead) {
+    if(hts_cond_wait_timeout(&cc->cc_req_cond, &cc->cc_mutex, NBT_TIMEOUT)) {
+      TRACE(TRACE_ERROR, "SMB", "%s:%d timeout waiting for credits",
+            cc->cc_hostname, cc->cc_port);
+      return -1;
+    }
   }
 
-  if(reply->hdr.errorcode) {
-    snprintf(errbuf, errlen, "Negotiation error 0x%08x",
-	     (int)letoh_32(reply->hdr.errorcode));
-    free(rbuf);
+  if(cc->cc_dead)
     return -1;
-  }
 
-  if(letoh_32(reply->capabilities) & SERVER_CAP_UNICODE)
-    cc->cc_unicode = 1;
-  else
-    cc->cc_unicode = 0;
+  cc->cc_credits -= charge;
 
-  cc->cc_bpc = cc->cc_unicode + 1;
+  if(cc->cc_dialect >= SMB2_DIALECT_0210)
+    h->credit_charge = htole_16(charge);
 
-  if(letoh_32(reply->capabilities) & SERVER_CAP_NT_SMBS)
-    cc->cc_ntsmb = 1;
-  else {
-    snprintf(errbuf, errlen, "Server does not support NTSMB");
-    free(rbuf);
-    return -1;
+  // Ask for a few more than we use until we have a decent window
+  h->credits = htole_16(charge +
+                        (cc->cc_credits < SMB2_CREDITS_WANTED ? 8 : 0));
+  h->message_id = htole_64(cc->cc_message_id);
+  cc->cc_message_id += charge;
+
+  if(cc->cc_signing)
+    smb2_sign(cc, h, len);
+  return 0;
+}
+
+
+/**
+ * Send a chain of SMB2 requests as one compound. Each request starts
+ * with room for a NBT header (like all our requests do). If 'related'
+ * is set all requests operates on the file opened by the first one.
+ * cc_mutex must be held
+ */
+static void
+smb2_send_compound_locked(cifs_connection_t *cc, int count,
+                          void **reqs, const int *lens, const int *payloads,
+                          int related, nbt_req_t **nrs, const char *info)
+{
+  int total = 4;
+  int err = cc->cc_dead;
+
+  for(int i = 0; i < count; i++) {
+    const int elen = lens[i] - 4;
+    total += i < count - 1 ? (elen + 7) & ~7 : elen;
+  }
+
+  uint8_t *frame = malloc(total);
+  int off = 4;
+
+  for(int i = 0; i < count; i++) {
+    const int elen = lens[i] - 4;
+    const int padded = i < count - 1 ? (elen + 7) & ~7 : elen;
+    SMB2_t *h = (SMB2_t *)(frame + off);
+
+    memcpy(h, reqs[i] + 4, elen);
+    memset((uint8_t *)h + elen, 0, padded - elen);
+
+    if(i < count - 1)
+      h->next_command = htole_32(padded);
+    if(i > 0 && related)
+      h->flags |= htole_32(SMB2_FLAGS_RELATED_OPERATIONS);
+
+    nbt_req_t *nr = calloc(1, sizeof(nbt_req_t));
+    nr->nr_result = -1;
+    LIST_INSERT_HEAD(&cc->cc_pending_nbt_requests, nr, nr_link);
+    nrs[i] = nr;
+
+    if(err || smb2_prepare_locked(cc, h, padded, payloads ? payloads[i] : 0)) {
+      nr->nr_result = 1;
+      err = 1;
+    } else {
+      nr->nr_mid = letoh_64(h->message_id);
+      SMBTRACE("%s:%d %s sent SMB2 cmd=%d mid=%"PRId64,
+               cc->cc_hostname, cc->cc_port, info,
+               letoh_16(h->command), nr->nr_mid);
+    }
+    off += padded;
+  }
+
+  if(!err)
+    nbt_write_locked(cc, frame, total);
+  else
+    cc->cc_broken = 1;
+  free(frame);
+}
+
+
+/**
+ * Make dispatcher free the request when the reply arrives (or free it
+ * directly if it already has). cc_mutex must be held
+ */
+static void
+nbt_discard_locked(nbt_req_t *nr)
+{
+  if(nr->nr_result == -1) {
+    nr->nr_discard = 1;
+    return;
+  }
+  LIST_REMOVE(nr, nr_link);
+  free(nr->nr_response);
+  free(nr);
+}
+
+
+/**
+ *
+ */
+static size_t
+utf8_to_smb(const cifs_connection_t *cc, uint8_t *dst, const char *src)
+{
+  size_t r;
+  if(cc->cc_unicode)
+    r = utf8_to_ucs2(dst, src, 1);
+  else
+    r = utf8_to_ascii(dst, src);
+  return r;
+}
+
+/**
+ *
+ */
+static void
+cifs_maybe_destroy(cifs_connection_t *cc)
+{
+
+  if(cc->cc_refcount > 0) {
+    hts_mutex_unlock(&smb_global_mutex);
+    return;
+  }
+
+  LIST_REMOVE(cc, cc_link);
+
+  // As we are unlinked noone can find us anymore, so it's safe to unlock now
+  hts_mutex_unlock(&smb_global_mutex);
+
+  if(cc->cc_tc != NULL) {
+    SMBTRACE("Disconnecting from %s:%d", cc->cc_hostname, cc->cc_port);
+    tcp_shutdown(cc->cc_tc);
+  }
+
+  if(cc->cc_thread)
+    hts_thread_join(&cc->cc_thread);
+
+  if(cc->cc_tc != NULL)
+    tcp_close(cc->cc_tc);
+
+  callout_disarm(&cc->cc_timer);
+
+  hts_cond_destroy(&cc->cc_cond);
+  hts_cond_destroy(&cc->cc_req_cond);
+  hts_mutex_destroy(&cc->cc_mutex);
+  free(cc->cc_hostname);
+  free(cc->cc_native_os);
+  free(cc->cc_native_lanman);
+  free(cc->cc_primary_domain);
+  free(cc);
+}
+
+
+/**
+ *
+ */
+static void
+cifs_release_connection(cifs_connection_t *cc)
+{
+  cc->cc_refcount--;
+  cifs_maybe_destroy(cc);
+}
+
+
+
+/**
+ * Synchronous SMB2 request, only used during connection setup before
+ * the dispatch thread is running
+ */
+static int
+smb2_sync_req(cifs_connection_t *cc, void *req, int len,
+              void **rbufp, int *rlenp)
+{
+  SMB2_t *h = req + 4;
+
+  hts_mutex_lock(&cc->cc_mutex);
+  int r = smb2_prepare_locked(cc, h, len - 4, 0);
+  if(!r)
+    nbt_write_locked(cc, req, len);
+  hts_mutex_unlock(&cc->cc_mutex);
+
+  if(r)
+    return -1;
+
+  while(1) {
+    if(nbt_read(cc, rbufp, rlenp))
+      return -1;
+
+    const SMB2_t *rh = *rbufp;
+    if(*rlenp < sizeof(SMB2_t) || memcmp(rh->protocol_id, "\xfeSMB", 4)) {
+      free(*rbufp);
+      return -1;
+    }
+
+    cc->cc_credits += letoh_16(rh->credits);
+
+    if(rh->flags & htole_32(SMB2_FLAGS_ASYNC_COMMAND) &&
+       rh->status == htole_32(STATUS_PENDING)) {
+      free(*rbufp);
+      continue; // Interim response
+    }
+    return 0;
+  }
+}
+
+
+/**
+ *
+ */
+static int
+smb2_parse_negotiate(cifs_connection_t *cc, void *rbuf, int len,
+                     char *errbuf, size_t errlen)
+{
+  const SMB2_NEGOTIATE_resp_t *reply = rbuf;
+
+  if(len < sizeof(SMB2_NEGOTIATE_resp_t)) {
+    snprintf(errbuf, errlen, "Malformed response %d bytes during negotiation",
+             len);
+    free(rbuf);
+    return -1;
+  }
+
+  if(reply->hdr.status) {
+    snprintf(errbuf, errlen, "Negotiation error 0x%08x",
+             (int)letoh_32(reply->hdr.status));
+    free(rbuf);
+    return -1;
+  }
+
+  cc->cc_dialect = letoh_16(reply->dialect);
+  cc->cc_capabilities = letoh_32(reply->capabilities);
+  cc->cc_signing_required =
+    !!(letoh_16(reply->security_mode) & SMB2_NEGOTIATE_SIGNING_REQUIRED);
+
+  if(cc->cc_capabilities & SMB2_GLOBAL_CAP_LARGE_MTU)
+    cc->cc_max_read_size = MIN(SMB2_MAX_READ_SIZE,
+                               letoh_32(reply->max_read_size));
+  else
+    cc->cc_max_read_size = MIN(65536, letoh_32(reply->max_read_size));
+
+  // Everything in SMB2 is user level security and unicode
+  cc->cc_security_mode = SECURITY_USER_LEVEL;
+  cc->cc_unicode = 1;
+  cc->cc_bpc = 2;
+  free(rbuf);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+smb2_negotiate(cifs_connection_t *cc, char *errbuf, size_t errlen)
+{
+  static const uint16_t dialects[] = {
+    SMB2_DIALECT_0202,
+    SMB2_DIALECT_0210,
+    SMB2_DIALECT_0300,
+    SMB2_DIALECT_0302,
+  };
+  const int num_dialects = sizeof(dialects) / sizeof(dialects[0]);
+  const int tlen = sizeof(SMB2_NEGOTIATE_req_t) + sizeof(dialects);
+  SMB2_NEGOTIATE_req_t *req = alloca(tlen);
+  void *rbuf;
+  int rlen;
+
+  memset(req, 0, tlen);
+  smb2_init_header(cc, &req->hdr, SMB2_NEGOTIATE, 0);
+  req->structure_size = htole_16(36);
+  req->dialect_count = htole_16(num_dialects);
+  req->security_mode = htole_16(SMB2_NEGOTIATE_SIGNING_ENABLED);
+  req->capabilities = htole_32(SMB2_GLOBAL_CAP_LARGE_MTU);
+  arch_get_random_bytes(req->client_guid, sizeof(req->client_guid));
+  for(int i = 0; i < num_dialects; i++)
+    req->dialects[i] = htole_16(dialects[i]);
+
+  if(smb2_sync_req(cc, req, tlen, &rbuf, &rlen)) {
+    snprintf(errbuf, errlen, "Socket read error during negotiation");
+    return -1;
+  }
+  return smb2_parse_negotiate(cc, rbuf, rlen, errbuf, errlen);
+}
+
+
+/**
+ *
+ */
+static int
+smb_neg_proto(cifs_connection_t *cc, char *errbuf, size_t errlen)
+{
+  static const char *dialects[] = {"NT LM 0.12", "SMB 2.002", "SMB 2.???"};
+  SMB_NEG_PROTOCOL_req_t *req;
+  SMB_NEG_PROTOCOL_reply_t *reply;
+  void *rbuf;
+
+  // Anonymous connections are used for RAP server enumeration which
+  // only exist in SMBv1
+  int num_dialects = cc->cc_flags & CC_F_ANONYMOUS ? 1 : 3;
+#ifdef SMB_BENCHMARK
+  if(getenv("SMB_BENCHMARK_SMB1"))
+    num_dialects = 1;
+#endif
+  int len = 0;
+  for(int i = 0; i < num_dialects; i++)
+    len += 1 + strlen(dialects[i]) + 1;
+
+  int tlen = sizeof(SMB_NEG_PROTOCOL_req_t) + len;
+
+  req = alloca(tlen);
+  memset(req, 0, tlen);
+
+  smbv1_init_header(cc, &req->hdr, SMB_NEG_PROTOCOL,
+                    SMB_FLAGS_CASELESS_PATHNAMES, SMB_FLAGS2_32BIT_STATUS,
+                    0, 1);
+
+  req->wordcount = 0;
+  req->bytecount = htole_16(len);
+  char *p = req->protos;
+  for(int i = 0; i < num_dialects; i++) {
+    *p++ = 2;
+    strcpy(p, dialects[i]);
+    p += strlen(dialects[i]) + 1;
+  }
+
+  nbt_write(cc, req, tlen);
+
+  if(nbt_read(cc, &rbuf, &len)) {
+    snprintf(errbuf, errlen, "Socket read error during negotiation");
+    return -1;
+  }
+
+  if(len >= sizeof(SMB2_t) && !memcmp(rbuf, "\xfeSMB", 4)) {
+    // Server selected SMB2
+    const SMB2_t *h = rbuf;
+    cc->cc_credits += letoh_16(h->credits);
+    cc->cc_message_id = 1;
+
+    if(smb2_parse_negotiate(cc, rbuf, len, errbuf, errlen))
+      return -1;
+
+    if(cc->cc_dialect == SMB2_DIALECT_WILD &&
+       smb2_negotiate(cc, errbuf, errlen))
+      return -1;
+
+    SMBTRACE("%s:%d Negotiated SMB dialect 0x%04x, max read %d",
+             cc->cc_hostname, cc->cc_port, cc->cc_dialect,
+             cc->cc_max_read_size);
+    return 0;
+  }
+
+  reply = rbuf;
+
+  if(len < sizeof(SMB_NEG_PROTOCOL_reply_t) || reply->wordcount != 17) {
+    snprintf(errbuf, errlen, "Malformed response %d bytes during negotiation",
+	     len);
+    free(rbuf);
+    return -1;
+  }
+
+  if(reply->hdr.errorcode) {
+    snprintf(errbuf, errlen, "Negotiation error 0x%08x",
+	     (int)letoh_32(reply->hdr.errorcode));
+    free(rbuf);
+    return -1;
+  }
+
+  if(letoh_32(reply->capabilities) & SERVER_CAP_UNICODE)
+    cc->cc_unicode = 1;
+  else
+    cc->cc_unicode = 0;
+
+  cc->cc_bpc = cc->cc_unicode + 1;
+
+  if(letoh_32(reply->capabilities) & SERVER_CAP_NT_SMBS)
+    cc->cc_ntsmb = 1;
+  else {
+    snprintf(errbuf, errlen, "Server does not support NTSMB");
+    free(rbuf);
+    return -1;
   }
 
   cc->cc_session_key = reply->session_key;
@@ -597,44 +1403,24 @@ smb_neg_proto(cifs_connection_t *cc, char *errbuf, size_t errlen)
 
 
 /**
+ * Figure out which credentials to use when setting up a session.
  *
+ * Returns 0 if credentials are set, -1 if rejected by user and -2 if we
+ * need to ask the user but are not allowed to (CC_F_NON_INTERACTIVE)
  */
 static int
-smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
-               int flags)
+cifs_get_credentials(cifs_connection_t *cc, int flags, int user_level,
+                     const char *retry_reason, char **usernamep,
+                     char **passwordp, char **domainp,
+                     char *errbuf, size_t errlen)
 {
-  SMB_SETUP_ANDX_req_t *req;
-  SMB_SETUP_ANDX_reply_t *reply;
-
-  char *username = NULL;
-  const char *os = "Unix";
-  const char *lanmgr = APPNAMEUSER;
-
   char *domain = NULL;
 
-
-  size_t ulen = 0;
-  size_t olen = utf8_to_smb(cc, NULL, os);
-  size_t llen = utf8_to_smb(cc, NULL, lanmgr);
-
-  void *rbuf;
-  int rlen;
-
-  const char *retry_reason = NULL;
-  char reason[256];
-
-  uint8_t password[24];
-  int password_len;
-
  again:
-  password[0] = 0;
-  password_len = 1;
   free(domain);
   domain = strdup(cc->cc_domain[0] ? (char *)cc->cc_domain : "WORKGROUP");
-  char *password_cleartext;
 
-  if(cc->cc_security_mode & SECURITY_USER_LEVEL &&
-     !(flags & CC_F_AS_GUEST)) {
+  if(user_level && !(flags & CC_F_AS_GUEST)) {
     char id[256];
     char name[256];
 
@@ -648,7 +1434,7 @@ smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
 
     snprintf(name, sizeof(name), "Samba server '%s'", cc->cc_hostname);
 
-    int r = keyring_lookup(id, &username, &password_cleartext, &domain, NULL,
+    int r = keyring_lookup(id, usernamep, passwordp, &domain, NULL,
 			   name, retry_reason,
 			   (retry_reason ? KEYRING_QUERY_USER : 0) |
 			   KEYRING_SHOW_REMEMBER_ME | KEYRING_REMEMBER_ME_SET);
@@ -673,16 +1459,63 @@ smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
 
   } else if(flags & CC_F_ANONYMOUS) {
     // Anonymous
-    username = NULL;
-    password_cleartext = NULL;
+    *usernamep = NULL;
+    *passwordp = NULL;
     free(domain);
     domain = NULL;
 
   } else {
-    username = strdup("guest");
-    password_cleartext = strdup("");
+    *usernamep = strdup("guest");
+    *passwordp = strdup("");
   }
 
+  *domainp = domain;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
+               int flags)
+{
+  SMB_SETUP_ANDX_req_t *req;
+  SMB_SETUP_ANDX_reply_t *reply;
+
+  char *username = NULL;
+  const char *os = "Unix";
+  const char *lanmgr = APPNAMEUSER;
+
+  char *domain = NULL;
+
+
+  size_t ulen = 0;
+  size_t olen = utf8_to_smb(cc, NULL, os);
+  size_t llen = utf8_to_smb(cc, NULL, lanmgr);
+
+  void *rbuf;
+  int rlen;
+
+  const char *retry_reason = NULL;
+  char reason[256];
+
+  uint8_t password[24];
+  int password_len;
+
+ again:
+  password[0] = 0;
+  password_len = 1;
+  char *password_cleartext;
+
+  int r = cifs_get_credentials(cc, flags,
+                               cc->cc_security_mode & SECURITY_USER_LEVEL,
+                               retry_reason, &username, &password_cleartext,
+                               &domain, errbuf, errlen);
+  if(r)
+    return r;
+
   int password_pad = 0;
 
   if(password_cleartext != NULL) {
@@ -827,6 +1660,168 @@ smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
 }
 
 
+/**
+ *
+ */
+static int
+smb2_session_setup_req(cifs_connection_t *cc, const void *blob, int bloblen,
+                       void **rbufp, int *rlenp)
+{
+  const int tlen = sizeof(SMB2_SESSION_SETUP_req_t) + bloblen;
+  SMB2_SESSION_SETUP_req_t *req = alloca(tlen);
+
+  memset(req, 0, tlen);
+  smb2_init_header(cc, &req->hdr, SMB2_SESSION_SETUP, 0);
+  req->structure_size = htole_16(25);
+  req->security_mode = SMB2_NEGOTIATE_SIGNING_ENABLED;
+  req->security_buffer_offset = htole_16(sizeof(SMB2_SESSION_SETUP_req_t) - 4);
+  req->security_buffer_length = htole_16(bloblen);
+  memcpy(req->buffer, blob, bloblen);
+  return smb2_sync_req(cc, req, tlen, rbufp, rlenp);
+}
+
+
+/**
+ * SMB2 session setup using NTLMv2 (raw NTLMSSP, no SPNEGO wrapping)
+ */
+static int
+smb2_session_setup(cifs_connection_t *cc, char *errbuf, size_t errlen,
+                   int flags)
+{
+  const char *retry_reason = NULL;
+  char reason[256];
+  uint8_t negotiate[32];
+  uint8_t session_key[16];
+  void *rbuf;
+  int rlen;
+
+ again:
+  cc->cc_session_id = 0;
+  cc->cc_signing = 0;
+
+  ntlmssp_negotiate(negotiate);
+
+  if(smb2_session_setup_req(cc, negotiate, sizeof(negotiate), &rbuf, &rlen)) {
+    snprintf(errbuf, errlen, "Socket read error during setup");
+    return -1;
+  }
+
+  const SMB2_SESSION_SETUP_resp_t *reply = rbuf;
+  uint32_t status = letoh_32(reply->hdr.status);
+
+  if(status != STATUS_MORE_PROCESSING_REQUIRED ||
+     rlen < sizeof(SMB2_SESSION_SETUP_resp_t)) {
+    smberr_write(errbuf, errlen, status);
+    free(rbuf);
+    return -1;
+  }
+
+  cc->cc_session_id = letoh_64(reply->hdr.session_id);
+
+  const int chl_off = letoh_16(reply->security_buffer_offset);
+  const int chl_len = letoh_16(reply->security_buffer_length);
+
+  if(chl_off + chl_len > rlen || chl_len < 48) {
+    snprintf(errbuf, errlen, "Malformed NTLMSSP challenge");
+    free(rbuf);
+    return -1;
+  }
+
+  const uint8_t *chl = rbuf + chl_off;
+
+  // Use target name (the domain) from challenge as default domain
+  const int tn_len = rd16_le(chl + 12);
+  const int tn_off = rd32_le(chl + 16);
+  if(tn_len && tn_off + tn_len <= chl_len)
+    ucs2_to_utf8(cc->cc_domain, sizeof(cc->cc_domain),
+                 chl + tn_off, tn_len, 1);
+
+  char *username = NULL;
+  char *password = NULL;
+  char *domain = NULL;
+
+  int r = cifs_get_credentials(cc, flags, 1, retry_reason,
+                               &username, &password, &domain,
+                               errbuf, errlen);
+  if(r) {
+    free(rbuf);
+    return r;
+  }
+
+  SMBTRACE("SETUP %s:%s:%s", username ?: "<anonymous>",
+           password && *password ? "<hidden>" : "<unset>", domain ?: "");
+
+  uint8_t *auth;
+  int authlen = ntlmssp_authenticate(&auth, session_key, chl, chl_len,
+                                     username, password, domain);
+  free(rbuf);
+  free(username);
+  free(password);
+  free(domain);
+
+  if(authlen < 0) {
+    snprintf(errbuf, errlen, "Malformed NTLMSSP challenge");
+    return -1;
+  }
+
+  r = smb2_session_setup_req(cc, auth, authlen, &rbuf, &rlen);
+  free(auth);
+  if(r) {
+    snprintf(errbuf, errlen, "Socket read error during setup");
+    return -1;
+  }
+
+  reply = rbuf;
+  status = letoh_32(reply->hdr.status);
+
+  SMBTRACE("SETUP errorcode=0x%08x", status);
+
+  if(status) {
+    smberr_write(reason, sizeof(reason), status);
+    retry_reason = reason;
+    free(rbuf);
+    if(flags & CC_F_AS_GUEST) {
+      snprintf(errbuf, errlen, "Guest login failed");
+      return -1;
+    }
+    goto again;
+  }
+
+  if(rlen < sizeof(SMB2_SESSION_SETUP_resp_t)) {
+    snprintf(errbuf, errlen, "Malformed response %d bytes during setup",
+             rlen);
+    free(rbuf);
+    return -1;
+  }
+
+  const int session_flags = letoh_16(reply->session_flags);
+  const int guest = !!(session_flags & (SMB2_SESSION_FLAG_IS_GUEST |
+                                        SMB2_SESSION_FLAG_IS_NULL));
+  free(rbuf);
+
+  SMBTRACE("Logged in with session 0x%"PRIx64" guest=%s dialect=0x%04x",
+           cc->cc_session_id, guest ? "yes" : "no", cc->cc_dialect);
+
+  if(guest && !(flags & CC_F_AS_GUEST)) {
+    retry_reason = "Login attempt failed";
+    goto again;
+  }
+
+  if(cc->cc_signing_required && !guest) {
+    if(cc->cc_dialect >= SMB2_DIALECT_0300)
+      smb3_signing_key(cc->cc_signing_key, session_key);
+    else
+      memcpy(cc->cc_signing_key, session_key, 16);
+    cc->cc_signing = 1;
+  }
+
+  if(!(flags & CC_F_ANONYMOUS))
+    usage_event("SMB connect", 1, NULL);
+
+  return 0;
+}
+
+
 /**
  *
  */
@@ -836,8 +1831,110 @@ dump_request_list(cifs_connection_t *cc)
   nbt_req_t *nr;
   SMBTRACE("List of pending reuqests");
   LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link) {
-    SMBTRACE("  Pending request %d", nr->nr_mid);
+    SMBTRACE("  Pending request %"PRId64, nr->nr_mid);
+  }
+}
+
+
+/**
+ * Handle a SMB2 frame, it may contain multiple (compounded) responses
+ */
+static int
+smb2_dispatch(cifs_connection_t *cc, void *buf, int len)
+{
+  int off = 0;
+  int r = 0;
+  nbt_req_t *nr;
+
+  hts_mutex_lock(&cc->cc_mutex);
+
+  while(1) {
+    SMB2_t *h = buf + off;
+
+    if(len - off < sizeof(SMB2_t)) {
+      r = -1;
+      break;
+    }
+
+    const uint32_t next = letoh_32(h->next_command);
+    const int elen = next ? next : len - off;
+
+    if(elen < sizeof(SMB2_t) || elen > len - off) {
+      r = -1;
+      break;
+    }
+
+    const uint64_t mid = letoh_64(h->message_id);
+    const int interim = h->flags & htole_32(SMB2_FLAGS_ASYNC_COMMAND) &&
+      h->status == htole_32(STATUS_PENDING);
+
+    // Oplock breaks (mid -1) and interim responses are never signed
+    if(cc->cc_signing && mid != UINT64_MAX && !interim &&
+       smb2_verify(cc, h, elen)) {
+      TRACE(TRACE_ERROR, "SMB",
+            "%s:%d bad signature on SMB2 response mid=%"PRId64
+            ", dropping connection", cc->cc_hostname, cc->cc_port, mid);
+      r = -2;
+      break;
+    }
+
+    // Only trust the credit grant once the signature has been checked
+    cc->cc_credits += letoh_16(h->credits);
+
+    if(h->command == htole_16(SMB2_ECHO))
+      cc->cc_wait_for_ping = 0;
+
+    if(interim) {
+      // Interim response, real one will follow later
+      goto next;
+    }
+
+    LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link)
+      if(nr->nr_mid == mid && nr->nr_result == -1)
+        break;
+
+    if(nr == NULL) {
+      SMBTRACE("%s:%d unexpected SMB2 response mid=%"PRId64" on %p",
+               cc->cc_hostname, cc->cc_port, mid, cc);
+      dump_request_list(cc);
+      goto next;
+    }
+
+    SMBTRACE("%s:%d Got response for mid=%"PRId64" (err:0x%08x len:%d)",
+             cc->cc_hostname, cc->cc_port, mid,
+             (int)letoh_32(h->status), elen);
+
+    if(nr->nr_discard) {
+      LIST_REMOVE(nr, nr_link);
+      free(nr);
+      goto next;
+    }
+
+    if(off == 0 && next == 0) {
+      // Common case, hand over buffer as is
+      nr->nr_response = buf;
+      buf = NULL;
+    } else {
+      nr->nr_response = malloc(elen);
+      memcpy(nr->nr_response, h, elen);
+    }
+    nr->nr_response_len = elen;
+    nr->nr_result = 0;
+
+  next:
+    if(next == 0)
+      break;
+    off += next;
   }
+
+  hts_cond_broadcast(&cc->cc_req_cond);
+  hts_mutex_unlock(&cc->cc_mutex);
+  free(buf);
+
+  if(r == -1)
+    TRACE(TRACE_ERROR, "SMB", "%s:%d malformed SMB2 packet",
+          cc->cc_hostname, cc->cc_port);
+  return r;
 }
 
 
@@ -861,6 +1958,12 @@ smb_dispatch(void *aux)
     if(nbt_read(cc, &buf, &len))
       break;
 
+    if(len >= 4 && !memcmp(buf, "\xfeSMB", 4)) {
+      if(smb2_dispatch(cc, buf, len))
+        break;
+      continue;
+    }
+
     if(len < sizeof(SMB_t)) {
       TRACE(TRACE_ERROR, "SMB", "%s:%d malformed packet smbhdrlen %d",
 	    cc->cc_hostname, cc->cc_port, len);
@@ -883,7 +1986,7 @@ smb_dispatch(void *aux)
       continue;
     }
 
-    hts_mutex_lock(&smb_global_mutex);
+    hts_mutex_lock(&cc->cc_mutex);
 
     LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link)
       if(nr->nr_mid == mid)
@@ -937,8 +2040,8 @@ smb_dispatch(void *aux)
             free(nr->nr_response);
             nr->nr_response = NULL;
             nr->nr_response_len = 0;
-            hts_cond_broadcast(&cc->cc_cond);
-            hts_mutex_unlock(&smb_global_mutex);
+            hts_cond_broadcast(&cc->cc_req_cond);
+            hts_mutex_unlock(&cc->cc_mutex);
             continue;
           }
 
@@ -964,7 +2067,7 @@ smb_dispatch(void *aux)
         }
 
         if(nr->nr_data_count < total_count) {
-          hts_mutex_unlock(&smb_global_mutex);
+          hts_mutex_unlock(&cc->cc_mutex);
           continue; // Not complete yet
         }
 
@@ -974,7 +2077,7 @@ smb_dispatch(void *aux)
       }
 
       nr->nr_result = 0;
-      hts_cond_broadcast(&cc->cc_cond);
+      hts_cond_broadcast(&cc->cc_req_cond);
 
     } else {
       SMBTRACE("%s:%d unexpected response pid=%d mid=%d on %p",
@@ -983,18 +2086,30 @@ smb_dispatch(void *aux)
 
       free(buf);
     }
-    hts_mutex_unlock(&smb_global_mutex);
+    hts_mutex_unlock(&cc->cc_mutex);
   }
 
-  hts_mutex_lock(&smb_global_mutex);
+  hts_mutex_lock(&cc->cc_mutex);
 
-  LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link) {
-    nr->nr_result = 1;
-    free(nr->nr_response);
+  cc->cc_dead = 1;
+
+  nbt_req_t *next;
+  for(nr = LIST_FIRST(&cc->cc_pending_nbt_requests); nr != NULL; nr = next) {
+    next = LIST_NEXT(nr, nr_link);
+    if(nr->nr_discard) {
+      LIST_REMOVE(nr, nr_link);
+      free(nr);
+      continue;
+    }
+    if(nr->nr_result == -1) {
+      nr->nr_result = 1;
+      free(nr->nr_response);
+      nr->nr_response = NULL;
+    }
   }
 
-  hts_cond_broadcast(&cc->cc_cond);
-  hts_mutex_unlock(&smb_global_mutex);
+  hts_cond_broadcast(&cc->cc_req_cond);
+  hts_mutex_unlock(&cc->cc_mutex);
   return NULL;
 }
 
@@ -1076,6 +2191,8 @@ cifs_get_connection(const char *hostname, int port,
     cc->cc_flags = flags;
 
     hts_cond_init(&cc->cc_cond, &smb_global_mutex);
+    hts_mutex_init(&cc->cc_mutex);
+    hts_cond_init(&cc->cc_req_cond, &cc->cc_mutex);
 
     LIST_INSERT_HEAD(&cifs_connections, cc, cc_link);
     hts_mutex_unlock(&smb_global_mutex);
@@ -1098,7 +2215,11 @@ cifs_get_connection(const char *hostname, int port,
 	SMBTRACE("%s:%d Protocol negotiated", hostname, port);
 
 	int r;
-	r = smb_setup_andX(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf), flags);
+	if(cc->cc_dialect)
+	  r = smb2_session_setup(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf),
+				 flags);
+	else
+	  r = smb_setup_andX(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf), flags);
 
 	if(r) {
 	  if(r == -2) {
@@ -1140,53 +2261,84 @@ cifs_get_connection(const char *hostname, int port,
 
 
 /**
- *
+ * Send request. cc_mutex must be held
  */
 static nbt_req_t *
-nbt_async_req(cifs_connection_t *cc, void *request, int request_len,
-              int is_trans2, const char *info)
+nbt_async_req_locked(cifs_connection_t *cc, void *request, int request_len,
+                     int is_trans2, int payload, const char *info)
 {
+  nbt_req_t *nr;
+
+  if(cc->cc_dialect) {
+    smb2_send_compound_locked(cc, 1, &request, &request_len, &payload, 0,
+                              &nr, info);
+    return nr;
+  }
+
   SMB_t *h = request + 4;
-  nbt_req_t *nr = calloc(1, sizeof(nbt_req_t));
+  nr = calloc(1, sizeof(nbt_req_t));
   nr->nr_result = -1;
   nr->nr_mid = cc->cc_mid_generator++;
   nr->nr_is_trans2 = is_trans2;
   h->pid = htole_16(2);
   h->mid = htole_16(nr->nr_mid);
-  nbt_write(cc, request, request_len);
 
   LIST_INSERT_HEAD(&cc->cc_pending_nbt_requests, nr, nr_link);
+
+  if(cc->cc_dead)
+    nr->nr_result = 1;
+  else
+    nbt_write_locked(cc, request, request_len);
+
   SMBTRACE("%s:%d %s sent mid=%d on thread %lx", cc->cc_hostname, cc->cc_port,
-           info, nr->nr_mid, (long)hts_thread_current());
+           info, (int)nr->nr_mid, (long)hts_thread_current());
   return nr;
 }
 
 
 /**
- *
+ * Wait for reply. cc_mutex must be held. Returns -1 on timeout
  */
 static int
-nbt_async_req_reply_ex(cifs_connection_t *cc,
-                       void *request, int request_len,
-                       void **responsep, int *response_lenp,
-                       int is_trans2, const char *info)
+nbt_wait_locked(cifs_connection_t *cc, nbt_req_t *nr)
 {
-  nbt_req_t *nr = nbt_async_req(cc, request, request_len, is_trans2, info);
-
   while(nr->nr_result == -1) {
-    if(hts_cond_wait_timeout(&cc->cc_cond, &smb_global_mutex, NBT_TIMEOUT)) {
-      TRACE(TRACE_ERROR, "SMB", "%s:%d request timeout (%d) on %p",
-	    cc->cc_hostname, cc->cc_port, nr->nr_mid, cc);
-
+    if(hts_cond_wait_timeout(&cc->cc_req_cond, &cc->cc_mutex, NBT_TIMEOUT)) {
+      TRACE(TRACE_ERROR, "SMB", "%s:%d request timeout (%"PRId64") on %p",
+            cc->cc_hostname, cc->cc_port, nr->nr_mid, cc);
 
       dump_request_list(cc);
-
-      cc->cc_broken = 1;
-      break;
+      return -1;
     }
   }
+  return 0;
+}
+
+
+/**
+ * Send request and wait for reply. smb_global_mutex must be held
+ * but it's released while waiting
+ */
+static int
+nbt_async_req_reply_ex(cifs_connection_t *cc,
+                       void *request, int request_len,
+                       void **responsep, int *response_lenp,
+                       int is_trans2, int payload, const char *info)
+{
+  hts_mutex_unlock(&smb_global_mutex);
+  hts_mutex_lock(&cc->cc_mutex);
+
+  nbt_req_t *nr = nbt_async_req_locked(cc, request, request_len, is_trans2,
+                                       payload, info);
+  const int timeout = nbt_wait_locked(cc, nr);
   LIST_REMOVE(nr, nr_link);
 
+  hts_mutex_unlock(&cc->cc_mutex);
+  hts_mutex_lock(&smb_global_mutex);
+
+  if(timeout)
+    cc->cc_broken = 1;
+
   int r = nr->nr_result;
   *responsep = nr->nr_response;
   *response_lenp = nr->nr_response_len;
@@ -1196,7 +2348,60 @@ nbt_async_req_reply_ex(cifs_connection_t *cc,
 }
 
 #define nbt_async_req_reply(a, b, c, d, e, f) \
-  nbt_async_req_reply_ex(a, b, c, d, e, f, __FUNCTION__)
+  nbt_async_req_reply_ex(a, b, c, d, e, f, 0, __FUNCTION__)
+
+#define smb2_req_reply(a, b, c, d, e, payload) \
+  nbt_async_req_reply_ex(a, b, c, d, e, 0, payload, __FUNCTION__)
+
+
+/**
+ * Send compound SMB2 request and wait for all replies. smb_global_mutex
+ * must be held but it's released while waiting.
+ *
+ * If anything fails all responses are freed and -1 is returned
+ */
+static int
+smb2_compound_reply(cifs_connection_t *cc, int count, void **reqs,
+                    const int *lens, void **rbufs, int *rlens,
+                    const char *info)
+{
+  nbt_req_t *nrs[SMB2_MAX_COMPOUND];
+  int timeout = 0;
+  int r = 0;
+
+  assert(count <= SMB2_MAX_COMPOUND);
+
+  hts_mutex_unlock(&smb_global_mutex);
+  hts_mutex_lock(&cc->cc_mutex);
+
+  smb2_send_compound_locked(cc, count, reqs, lens, NULL, 1, nrs, info);
+
+  for(int i = 0; i < count; i++) {
+    nbt_req_t *nr = nrs[i];
+    if(!timeout && nbt_wait_locked(cc, nr))
+      timeout = 1;
+    LIST_REMOVE(nr, nr_link);
+    if(nr->nr_result)
+      r = -1;
+    rbufs[i] = nr->nr_response;
+    rlens[i] = nr->nr_response_len;
+    free(nr);
+  }
+
+  hts_mutex_unlock(&cc->cc_mutex);
+  hts_mutex_lock(&smb_global_mutex);
+
+  if(timeout)
+    cc->cc_broken = 1;
+
+  if(r) {
+    for(int i = 0; i < count; i++) {
+      free(rbufs[i]);
+      rbufs[i] = NULL;
+    }
+  }
+  return r;
+}
 
 
 /**
@@ -1249,12 +2454,72 @@ cifs_disconnect(cifs_connection_t *cc)
  *
  */
 static cifs_tree_t *
-smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
-		      char *errbuf, size_t errlen)
+smb2_tree_connect(cifs_connection_t *cc, const char *share)
 {
-  SMB_TREE_CONNECT_ANDX_req_t *req;
-  SMB_TREE_CONNECT_ANDX_reply_t *reply;
-  char resource[256];
+  char path[256];
+  void *rbuf;
+  int rlen;
+
+  snprintf(path, sizeof(path), "\\\\%s\\%s", cc->cc_hostname, share);
+
+  const int plen = utf8_to_ucs2(NULL, path, 1);
+  const int tlen = sizeof(SMB2_TREE_CONNECT_req_t) + plen;
+  SMB2_TREE_CONNECT_req_t *req = alloca(tlen);
+
+  memset(req, 0, tlen);
+  smb2_init_header(cc, &req->hdr, SMB2_TREE_CONNECT, 0);
+  req->structure_size = htole_16(9);
+  req->path_offset = htole_16(sizeof(SMB2_TREE_CONNECT_req_t) - 4);
+  req->path_length = htole_16(plen - 2);
+  utf8_to_ucs2(req->buffer, path, 1);
+
+  cifs_tree_t *ct = calloc(1, sizeof(cifs_tree_t));
+  ct->ct_cc = cc;
+  LIST_INSERT_HEAD(&cc->cc_trees, ct, ct_link);
+  ct->ct_share = strdup(share);
+  ct->ct_refcount = 1;
+  hts_cond_init(&ct->ct_cond, &smb_global_mutex);
+  ct->ct_status = CT_CONNECTING;
+
+  if(smb2_req_reply(cc, req, tlen, &rbuf, &rlen, 0)) {
+    ct->ct_status = CT_ERROR;
+    snprintf(ct->ct_errbuf, sizeof(ct->ct_errbuf), "Connection lost");
+  } else {
+    const SMB2_TREE_CONNECT_resp_t *reply = rbuf;
+    uint32_t err = letoh_32(reply->hdr.status);
+    SMBTRACE("Tree connect errorcode:0x%08x (%s)", err, share);
+
+    if(err != 0) {
+      ct->ct_status = CT_ERROR;
+      smberr_write(ct->ct_errbuf, sizeof(ct->ct_errbuf), err);
+    } else if(rlen < sizeof(SMB2_TREE_CONNECT_resp_t)) {
+      ct->ct_status = CT_ERROR;
+      snprintf(ct->ct_errbuf, sizeof(ct->ct_errbuf), "Short packet");
+    } else if(letoh_32(reply->share_flags) & SMB2_SHAREFLAG_ENCRYPT_DATA) {
+      ct->ct_status = CT_ERROR;
+      snprintf(ct->ct_errbuf, sizeof(ct->ct_errbuf),
+               "Share requires encryption which is not supported");
+    } else {
+      ct->ct_tid = letoh_32(reply->hdr.tree_id);
+      ct->ct_status = CT_RUNNING;
+    }
+  }
+  free(rbuf);
+  hts_cond_broadcast(&ct->ct_cond);
+  return ct;
+}
+
+
+/**
+ *
+ */
+static cifs_tree_t *
+smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
+		      char *errbuf, size_t errlen)
+{
+  SMB_TREE_CONNECT_ANDX_req_t *req;
+  SMB_TREE_CONNECT_ANDX_reply_t *reply;
+  char resource[256];
   const char *service = "?????";
   uint8_t password[24];
   void *rbuf;
@@ -1278,7 +2543,10 @@ smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
   } else {
     ct = NULL;
   }
-  if(ct == NULL) {
+
+  if(ct == NULL && cc->cc_dialect) {
+    ct = smb2_tree_connect(cc, share);
+  } else if(ct == NULL) {
 
     int password_len;
 
@@ -1824,112 +3092,777 @@ parse_enum_shares(const uint8_t *data, int len, cifs_connection_t *cc,
 }
 
 /**
- *
+ *
+ */
+static int
+dcerpc_enum_shares(cifs_tree_t *ct, int fid, char *errbuf, size_t errlen,
+                   fa_dir_t *fd)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  const char *servername = cc->cc_hostname;
+
+  int servernamechars = strlen(servername) + 1;
+  int snlen = utf8_to_smb(cc, NULL, servername);
+  snlen = (snlen + 3) & ~3;
+  int arglen = 16 + snlen + 32;
+  int tlen = sizeof(DCERPC_enum_shares_req_t) + arglen;
+  DCERPC_enum_shares_req_t *req = alloca(tlen);
+  TRANS_req_t *treq = &req->h.trans;
+
+  memset(req, 0, tlen);
+
+  smbv1_init_header(cc, &treq->hdr, SMB_TRANSACTION,
+                    SMB_FLAGS_CANONICAL_PATHNAMES |
+                    SMB_FLAGS_CASELESS_PATHNAMES, 0, ct->ct_tid, 1);
+
+  int frag_len = arglen + 24;
+
+  treq->wordcount = 16;
+  treq->total_data_count = htole_16(frag_len);
+  treq->max_data_count = htole_16(cc->cc_max_buffer_size);
+  treq->param_offset = htole_16(84);
+  treq->data_count = htole_16(frag_len);
+  treq->data_offset = htole_16(84);
+  treq->setup_count = 2;
+
+  req->h.function = htole_16(0x26); // TransactNmPipe
+  req->h.fid = fid;
+  req->h.byte_count = htole_16(frag_len + 17);
+  memcpy(req->h.name, "\\\000P\000I\000P\000E\x00\\\000\000", 14);
+
+  req->h.rpc.major_version = 5;
+  req->h.rpc.type = 0x0; // Request
+  req->h.rpc.flags = 0x3;
+  req->h.rpc.data_representation = htole_32(0x10);
+  req->h.rpc.frag_length = htole_16(frag_len);
+  req->h.rpc.callid = htole_32(2);
+
+  req->alloc_hint = htole_32(68);
+  req->context_id = 0;
+  req->opnum = htole_16(15); // NetShareEnumAll
+
+  uint8_t *p = req->payload;
+
+  wr32_le(p + 0, 0x20000);
+  wr32_le(p + 4, servernamechars);
+  wr32_le(p + 12, servernamechars);
+  p += 16;
+  utf8_to_smb(cc, p, servername);
+  p += snlen;
+  memcpy(p, enumargs, 32);
+
+  void *rbuf;
+  int rlen;
+
+  if(nbt_async_req_reply(ct->ct_cc, req, tlen, &rbuf, &rlen, 0)) {
+    snprintf(errbuf, errlen, "I/O error");
+    return -1;
+  }
+
+  if(rlen <  sizeof(TRANS_reply_t)) {
+    snprintf(errbuf, errlen, "Short packet");
+    goto bad;
+  }
+
+  const TRANS_reply_t *treply = rbuf;
+  int data_offset = letoh_16(treply->data_offset);
+  int data_len = rlen - data_offset;
+  if(data_len < sizeof(DCERPC_enum_shares_reply_t)) {
+    snprintf(errbuf, errlen, "Short enumshare reply");
+    goto bad;
+  }
+
+  const DCERPC_enum_shares_reply_t *reply = rbuf + data_offset;
+
+  if(reply->hdr.flags != 3) {
+    snprintf(errbuf, errlen, "Fragmented enumshare replies not supported");
+    goto bad;
+  }
+
+
+  parse_enum_shares(reply->payload,
+                    data_len - sizeof(DCERPC_enum_shares_reply_t), cc, fd);
+
+  free(rbuf);
+  close_srvsvc(ct, fid),
+  cifs_release_tree(ct, 0);
+  return 0;
+
+
+ bad:
+  free(rbuf);
+  close_srvsvc(ct, fid),
+  cifs_release_tree(ct, 0);
+  return -1;
+}
+
+
+
+/**
+ *
+ */
+static int
+check_smb2_error(cifs_tree_t *ct, void *rbuf, size_t rlen, size_t runt_lim,
+                 char *errbuf, size_t errlen)
+{
+  const SMB2_t *h = rbuf;
+  uint32_t errcode = letoh_32(h->status);
+
+  if(errcode) {
+    snprintf(errbuf, errlen, "SMB Error 0x%08x", errcode);
+    SMBTRACE("Error: 0x%08x", errcode);
+    free(rbuf);
+    cifs_release_tree(ct, 0);
+    return -1;
+  }
+
+  if(rlen < runt_lim) {
+    snprintf(errbuf, errlen, "Short packet");
+    free(rbuf);
+    cifs_release_tree(ct, 1);
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Build a SMB2 CREATE request. 'filename' is relative to share root
+ * and backslashified
+ */
+static void *
+smb2_create_req(cifs_tree_t *ct, const char *filename, uint32_t access,
+                uint32_t options, int *lenp)
+{
+  char *fname = mystrdupa(filename);
+  int l = strlen(fname);
+  while(l > 0 && fname[l - 1] == '\\')
+    fname[--l] = 0;
+
+  const int plen = utf8_to_ucs2(NULL, fname, 1);
+  const int tlen = sizeof(SMB2_CREATE_req_t) + plen;
+  SMB2_CREATE_req_t *req = calloc(1, tlen);
+
+  smb2_init_header(ct->ct_cc, &req->hdr, SMB2_CREATE, ct->ct_tid);
+  req->structure_size = htole_16(57);
+  req->impersonation_level = htole_32(2);
+  req->desired_access = htole_32(access);
+  req->share_access = htole_32(7);       // Read | Write | Delete
+  req->create_disposition = htole_32(1); // FILE_OPEN
+  req->create_options = htole_32(options);
+  req->name_offset = htole_16(sizeof(SMB2_CREATE_req_t) - 4);
+  req->name_length = htole_16(plen - 2);
+  utf8_to_ucs2(req->buffer, fname, 1);
+  *lenp = tlen;
+  return req;
+}
+
+
+/**
+ * If 'file_id' is NULL the request operates on the file opened earlier
+ * in the same compound
+ */
+static void
+smb2_set_file_id(uint8_t *dst, const uint8_t *file_id)
+{
+  if(file_id != NULL)
+    memcpy(dst, file_id, SMB2_FILE_ID_SIZE);
+  else
+    memset(dst, 0xff, SMB2_FILE_ID_SIZE);
+}
+
+
+/**
+ *
+ */
+static void *
+smb2_close_req(cifs_tree_t *ct, const uint8_t *file_id, int *lenp)
+{
+  SMB2_CLOSE_req_t *req = calloc(1, sizeof(SMB2_CLOSE_req_t));
+  smb2_init_header(ct->ct_cc, &req->hdr, SMB2_CLOSE, ct->ct_tid);
+  req->structure_size = htole_16(24);
+  smb2_set_file_id(req->file_id, file_id);
+  *lenp = sizeof(SMB2_CLOSE_req_t);
+  return req;
+}
+
+
+/**
+ *
+ */
+static void *
+smb2_query_directory_req(cifs_tree_t *ct, const uint8_t *file_id, int flags,
+                         int *lenp)
+{
+  const int tlen = sizeof(SMB2_QUERY_DIRECTORY_req_t) + 2;
+  SMB2_QUERY_DIRECTORY_req_t *req = calloc(1, tlen);
+  smb2_init_header(ct->ct_cc, &req->hdr, SMB2_QUERY_DIRECTORY, ct->ct_tid);
+  req->structure_size = htole_16(33);
+  req->file_information_class = SMB2_FILE_DIRECTORY_INFORMATION;
+  req->flags = flags;
+  smb2_set_file_id(req->file_id, file_id);
+  req->file_name_offset = htole_16(sizeof(SMB2_QUERY_DIRECTORY_req_t) - 4);
+  req->file_name_length = htole_16(2);
+  req->output_buffer_length = htole_32(65536);
+  req->buffer[0] = '*';
+  *lenp = tlen;
+  return req;
+}
+
+
+/**
+ *
+ */
+static void *
+smb2_ioctl_req(cifs_tree_t *ct, const uint8_t *file_id,
+               const void *data, int len, int *lenp)
+{
+  const int tlen = sizeof(SMB2_IOCTL_req_t) + len;
+  SMB2_IOCTL_req_t *req = calloc(1, tlen);
+  smb2_init_header(ct->ct_cc, &req->hdr, SMB2_IOCTL, ct->ct_tid);
+  req->structure_size = htole_16(57);
+  req->ctl_code = htole_32(FSCTL_PIPE_TRANSCEIVE);
+  smb2_set_file_id(req->file_id, file_id);
+  req->input_offset = htole_32(sizeof(SMB2_IOCTL_req_t) - 4);
+  req->input_count = htole_32(len);
+  req->max_output_response = htole_32(65536);
+  req->flags = htole_32(SMB2_0_IOCTL_IS_FSCTL);
+  memcpy(req->buffer, data, len);
+  *lenp = tlen;
+  return req;
+}
+
+
+/**
+ * Close file without waiting for the reply
+ */
+static void
+smb2_close_async(cifs_tree_t *ct, const uint8_t *file_id)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  SMB2_CLOSE_req_t *req = alloca(sizeof(SMB2_CLOSE_req_t));
+  int len = sizeof(SMB2_CLOSE_req_t);
+  nbt_req_t *nr;
+
+  memset(req, 0, sizeof(SMB2_CLOSE_req_t));
+  smb2_init_header(cc, &req->hdr, SMB2_CLOSE, ct->ct_tid);
+  req->structure_size = htole_16(24);
+  smb2_set_file_id(req->file_id, file_id);
+
+  hts_mutex_lock(&cc->cc_mutex);
+  smb2_send_compound_locked(cc, 1, (void **)&req, &len, NULL, 0, &nr, "close");
+  nbt_discard_locked(nr);
+  hts_mutex_unlock(&cc->cc_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+smb2_free_requests(void **reqs, int count)
+{
+  for(int i = 0; i < count; i++)
+    free(reqs[i]);
+}
+
+
+/**
+ * Enumerate shares using DCE/RPC over the srvsvc pipe on IPC$
+ */
+static int
+smb2_enum_shares(cifs_tree_t *ct, fa_dir_t *fd, char *errbuf, size_t errlen)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  void *reqs[2];
+  int lens[2];
+  void *rbufs[2];
+  int rlens[2];
+  uint8_t file_id[SMB2_FILE_ID_SIZE];
+
+  // Open pipe and bind in one round trip
+
+  uint8_t bind[28 + sizeof(bind_args)];
+  DCERPC_hdr_t *rpc = (DCERPC_hdr_t *)bind;
+  memset(bind, 0, sizeof(bind));
+  rpc->major_version = 5;
+  rpc->type = 0xb; // Bind
+  rpc->flags = 0x3;
+  rpc->data_representation = htole_32(0x10);
+  rpc->frag_length = htole_16(sizeof(bind));
+  rpc->callid = htole_32(1);
+  wr16_le(bind + 16, 65535); // Max xmit frag
+  wr16_le(bind + 18, 65535); // Max recv frag
+  bind[24] = 1;             // Number of context items
+  memcpy(bind + 28, bind_args, sizeof(bind_args));
+
+  reqs[0] = smb2_create_req(ct, "srvsvc", 0x0012019f, 0, &lens[0]);
+  reqs[1] = smb2_ioctl_req(ct, NULL, bind, sizeof(bind), &lens[1]);
+
+  int r = smb2_compound_reply(cc, 2, reqs, lens, rbufs, rlens, "srvsvc");
+  smb2_free_requests(reqs, 2);
+
+  if(r)
+    return release_tree_io_error(ct, errbuf, errlen);
+
+  if(check_smb2_error(ct, rbufs[0], rlens[0], sizeof(SMB2_CREATE_resp_t),
+                      errbuf, errlen)) {
+    free(rbufs[1]);
+    return -1;
+  }
+
+  const SMB2_CREATE_resp_t *cresp = rbufs[0];
+  memcpy(file_id, cresp->file_id, SMB2_FILE_ID_SIZE);
+  free(rbufs[0]);
+
+  const SMB2_t *h = rbufs[1];
+  if(h->status) {
+    snprintf(errbuf, errlen, "DCE/RPC bind failed 0x%08x",
+             (int)letoh_32(h->status));
+    free(rbufs[1]);
+    goto bad;
+  }
+  free(rbufs[1]);
+
+  // NetShareEnumAll
+
+  const char *servername = cc->cc_hostname;
+  int servernamechars = strlen(servername) + 1;
+  int snlen = utf8_to_smb(cc, NULL, servername);
+  snlen = (snlen + 3) & ~3;
+  int arglen = 16 + snlen + 32;
+  int frag_len = arglen + 24;
+  uint8_t *pdu = alloca(frag_len);
+
+  memset(pdu, 0, frag_len);
+  rpc = (DCERPC_hdr_t *)pdu;
+  rpc->major_version = 5;
+  rpc->type = 0x0; // Request
+  rpc->flags = 0x3;
+  rpc->data_representation = htole_32(0x10);
+  rpc->frag_length = htole_16(frag_len);
+  rpc->callid = htole_32(2);
+  wr32_le(pdu + 16, 68);  // Alloc hint
+  wr16_le(pdu + 22, 15);  // NetShareEnumAll
+
+  uint8_t *p = pdu + 24;
+  wr32_le(p + 0, 0x20000);
+  wr32_le(p + 4, servernamechars);
+  wr32_le(p + 12, servernamechars);
+  p += 16;
+  utf8_to_smb(cc, p, servername);
+  p += snlen;
+  memcpy(p, enumargs, 32);
+
+  void *req;
+  int len;
+  void *rbuf;
+  int rlen;
+
+  req = smb2_ioctl_req(ct, file_id, pdu, frag_len, &len);
+  r = smb2_req_reply(cc, req, len, &rbuf, &rlen, 65536);
+  free(req);
+
+  if(r) {
+    snprintf(errbuf, errlen, "I/O error");
+    goto bad;
+  }
+
+  const SMB2_IOCTL_resp_t *iresp = rbuf;
+  if(iresp->hdr.status == htole_32(STATUS_BUFFER_OVERFLOW)) {
+    snprintf(errbuf, errlen, "Fragmented enumshare replies not supported");
+    free(rbuf);
+    goto bad;
+  }
+
+  if(iresp->hdr.status || rlen < sizeof(SMB2_IOCTL_resp_t)) {
+    snprintf(errbuf, errlen, "Enumshare failed 0x%08x",
+             (int)letoh_32(iresp->hdr.status));
+    free(rbuf);
+    goto bad;
+  }
+
+  const int data_offset = letoh_32(iresp->output_offset);
+  const int data_len = letoh_32(iresp->output_count);
+
+  if(data_offset + data_len > rlen ||
+     data_len < sizeof(DCERPC_enum_shares_reply_t)) {
+    snprintf(errbuf, errlen, "Short enumshare reply");
+    free(rbuf);
+    goto bad;
+  }
+
+  const DCERPC_enum_shares_reply_t *reply = rbuf + data_offset;
+
+  if(reply->hdr.flags != 3) {
+    snprintf(errbuf, errlen, "Fragmented enumshare replies not supported");
+    free(rbuf);
+    goto bad;
+  }
+
+  parse_enum_shares(reply->payload,
+                    data_len - sizeof(DCERPC_enum_shares_reply_t), cc, fd);
+  free(rbuf);
+  smb2_close_async(ct, file_id);
+  cifs_release_tree(ct, 0);
+  return 0;
+
+ bad:
+  smb2_close_async(ct, file_id);
+  cifs_release_tree(ct, 0);
+  return -1;
+}
+
+
+/**
+ *
+ */
+static int
+smb2_delete(cifs_tree_t *ct, const char *filename, int dir,
+            char *errbuf, size_t errlen)
+{
+  void *reqs[2];
+  int lens[2];
+  void *rbufs[2];
+  int rlens[2];
+
+  reqs[0] = smb2_create_req(ct, filename, 0x00010000, // DELETE
+                            SMB2_FILE_DELETE_ON_CLOSE |
+                            (dir ? SMB2_FILE_DIRECTORY_FILE :
+                             SMB2_FILE_NON_DIRECTORY_FILE), &lens[0]);
+  reqs[1] = smb2_close_req(ct, NULL, &lens[1]);
+
+  int r = smb2_compound_reply(ct->ct_cc, 2, reqs, lens, rbufs, rlens,
+                              "delete");
+  smb2_free_requests(reqs, 2);
+
+  if(r)
+    return release_tree_io_error(ct, errbuf, errlen);
+
+  if(check_smb2_error(ct, rbufs[0], rlens[0], sizeof(SMB2_t),
+                      errbuf, errlen)) {
+    free(rbufs[1]);
+    return -1;
+  }
+  free(rbufs[0]);
+
+  // Deletion happens on close so we need to check for errors there too
+  if(check_smb2_error(ct, rbufs[1], rlens[1], sizeof(SMB2_t),
+                      errbuf, errlen))
+    return -1;
+  free(rbufs[1]);
+  cifs_release_tree(ct, 0);
+  return 0;
+}
+
+
+/**
+ * Stat using a compounded CREATE + CLOSE, everything we need is
+ * returned in the CREATE response
+ */
+static int
+smb2_stat(cifs_tree_t *ct, const char *filename, fa_stat_t *fs,
+          char *errbuf, size_t errlen)
+{
+  void *reqs[2];
+  int lens[2];
+  void *rbufs[2];
+  int rlens[2];
+  char *fname = mystrdupa(filename);
+  backslashify(fname);
+
+  reqs[0] = smb2_create_req(ct, fname, 0x00000080, // FILE_READ_ATTRIBUTES
+                            0, &lens[0]);
+  reqs[1] = smb2_close_req(ct, NULL, &lens[1]);
+
+  int r = smb2_compound_reply(ct->ct_cc, 2, reqs, lens, rbufs, rlens, "stat");
+  smb2_free_requests(reqs, 2);
+
+  if(r)
+    return release_tree_io_error(ct, errbuf, errlen);
+
+  free(rbufs[1]);
+
+  if(check_smb2_error(ct, rbufs[0], rlens[0], sizeof(SMB2_CREATE_resp_t),
+                      errbuf, errlen))
+    return -1;
+
+  const SMB2_CREATE_resp_t *resp = rbufs[0];
+
+  fs->fs_mtime = parsetime(resp->change_time);
+  if(letoh_32(resp->file_attributes) & 0x10) {
+    fs->fs_type = CONTENT_DIR;
+    fs->fs_size = 0;
+  } else {
+    fs->fs_type = CONTENT_FILE;
+    fs->fs_size = letoh_64(resp->end_of_file);
+  }
+  free(rbufs[0]);
+  return 0;
+}
+
+
+/**
+ * Returns 1 when there are no more entries, -1 on error
+ */
+static int
+smb2_scandir_parse(const void *rbuf, int rlen, fa_dir_t *fd,
+                   char *url, char *urlbase, size_t urlspace)
+{
+  const SMB2_QUERY_DIRECTORY_resp_t *resp = rbuf;
+  const uint32_t status = letoh_32(resp->hdr.status);
+  char fname[512];
+  fa_dir_entry_t *fde;
+
+  if(status == STATUS_NO_MORE_FILES || status == STATUS_NO_SUCH_FILE)
+    return 1;
+
+  if(status || rlen < sizeof(SMB2_QUERY_DIRECTORY_resp_t))
+    return -1;
+
+  unsigned int off = letoh_16(resp->output_buffer_offset);
+  const unsigned int end = off + letoh_32(resp->output_buffer_length);
+
+  if(end > rlen)
+    return -1;
+
+  while(off + sizeof(SMB2_FILE_DIRECTORY_INFO_t) <= end) {
+    const SMB2_FILE_DIRECTORY_INFO_t *fdi = rbuf + off;
+    const unsigned int namelen = letoh_32(fdi->file_name_length);
+
+    if(off + sizeof(SMB2_FILE_DIRECTORY_INFO_t) + namelen > end)
+      return -1;
+
+    ucs2_to_utf8((uint8_t *)fname, sizeof(fname), fdi->file_name, namelen, 1);
+
+    if(strcmp(fname, ".") && strcmp(fname, "..")) {
+      snprintf(urlbase, urlspace, "%s", fname);
+
+      int isdir = letoh_32(fdi->file_attributes) & 0x10;
+
+      fde = fa_dir_add(fd, url, fname, isdir ? CONTENT_DIR : CONTENT_FILE);
+      if(fde != NULL) {
+        fde->fde_stat.fs_size = letoh_64(fdi->end_of_file);
+        fde->fde_stat.fs_mtime = parsetime(fdi->change_time);
+        fde->fde_statdone = 1;
+      }
+    }
+
+    const unsigned int neo = letoh_32(fdi->next_entry_offset);
+    if(neo == 0)
+      break;
+    off += neo;
+  }
+  return 0;
+}
+
+
+/**
+ * Open directory and ask for the first two batches of entries in one
+ * compound request. Most directories are complete after this single
+ * round trip
  */
 static int
-dcerpc_enum_shares(cifs_tree_t *ct, int fid, char *errbuf, size_t errlen,
-                   fa_dir_t *fd)
+smb2_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
+             char *url, char *urlbase, size_t urlspace,
+             char *errbuf, size_t errlen)
 {
   cifs_connection_t *cc = ct->ct_cc;
-  const char *servername = cc->cc_hostname;
-
-  int servernamechars = strlen(servername) + 1;
-  int snlen = utf8_to_smb(cc, NULL, servername);
-  snlen = (snlen + 3) & ~3;
-  int arglen = 16 + snlen + 32;
-  int tlen = sizeof(DCERPC_enum_shares_req_t) + arglen;
-  DCERPC_enum_shares_req_t *req = alloca(tlen);
-  TRANS_req_t *treq = &req->h.trans;
+  void *reqs[3];
+  int lens[3];
+  void *rbufs[3];
+  int rlens[3];
+  uint8_t file_id[SMB2_FILE_ID_SIZE];
+  char *dname = mystrdupa(path);
+  int eod = 0;
+
+  backslashify(dname);
+
+  reqs[0] = smb2_create_req(ct, dname,
+                            0x00100081, // LIST_DIRECTORY|READ_ATTR|SYNC
+                            SMB2_FILE_DIRECTORY_FILE, &lens[0]);
+  reqs[1] = smb2_query_directory_req(ct, NULL, SMB2_RESTART_SCANS, &lens[1]);
+  reqs[2] = smb2_query_directory_req(ct, NULL, 0, &lens[2]);
+
+  int r = smb2_compound_reply(cc, 3, reqs, lens, rbufs, rlens, "scandir");
+  smb2_free_requests(reqs, 3);
+
+  if(r)
+    return release_tree_io_error(ct, errbuf, errlen);
+
+  if(check_smb2_error(ct, rbufs[0], rlens[0], sizeof(SMB2_CREATE_resp_t),
+                      errbuf, errlen)) {
+    free(rbufs[1]);
+    free(rbufs[2]);
+    return -1;
+  }
 
-  memset(req, 0, tlen);
+  const SMB2_CREATE_resp_t *cresp = rbufs[0];
+  memcpy(file_id, cresp->file_id, SMB2_FILE_ID_SIZE);
+  free(rbufs[0]);
 
-  smbv1_init_header(cc, &treq->hdr, SMB_TRANSACTION,
-                    SMB_FLAGS_CANONICAL_PATHNAMES |
-                    SMB_FLAGS_CASELESS_PATHNAMES, 0, ct->ct_tid, 1);
+  for(int i = 1; i < 3; i++) {
+    if(!eod)
+      eod = smb2_scandir_parse(rbufs[i], rlens[i], fd,
+                               url, urlbase, urlspace);
+    free(rbufs[i]);
+  }
 
-  int frag_len = arglen + 24;
+  while(!eod) {
+    void *req = smb2_query_directory_req(ct, file_id, 0, &lens[0]);
+    r = smb2_req_reply(cc, req, lens[0], &rbufs[0], &rlens[0], 65536);
+    free(req);
+    if(r)
+      return release_tree_io_error(ct, errbuf, errlen);
 
-  treq->wordcount = 16;
-  treq->total_data_count = htole_16(frag_len);
-  treq->max_data_count = htole_16(cc->cc_max_buffer_size);
-  treq->param_offset = htole_16(84);
-  treq->data_count = htole_16(frag_len);
-  treq->data_offset = htole_16(84);
-  treq->setup_count = 2;
+    eod = smb2_scandir_parse(rbufs[0], rlens[0], fd, url, urlbase, urlspace);
+    free(rbufs[0]);
+  }
 
-  req->h.function = htole_16(0x26); // TransactNmPipe
-  req->h.fid = fid;
-  req->h.byte_count = htole_16(frag_len + 17);
-  memcpy(req->h.name, "\\\000P\000I\000P\000E\x00\\\000\000", 14);
+  smb2_close_async(ct, file_id);
 
-  req->h.rpc.major_version = 5;
-  req->h.rpc.type = 0x0; // Request
-  req->h.rpc.flags = 0x3;
-  req->h.rpc.data_representation = htole_32(0x10);
-  req->h.rpc.frag_length = htole_16(frag_len);
-  req->h.rpc.callid = htole_32(2);
+  if(eod < 0)
+    return release_tree_protocol_error(ct, errbuf, errlen);
+  return 0;
+}
 
-  req->alloc_hint = htole_32(68);
-  req->context_id = 0;
-  req->opnum = htole_16(15); // NetShareEnumAll
 
-  uint8_t *p = req->payload;
+/**
+ *
+ */
+static fa_err_code_t
+smb2_set_xattr(cifs_tree_t *ct, const char *filename, const char *name,
+               const void *data, size_t data_len)
+{
+  void *reqs[3];
+  int lens[3];
+  void *rbufs[3];
+  int rlens[3];
+  const int name_len = strlen(name);
+  const int dlen = sizeof(SMB2_FULL_EA_INFO_t) + name_len + 1 + data_len;
+  const int tlen = sizeof(SMB2_SET_INFO_req_t) + dlen;
+  SMB2_SET_INFO_req_t *req = calloc(1, tlen);
+
+  smb2_init_header(ct->ct_cc, &req->hdr, SMB2_SET_INFO, ct->ct_tid);
+  req->structure_size = htole_16(33);
+  req->info_type = SMB2_0_INFO_FILE;
+  req->file_info_class = SMB2_FILE_FULL_EA_INFORMATION;
+  req->buffer_length = htole_32(dlen);
+  req->buffer_offset = htole_16(sizeof(SMB2_SET_INFO_req_t) - 4);
+  smb2_set_file_id(req->file_id, NULL);
+
+  SMB2_FULL_EA_INFO_t *ea = (void *)req->buffer;
+  ea->name_len = name_len;
+  ea->value_len = htole_16(data_len);
+  memcpy(ea->data, name, name_len + 1);
+  if(data != NULL)
+    memcpy(ea->data + name_len + 1, data, data_len);
 
-  wr32_le(p + 0, 0x20000);
-  wr32_le(p + 4, servernamechars);
-  wr32_le(p + 12, servernamechars);
-  p += 16;
-  utf8_to_smb(cc, p, servername);
-  p += snlen;
-  memcpy(p, enumargs, 32);
+  reqs[0] = smb2_create_req(ct, filename, 0x00000010, // FILE_WRITE_EA
+                            0, &lens[0]);
+  reqs[1] = req;
+  lens[1] = tlen;
+  reqs[2] = smb2_close_req(ct, NULL, &lens[2]);
 
-  void *rbuf;
-  int rlen;
+  int r = smb2_compound_reply(ct->ct_cc, 3, reqs, lens, rbufs, rlens,
+                              "setxattr");
+  smb2_free_requests(reqs, 3);
 
-  if(nbt_async_req_reply(ct->ct_cc, req, tlen, &rbuf, &rlen, 0)) {
-    snprintf(errbuf, errlen, "I/O error");
-    return -1;
-  }
+  if(r)
+    return release_tree_io_error(ct, NULL, 0);
 
-  if(rlen <  sizeof(TRANS_reply_t)) {
-    snprintf(errbuf, errlen, "Short packet");
-    goto bad;
-  }
+  const SMB2_t *h0 = rbufs[0];
+  const SMB2_t *h1 = rbufs[1];
+  uint32_t errcode = letoh_32(h0->status ?: h1->status);
+  smb2_free_requests(rbufs, 3);
+  cifs_release_tree(ct, 0);
 
-  const TRANS_reply_t *treply = rbuf;
-  int data_offset = letoh_16(treply->data_offset);
-  int data_len = rlen - data_offset;
-  if(data_len < sizeof(DCERPC_enum_shares_reply_t)) {
-    snprintf(errbuf, errlen, "Short enumshare reply");
-    goto bad;
+  switch(errcode) {
+  case 0:
+    return FAP_OK;
+  case STATUS_ACCESS_DENIED:
+    return FAP_PERMISSION_DENIED;
+  case STATUS_EAS_NOT_SUPPORTED:
+  case STATUS_NOT_SUPPORTED:
+    return FAP_NOT_SUPPORTED;
+  default:
+    return FAP_ERROR;
   }
+}
 
-  const DCERPC_enum_shares_reply_t *reply = rbuf + data_offset;
-
-  if(reply->hdr.flags != 3) {
-    snprintf(errbuf, errlen, "Fragmented enumshare replies not supported");
-    goto bad;
-  }
 
+/**
+ *
+ */
+static fa_err_code_t
+smb2_get_xattr(cifs_tree_t *ct, const char *filename, const char *name,
+               void **datap, size_t *lenp)
+{
+  void *reqs[3];
+  int lens[3];
+  void *rbufs[3];
+  int rlens[3];
+  const int name_len = strlen(name);
+  const int ilen = sizeof(SMB2_GET_EA_INFO_t) + name_len + 1;
+  const int tlen = sizeof(SMB2_QUERY_INFO_req_t) + ilen;
+  SMB2_QUERY_INFO_req_t *req = calloc(1, tlen);
+
+  smb2_init_header(ct->ct_cc, &req->hdr, SMB2_QUERY_INFO, ct->ct_tid);
+  req->structure_size = htole_16(41);
+  req->info_type = SMB2_0_INFO_FILE;
+  req->file_info_class = SMB2_FILE_FULL_EA_INFORMATION;
+  req->output_buffer_length = htole_32(65536);
+  req->input_buffer_offset = htole_16(sizeof(SMB2_QUERY_INFO_req_t) - 4);
+  req->input_buffer_length = htole_32(ilen);
+  smb2_set_file_id(req->file_id, NULL);
+
+  SMB2_GET_EA_INFO_t *gea = (void *)req->buffer;
+  gea->name_len = name_len;
+  memcpy(gea->data, name, name_len + 1);
+
+  reqs[0] = smb2_create_req(ct, filename, 0x00000008, // FILE_READ_EA
+                            0, &lens[0]);
+  reqs[1] = req;
+  lens[1] = tlen;
+  reqs[2] = smb2_close_req(ct, NULL, &lens[2]);
+
+  int r = smb2_compound_reply(ct->ct_cc, 3, reqs, lens, rbufs, rlens,
+                              "getxattr");
+  smb2_free_requests(reqs, 3);
+
+  if(r)
+    return release_tree_io_error(ct, NULL, 0);
 
-  parse_enum_shares(reply->payload,
-                    data_len - sizeof(DCERPC_enum_shares_reply_t), cc, fd);
+  const SMB2_QUERY_INFO_resp_t *resp = rbufs[1];
+  int retcode = FAP_ERROR;
 
-  free(rbuf);
-  close_srvsvc(ct, fid),
-  cifs_release_tree(ct, 0);
-  return 0;
+  if(resp->hdr.status == 0 && rlens[1] >= sizeof(SMB2_QUERY_INFO_resp_t)) {
+    const int offset = letoh_16(resp->output_buffer_offset);
+    const int len = letoh_32(resp->output_buffer_length);
 
+    if(len >= sizeof(SMB2_FULL_EA_INFO_t) && offset + len <= rlens[1]) {
+      const SMB2_FULL_EA_INFO_t *ea = rbufs[1] + offset;
+      const int dlen = letoh_16(ea->value_len);
 
- bad:
-  free(rbuf);
-  close_srvsvc(ct, fid),
+      if(sizeof(SMB2_FULL_EA_INFO_t) + ea->name_len + 1 + dlen <= len) {
+        retcode = FAP_OK;
+        if(dlen > 0) {
+          *datap = malloc(dlen);
+          memcpy(*datap, ea->data + ea->name_len + 1, dlen);
+          *lenp = dlen;
+        } else {
+          *datap = NULL;
+          *lenp = 0;
+        }
+      }
+    }
+  }
+  smb2_free_requests(rbufs, 3);
   cifs_release_tree(ct, 0);
-  return -1;
+  return retcode;
 }
 
 
-
 /**
  *
  */
@@ -1943,6 +3876,9 @@ cifs_enum_shares(cifs_connection_t *cc, fa_dir_t *fd,
   if(ct == NULL)
     return -1;
 
+  if(cc->cc_dialect)
+    return smb2_enum_shares(ct, fd, errbuf, errlen);
+
   int fid = open_srvsvc(ct, errbuf, errlen);
   if(fid < 0)
     return -1;
@@ -1974,6 +3910,9 @@ cifs_delete(const char *url, char *errbuf, size_t errlen, int dir)
   backslashify(filename);
   cc = ct->ct_cc;
 
+  if(cc->cc_dialect)
+    return smb2_delete(ct, filename, dir, errbuf, errlen);
+
   int plen = utf8_to_smb(cc, NULL, filename);
   int tlen;
   void *reqbuf;
@@ -2025,6 +3964,9 @@ static int
 cifs_stat(cifs_tree_t *ct, const char *filename, fa_stat_t *fs,
 	  char *errbuf, size_t errlen)
 {
+  if(ct->ct_cc->cc_dialect)
+    return smb2_stat(ct, filename, fs, errbuf, errlen);
+
   char *fname = mystrdupa(filename);
   backslashify(fname);
   int plen = utf8_to_smb(ct->ct_cc, NULL, fname);
@@ -2114,6 +4056,9 @@ cifs_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
   urlbase = url + strlen(url);
   urlspace = sizeof(url) - strlen(url);
 
+  if(ct->ct_cc->cc_dialect)
+    return smb2_scandir(ct, path, fd, url, urlbase, urlspace, errbuf, errlen);
+
   while(1) {
 
     memset(req, 0, tlen);
@@ -2236,9 +4181,197 @@ typedef struct smb_file {
   uint16_t sf_fid;
   uint64_t sf_pos;
   uint64_t sf_file_size;
+
+  // SMB2
+
+  uint8_t sf_file_id[SMB2_FILE_ID_SIZE];
+  int64_t sf_read_end;   // Position where last read ended
+  int sf_num_reads;
+  nbt_req_t *sf_reads[SMB2_MAX_READS];  // Reads in flight, in file order
 } smb_file_t;
 
 
+/**
+ *
+ */
+static fa_handle_t *
+smb2_open(fa_protocol_t *fap, cifs_tree_t *ct, const char *filename,
+          char *errbuf, size_t errlen)
+{
+  void *rbuf;
+  int rlen;
+  int len;
+  void *req = smb2_create_req(ct, filename,
+                              0x00120089, // READ_DATA|READ_EA|READ_ATTR|...
+                              SMB2_FILE_NON_DIRECTORY_FILE, &len);
+
+  int r = smb2_req_reply(ct->ct_cc, req, len, &rbuf, &rlen, 0);
+  free(req);
+
+  if(r) {
+    snprintf(errbuf, errlen, "I/O error");
+    cifs_release_tree(ct, 1);
+    return NULL;
+  }
+
+  if(check_smb2_error(ct, rbuf, rlen, sizeof(SMB2_CREATE_resp_t),
+                      errbuf, errlen))
+    return NULL;
+
+  hts_mutex_unlock(&smb_global_mutex);
+
+  const SMB2_CREATE_resp_t *resp = rbuf;
+  smb_file_t *sf = calloc(1, sizeof(smb_file_t));
+  sf->sf_ct = ct;
+  memcpy(sf->sf_file_id, resp->file_id, SMB2_FILE_ID_SIZE);
+  sf->sf_file_size = letoh_64(resp->end_of_file);
+  sf->sf_read_end = -1;
+  sf->h.fh_proto = fap;
+  free(rbuf);
+  return &sf->h;
+}
+
+
+/**
+ * Drop all reads in flight. cc_mutex must be held
+ */
+static void
+smb2_read_abandon_locked(smb_file_t *sf)
+{
+  for(int i = 0; i < sf->sf_num_reads; i++)
+    nbt_discard_locked(sf->sf_reads[i]);
+  sf->sf_num_reads = 0;
+}
+
+
+/**
+ * Make sure reads covering 'want' bytes from current position are in
+ * flight. If access is sequential we also keep up to
+ * SMB2_READAHEAD_SIZE bytes of read-ahead going as long as we don't
+ * eat up the last credits. cc_mutex must be held
+ */
+static void
+smb2_read_issue_locked(smb_file_t *sf, size_t want, int sequential)
+{
+  cifs_tree_t *ct = sf->sf_ct;
+  cifs_connection_t *cc = ct->ct_cc;
+  uint64_t next = sf->sf_pos;
+
+  if(sf->sf_num_reads > 0) {
+    const nbt_req_t *last = sf->sf_reads[sf->sf_num_reads - 1];
+    next = last->nr_pos + last->nr_cnt;
+  }
+
+  while(sf->sf_num_reads < SMB2_MAX_READS && next < sf->sf_file_size) {
+    const uint64_t covered = next - sf->sf_pos;
+    const int cnt = MIN(cc->cc_max_read_size, sf->sf_file_size - next);
+
+    if(covered >= want) {
+      if(!sequential || covered >= want + SMB2_READAHEAD_SIZE)
+        break;
+      if(cc->cc_credits <= smb2_credit_charge(cc, cnt))
+        break;
+    }
+
+    SMB2_READ_req_t *req = alloca(sizeof(SMB2_READ_req_t));
+    int len = sizeof(SMB2_READ_req_t);
+    nbt_req_t *nr;
+
+    memset(req, 0, sizeof(SMB2_READ_req_t));
+    smb2_init_header(cc, &req->hdr, SMB2_READ, ct->ct_tid);
+    req->structure_size = htole_16(49);
+    req->length = htole_32(cnt);
+    req->offset = htole_64(next);
+    memcpy(req->file_id, sf->sf_file_id, SMB2_FILE_ID_SIZE);
+
+    smb2_send_compound_locked(cc, 1, (void **)&req, &len, &cnt, 0, &nr,
+                              "read");
+    nr->nr_pos = next;
+    nr->nr_cnt = cnt;
+    sf->sf_reads[sf->sf_num_reads++] = nr;
+    next += cnt;
+  }
+}
+
+
+/**
+ * Read using multiple outstanding SMB2 reads of up to cc_max_read_size
+ * each. Data not consumed is kept around for the next read
+ */
+static int
+smb2_read(smb_file_t *sf, void *buf, size_t size)
+{
+  cifs_connection_t *cc = sf->sf_ct->ct_cc;
+  const int sequential = sf->sf_read_end == sf->sf_pos;
+  size_t total = 0;
+  nbt_req_t *nr;
+
+  hts_mutex_lock(&cc->cc_mutex);
+
+  while(total < size) {
+
+    if(sf->sf_num_reads > 0) {
+      nr = sf->sf_reads[0];
+      if(nr->nr_pos + nr->nr_offset != sf->sf_pos)
+        smb2_read_abandon_locked(sf); // We've seeked
+    }
+
+    smb2_read_issue_locked(sf, size - total, sequential);
+
+    if(sf->sf_num_reads == 0)
+      break; // EOF
+
+    nr = sf->sf_reads[0];
+    if(nbt_wait_locked(cc, nr)) {
+      cc->cc_broken = 1;
+      goto fail;
+    }
+
+    if(nr->nr_result)
+      goto fail;
+
+    const SMB2_READ_resp_t *resp = nr->nr_response;
+    const uint32_t status = letoh_32(resp->hdr.status);
+    int dlen = 0;
+
+    if(status != STATUS_END_OF_FILE) {
+      if(status || nr->nr_response_len < sizeof(SMB2_READ_resp_t))
+        goto fail;
+
+      const int doff = resp->data_offset;
+      dlen = letoh_32(resp->data_length);
+      if(doff + dlen > nr->nr_response_len || dlen > nr->nr_cnt)
+        goto fail;
+
+      const int copy = MIN(dlen - nr->nr_offset, size - total);
+      memcpy(buf + total, nr->nr_response + doff + nr->nr_offset, copy);
+      nr->nr_offset += copy;
+      sf->sf_pos += copy;
+      total += copy;
+      if(nr->nr_offset < dlen)
+        continue; // Keep rest of this chunk
+    }
+
+    sf->sf_num_reads--;
+    memmove(sf->sf_reads, sf->sf_reads + 1,
+            sf->sf_num_reads * sizeof(nbt_req_t *));
+    const int short_read = dlen < nr->nr_cnt;
+    nbt_discard_locked(nr);
+
+    if(short_read)
+      break;
+  }
+  sf->sf_read_end = sf->sf_pos;
+  hts_mutex_unlock(&cc->cc_mutex);
+  return total;
+
+ fail:
+  smb2_read_abandon_locked(sf);
+  hts_mutex_unlock(&cc->cc_mutex);
+  return -1;
+}
+
+
 
 /**
  *
@@ -2262,6 +4395,9 @@ smb_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
 
   backslashify(filename);
 
+  if(cc->cc_dialect)
+    return smb2_open(fap, ct, filename, errbuf, errlen);
+
   int plen = utf8_to_smb(cc, NULL, filename);
   int tlen = sizeof(SMB_NTCREATE_ANDX_req_t) + plen + cc->cc_unicode;
 
@@ -2323,6 +4459,16 @@ smb_close(fa_handle_t *fh)
 
   hts_mutex_lock(&smb_global_mutex);
 
+  if(ct->ct_cc->cc_dialect) {
+    hts_mutex_lock(&ct->ct_cc->cc_mutex);
+    smb2_read_abandon_locked(sf);
+    hts_mutex_unlock(&ct->ct_cc->cc_mutex);
+    smb2_close_async(ct, sf->sf_file_id);
+    cifs_release_tree(sf->sf_ct, 0);
+    free(sf);
+    return;
+  }
+
   req = alloca(sizeof(SMB_CLOSE_req_t));
   memset(req, 0, sizeof(SMB_CLOSE_req_t));
 
@@ -2361,12 +4507,15 @@ smb_read(fa_handle_t *fh, void *buf, size_t size)
   if(size == 0)
     return 0;
 
+  if(ct->ct_cc->cc_dialect)
+    return smb2_read(sf, buf, size);
+
   LIST_INIT(&reqs);
 
   req = alloca(sizeof(SMB_READ_ANDX_req_t));
   memset(req, 0, sizeof(SMB_READ_ANDX_req_t));
 
-  hts_mutex_lock(&smb_global_mutex);
+  hts_mutex_lock(&ct->ct_cc->cc_mutex);
 
   while(size > 0) {
     cnt = MIN(size, 57344); // 14 * 4096 is max according to spec
@@ -2382,8 +4531,8 @@ smb_read(fa_handle_t *fh, void *buf, size_t size)
     req->wordcount = 12;
     req->andx_command = 0xff;
 
-    nr = nbt_async_req(ct->ct_cc, req, sizeof(SMB_READ_ANDX_req_t), 0,
-                       "read");
+    nr = nbt_async_req_locked(ct->ct_cc, req, sizeof(SMB_READ_ANDX_req_t), 0,
+                              0, "read");
     LIST_INSERT_HEAD(&reqs, nr, nr_multi_link);
 
     nr->nr_offset = total;
@@ -2400,7 +4549,7 @@ smb_read(fa_handle_t *fh, void *buf, size_t size)
 	break;
 
     if(nr != NULL) {
-      if(hts_cond_wait_timeout(&ct->ct_cc->cc_cond, &smb_global_mutex,
+      if(hts_cond_wait_timeout(&ct->ct_cc->cc_req_cond, &ct->ct_cc->cc_mutex,
                                NBT_TIMEOUT)) {
 	break;
       }
@@ -2437,7 +4586,7 @@ smb_read(fa_handle_t *fh, void *buf, size_t size)
     }
     free(nr);
   }
-  hts_mutex_unlock(&smb_global_mutex);
+  hts_mutex_unlock(&ct->ct_cc->cc_mutex);
   return total;
 
  fail:
@@ -2448,7 +4597,7 @@ smb_read(fa_handle_t *fh, void *buf, size_t size)
     free(nr->nr_response);
     free(nr);
   }
-  hts_mutex_unlock(&smb_global_mutex);
+  hts_mutex_unlock(&ct->ct_cc->cc_mutex);
   return -1;
 
 }
@@ -2589,6 +4738,9 @@ smb_set_xattr(struct fa_protocol *fap, const char *url,
 
   backslashify(filename);
 
+  if(ct->ct_cc->cc_dialect)
+    return smb2_set_xattr(ct, filename, name, data, data_len);
+
   int plen = utf8_to_smb(ct->ct_cc, NULL, filename);
   int dlen = sizeof(eahdr_t) + name_len + 1 + data_len;
   int tlen = sizeof(SMB_TRANS2_PATH_QUERY_req_t) + plen + dlen;
@@ -2662,6 +4814,10 @@ smb_get_xattr(struct fa_protocol *fap, const char *url,
     return -1;
 
   backslashify(filename);
+
+  if(ct->ct_cc->cc_dialect)
+    return smb2_get_xattr(ct, filename, name, datap, lenp);
+
   int plen = utf8_to_smb(ct->ct_cc, NULL, filename);
   int dlen = sizeof(get_eahdr_t) + name_len + 1;
   int tlen = sizeof(SMB_TRANS2_PATH_QUERY_req_t) + plen + dlen;
@@ -2733,15 +4889,36 @@ cifs_periodic(struct callout *c, void *opaque)
 
   hts_mutex_lock(&smb_global_mutex);
 
-  smbv1_init_header(cc, &req->hdr, SMB_ECHO, 0, 0, 0, 1);
-  req->wordcount = 1;
-  req->echo_count = htole_16(1);
-  req->byte_count = htole_16(2);
-  req->data[0] = 0x13;
-  req->data[1] = 0x37;
+  if(cc->cc_dialect) {
+    SMB2_ECHO_req_t *req2 = alloca(sizeof(SMB2_ECHO_req_t));
+    int len = sizeof(SMB2_ECHO_req_t);
+    nbt_req_t *nr;
+
+    memset(req2, 0, sizeof(SMB2_ECHO_req_t));
+    smb2_init_header(cc, &req2->hdr, SMB2_ECHO, 0);
+    req2->structure_size = htole_16(4);
+
+    // Don't block the global lock waiting for credits, if we're out
+    // of them there are requests in flight that will time out anyway
+    hts_mutex_lock(&cc->cc_mutex);
+    if(cc->cc_credits > 0) {
+      smb2_send_compound_locked(cc, 1, (void **)&req2, &len, NULL, 0, &nr,
+                                "echo");
+      nbt_discard_locked(nr);
+    }
+    hts_mutex_unlock(&cc->cc_mutex);
 
-  req->hdr.pid = htole_16(3); // PING
-  nbt_write(cc, req, sizeof(EchoRequest_t) + 2);
+  } else {
+    smbv1_init_header(cc, &req->hdr, SMB_ECHO, 0, 0, 0, 1);
+    req->wordcount = 1;
+    req->echo_count = htole_16(1);
+    req->byte_count = htole_16(2);
+    req->data[0] = 0x13;
+    req->data[1] = 0x37;
+
+    req->hdr.pid = htole_16(3); // PING
+    nbt_write(cc, req, sizeof(EchoRequest_t) + 2);
+  }
 
   if(cc->cc_wait_for_ping) {
     cc->cc_broken = 1;
@@ -2898,6 +5075,93 @@ smb_enum_servers(const char *hostname)
 }
 
 
+#ifdef SMB_BENCHMARK
+
+#define SMB_BENCHMARK_READ_SIZE (1024 * 1024)
+#define SMB_BENCHMARK_MAX_BYTES (1024LL * 1024 * 1024)
+#define SMB_BENCHMARK_SCANDIR_ROUNDS 10
+
+static fa_protocol_t fa_protocol_smb;
+
+/**
+ * Measure sequential read throughput of the file given by
+ * $SMB_BENCHMARK_URL and the latency of listing its parent directory.
+ * Set $SMB_BENCHMARK_SMB1 to compare with the SMBv1 code path
+ */
+static void *
+smb_benchmark(void *aux)
+{
+  const char *url = getenv("SMB_BENCHMARK_URL");
+  char errbuf[256];
+  int64_t ts;
+
+  if(url == NULL)
+    return NULL;
+
+  ts = arch_get_ts();
+  fa_handle_t *fh = smb_open(&fa_protocol_smb, url, errbuf, sizeof(errbuf),
+                             FA_NON_INTERACTIVE, NULL);
+  if(fh == NULL) {
+    TRACE(TRACE_ERROR, "SMB", "Benchmark: Unable to open %s -- %s",
+          url, errbuf);
+    return NULL;
+  }
+  const int64_t open_time = arch_get_ts() - ts;
+  const int dialect = ((smb_file_t *)fh)->sf_ct->ct_cc->cc_dialect;
+
+  void *buf = malloc(SMB_BENCHMARK_READ_SIZE);
+  int64_t total = 0;
+
+  ts = arch_get_ts();
+  while(total < SMB_BENCHMARK_MAX_BYTES) {
+    int r = smb_read(fh, buf, SMB_BENCHMARK_READ_SIZE);
+    if(r <= 0)
+      break;
+    total += r;
+  }
+  const int64_t read_time = MAX(arch_get_ts() - ts, 1);
+  smb_close(fh);
+  free(buf);
+
+  TRACE(TRACE_INFO, "SMB",
+        "Benchmark: dialect 0x%04x open %d ms, "
+        "read %"PRId64" bytes in %d ms, %.1f MB/s",
+        dialect, (int)(open_time / 1000), total, (int)(read_time / 1000),
+        (double)total / read_time);
+
+  char *dir = mystrdupa(url);
+  char *p = strrchr(dir, '/');
+  if(p != NULL)
+    *p = 0;
+
+  int64_t sum = 0, best = INT64_MAX;
+  int rounds, entries = 0;
+  for(rounds = 0; rounds < SMB_BENCHMARK_SCANDIR_ROUNDS; rounds++) {
+    fa_dir_t *fd = fa_dir_alloc();
+    ts = arch_get_ts();
+    int r = smb_scandir(&fa_protocol_smb, fd, dir, errbuf, sizeof(errbuf),
+                        FA_NON_INTERACTIVE);
+    ts = arch_get_ts() - ts;
+    entries = fd->fd_count;
+    fa_dir_free(fd);
+    if(r) {
+      TRACE(TRACE_ERROR, "SMB", "Benchmark: Unable to scan %s -- %s",
+            dir, errbuf);
+      break;
+    }
+    sum += ts;
+    best = MIN(best, ts);
+  }
+
+  if(rounds > 0)
+    TRACE(TRACE_INFO, "SMB",
+          "Benchmark: scandir %s (%d entries) avg %.2f ms, best %.2f ms",
+          dir, entries, sum / 1000.0 / rounds, best / 1000.0);
+  return NULL;
+}
+#endif
+
+
 /**
  *
  */
@@ -2905,6 +5169,10 @@ static void
 smb_init(void)
 {
   hts_mutex_init(&smb_global_mutex);
+#ifdef SMB_BENCHMARK
+  hts_thread_create_detached("smbbenchmark", smb_benchmark, NULL,
+                             THREAD_PRIO_FILESYSTEM);
+#endif
 }
 
 
@@ -0,0 +1,391 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+#include "nbt.h"
+
+// https://msdn.microsoft.com/en-us/library/cc246482.aspx
+
+#define SMB2_NEGOTIATE        0x0000
+#define SMB2_SESSION_SETUP    0x0001
+#define SMB2_TREE_CONNECT     0x0003
+#define SMB2_CREATE           0x0005
+#define SMB2_CLOSE            0x0006
+#define SMB2_READ             0x0008
+#define SMB2_IOCTL            0x000b
+#define SMB2_ECHO             0x000d
+#define SMB2_QUERY_DIRECTORY  0x000e
+#define SMB2_QUERY_INFO       0x0010
+#define SMB2_SET_INFO         0x0011
+
+#define SMB2_FLAGS_SERVER_TO_REDIR    0x00000001
+#define SMB2_FLAGS_ASYNC_COMMAND      0x00000002
+#define SMB2_FLAGS_RELATED_OPERATIONS 0x00000004
+#define SMB2_FLAGS_SIGNED             0x00000008
+
+#define SMB2_NEGOTIATE_SIGNING_ENABLED  0x0001
+#define SMB2_NEGOTIATE_SIGNING_REQUIRED 0x0002
+
+#define SMB2_GLOBAL_CAP_LARGE_MTU     0x00000004
+
+#define SMB2_SESSION_FLAG_IS_GUEST    0x0001
+#define SMB2_SESSION_FLAG_IS_NULL     0x0002
+
+#define SMB2_SHAREFLAG_ENCRYPT_DATA   0x00008000
+
+#define SMB2_DIALECT_0202 0x0202
+#define SMB2_DIALECT_0210 0x0210
+#define SMB2_DIALECT_0300 0x0300
+#define SMB2_DIALECT_0302 0x0302
+#define SMB2_DIALECT_WILD 0x02ff
+
+#define STATUS_PENDING                  0x00000103
+#define STATUS_MORE_PROCESSING_REQUIRED 0xc0000016
+#define STATUS_NO_MORE_FILES            0x80000006
+#define STATUS_NO_SUCH_FILE             0xc000000f
+#define STATUS_BUFFER_OVERFLOW          0x80000005
+#define STATUS_END_OF_FILE              0xc0000011
+#define STATUS_NOT_SUPPORTED            0xc00000bb
+#define STATUS_EAS_NOT_SUPPORTED        0xc000004f
+#define STATUS_ACCESS_DENIED            0xc0000022
+#define STATUS_LOGON_FAILURE            0xc000006d
+
+#define SMB2_FILE_ID_SIZE 16
+
+/**
+ * SMB2 Header (64 bytes)
+ */
+typedef struct {
+  uint8_t protocol_id[4];
+  uint16_t structure_size;
+  uint16_t credit_charge;
+  uint32_t status;
+  uint16_t command;
+  uint16_t credits;
+  uint32_t flags;
+  uint32_t next_command;
+  uint64_t message_id;
+  uint32_t process_id;
+  uint32_t tree_id;
+  uint64_t session_id;
+  uint8_t signature[16];
+} __attribute__((packed)) SMB2_t;
+
+
+typedef struct {
+  NBT_t nbt;
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t dialect_count;
+  uint16_t security_mode;
+  uint16_t reserved;
+  uint32_t capabilities;
+  uint8_t client_guid[16];
+  uint64_t client_start_time;
+  uint16_t dialects[0];
+} __attribute__((packed)) SMB2_NEGOTIATE_req_t;
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t security_mode;
+  uint16_t dialect;
+  uint16_t negotiate_context_count;
+  uint8_t server_guid[16];
+  uint32_t capabilities;
+  uint32_t max_transact_size;
+  uint32_t max_read_size;
+  uint32_t max_write_size;
+  uint64_t system_time;
+  uint64_t server_start_time;
+  uint16_t security_buffer_offset;
+  uint16_t security_buffer_length;
+  uint32_t negotiate_context_offset;
+} __attribute__((packed)) SMB2_NEGOTIATE_resp_t;
+
+
+typedef struct {
+  NBT_t nbt;
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint8_t flags;
+  uint8_t security_mode;
+  uint32_t capabilities;
+  uint32_t channel;
+  uint16_t security_buffer_offset;
+  uint16_t security_buffer_length;
+  uint64_t previous_session_id;
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_SESSION_SETUP_req_t;
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t session_flags;
+  uint16_t security_buffer_offset;
+  uint16_t security_buffer_length;
+} __attribute__((packed)) SMB2_SESSION_SETUP_resp_t;
+
+
+typedef struct {
+  NBT_t nbt;
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t reserved;
+  uint16_t path_offset;
+  uint16_t path_length;
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_TREE_CONNECT_req_t;
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint8_t share_type;
+  uint8_t reserved;
+  uint32_t share_flags;
+  uint32_t capabilities;
+  uint32_t maximal_access;
+} __attribute__((packed)) SMB2_TREE_CONNECT_resp_t;
+
+
+typedef struct {
+  NBT_t nbt;
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint8_t security_flags;
+  uint8_t requested_oplock_level;
+  uint32_t impersonation_level;
+  uint64_t smb_create_flags;
+  uint64_t reserved;
+  uint32_t desired_access;
+  uint32_t file_attributes;
+  uint32_t share_access;
+  uint32_t create_disposition;
+  uint32_t create_options;
+  uint16_t name_offset;
+  uint16_t name_length;
+  uint32_t create_contexts_offset;
+  uint32_t create_contexts_length;
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_CREATE_req_t;
+
+#define SMB2_FILE_DIRECTORY_FILE     0x00000001
+#define SMB2_FILE_NON_DIRECTORY_FILE 0x00000040
+#define SMB2_FILE_DELETE_ON_CLOSE    0x00001000
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint8_t oplock_level;
+  uint8_t flags;
+  uint32_t create_action;
+  uint64_t creation_time;
+  uint64_t last_access_time;
+  uint64_t last_write_time;
+  uint64_t change_time;
+  uint64_t allocation_size;
+  uint64_t end_of_file;
+  uint32_t file_attributes;
+  uint32_t reserved2;
+  uint8_t file_id[SMB2_FILE_ID_SIZE];
+  uint32_t create_contexts_offset;
+  uint32_t create_contexts_length;
+} __attribute__((packed)) SMB2_CREATE_resp_t;
+
+
+typedef struct {
+  NBT_t nbt;
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t flags;
+  uint32_t reserved;
+  uint8_t file_id[SMB2_FILE_ID_SIZE];
+} __attribute__((packed)) SMB2_CLOSE_req_t;
+
+
+typedef struct {
+  NBT_t nbt;
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint8_t padding;
+  uint8_t flags;
+  uint32_t length;
+  uint64_t offset;
+  uint8_t file_id[SMB2_FILE_ID_SIZE];
+  uint32_t minimum_count;
+  uint32_t channel;
+  uint32_t remaining_bytes;
+  uint16_t read_channel_info_offset;
+  uint16_t read_channel_info_length;
+  uint8_t buffer[1];
+} __attribute__((packed)) SMB2_READ_req_t;
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint8_t data_offset;
+  uint8_t reserved;
+  uint32_t data_length;
+  uint32_t data_remaining;
+  uint32_t reserved2;
+} __attribute__((packed)) SMB2_READ_resp_t;
+
+
+typedef struct {
+  NBT_t nbt;
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t reserved;
+  uint32_t ctl_code;
+  uint8_t file_id[SMB2_FILE_ID_SIZE];
+  uint32_t input_offset;
+  uint32_t input_count;
+  uint32_t max_input_response;
+  uint32_t output_offset;
+  uint32_t output_count;
+  uint32_t max_output_response;
+  uint32_t flags;
+  uint32_t reserved2;
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_IOCTL_req_t;
+
+#define FSCTL_PIPE_TRANSCEIVE 0x0011c017
+#define SMB2_0_IOCTL_IS_FSCTL 0x00000001
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t reserved;
+  uint32_t ctl_code;
+  uint8_t file_id[SMB2_FILE_ID_SIZE];
+  uint32_t input_offset;
+  uint32_t input_count;
+  uint32_t output_offset;
+  uint32_t output_count;
+  uint32_t flags;
+  uint32_t reserved2;
+} __attribute__((packed)) SMB2_IOCTL_resp_t;
+
+
+typedef struct {
+  NBT_t nbt;
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t reserved;
+} __attribute__((packed)) SMB2_ECHO_req_t;
+
+
+typedef struct {
+  NBT_t nbt;
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint8_t file_information_class;
+  uint8_t flags;
+  uint32_t file_index;
+  uint8_t file_id[SMB2_FILE_ID_SIZE];
+  uint16_t file_name_offset;
+  uint16_t file_name_length;
+  uint32_t output_buffer_length;
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_QUERY_DIRECTORY_req_t;
+
+#define SMB2_FILE_DIRECTORY_INFORMATION 0x01
+
+#define SMB2_RESTART_SCANS 0x01
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t output_buffer_offset;
+  uint32_t output_buffer_length;
+} __attribute__((packed)) SMB2_QUERY_DIRECTORY_resp_t;
+
+typedef struct {
+  uint32_t next_entry_offset;
+  uint32_t file_index;
+  uint64_t creation_time;
+  uint64_t last_access_time;
+  uint64_t last_write_time;
+  uint64_t change_time;
+  uint64_t end_of_file;
+  uint64_t allocation_size;
+  uint32_t file_attributes;
+  uint32_t file_name_length;
+  uint8_t file_name[0];
+} __attribute__((packed)) SMB2_FILE_DIRECTORY_INFO_t;
+
+
+typedef struct {
+  NBT_t nbt;
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint8_t info_type;
+  uint8_t file_info_class;
+  uint32_t output_buffer_length;
+  uint16_t input_buffer_offset;
+  uint16_t reserved;
+  uint32_t input_buffer_length;
+  uint32_t additional_information;
+  uint32_t flags;
+  uint8_t file_id[SMB2_FILE_ID_SIZE];
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_QUERY_INFO_req_t;
+
+#define SMB2_0_INFO_FILE             0x01
+#define SMB2_FILE_FULL_EA_INFORMATION 15
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t output_buffer_offset;
+  uint32_t output_buffer_length;
+} __attribute__((packed)) SMB2_QUERY_INFO_resp_t;
+
+
+typedef struct {
+  NBT_t nbt;
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint8_t info_type;
+  uint8_t file_info_class;
+  uint32_t buffer_length;
+  uint16_t buffer_offset;
+  uint16_t reserved;
+  uint32_t additional_information;
+  uint8_t file_id[SMB2_FILE_ID_SIZE];
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_SET_INFO_req_t;
+
+
+/**
+ * FILE_FULL_EA_INFORMATION, used for both query and set
+ */
+typedef struct {
+  uint32_t next_entry_offset;
+  uint8_t flags;
+  uint8_t name_len;
+  uint16_t value_len;
+  char data[0];
+} __attribute__((packed)) SMB2_FULL_EA_INFO_t;
+
+typedef struct {
+  uint32_t next_entry_offset;
+  uint8_t name_len;
+  char data[0];
+} __attribute__((packed)) SMB2_GET_EA_INFO_t;
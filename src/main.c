@@ -25,6 +25,7 @@
 
 #include "main.h"
 #include "event.h"
+#include "task.h"
 #include "prop/prop.h"
 #include "arch/arch.h"
 #include "arch/threads.h"
@@ -335,41 +336,11 @@ generate_device_id(void)
 /**
  *
  */
-void
-main_init(void)
+static void
+make_cache_path(void)
 {
   char errbuf[512];
 
-  hts_mutex_init(&gconf.state_mutex);
-  hts_cond_init(&gconf.state_cond, &gconf.state_mutex);
-
-  gconf.exit_code = 1;
-
-  unicode_init();
-
-  /* Initialize property tree */
-  prop_init();
-  init_global_info();
-
-  /* Callout framework */
-  callout_init();
-
-  /* Network init */
-  asyncio_init_early();
-  init_group(INIT_GROUP_NET);
-
-
-  /* Initiailize logging */
-  trace_init();
-
-  prop_init_late();
-
-  /* Initialize settings */
-  settings_init();
-
-  /* Notification framework */
-  notifications_init();
-
   TRACE(TRACE_DEBUG, "core", "Loading resources from %s", app_dataroot());
 
   TRACE(TRACE_DEBUG, "core", "Cache path: %s", gconf.cache_path);
@@ -381,15 +352,16 @@ main_init(void)
 	  gconf.cache_path, errbuf);
     gconf.cache_path = NULL;
   }
+}
 
-  /* Initialize sqlite3 */
-#if ENABLE_SQLITE
-  db_init();
-#endif
-
-  /* Initializte blob cache */
-  blobcache_init();
 
+/**
+ *
+ */
+static void
+make_persistent_path(void)
+{
+  char errbuf[512];
 
   TRACE(TRACE_DEBUG, "core", "Persistent path: %s", gconf.persistent_path);
 
@@ -401,57 +373,43 @@ main_init(void)
 	  gconf.persistent_path, errbuf);
     gconf.persistent_path = NULL;
   }
+}
 
-  /* Per-item key/value store */
-  kvstore_init();
-
-  /* Metadata init */
-#if ENABLE_METADATA
-  metadata_init();
-  metadb_init();
-  decoration_init();
-#endif
-
-  subtitles_init();
-
-  /* Initialize keyring */
-  keyring_init();
 
 #if ENABLE_LIBAV
-  /* Initialize libavcodec & libavformat */
+/**
+ * Initialize libavcodec & libavformat
+ */
+static void
+libav_init(void)
+{
   av_lockmgr_register(fflockmgr);
   av_log_set_callback(fflog);
   av_register_all();
 
   TRACE(TRACE_INFO, "libav", LIBAVFORMAT_IDENT", "LIBAVCODEC_IDENT", "LIBAVUTIL_IDENT" cpuflags:0x%x", av_get_cpu_flags());
+}
 #endif
 
-  init_group(INIT_GROUP_GRAPHICS);
-
-#if ENABLE_GLW
-  glw_settings_init();
-#endif
-
-  /* Initialize media subsystem */
-  media_init();
-
-  /* Service handling */
-  service_init();
-
-  /* Initialize backend content handlers */
-  backend_init();
-
-  /* Initialize navigator */
-  nav_init();
-
-  /* Initialize audio subsystem */
-  audio_init();
 
+static void init_group_net(void)      { init_group(INIT_GROUP_NET); }
+static void init_group_graphics(void) { init_group(INIT_GROUP_GRAPHICS); }
+static void init_group_ipc(void)      { init_group(INIT_GROUP_IPC); }
+static void init_group_api(void)      { init_group(INIT_GROUP_API); }
+static void init_plugins(void)
+{
 #if ENABLE_PLUGINS
-  /* Initialize plugin manager */
   plugins_init(gconf.devplugins);
 #endif
+}
+
 
+/**
+ *
+ */
+static void
+init_device_id(void)
+{
   generate_device_id();
   TRACE(TRACE_DEBUG, "SYSTEM", "Hashed device ID: %s", gconf.device_id);
   if(gconf.device_type[0])
@@ -459,28 +417,322 @@ main_init(void)
 
   /* Start software installer thread (plugins, upgrade, etc) */
   hts_thread_create_detached("swinst", swthread, NULL, THREAD_PRIO_BGTASK);
+}
 
-  /* Internationalization */
-  i18n_init();
-
-  /* Video settings */
-  video_settings_init();
-
-  /* Various interprocess communication stuff (D-Bus on Linux, etc) */
-  init_group(INIT_GROUP_IPC);
 
-  /* Service discovery. Must be after ipc_init() (d-bus and threads, etc) */
+/**
+ * Service discovery. Must be after ipc_init() (d-bus and threads, etc)
+ */
+static void
+init_sd(void)
+{
   if(!gconf.disable_sd)
     sd_init();
+}
+
+
+/**
+ * Startup steps run by main_init()
+ *
+ * Each step lists the steps it depends on. Steps without the
+ * INIT_STEP_MAIN flag are started on the task pool as soon as their
+ * dependencies are done so independent disk I/O (sqlite schema
+ * upgrades, cache index, libav registration) can overlap.
+ *
+ * Everything that creates settings runs on the main thread in its
+ * original order, otherwise the order of entries on the settings pages
+ * would change from boot to boot. The same goes for everything from
+ * IS_MEDIA and onwards, those steps poke around in each others state.
+ */
+enum {
+  IS_UNICODE,
+  IS_PROP,
+  IS_GLOBAL_INFO,
+  IS_CALLOUT,
+  IS_ASYNCIO_EARLY,
+  IS_NET,
+  IS_TRACE,
+  IS_PROP_LATE,
+  IS_SETTINGS,
+  IS_NOTIFICATIONS,
+
+  IS_CACHE_PATH,
+  IS_DB,
+  IS_BLOBCACHE,
+  IS_PERSISTENT_PATH,
+  IS_KVSTORE,
+  IS_METADATA,
+  IS_METADB,
+  IS_DECORATION,
+  IS_SUBTITLES,
+  IS_KEYRING,
+  IS_LIBAV,
+  IS_GRAPHICS,
+  IS_GLW_SETTINGS,
+
+  IS_MEDIA,
+  IS_SERVICE,
+  IS_BACKEND,
+  IS_NAV,
+  IS_AUDIO,
+  IS_PLUGINS,
+  IS_DEVICE_ID,
+  IS_I18N,
+  IS_VIDEO_SETTINGS,
+  IS_IPC,
+  IS_SD,
+  IS_API,
+  IS_ASYNCIO_START,
+  IS_RUNCONTROL,
+
+  IS_num
+};
+
+#define DEP(x) (1ULL << (x))
+
+#define INIT_STEP_MAIN 0x1 // Must run on the thread calling main_init()
+
+// Steps running on the task pool that must be done before IS_MEDIA
+#define DEP_PARALLEL (DEP(IS_DB) | DEP(IS_BLOBCACHE) | DEP(IS_KVSTORE) | \
+                      DEP(IS_METADB) | DEP(IS_LIBAV))
+
+typedef struct init_step {
+  const char *name;
+  void (*fn)(void);
+  uint64_t deps;
+  int flags;
+} init_step_t;
+
+static const init_step_t init_steps[IS_num] = {
+  [IS_UNICODE]       = {"unicode", unicode_init, 0, INIT_STEP_MAIN},
+  [IS_PROP]          = {"prop", prop_init, DEP(IS_UNICODE), INIT_STEP_MAIN},
+  [IS_GLOBAL_INFO]   = {"globalinfo", init_global_info, DEP(IS_PROP),
+                        INIT_STEP_MAIN},
+  [IS_CALLOUT]       = {"callout", callout_init, DEP(IS_GLOBAL_INFO),
+                        INIT_STEP_MAIN},
+  [IS_ASYNCIO_EARLY] = {"asyncio-early", asyncio_init_early, DEP(IS_CALLOUT),
+                        INIT_STEP_MAIN},
+  [IS_NET]           = {"net", init_group_net, DEP(IS_ASYNCIO_EARLY),
+                        INIT_STEP_MAIN},
+  [IS_TRACE]         = {"trace", trace_init, DEP(IS_NET), INIT_STEP_MAIN},
+  [IS_PROP_LATE]     = {"prop-late", prop_init_late, DEP(IS_TRACE),
+                        INIT_STEP_MAIN},
+  [IS_SETTINGS]      = {"settings", settings_init, DEP(IS_PROP_LATE),
+                        INIT_STEP_MAIN},
+  [IS_NOTIFICATIONS] = {"notifications", notifications_init,
+                        DEP(IS_SETTINGS), INIT_STEP_MAIN},
+
+  [IS_CACHE_PATH]    = {"cachepath", make_cache_path, DEP(IS_NOTIFICATIONS),
+                        INIT_STEP_MAIN},
+#if ENABLE_SQLITE
+  [IS_DB]            = {"sqlite", db_init, DEP(IS_CACHE_PATH)},
+#endif
+  [IS_BLOBCACHE]     = {"blobcache", blobcache_init, DEP(IS_CACHE_PATH)},
+  [IS_PERSISTENT_PATH] = {"persistentpath", make_persistent_path,
+                          DEP(IS_CACHE_PATH), INIT_STEP_MAIN},
+  [IS_KVSTORE]       = {"kvstore", kvstore_init,
+                        DEP(IS_DB) | DEP(IS_PERSISTENT_PATH)},
+#if ENABLE_METADATA
+  [IS_METADATA]      = {"metadata", metadata_init, DEP(IS_PERSISTENT_PATH),
+                        INIT_STEP_MAIN},
+  // metadb attaches to the kvstore database when upgrading. It adds
+  // to general:resets so it must come after blobcache
+  [IS_METADB]        = {"metadb", metadb_init,
+                        DEP(IS_KVSTORE) | DEP(IS_METADATA) |
+                        DEP(IS_BLOBCACHE)},
+  [IS_DECORATION]    = {"decoration", decoration_init,
+                        DEP(IS_METADATA) | DEP(IS_METADB), INIT_STEP_MAIN},
+#endif
+  [IS_SUBTITLES]     = {"subtitles", subtitles_init,
+                        DEP(IS_PERSISTENT_PATH) | DEP(IS_DECORATION),
+                        INIT_STEP_MAIN},
+  [IS_KEYRING]       = {"keyring", keyring_init,
+                        DEP(IS_SUBTITLES) | DEP(IS_BLOBCACHE) |
+                        DEP(IS_METADB), INIT_STEP_MAIN},
+#if ENABLE_LIBAV
+  [IS_LIBAV]         = {"libav", libav_init, DEP(IS_NOTIFICATIONS)},
+#endif
+  [IS_GRAPHICS]      = {"graphics", init_group_graphics, DEP(IS_KEYRING),
+                        INIT_STEP_MAIN},
+#if ENABLE_GLW
+  [IS_GLW_SETTINGS]  = {"glwsettings", glw_settings_init, DEP(IS_GRAPHICS),
+                        INIT_STEP_MAIN},
+#endif
+
+  [IS_MEDIA]         = {"media", media_init,
+                        DEP(IS_GRAPHICS) | DEP(IS_GLW_SETTINGS) | DEP_PARALLEL,
+                        INIT_STEP_MAIN},
+  [IS_SERVICE]       = {"service", service_init, DEP(IS_MEDIA),
+                        INIT_STEP_MAIN},
+  [IS_BACKEND]       = {"backend", backend_init, DEP(IS_SERVICE),
+                        INIT_STEP_MAIN},
+  [IS_NAV]           = {"navigator", nav_init, DEP(IS_BACKEND),
+                        INIT_STEP_MAIN},
+  [IS_AUDIO]         = {"audio", audio_init, DEP(IS_NAV), INIT_STEP_MAIN},
+  [IS_PLUGINS]       = {"plugins", init_plugins, DEP(IS_AUDIO),
+                        INIT_STEP_MAIN},
+  [IS_DEVICE_ID]     = {"deviceid", init_device_id, DEP(IS_PLUGINS),
+                        INIT_STEP_MAIN},
+  [IS_I18N]          = {"i18n", i18n_init, DEP(IS_DEVICE_ID), INIT_STEP_MAIN},
+  [IS_VIDEO_SETTINGS] = {"videosettings", video_settings_init, DEP(IS_I18N),
+                         INIT_STEP_MAIN},
+  [IS_IPC]           = {"ipc", init_group_ipc, DEP(IS_VIDEO_SETTINGS),
+                        INIT_STEP_MAIN},
+  [IS_SD]            = {"sd", init_sd, DEP(IS_IPC), INIT_STEP_MAIN},
+  [IS_API]           = {"api", init_group_api, DEP(IS_SD), INIT_STEP_MAIN},
+  [IS_ASYNCIO_START] = {"asyncio", asyncio_start, DEP(IS_API),
+                        INIT_STEP_MAIN},
+  [IS_RUNCONTROL]    = {"runcontrol", runcontrol_init,
+                        DEP(IS_ASYNCIO_START), INIT_STEP_MAIN},
+};
+
+static HTS_MUTEX_DECL(init_mutex);
+static hts_cond_t init_cond;
+static uint64_t init_done;
+static int64_t init_start;
+static int64_t init_step_start[IS_num];
+static int64_t init_step_stop[IS_num];
+
 
-  /* Initialize various external APIs */
-  init_group(INIT_GROUP_API);
+/**
+ *
+ */
+static void
+init_step_run(int i)
+{
+  init_step_start[i] = arch_get_ts();
+  init_steps[i].fn();
+  init_step_stop[i] = arch_get_ts();
+}
+
+
+/**
+ *
+ */
+static void
+init_step_task(void *aux)
+{
+  const int i = (intptr_t)aux;
+
+  init_step_run(i);
+
+  hts_mutex_lock(&init_mutex);
+  init_done |= DEP(i);
+  hts_cond_signal(&init_cond);
+  hts_mutex_unlock(&init_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+init_run_steps(void)
+{
+  const uint64_t all = DEP(IS_num) - 1;
+  uint64_t started = 0;
+
+  hts_cond_init(&init_cond, &init_mutex);
+
+  // Steps compiled out are done from the start
+  for(int i = 0; i < IS_num; i++) {
+    if(init_steps[i].fn == NULL) {
+      init_done |= DEP(i);
+      started |= DEP(i);
+    }
+  }
+
+  hts_mutex_lock(&init_mutex);
+
+  while(init_done != all) {
+    int ran = 0;
+
+    for(int i = 0; i < IS_num; i++) {
+      const init_step_t *is = &init_steps[i];
+      if(started & DEP(i) || (is->deps & init_done) != is->deps)
+        continue;
+
+      started |= DEP(i);
+
+      if(is->flags & INIT_STEP_MAIN) {
+        hts_mutex_unlock(&init_mutex);
+        init_step_run(i);
+        hts_mutex_lock(&init_mutex);
+        init_done |= DEP(i);
+        ran = 1;
+        break;
+      }
+
+      task_run(init_step_task, (void *)(intptr_t)i);
+    }
+
+    if(!ran && init_done != all)
+      hts_cond_wait(&init_cond, &init_mutex);
+  }
+
+  hts_mutex_unlock(&init_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+init_report(void)
+{
+  const int level = gconf.startup_profile ? TRACE_INFO : TRACE_DEBUG;
+  int64_t sum = 0;
+
+  for(int i = 0; i < IS_num; i++) {
+    const init_step_t *is = &init_steps[i];
+    if(is->fn == NULL)
+      continue;
 
-  /* Asynchronous IO (Used by HTTP server, etc) */
-  asyncio_start();
+    const int64_t d = init_step_stop[i] - init_step_start[i];
+    sum += d;
+    TRACE(level, "init", "%-16s %6.1fms started at %6.1fms%s",
+          is->name, d / 1000.0, (init_step_start[i] - init_start) / 1000.0,
+          is->flags & INIT_STEP_MAIN ? "" : " (task)");
+  }
+
+  TRACE(level, "init", "Initialized in %.1fms (%.1fms serial)",
+        (arch_get_ts() - init_start) / 1000.0, sum / 1000.0);
+}
 
-  runcontrol_init();
 
+/**
+ *
+ */
+void
+startup_profile_mark(const char *event)
+{
+  if(!gconf.startup_profile)
+    return;
+  TRACE(TRACE_INFO, "init", "%s at %.1fms",
+        event, (arch_get_ts() - init_start) / 1000.0);
+}
+
+
+/**
+ *
+ */
+void
+main_init(void)
+{
+  init_start = arch_get_ts();
+
+  hts_mutex_init(&gconf.state_mutex);
+  hts_cond_init(&gconf.state_cond, &gconf.state_mutex);
+
+  gconf.exit_code = 1;
+
+  init_run_steps();
+
+#ifdef DICTCMP_BENCHMARK
+  dictcmp_benchmark();
+#endif
+
+  init_report();
 }
 
 
@@ -532,6 +784,7 @@ parse_opts(int argc, char **argv)
 	     "                       Intended for plugin development\n"
 	     "   -j <path>           Load javascript file\n"
 	     "   --skin <skin>     Select skin (for GLW ui)\n"
+	     "   --startup-profile - Print time spent in each startup step.\n"
 	     "\n"
 	     "  URL is any URL-type supported, "
 	     "e.g., \"file:///...\"\n"
@@ -562,6 +815,10 @@ parse_opts(int argc, char **argv)
       gconf.show_usage_events = 1;
       argc -= 1; argv += 1;
       continue;
+    } else if(!strcmp(argv[0], "--startup-profile")) {
+      gconf.startup_profile = 1;
+      argc -= 1; argv += 1;
+      continue;
     } else if(!strcmp(argv[0], "--no-ui")) {
       gconf.noui = 1;
       argc -= 1; argv += 1;
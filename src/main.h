@@ -217,6 +217,7 @@ typedef struct gconf {
   int swrefresh;
   int debug_glw;
   int show_usage_events;
+  int startup_profile;
 
   int can_standby;
   int can_poweroff;
@@ -295,6 +296,7 @@ typedef struct gconf {
   struct prop_concat *settings_look_and_feel;
   struct setting *setting_av_volume; // Maybe move to audio.h
   struct setting *setting_av_sync;   // Maybe move to audio.h
+  int audio_gapless_preload;         // Seconds, 0 = Off
 
   hts_mutex_t state_mutex;
   hts_cond_t state_cond;
@@ -376,4 +378,6 @@ extern void inithelper_register(inithelper_t *ih);
 
 void init_group(int group);
 
+void startup_profile_mark(const char *event);
+
 void fini_group(int group);
@@ -205,6 +205,16 @@ typedef struct media_pipe {
    */
   int mp_pre_buffer_delay; // in µs
 
+  /*
+   * Gapless playback
+   *
+   * If non-zero, demuxers playing a single track (fa_audio) return
+   * EOF as soon as their demuxing is done and less than this many µs
+   * of audio is left in the queue. This gives the caller time to open
+   * the next track and append it to the same queues without flushing
+   */
+  int64_t mp_gapless_preload;
+
 
   pool_t *mp_mb_pool;
 
@@ -83,6 +83,43 @@ media_buf_from_avpkt_unlocked(media_pipe_t *mp, AVPacket *pkt)
 }
 
 
+/**
+ *
+ */
+static void
+media_buf_release_buf(void *opaque, uint8_t *data)
+{
+  buf_release(opaque);
+}
+
+
+/**
+ * Create a media_buf referencing 'size' bytes at 'data' inside 'b'
+ * without copying. The caller must make sure there are
+ * FF_INPUT_BUFFER_PADDING_SIZE zeroed bytes after the payload
+ */
+media_buf_t *
+media_buf_from_buf_unlocked(media_pipe_t *mp, buf_t *b,
+                            const void *data, size_t size)
+{
+  media_buf_t *mb;
+
+  hts_mutex_lock(&mp->mp_mutex);
+  mb = pool_get(mp->mp_mb_pool);
+  hts_mutex_unlock(&mp->mp_mutex);
+
+  mb->mb_dtor = media_buf_dtor_avpacket;
+
+  av_init_packet(&mb->mb_pkt);
+  mb->mb_pkt.buf = av_buffer_create((uint8_t *)data, size,
+                                    media_buf_release_buf, buf_retain(b),
+                                    AV_BUFFER_FLAG_READONLY);
+  mb->mb_data = (uint8_t *)data;
+  mb->mb_size = size;
+  return mb;
+}
+
+
 /**
  *
  */
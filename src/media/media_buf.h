@@ -169,4 +169,7 @@ media_buf_t *media_buf_alloc_unlocked(struct media_pipe *mp,
 media_buf_t *media_buf_from_avpkt_unlocked(struct media_pipe *mp,
                                            struct AVPacket *pkt);
 
+media_buf_t *media_buf_from_buf_unlocked(struct media_pipe *mp, struct buf *b,
+                                         const void *data, size_t size);
+
 void media_buf_dtor_frame_info(media_buf_t *mb);
@@ -39,6 +39,11 @@ mq_flush_q(media_pipe_t *mp, media_queue_t *mq, struct media_buf_queue *q,
       continue;
     if(mb->mb_data_type == MB_CTRL_UNBLOCK && !full)
       continue;
+
+    // Data after this have been dropped so the value is current now
+    if(mb->mb_data_type == MB_SET_PROP_STRING)
+      prop_set_string(mb->mb_prop, (void *)mb->mb_data);
+
     TAILQ_REMOVE(q, mb, mb_link);
     mq->mq_packets_current--;
     mp->mp_buffer_current -= mb_buffered_size(mb);
@@ -415,6 +420,29 @@ mp_wait_for_empty_queues(media_pipe_t *mp)
 
 
 
+/**
+ * Wait until less than 'delay' µs of audio is queued
+ */
+event_t *
+mp_wait_for_audio_delay(media_pipe_t *mp, int64_t delay)
+{
+  media_queue_t *mq = &mp->mp_audio;
+  event_t *e;
+  hts_mutex_lock(&mp->mp_mutex);
+
+  while((e = TAILQ_FIRST(&mp->mp_eq)) == NULL &&
+        TAILQ_FIRST(&mq->mq_q_data) != NULL &&
+        mq_get_buffer_delay(mq) >= delay)
+    hts_cond_wait(&mp->mp_backpressure, &mp->mp_mutex);
+
+  if(e != NULL)
+    TAILQ_REMOVE(&mp->mp_eq, e, e_link);
+
+  hts_mutex_unlock(&mp->mp_mutex);
+  return e;
+}
+
+
 /**
  *
  */
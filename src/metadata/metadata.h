@@ -448,6 +448,8 @@ metadata_lazy_video_t *metadata_bind_video_info(rstr_t *url, rstr_t *filename,
 
 void mlv_unbind(metadata_lazy_video_t *mlv, int cleanup);
 
+void metadata_visibility_hint(struct prop *p, int visible);
+
 void mlv_set_imdb_id(metadata_lazy_video_t *mlv, rstr_t *imdb_id);
 
 void mlv_set_duration(metadata_lazy_video_t *mlv, int duration);
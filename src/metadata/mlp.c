@@ -28,10 +28,12 @@
 #include "prop/prop_linkselected.h"
 
 #include "main.h"
+#include "arch/arch.h"
 #include "media/media.h"
 #include "htsmsg/htsmsg_json.h"
 #include "misc/str.h"
 #include "misc/regex.h"
+#include "misc/minmax.h"
 #include "api/lastfm.h"
 
 #include "metadata.h"
@@ -56,13 +58,19 @@ static void metadata_threads_start(void);
 
 TAILQ_HEAD(metadata_lazy_prop_queue, metadata_lazy_prop);
 static struct metadata_lazy_prop_queue mlpqueue;
+static struct metadata_lazy_prop_queue mlp_visqueue; // Visible in UI
 struct metadata_lazy_prop;
 
+#define MLP_ANCESTORS  4
+#define MLP_BATCH_SIZE 16
+
 /**
  *
  */
 typedef struct metadata_lazy_class {
   void (*mlc_load)(void *db, struct metadata_lazy_prop *mlp);
+  // Load from database only, return 0 if nothing more needs to be done
+  int (*mlc_load_cached)(void *db, struct metadata_lazy_prop *mlp);
   void (*mlc_kill)(struct metadata_lazy_prop *mlp);
   void (*mlc_dtor)(struct metadata_lazy_prop *mlp);
   size_t mlc_alloc_size;
@@ -81,10 +89,38 @@ typedef struct metadata_lazy_prop {
   unsigned char mlp_zombie : 1;
   unsigned char mlp_queued : 1;
   unsigned char mlp_loading : 1;
+  unsigned char mlp_visible : 1;  // On mlp_visqueue
+  unsigned char mlp_probed : 1;   // mlc_load_cached() already missed
+
+  prop_t *mlp_prop;  // Bound prop, reference is held by subclass
+
+  // mlp_prop and its parents, only used for comparison
+  prop_t *mlp_ancestors[MLP_ANCESTORS];
+
+  int64_t mlp_visible_ts;
 
 } metadata_lazy_prop_t;
 
 
+/**
+ * Set of props (list items) currently visible in the UI
+ */
+typedef struct mlp_visible {
+  LIST_ENTRY(mlp_visible) mv_link;
+  prop_t *mv_prop;
+  int mv_count;
+} mlp_visible_t;
+
+#define MLP_VISIBLE_HASH_SIZE 64
+
+LIST_HEAD(mlp_visible_list, mlp_visible);
+static struct mlp_visible_list mlp_visible_hash[MLP_VISIBLE_HASH_SIZE];
+
+static int mlp_stats_count;
+static int64_t mlp_stats_sum;
+static int64_t mlp_stats_max;
+
+
 /**
  *
  */
@@ -98,6 +134,64 @@ mlp_alloc(const metadata_lazy_class_t *class)
 }
 
 
+/**
+ *
+ */
+static mlp_visible_t *
+mlp_visible_find(prop_t *p)
+{
+  mlp_visible_t *mv;
+  const int h = ((intptr_t)p >> 4) & (MLP_VISIBLE_HASH_SIZE - 1);
+  LIST_FOREACH(mv, &mlp_visible_hash[h], mv_link)
+    if(mv->mv_prop == p)
+      return mv;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static int
+mlp_is_visible(const metadata_lazy_prop_t *mlp)
+{
+  for(int i = 0; i < MLP_ANCESTORS && mlp->mlp_ancestors[i] != NULL; i++)
+    if(mlp_visible_find(mlp->mlp_ancestors[i]) != NULL)
+      return 1;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+mlp_has_ancestor(const metadata_lazy_prop_t *mlp, const prop_t *p)
+{
+  for(int i = 0; i < MLP_ANCESTORS && mlp->mlp_ancestors[i] != NULL; i++)
+    if(mlp->mlp_ancestors[i] == p)
+      return 1;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+mlp_insert(metadata_lazy_prop_t *mlp, int head)
+{
+  struct metadata_lazy_prop_queue *q = mlp->mlp_visible ?
+    &mlp_visqueue : &mlpqueue;
+
+  if(head)
+    TAILQ_INSERT_HEAD(q, mlp, mlp_link);
+  else
+    TAILQ_INSERT_TAIL(q, mlp, mlp_link);
+  mlp->mlp_queued = 1;
+}
+
+
 /**
  *
  */
@@ -106,8 +200,19 @@ mlp_enqueue(metadata_lazy_prop_t *mlp)
 {
   if(mlp->mlp_zombie || mlp->mlp_queued)
     return;
-  TAILQ_INSERT_TAIL(&mlpqueue, mlp, mlp_link);
-  mlp->mlp_queued = 1;
+
+  memset(mlp->mlp_ancestors, 0, sizeof(mlp->mlp_ancestors));
+  if(mlp->mlp_prop != NULL)
+    prop_get_ancestors(mlp->mlp_prop, mlp->mlp_ancestors, MLP_ANCESTORS);
+
+  mlp->mlp_visible = mlp_is_visible(mlp);
+  if(!mlp->mlp_visible)
+    mlp->mlp_visible_ts = 0;
+  else if(mlp->mlp_visible_ts == 0)
+    mlp->mlp_visible_ts = arch_get_ts();
+
+  mlp->mlp_probed = 0;
+  mlp_insert(mlp, 0);
   metadata_threads_start();
 }
 
@@ -121,11 +226,104 @@ mlp_unqueue(metadata_lazy_prop_t *mlp)
   if(!mlp->mlp_queued)
     return;
 
-  TAILQ_REMOVE(&mlpqueue, mlp, mlp_link);
+  TAILQ_REMOVE(mlp->mlp_visible ? &mlp_visqueue : &mlpqueue, mlp, mlp_link);
   mlp->mlp_queued = 0;
 }
 
 
+/**
+ * Called by the UI when a list item becomes visible (or close to)
+ * and when it goes away again. Queued requests below that item are
+ * moved to the front or back of the line accordingly
+ */
+void
+metadata_visibility_hint(prop_t *p, int visible)
+{
+  metadata_lazy_prop_t *mlp, *next;
+  mlp_visible_t *mv;
+
+  if(p == NULL)
+    return;
+
+  p = prop_follow(p);
+
+  hts_mutex_lock(&metadata_mutex);
+
+  mv = mlp_visible_find(p);
+
+  if(visible) {
+
+    if(mv != NULL) {
+      mv->mv_count++;
+    } else {
+      mv = malloc(sizeof(mlp_visible_t));
+      mv->mv_prop = prop_ref_inc(p);
+      mv->mv_count = 1;
+      const int h = ((intptr_t)p >> 4) & (MLP_VISIBLE_HASH_SIZE - 1);
+      LIST_INSERT_HEAD(&mlp_visible_hash[h], mv, mv_link);
+
+      const int64_t now = arch_get_ts();
+      for(mlp = TAILQ_FIRST(&mlpqueue); mlp != NULL; mlp = next) {
+        next = TAILQ_NEXT(mlp, mlp_link);
+        if(!mlp_has_ancestor(mlp, p))
+          continue;
+        mlp_unqueue(mlp);
+        mlp->mlp_visible = 1;
+        mlp->mlp_visible_ts = now;
+        mlp_insert(mlp, 0);
+      }
+    }
+
+  } else if(mv != NULL && --mv->mv_count == 0) {
+
+    LIST_REMOVE(mv, mv_link);
+
+    for(mlp = TAILQ_FIRST(&mlp_visqueue); mlp != NULL; mlp = next) {
+      next = TAILQ_NEXT(mlp, mlp_link);
+      if(!mlp_has_ancestor(mlp, p) || mlp_is_visible(mlp))
+        continue;
+      mlp_unqueue(mlp);
+      mlp->mlp_visible = 0;
+      mlp->mlp_visible_ts = 0;
+      mlp_insert(mlp, 0);
+    }
+    prop_ref_dec(mv->mv_prop);
+    free(mv);
+  }
+
+  hts_mutex_unlock(&metadata_mutex);
+  prop_ref_dec(p);
+}
+
+
+/**
+ * Keep track of how long it takes from an item becoming visible until
+ * its metadata has been loaded
+ */
+static void
+mlp_loaded(metadata_lazy_prop_t *mlp)
+{
+  if(mlp->mlp_visible_ts == 0)
+    return;
+
+  const int64_t d = arch_get_ts() - mlp->mlp_visible_ts;
+  mlp->mlp_visible_ts = 0;
+
+  mlp_stats_count++;
+  mlp_stats_sum += d;
+  mlp_stats_max = MAX(mlp_stats_max, d);
+
+  if(mlp_stats_count == 50) {
+    METADATA_TRACE("Visible items loaded in avg %d ms, max %d ms",
+                   (int)(mlp_stats_sum / mlp_stats_count / 1000),
+                   (int)(mlp_stats_max / 1000));
+    mlp_stats_count = 0;
+    mlp_stats_sum = 0;
+    mlp_stats_max = 0;
+  }
+}
+
+
 /**
  *
  */
@@ -287,6 +485,7 @@ metadata_bind_artistpics(prop_t *prop, rstr_t *artist)
   metadata_lazy_artist_t *mla = mlp_alloc(&mlc_artist);
 
   mla->mla_prop = prop_ref_inc(prop);
+  mla->mla_mlp.mlp_prop = mla->mla_prop;
   mla->mla_artist = rstr_spn(artist, ";:,-[", 1);
   mla->mla_sub =
     prop_subscribe(PROP_SUB_TRACK_DESTROY_EXP | PROP_SUB_SUBSCRIPTION_MONITOR,
@@ -341,6 +540,31 @@ mlp_album_load(void *db, metadata_lazy_prop_t *mlp)
 }
 
 
+/**
+ *
+ */
+static int
+mlp_album_load_cached(void *db, metadata_lazy_prop_t *mlp)
+{
+  metadata_lazy_album_t *mla = (metadata_lazy_album_t *)mlp;
+
+  mlp_retain(mlp);
+
+  hts_mutex_unlock(&metadata_mutex);
+
+  rstr_t *r = metadb_get_album_art(db, rstr_get(mla->mla_album),
+                                   rstr_get(mla->mla_artist));
+  if(r != NULL) {
+    prop_set_rstring(mla->mla_prop, r);
+    rstr_release(r);
+  }
+
+  hts_mutex_lock(&metadata_mutex);
+  mlp_release(mlp);
+  return r == NULL;
+}
+
+
 /**
  *
  */
@@ -359,6 +583,7 @@ mlp_album_dtor(metadata_lazy_prop_t *mlp)
  */
 const static metadata_lazy_class_t mlc_album = {
   .mlc_load = mlp_album_load,
+  .mlc_load_cached = mlp_album_load_cached,
   .mlc_dtor = mlp_album_dtor,
   .mlc_alloc_size = sizeof(metadata_lazy_album_t),
 };
@@ -372,6 +597,7 @@ metadata_bind_albumart(prop_t *prop, rstr_t *artist, rstr_t *album)
 {
   metadata_lazy_album_t *mla = mlp_alloc(&mlc_album);
   mla->mla_prop = prop_ref_inc(prop);
+  mla->mla_mlp.mlp_prop = mla->mla_prop;
   mla->mla_artist = rstr_spn(artist, ";:,-[", 1);
   mla->mla_album  = rstr_spn(album, "[(", 1);
   mla->mla_sub =
@@ -751,8 +977,16 @@ set_artwork(prop_t *p, const char *name, rstr_vec_t *vec)
 /**
  *
  */
+#define MLV_CACHE_MISS 1
+
+/**
+ * If cache_only is set we only use what's in the database. Returns
+ * MLV_CACHE_MISS (before touching any props) if a network lookup
+ * would be needed
+ */
 static int
-mlv_get_video_info0(void *db, metadata_lazy_video_t *mlv, int refresh)
+mlv_get_video_info0(void *db, metadata_lazy_video_t *mlv, int refresh,
+                    int cache_only)
 {
   rstr_t *title = NULL;
   metadata_t *md = NULL;
@@ -762,6 +996,12 @@ mlv_get_video_info0(void *db, metadata_lazy_video_t *mlv, int refresh)
   int fixed_ds;
   const char *sq = rstr_get(mlv->mlv_custom_query);
 
+  // A cache probe runs inside a batch transaction, waiting for another
+  // thread's lookup here could deadlock on the database. Report a miss
+  // and let the full load deal with it
+  if(cache_only && mlv->mlv_mlp.mlp_loading)
+    return 1;
+
   int sq_is_imdb_id = sq && sq[0] == 't' && sq[1] == 't' &&
     sq[2] >= '0' && sq[2] <= '9';
 
@@ -872,7 +1112,8 @@ mlv_get_video_info0(void *db, metadata_lazy_video_t *mlv, int refresh)
     fixed_ds = 0;
   }
 
-  prop_set(mlv->mlv_m, "loading", PROP_SET_INT, 1);
+  if(!cache_only)
+    prop_set(mlv->mlv_m, "loading", PROP_SET_INT, 1);
 
 
   if(!mlv->mlv_manual && (md == NULL || !md->md_preferred)) {
@@ -964,6 +1205,13 @@ mlv_get_video_info0(void *db, metadata_lazy_video_t *mlv, int refresh)
         }
       }
 
+      if(cache_only) {
+        if(md != NULL)
+          metadata_destroy(md);
+        r = MLV_CACHE_MISS;
+        goto done;
+      }
+
       rval = metadb_videoitem_delete_from_ds(db, rstr_get(mlv->mlv_url),
 					     ms->ms_id);
 
@@ -1066,6 +1314,12 @@ mlv_get_video_info0(void *db, metadata_lazy_video_t *mlv, int refresh)
      ms->ms_funcs->query_by_id != NULL &&
      (mlv->mlv_mlp.mlp_req_items & ms->ms_complete_props)) {
 
+    if(cache_only) {
+      metadata_destroy(md);
+      r = MLV_CACHE_MISS;
+      goto done;
+    }
+
     METADATA_TRACE(
 	  "Performing additional query for %s : %s", ms->ms_name,
 	  rstr_get(md->md_ext_id));
@@ -1226,7 +1480,17 @@ mlv_get_video_info0(void *db, metadata_lazy_video_t *mlv, int refresh)
 static void
 mlv_load(void *db, metadata_lazy_prop_t *mlp)
 {
-  mlv_get_video_info0(db, (metadata_lazy_video_t *)mlp, 0);
+  mlv_get_video_info0(db, (metadata_lazy_video_t *)mlp, 0, 0);
+}
+
+
+/**
+ *
+ */
+static int
+mlv_load_cached(void *db, metadata_lazy_prop_t *mlp)
+{
+  return mlv_get_video_info0(db, (metadata_lazy_video_t *)mlp, 0, 1);
 }
 
 
@@ -1253,7 +1517,7 @@ mlv_set_preferred(metadata_lazy_video_t *mlv, int64_t vid)
 {
   void *db = metadb_get();
   metadb_videoitem_set_preferred(db, rstr_get(mlv->mlv_url), vid);
-  mlv_get_video_info0(db, mlv, 0);
+  mlv_get_video_info0(db, mlv, 0, 0);
   metadb_close(db);
 }
 
@@ -1376,7 +1640,7 @@ mlv_set_source(metadata_lazy_video_t *mlv, const char *name)
 
   void *db = metadb_get();
   metadb_item_set_preferred_ds(db, rstr_get(mlv->mlv_url), id);
-  mlv_get_video_info0(db, mlv, 0);
+  mlv_get_video_info0(db, mlv, 0, 0);
   metadb_close(db);
   load_alternatives(mlv);
 }
@@ -1427,7 +1691,7 @@ mlv_refresh_video_info(metadata_lazy_video_t *mlv)
 
   metadb_item_set_preferred_ds(db, rstr_get(mlv->mlv_url), 0);
   metadb_videoitem_set_preferred(db, rstr_get(mlv->mlv_url), 0);
-  mlv_get_video_info0(db, mlv, 1);
+  mlv_get_video_info0(db, mlv, 1, 0);
   metadb_close(db);
   load_alternatives(mlv);
 }
@@ -1616,6 +1880,7 @@ mlv_dtor(metadata_lazy_prop_t *mlp)
  */
 const static metadata_lazy_class_t mlc_video = {
   .mlc_load = mlv_load,
+  .mlc_load_cached = mlv_load_cached,
   .mlc_dtor = mlv_dtor,
   .mlc_kill = mlv_kill,
   .mlc_alloc_size = sizeof(metadata_lazy_video_t),
@@ -1865,6 +2130,7 @@ metadata_bind_video_info(rstr_t *url, rstr_t *filename,
   mlv->mlv_passive = passive;
   mlv->mlv_manual = manual;
   mlv->mlv_root = prop_ref_inc(root);
+  mlv->mlv_mlp.mlp_prop = mlv->mlv_root;
   mlv->mlv_initiator = rstr_dup(initiator);
   mlv->mlv_m = prop_create_r(root, "metadata");
 
@@ -1976,7 +2242,7 @@ mlv_direct_query(void *db, rstr_t *url, rstr_t *filename,
   mlv.mlv_type     = METADATA_TYPE_VIDEO;
 
   hts_mutex_lock(&metadata_mutex);
-  int r = mlv_get_video_info0(db, &mlv, 1);
+  int r = mlv_get_video_info0(db, &mlv, 1, 0);
   hts_mutex_unlock(&metadata_mutex);
   rstr_release(mlv.mlv_url);
   rstr_release(mlv.mlv_filename);
@@ -1986,6 +2252,67 @@ mlv_direct_query(void *db, rstr_t *url, rstr_t *filename,
 }
 
 
+/**
+ * Try to satisfy a batch of queued requests from the database within
+ * a single transaction. The ones that need more work are put back at
+ * the front of their queue in the same order.
+ *
+ * Requests that some other thread is busy loading are left in the
+ * queue. metadata_mutex is not held while opening or committing the
+ * transaction
+ */
+static void
+mlp_load_batch(void *db)
+{
+  metadata_lazy_prop_t *vec[MLP_BATCH_SIZE], *mlp;
+  char miss[MLP_BATCH_SIZE];
+  struct metadata_lazy_prop_queue *queues[2] = {&mlp_visqueue, &mlpqueue};
+  int n = 0;
+
+  for(int q = 0; q < 2; q++) {
+    TAILQ_FOREACH(mlp, queues[q], mlp_link) {
+      if(n == MLP_BATCH_SIZE)
+        break;
+      if(!mlp->mlp_probed && !mlp->mlp_loading &&
+         mlp->mlp_class->mlc_load_cached != NULL)
+        vec[n++] = mlp;
+    }
+  }
+
+  for(int i = 0; i < n; i++) {
+    mlp_unqueue(vec[i]);
+    vec[i]->mlp_probed = 1;
+    mlp_retain(vec[i]);
+  }
+
+  hts_mutex_unlock(&metadata_mutex);
+  const int txn = !db_begin(db);
+  hts_mutex_lock(&metadata_mutex);
+
+  for(int i = 0; i < n; i++) {
+    mlp = vec[i];
+    miss[i] = mlp->mlp_zombie ? 0 : mlp->mlp_class->mlc_load_cached(db, mlp);
+    if(!miss[i])
+      mlp_loaded(mlp);
+  }
+
+  if(txn) {
+    hts_mutex_unlock(&metadata_mutex);
+    db_commit(db);
+    hts_mutex_lock(&metadata_mutex);
+  }
+
+  for(int i = n - 1; i >= 0; i--) {
+    mlp = vec[i];
+    if(miss[i] && !mlp->mlp_zombie && !mlp->mlp_queued) {
+      mlp->mlp_visible = mlp_is_visible(mlp);
+      mlp_insert(mlp, 1);
+    }
+    mlp_release(mlp);
+  }
+}
+
+
 /**
  *
  */
@@ -2000,17 +2327,26 @@ metadata_thread(void *aux)
 
     metadata_lazy_prop_t *mlp;
 
-    mlp = TAILQ_FIRST(&mlpqueue);
+    mlp = TAILQ_FIRST(&mlp_visqueue) ?: TAILQ_FIRST(&mlpqueue);
     if(mlp == NULL)
       break;
 
     if(db == NULL)
       db = metadb_get();
 
-    TAILQ_REMOVE(&mlpqueue, mlp, mlp_link);
-    mlp->mlp_queued = 0;
-    if(!mlp->mlp_zombie)
+    if(db != NULL && !mlp->mlp_probed && !mlp->mlp_loading &&
+       mlp->mlp_class->mlc_load_cached != NULL) {
+      mlp_load_batch(db);
+      continue;
+    }
+
+    mlp_unqueue(mlp);
+    if(!mlp->mlp_zombie) {
+      mlp_retain(mlp);
       mlp->mlp_class->mlc_load(db, mlp);
+      mlp_loaded(mlp);
+      mlp_release(mlp);
+    }
   }
 
   metadata_num_threads--;
@@ -2045,6 +2381,7 @@ void
 mlp_init(void)
 {
   TAILQ_INIT(&mlpqueue);
+  TAILQ_INIT(&mlp_visqueue);
   hts_mutex_init(&metadata_mutex);
   hts_cond_init(&metadata_loading_cond, &metadata_mutex);
 }
@@ -24,24 +24,11 @@
 #include "callout.h"
 #include "arch/arch.h"
 
-static LIST_HEAD(, callout) callouts;
+static timerwheel_t callouts;
 
 static hts_mutex_t callout_mutex;
 static hts_cond_t callout_cond;
 
-/**
- *htsmsg_t *props
- */
-static int
-calloutcmp(callout_t *a, callout_t *b)
-{
-  if(a->c_deadline < b->c_deadline)
-    return -1;
-  else if(a->c_deadline > b->c_deadline)
-    return 1;
- return 0;
-}
-
 
 /**
  *
@@ -55,24 +42,18 @@ callout_arm0(callout_t *d, callout_callback_t *callback, void *opaque,
   hts_mutex_lock(&callout_mutex);
 
   if(d == NULL) {
-    d = malloc(sizeof(callout_t));
-  } else {
-
-    if(d->c_callback != NULL) {
-      LIST_REMOVE(d, c_link);
-    } else {
-      retain = lockmgr;
-    }
+    d = calloc(1, sizeof(callout_t));
+  } else if(d->c_callback == NULL) {
+    retain = lockmgr;
   }
 
   d->c_callback = callback;
   d->c_opaque = opaque;
   d->c_delta = delta;
-  d->c_deadline = arch_get_ts() + delta;
   d->c_armed_by_file = file;
   d->c_armed_by_line = line;
   d->c_lockmgr = lockmgr;
-  LIST_INSERT_SORTED(&callouts, d, c_link, calloutcmp, callout_t);
+  timerwheel_arm(&callouts, &d->c_timer, arch_get_ts() + delta);
   hts_cond_signal(&callout_cond);
   hts_mutex_unlock(&callout_mutex);
   if(retain)
@@ -124,10 +105,9 @@ callout_rearm(callout_t *d, int64_t delta)
   hts_mutex_lock(&callout_mutex);
 
   if(d->c_callback != NULL) {
-    d->c_deadline += delta - d->c_delta;
+    timerwheel_arm(&callouts, &d->c_timer,
+                   d->c_timer.twt_expire + delta - d->c_delta);
     d->c_delta = delta;
-    LIST_REMOVE(d, c_link);
-    LIST_INSERT_SORTED(&callouts, d, c_link, calloutcmp, callout_t);
   }
 
   hts_mutex_unlock(&callout_mutex);
@@ -144,7 +124,7 @@ callout_disarm(callout_t *c)
   lockmgr_fn_t *lm;
   if(c->c_callback) {
     lm = c->c_lockmgr;
-    LIST_REMOVE(c, c_link);
+    timerwheel_disarm(&callouts, &c->c_timer);
     c->c_callback = NULL;
   } else {
     lm = NULL;
@@ -161,7 +141,7 @@ callout_disarm(callout_t *c)
 static void *
 callout_loop(void *aux)
 {
-  uint64_t now;
+  int64_t now;
   callout_t *c;
   callout_callback_t *cc;
 
@@ -171,9 +151,10 @@ callout_loop(void *aux)
 
     now = arch_get_ts();
 
-    while((c = LIST_FIRST(&callouts)) != NULL && c->c_deadline <= now) {
+    timerwheel_advance(&callouts, now);
+
+    while((c = (callout_t *)timerwheel_expired(&callouts)) != NULL) {
       cc = c->c_callback;
-      LIST_REMOVE(c, c_link);
       c->c_callback = NULL;
       lockmgr_fn_t *lm = c->c_lockmgr;
       const char *file = c->c_armed_by_file;
@@ -199,12 +180,13 @@ callout_loop(void *aux)
       now = ts;
     }
 
-    if((c = LIST_FIRST(&callouts)) != NULL) {
+    const int64_t next = timerwheel_next_event(&callouts);
 
-      int timeout = (c->c_deadline - now + 999) / 1000;
-      hts_cond_wait_timeout(&callout_cond, &callout_mutex, timeout);
-    } else {
+    if(next == INT64_MAX) {
       hts_cond_wait(&callout_cond, &callout_mutex);
+    } else if(next > now) {
+      int timeout = (next - now + 999) / 1000;
+      hts_cond_wait_timeout(&callout_cond, &callout_mutex, timeout);
     }
   }
 
@@ -264,6 +246,59 @@ callout_update_clock_props(void)
 }
 
 
+/**
+ * Statistics published under global.system. All groups are refreshed
+ * from a single timer once a second
+ */
+typedef struct callout_stats {
+  LIST_ENTRY(callout_stats) cs_link;
+  void (*cs_update)(void);
+} callout_stats_t;
+
+static LIST_HEAD(, callout_stats) callout_stats_list;
+static HTS_MUTEX_DECL(callout_stats_mutex);
+static callout_t callout_stats_timer;
+
+
+/**
+ *
+ */
+static void
+callout_stats_update(callout_t *c, void *aux)
+{
+  callout_stats_t *cs;
+
+  callout_arm(&callout_stats_timer, callout_stats_update, NULL, 1);
+
+  hts_mutex_lock(&callout_stats_mutex);
+  LIST_FOREACH(cs, &callout_stats_list, cs_link)
+    cs->cs_update();
+  hts_mutex_unlock(&callout_stats_mutex);
+}
+
+
+/**
+ * Have update called once a second to copy counters into props.
+ * The props must exist already, update is also called right away
+ */
+void
+callout_stats_register(void (*update)(void))
+{
+  callout_stats_t *cs = malloc(sizeof(callout_stats_t));
+
+  cs->cs_update = update;
+
+  hts_mutex_lock(&callout_stats_mutex);
+  update();
+  const int first = LIST_FIRST(&callout_stats_list) == NULL;
+  LIST_INSERT_HEAD(&callout_stats_list, cs, cs_link);
+  hts_mutex_unlock(&callout_stats_mutex);
+
+  if(first)
+    callout_arm(&callout_stats_timer, callout_stats_update, NULL, 1);
+}
+
+
 /**
  *
  */
@@ -273,6 +308,11 @@ callout_init(void)
 
   hts_mutex_init(&callout_mutex);
   hts_cond_init(&callout_cond, &callout_mutex);
+  timerwheel_init(&callouts, arch_get_ts());
+
+#ifdef TIMERWHEEL_BENCHMARK
+  timerwheel_benchmark();
+#endif
 
   hts_thread_create_detached("callout", callout_loop, NULL,
 			     THREAD_PRIO_BGTASK);
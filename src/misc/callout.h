@@ -22,16 +22,16 @@
 #include <stdint.h>
 #include "queue.h"
 #include "lockmgr.h"
+#include "timerwheel.h"
 
 struct callout;
 typedef void (callout_callback_t)(struct callout *c, void *opaque);
 
 typedef struct callout {
-  LIST_ENTRY(callout) c_link;
+  timerwheel_timer_t c_timer; // Must be first
   callout_callback_t *c_callback;
   lockmgr_fn_t *c_lockmgr;
   void *c_opaque;
-  uint64_t c_deadline;
   int64_t c_delta;
   const char *c_armed_by_file;
   int c_armed_by_line;
@@ -66,4 +66,6 @@ void callout_init(void);
 
 void callout_update_clock_props(void);
 
+void callout_stats_register(void (*update)(void));
+
 #define callout_isarmed(c) ((c)->c_callback != NULL)
@@ -18,6 +18,9 @@
  *  For more information, contact andreas@lonelycoder.com
  */
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
+
 #include "config.h"
 
 #if ENABLE_COMMONCRYPTO
@@ -32,6 +35,14 @@
 
 #define sha1_final(ctx, output) CC_SHA1_Final(output, &ctx)
 
+#define sha256_decl(ctx) CC_SHA256_CTX ctx
+
+#define sha256_init(ctx) CC_SHA256_Init(&ctx)
+
+#define sha256_update(ctx, data, len) CC_SHA256_Update(&ctx, data, len)
+
+#define sha256_final(ctx, output) CC_SHA256_Final(output, &ctx)
+
 #elif ENABLE_POLARSSL
 
 #include "polarssl/sha1.h"
@@ -42,6 +53,14 @@
 
 #define sha1_final(ctx, output) sha1_finish(ctx, output);
 
+#include "polarssl/sha256.h"
+
+#define sha256_decl(ctx) sha256_context *ctx = alloca(sizeof(sha256_context));
+
+#define sha256_init(ctx) sha256_starts(ctx, 0);
+
+#define sha256_final(ctx, output) sha256_finish(ctx, output);
+
 #elif ENABLE_LIBAV
 
 #include <libavutil/sha.h>
@@ -61,6 +80,25 @@
   av_freep(&ctx);                               \
   } while(0)
 
+#define sha256_decl(ctx) struct AVSHA *ctx = NULL;
+
+#define sha256_init(ctx) do {                   \
+  ctx = av_sha_alloc();                         \
+  av_sha_init(ctx, 256);                        \
+  } while(0)
+
+#define sha256_update(ctx, data, len) av_sha_update(ctx, data, len)
+
+#define sha256_final(ctx, output) sha1_final(ctx, output)
+
 #else
 #error no sha1
 #endif
+
+/**
+ * SHA-1 of a complete buffer. Uses the SHA instructions of the CPU if
+ * it has them, otherwise the implementation above
+ */
+void sha1_digest(uint8_t *output, const void *data, size_t len);
+
+const char *sha1_digest_impl(void);
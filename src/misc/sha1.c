@@ -0,0 +1,377 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "main.h"
+#include "sha.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SHA1_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#else
+#define SHA1_X86 0
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#define SHA1_ARMV8 1
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#endif
+#else
+#define SHA1_ARMV8 0
+#endif
+
+/**
+ *
+ */
+typedef struct sha1_impl {
+  const char *name;
+  int (*probe)(void);
+  void (*digest)(uint8_t *output, const uint8_t *data, size_t len);
+} sha1_impl_t;
+
+
+#if SHA1_X86 || SHA1_ARMV8
+
+/**
+ * Pad the message and run it through a block function that only
+ * knows how to compress whole 64 byte blocks
+ */
+static void
+sha1_blocks_digest(uint8_t *output, const uint8_t *data, size_t len,
+                   void (*blocks)(uint32_t *state, const uint8_t *data,
+                                  size_t num))
+{
+  uint32_t state[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+  };
+  uint8_t tail[128] = {};
+  const size_t full = len / 64;
+  const size_t rem = len & 63;
+  const int tailblocks = rem < 56 ? 1 : 2;
+  const uint64_t bits = (uint64_t)len << 3;
+
+  blocks(state, data, full);
+
+  memcpy(tail, data + full * 64, rem);
+  tail[rem] = 0x80;
+  for(int i = 0; i < 8; i++)
+    tail[tailblocks * 64 - 1 - i] = bits >> (i * 8);
+  blocks(state, tail, tailblocks);
+
+  for(int i = 0; i < 5; i++) {
+    output[i * 4 + 0] = state[i] >> 24;
+    output[i * 4 + 1] = state[i] >> 16;
+    output[i * 4 + 2] = state[i] >> 8;
+    output[i * 4 + 3] = state[i];
+  }
+}
+
+#endif
+
+
+#if SHA1_X86
+
+/**
+ *
+ */
+static int
+shani_probe(void)
+{
+  unsigned int a, b, c, d;
+  if(__get_cpuid_max(0, NULL) < 7)
+    return 0;
+  __cpuid_count(7, 0, a, b, c, d);
+  return (b & (1 << 29)) && __builtin_cpu_supports("sse4.1");
+}
+
+
+/**
+ * Four rounds, W[g] is kept in w[g & 3]. Message schedule for the
+ * next groups is computed as we go
+ */
+#define SHANI_ROUNDS(g, f) do {                                         \
+    if((g) >= 4)                                                        \
+      w[(g) & 3] =                                                      \
+        _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(w[(g) & 3], \
+                                                            w[((g) + 1) & 3]), \
+                                         w[((g) + 2) & 3]),             \
+                           w[((g) + 3) & 3]);                           \
+    e = (g) ? _mm_sha1nexte_epu32(prev, w[(g) & 3]) :                   \
+      _mm_add_epi32(e, w[0]);                                           \
+    prev = abcd;                                                        \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, f);                             \
+  } while(0)
+
+
+__attribute__((target("sha,sse4.1"))) static void
+shani_blocks(uint32_t *state, const uint8_t *data, size_t num)
+{
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+                                      0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state),
+                                   0x1b);
+  __m128i e = _mm_set_epi32(state[4], 0, 0, 0);
+  __m128i w[4], prev;
+
+  for(; num > 0; num--, data += 64) {
+    const __m128i abcd_save = abcd;
+    const __m128i e_save = e;
+
+    for(int i = 0; i < 4; i++)
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)
+                                              (data + i * 16)), mask);
+
+    SHANI_ROUNDS(0, 0);  SHANI_ROUNDS(1, 0);  SHANI_ROUNDS(2, 0);
+    SHANI_ROUNDS(3, 0);  SHANI_ROUNDS(4, 0);  SHANI_ROUNDS(5, 1);
+    SHANI_ROUNDS(6, 1);  SHANI_ROUNDS(7, 1);  SHANI_ROUNDS(8, 1);
+    SHANI_ROUNDS(9, 1);  SHANI_ROUNDS(10, 2); SHANI_ROUNDS(11, 2);
+    SHANI_ROUNDS(12, 2); SHANI_ROUNDS(13, 2); SHANI_ROUNDS(14, 2);
+    SHANI_ROUNDS(15, 3); SHANI_ROUNDS(16, 3); SHANI_ROUNDS(17, 3);
+    SHANI_ROUNDS(18, 3); SHANI_ROUNDS(19, 3);
+
+    e = _mm_sha1nexte_epu32(prev, e_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+  state[4] = _mm_extract_epi32(e, 3);
+}
+
+
+/**
+ *
+ */
+static void
+shani_digest(uint8_t *output, const uint8_t *data, size_t len)
+{
+  sha1_blocks_digest(output, data, len, shani_blocks);
+}
+
+#endif
+
+
+#if SHA1_ARMV8
+
+/**
+ *
+ */
+static int
+armv8_probe(void)
+{
+#ifdef __linux__
+  return !!(getauxval(AT_HWCAP) & HWCAP_SHA1);
+#else
+  return 1;
+#endif
+}
+
+
+/**
+ * Four rounds, W[g] is kept in w[g & 3]
+ */
+#define ARMV8_ROUNDS(g, op, k) do {                                     \
+    if((g) >= 4)                                                        \
+      w[(g) & 3] = vsha1su1q_u32(vsha1su0q_u32(w[(g) & 3],              \
+                                               w[((g) + 1) & 3],        \
+                                               w[((g) + 2) & 3]),       \
+                                 w[((g) + 3) & 3]);                     \
+    const uint32_t e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));            \
+    abcd = op(abcd, e, vaddq_u32(w[(g) & 3], vdupq_n_u32(k)));          \
+    e = e1;                                                             \
+  } while(0)
+
+#define K0 0x5a827999
+#define K1 0x6ed9eba1
+#define K2 0x8f1bbcdc
+#define K3 0xca62c1d6
+
+static void
+armv8_blocks(uint32_t *state, const uint8_t *data, size_t num)
+{
+  uint32x4_t abcd = vld1q_u32(state);
+  uint32_t e = state[4];
+  uint32x4_t w[4];
+
+  for(; num > 0; num--, data += 64) {
+    const uint32x4_t abcd_save = abcd;
+    const uint32_t e_save = e;
+
+    for(int i = 0; i < 4; i++)
+      w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+
+    ARMV8_ROUNDS(0, vsha1cq_u32, K0);  ARMV8_ROUNDS(1, vsha1cq_u32, K0);
+    ARMV8_ROUNDS(2, vsha1cq_u32, K0);  ARMV8_ROUNDS(3, vsha1cq_u32, K0);
+    ARMV8_ROUNDS(4, vsha1cq_u32, K0);  ARMV8_ROUNDS(5, vsha1pq_u32, K1);
+    ARMV8_ROUNDS(6, vsha1pq_u32, K1);  ARMV8_ROUNDS(7, vsha1pq_u32, K1);
+    ARMV8_ROUNDS(8, vsha1pq_u32, K1);  ARMV8_ROUNDS(9, vsha1pq_u32, K1);
+    ARMV8_ROUNDS(10, vsha1mq_u32, K2); ARMV8_ROUNDS(11, vsha1mq_u32, K2);
+    ARMV8_ROUNDS(12, vsha1mq_u32, K2); ARMV8_ROUNDS(13, vsha1mq_u32, K2);
+    ARMV8_ROUNDS(14, vsha1mq_u32, K2); ARMV8_ROUNDS(15, vsha1pq_u32, K3);
+    ARMV8_ROUNDS(16, vsha1pq_u32, K3); ARMV8_ROUNDS(17, vsha1pq_u32, K3);
+    ARMV8_ROUNDS(18, vsha1pq_u32, K3); ARMV8_ROUNDS(19, vsha1pq_u32, K3);
+
+    abcd = vaddq_u32(abcd, abcd_save);
+    e += e_save;
+  }
+
+  vst1q_u32(state, abcd);
+  state[4] = e;
+}
+
+
+/**
+ *
+ */
+static void
+armv8_digest(uint8_t *output, const uint8_t *data, size_t len)
+{
+  sha1_blocks_digest(output, data, len, armv8_blocks);
+}
+
+#endif
+
+
+/**
+ *
+ */
+static int
+platform_probe(void)
+{
+  return 1;
+}
+
+
+/**
+ *
+ */
+static void
+platform_digest(uint8_t *output, const uint8_t *data, size_t len)
+{
+  sha1_decl(shactx);
+  sha1_init(shactx);
+  sha1_update(shactx, data, len);
+  sha1_final(shactx, output);
+}
+
+
+/**
+ * In order of preference
+ */
+static const sha1_impl_t sha1_impls[] = {
+#if SHA1_X86
+  { "SHA-NI",   shani_probe,    shani_digest },
+#endif
+#if SHA1_ARMV8
+  { "ARMv8",    armv8_probe,    armv8_digest },
+#endif
+  { "platform", platform_probe, platform_digest },
+};
+
+
+/**
+ *
+ */
+static const sha1_impl_t *
+sha1_impl(void)
+{
+  static const sha1_impl_t *impl;
+
+  if(impl == NULL) {
+    int i;
+    for(i = 0; !sha1_impls[i].probe(); i++) {}
+    impl = &sha1_impls[i];
+  }
+  return impl;
+}
+
+
+/**
+ *
+ */
+void
+sha1_digest(uint8_t *output, const void *data, size_t len)
+{
+  sha1_impl()->digest(output, data, len);
+}
+
+
+/**
+ *
+ */
+const char *
+sha1_digest_impl(void)
+{
+  return sha1_impl()->name;
+}
+
+
+#ifdef SHA1_BENCHMARK
+#include <stdio.h>
+
+/**
+ * Hash a 16 MB buffer with each available implementation
+ */
+void
+sha1_benchmark(void)
+{
+  const size_t size = 16 * 1024 * 1024;
+  uint8_t *buf = malloc(size);
+  uint8_t ref[20], out[20];
+  uint32_t x = 0x12345678;
+
+  for(size_t i = 0; i < size; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf[i] = x;
+  }
+
+  for(int i = 0; i < ARRAYSIZE(sha1_impls); i++) {
+    const sha1_impl_t *impl = &sha1_impls[i];
+    if(!impl->probe())
+      continue;
+
+    int ok = 1;
+    // Cover every tail length, the padding is the easy part to get wrong
+    for(int len = 0; len < 200; len++) {
+      impl->digest(out, buf, len);
+      platform_digest(ref, buf, len);
+      ok &= !memcmp(ref, out, 20);
+    }
+
+    int64_t ts = arch_get_ts();
+    impl->digest(out, buf, size);
+    ts = arch_get_ts() - ts;
+    platform_digest(ref, buf, size);
+    ok &= !memcmp(ref, out, 20);
+
+    printf("sha1: %-8s %7.1f MB/s%s\n", impl->name,
+           (double)size / ts, ok ? "" : " (OUTPUT MISMATCH)");
+  }
+  free(buf);
+}
+#endif
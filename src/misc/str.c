@@ -29,6 +29,7 @@
 #include "i18n.h"
 
 #include "unicode_casefolding.h"
+#include "minmax.h"
 #include "charset_detector.h"
 #include "big5.h"
 #include "arch/arch.h"
@@ -937,6 +938,194 @@ dictcmp(const char *a, const char *b)
 }
 
 
+/**
+ * Append c using the UTF-8 bit layout. Unlike utf8_put() nothing is
+ * rejected so the byte order always follows the code point order
+ */
+static char *
+dictcmp_key_put(char *o, unsigned int c)
+{
+  if(c < 0x80) {
+    *o++ = c;
+  } else if(c < 0x800) {
+    *o++ = 0xc0 | (c >> 6);
+    *o++ = 0x80 | (c & 0x3f);
+  } else if(c < 0x10000) {
+    *o++ = 0xe0 | (c >> 12);
+    *o++ = 0x80 | ((c >> 6) & 0x3f);
+    *o++ = 0x80 | (c & 0x3f);
+  } else if(c < 0x200000) {
+    *o++ = 0xf0 | (c >> 18);
+    *o++ = 0x80 | ((c >> 12) & 0x3f);
+    *o++ = 0x80 | ((c >> 6) & 0x3f);
+    *o++ = 0x80 | (c & 0x3f);
+  } else if(c < 0x4000000) {
+    *o++ = 0xf8 | (c >> 24);
+    *o++ = 0x80 | ((c >> 18) & 0x3f);
+    *o++ = 0x80 | ((c >> 12) & 0x3f);
+    *o++ = 0x80 | ((c >> 6) & 0x3f);
+    *o++ = 0x80 | (c & 0x3f);
+  } else {
+    *o++ = 0xfc | (c >> 30);
+    *o++ = 0x80 | ((c >> 24) & 0x3f);
+    *o++ = 0x80 | ((c >> 18) & 0x3f);
+    *o++ = 0x80 | ((c >> 12) & 0x3f);
+    *o++ = 0x80 | ((c >> 6) & 0x3f);
+    *o++ = 0x80 | (c & 0x3f);
+  }
+  return o;
+}
+
+
+/**
+ * Return a collation key for str. strcmp() on two keys orders the
+ * same way as dictcmp() on the strings.
+ *
+ * Characters are casefolded and stored UTF-8 encoded. A run of digits
+ * is stored as '0', the number of significant digits plus one and the
+ * significant digits. Digits never appear as characters, so numbers
+ * sort between '/' and ':' just as dictcmp() does it.
+ */
+char *
+dictcmp_key(const char *str)
+{
+  int c;
+  str = no_the(str);
+  char *key = malloc(strlen(str) * 3 + 1);
+  char *o = key;
+
+  while((c = utf8_get(&str)) != 0) {
+    if(c >= '0' && c <= '9') {
+      const char *digits;
+      int len;
+
+      str--;
+      while(*str == '0')
+        str++;
+      digits = str;
+      while(*str >= '0' && *str <= '9')
+        str++;
+      len = MIN(str - digits, 254);
+      *o++ = '0';
+      *o++ = len + 1;
+      memcpy(o, digits, len);
+      o += len;
+    } else {
+      o = dictcmp_key_put(o, unicode_casefold(c));
+    }
+  }
+  *o++ = 0;
+  return realloc(key, o - key);
+}
+
+
+#ifdef DICTCMP_BENCHMARK
+#include "arch/arch.h"
+
+static int
+dictcmp_qsort(const void *A, const void *B)
+{
+  return dictcmp(*(const char **)A, *(const char **)B);
+}
+
+static int
+strcmp_qsort(const void *A, const void *B)
+{
+  return strcmp(*(const char **)A, *(const char **)B);
+}
+
+/**
+ * Sort 100k synthetic library titles with dictcmp() and with
+ * dictcmp_key() + strcmp()
+ */
+void
+dictcmp_benchmark(void)
+{
+  static const char *words[] = {
+    "the", "The", "Love", "love", "night", "Night", "Étoile", "étoile",
+    "Über", "über", "Ärger", "Zebra", "a", "B", "Ωmega", "ωmega", "-",
+    "(Remix)", "Vol.", "Part", "Song", "song", "Blue", "blue",
+  };
+  const int num = 100000;
+  const char **v1 = malloc(sizeof(char *) * num);
+  const char **v2 = malloc(sizeof(char *) * num);
+  char **keys = malloc(sizeof(char *) * num);
+  char **titles = malloc(sizeof(char *) * num);
+  char buf[256];
+  int64_t ts;
+  int i, j, bad = 0;
+
+  for(i = 0; i < num; i++) {
+    int o = 0;
+    const int nw = 1 + rand() % 5;
+    for(j = 0; j < nw; j++) {
+      if(rand() % 4 == 0)
+        o += snprintf(buf + o, sizeof(buf) - o, "%s%0*d", j ? " " : "",
+                      rand() % 3, rand() % 200);
+      else
+        o += snprintf(buf + o, sizeof(buf) - o, "%s%s", j ? " " : "",
+                      words[rand() % (sizeof(words) / sizeof(words[0]))]);
+    }
+    titles[i] = strdup(buf);
+  }
+
+  memcpy(v1, titles, sizeof(char *) * num);
+  ts = arch_get_ts();
+  qsort(v1, num, sizeof(char *), dictcmp_qsort);
+  printf("dictcmp: sort with dictcmp():        %d ms\n",
+         (int)((arch_get_ts() - ts) / 1000));
+
+  ts = arch_get_ts();
+  for(i = 0; i < num; i++)
+    keys[i] = dictcmp_key(titles[i]);
+  printf("dictcmp: compute keys:               %d ms\n",
+         (int)((arch_get_ts() - ts) / 1000));
+
+  memcpy(v2, keys, sizeof(char *) * num);
+  ts = arch_get_ts();
+  qsort(v2, num, sizeof(char *), strcmp_qsort);
+  printf("dictcmp: sort with keys:             %d ms\n",
+         (int)((arch_get_ts() - ts) / 1000));
+
+  for(i = 0; i < num; i++) {
+    const int a = rand() % num;
+    const int b = rand() % num;
+    const int r1 = dictcmp(titles[a], titles[b]);
+    const int r2 = strcmp(keys[a], keys[b]);
+    if((r1 < 0) != (r2 < 0) || (r1 > 0) != (r2 > 0))
+      bad++;
+  }
+  printf("dictcmp: %d of %d random pairs disagree\n", bad, num);
+
+  for(i = 0; i < num; i++) {
+    free(titles[i]);
+    free(keys[i]);
+  }
+  free(titles);
+  free(keys);
+  free(v1);
+  free(v2);
+}
+#endif
+
+
+/**
+ * Casefold src into dst which must have room for 3 * strlen(src) + 1
+ * bytes. Returns the length of the result, not counting the terminator
+ */
+size_t
+utf8_casefold(char *dst, const char *src)
+{
+  char *o = dst;
+  int c;
+
+  while((c = utf8_get(&src)) != 0)
+    o += utf8_put(o, unicode_casefold(c));
+  *o = 0;
+  return o - dst;
+}
+
+
 /**
  *
  */
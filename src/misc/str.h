@@ -58,6 +58,10 @@ url_split(char *proto, int proto_size,
 
 int dictcmp(const char *a, const char *b);
 
+char *dictcmp_key(const char *str);
+
+void dictcmp_benchmark(void);
+
 int utf8_get(const char **s);
 
 int utf8_verify(const char *str);
@@ -68,6 +72,8 @@ char *utf8_cleanup(const char *str);
 
 const char *mystrstr(const char *haystack, const char *needle);
 
+size_t utf8_casefold(char *dst, const char *src);
+
 void strvec_addp(char ***str, const char *v);
 
 void strvec_addpn(char ***str, const char *v, size_t len);
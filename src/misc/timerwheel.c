@@ -0,0 +1,298 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define TIMERWHEEL_EXPIRED (TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS + 1)
+
+#define TIMERWHEEL_MAX_DELTA \
+  ((1ULL << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS)) - 1)
+
+
+/**
+ *
+ */
+void
+timerwheel_init(timerwheel_t *tw, int64_t now)
+{
+  memset(tw, 0, sizeof(timerwheel_t));
+  tw->tw_now = now / TIMERWHEEL_TICK;
+}
+
+
+/**
+ * Insert timer into the slot matching its expire time relative to tw_now
+ */
+static void
+tw_insert(timerwheel_t *tw, timerwheel_timer_t *twt)
+{
+  uint64_t tick = (twt->twt_expire + TIMERWHEEL_TICK - 1) / TIMERWHEEL_TICK;
+
+  if(twt->twt_expire <= 0 || tick <= tw->tw_now) {
+    LIST_INSERT_HEAD(&tw->tw_expired, twt, twt_link);
+    twt->twt_slot = TIMERWHEEL_EXPIRED;
+    return;
+  }
+
+  uint64_t delta = tick - tw->tw_now;
+  if(delta > TIMERWHEEL_MAX_DELTA) {
+    // Too far into the future, it will be reinserted when cascaded
+    delta = TIMERWHEEL_MAX_DELTA;
+    tick = tw->tw_now + delta;
+  }
+
+  int level = 0;
+  while(delta >= (1ULL << (TIMERWHEEL_BITS * (level + 1))))
+    level++;
+
+  const int slot = (tick >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK;
+
+  LIST_INSERT_HEAD(&tw->tw_slots[level][slot], twt, twt_link);
+  tw->tw_bitmap[level] |= 1ULL << slot;
+  twt->twt_slot = level * TIMERWHEEL_SLOTS + slot + 1;
+}
+
+
+/**
+ *
+ */
+static void
+tw_remove(timerwheel_t *tw, timerwheel_timer_t *twt)
+{
+  LIST_REMOVE(twt, twt_link);
+
+  if(twt->twt_slot != TIMERWHEEL_EXPIRED) {
+    const int level = (twt->twt_slot - 1) / TIMERWHEEL_SLOTS;
+    const int slot  = (twt->twt_slot - 1) & TIMERWHEEL_MASK;
+    if(LIST_EMPTY(&tw->tw_slots[level][slot]))
+      tw->tw_bitmap[level] &= ~(1ULL << slot);
+  }
+  twt->twt_slot = 0;
+}
+
+
+/**
+ *
+ */
+void
+timerwheel_arm(timerwheel_t *tw, timerwheel_timer_t *twt, int64_t expire)
+{
+  if(twt->twt_slot)
+    tw_remove(tw, twt);
+  twt->twt_expire = expire;
+  tw_insert(tw, twt);
+}
+
+
+/**
+ *
+ */
+void
+timerwheel_disarm(timerwheel_t *tw, timerwheel_timer_t *twt)
+{
+  if(twt->twt_slot)
+    tw_remove(tw, twt);
+}
+
+
+/**
+ * Return the tick at which the next non-empty slot on the given level
+ * must be processed (expired for level 0, cascaded for higher levels)
+ */
+static uint64_t
+tw_level_next(const timerwheel_t *tw, int level)
+{
+  const uint64_t bitmap = tw->tw_bitmap[level];
+  if(bitmap == 0)
+    return UINT64_MAX;
+
+  const int shift = TIMERWHEEL_BITS * level;
+  const uint64_t cur = tw->tw_now >> shift;
+  const uint64_t idx = cur & TIMERWHEEL_MASK;
+  const uint64_t later = bitmap & ~((2ULL << idx) - 1);
+  uint64_t slot = cur & ~(uint64_t)TIMERWHEEL_MASK;
+
+  if(later)
+    slot += __builtin_ctzll(later);
+  else
+    slot += TIMERWHEEL_SLOTS + __builtin_ctzll(bitmap);
+
+  return slot << shift;
+}
+
+
+/**
+ *
+ */
+static uint64_t
+tw_next_tick(const timerwheel_t *tw)
+{
+  uint64_t next = UINT64_MAX;
+  for(int i = 0; i < TIMERWHEEL_LEVELS; i++) {
+    uint64_t n = tw_level_next(tw, i);
+    if(n < next)
+      next = n;
+  }
+  return next;
+}
+
+
+/**
+ * Move all timers in a slot one level down (or to the expired list)
+ */
+static void
+tw_cascade(timerwheel_t *tw, int level, int slot)
+{
+  struct timerwheel_timer_list *l = &tw->tw_slots[level][slot];
+  timerwheel_timer_t *twt;
+
+  if(!(tw->tw_bitmap[level] & (1ULL << slot)))
+    return;
+
+  tw->tw_bitmap[level] &= ~(1ULL << slot);
+
+  while((twt = LIST_FIRST(l)) != NULL) {
+    LIST_REMOVE(twt, twt_link);
+    tw_insert(tw, twt);
+  }
+}
+
+
+/**
+ * Expire everything that is due at or before 'now'
+ *
+ * Expired timers are collected on a list and must be fetched with
+ * timerwheel_expired()
+ */
+void
+timerwheel_advance(timerwheel_t *tw, int64_t now)
+{
+  const uint64_t target = now / TIMERWHEEL_TICK;
+
+  while(1) {
+    const uint64_t tick = tw_next_tick(tw);
+    if(tick > target)
+      break;
+
+    tw->tw_now = tick;
+
+    // Higher levels are cascaded when all levels below wrap around
+    for(int i = 1; i < TIMERWHEEL_LEVELS; i++) {
+      if(tick & ((1ULL << (TIMERWHEEL_BITS * i)) - 1))
+        break;
+      tw_cascade(tw, i, (tick >> (TIMERWHEEL_BITS * i)) & TIMERWHEEL_MASK);
+    }
+
+    // Everything in the current level 0 slot expires at this tick
+    tw_cascade(tw, 0, tick & TIMERWHEEL_MASK);
+  }
+
+  if(target > tw->tw_now)
+    tw->tw_now = target;
+}
+
+
+/**
+ * Dequeue one expired timer, NULL if there are no more
+ */
+timerwheel_timer_t *
+timerwheel_expired(timerwheel_t *tw)
+{
+  timerwheel_timer_t *twt = LIST_FIRST(&tw->tw_expired);
+  if(twt != NULL) {
+    LIST_REMOVE(twt, twt_link);
+    twt->twt_slot = 0;
+  }
+  return twt;
+}
+
+
+/**
+ * Return time when timerwheel_advance() needs to be called next,
+ * INT64_MAX if no timers are armed
+ *
+ * This may be earlier than the first timer's expire time as timers
+ * far out in the future needs to be cascaded
+ */
+int64_t
+timerwheel_next_event(const timerwheel_t *tw)
+{
+  if(!LIST_EMPTY(&tw->tw_expired))
+    return tw->tw_now * TIMERWHEEL_TICK;
+
+  const uint64_t tick = tw_next_tick(tw);
+  if(tick == UINT64_MAX)
+    return INT64_MAX;
+  return tick * TIMERWHEEL_TICK;
+}
+
+
+#ifdef TIMERWHEEL_BENCHMARK
+#include <stdio.h>
+#include <stdlib.h>
+#include "main.h"
+
+/**
+ * Arm, rearm, disarm and expire 100k timers spread over one minute
+ */
+void
+timerwheel_benchmark(void)
+{
+  const int num = 100000;
+  timerwheel_timer_t *v = calloc(num, sizeof(timerwheel_timer_t));
+  timerwheel_t *tw = malloc(sizeof(timerwheel_t));
+  int64_t now = arch_get_ts();
+  int64_t ts;
+  int i, fired = 0;
+
+  timerwheel_init(tw, now);
+
+  ts = arch_get_ts();
+  for(i = 0; i < num; i++)
+    timerwheel_arm(tw, &v[i], now + rand() % 60000000);
+  printf("timerwheel: arm:    %.1f ns/timer\n",
+         (arch_get_ts() - ts) * 1000.0 / num);
+
+  ts = arch_get_ts();
+  for(i = 0; i < num; i++)
+    timerwheel_arm(tw, &v[i], now + rand() % 60000000);
+  printf("timerwheel: rearm:  %.1f ns/timer\n",
+         (arch_get_ts() - ts) * 1000.0 / num);
+
+  ts = arch_get_ts();
+  for(i = 0; i < num; i += 2)
+    timerwheel_disarm(tw, &v[i]);
+  printf("timerwheel: disarm: %.1f ns/timer\n",
+         (arch_get_ts() - ts) * 1000.0 / (num / 2));
+
+  ts = arch_get_ts();
+  while(timerwheel_next_event(tw) != INT64_MAX) {
+    timerwheel_advance(tw, timerwheel_next_event(tw));
+    while(timerwheel_expired(tw) != NULL)
+      fired++;
+  }
+  printf("timerwheel: expire: %.1f ns/timer (%d fired)\n",
+         (arch_get_ts() - ts) * 1000.0 / fired, fired);
+
+  free(tw);
+  free(v);
+}
+#endif
@@ -0,0 +1,75 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+#include <stdint.h>
+#include "queue.h"
+
+/**
+ * Hierarchical timing wheel
+ *
+ * Times are in microseconds (same domain as arch_get_ts()) but timers
+ * are bucketed with TIMERWHEEL_TICK granularity and never fire early.
+ * Arm and disarm are O(1). Expiry cascades timers down one level at a
+ * time and hands them back in batches via timerwheel_expired()
+ *
+ * The wheel does no locking of its own
+ */
+
+#define TIMERWHEEL_TICK   1000  // 1ms
+#define TIMERWHEEL_BITS   6
+#define TIMERWHEEL_SLOTS  (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_MASK   (TIMERWHEEL_SLOTS - 1)
+#define TIMERWHEEL_LEVELS 6     // 2^36 ticks, ~795 days
+
+LIST_HEAD(timerwheel_timer_list, timerwheel_timer);
+
+typedef struct timerwheel_timer {
+  LIST_ENTRY(timerwheel_timer) twt_link;
+  int64_t twt_expire;
+  int twt_slot;  // 0 = Not armed
+} timerwheel_timer_t;
+
+
+typedef struct timerwheel {
+  uint64_t tw_now; // In ticks
+  uint64_t tw_bitmap[TIMERWHEEL_LEVELS];
+  struct timerwheel_timer_list tw_expired;
+  struct timerwheel_timer_list tw_slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+} timerwheel_t;
+
+
+void timerwheel_init(timerwheel_t *tw, int64_t now);
+
+void timerwheel_arm(timerwheel_t *tw, timerwheel_timer_t *twt, int64_t expire);
+
+void timerwheel_disarm(timerwheel_t *tw, timerwheel_timer_t *twt);
+
+void timerwheel_advance(timerwheel_t *tw, int64_t now);
+
+timerwheel_timer_t *timerwheel_expired(timerwheel_t *tw);
+
+int64_t timerwheel_next_event(const timerwheel_t *tw);
+
+#define timerwheel_is_armed(twt) ((twt)->twt_slot != 0)
+
+#ifdef TIMERWHEEL_BENCHMARK
+void timerwheel_benchmark(void);
+#endif
@@ -96,8 +96,7 @@ static PP_Resource asyncio_msgloop;
 static void (*workers[MAX_WORKERS])(void);
 static int workers_cnt;
 
-LIST_HEAD(asyncio_timer_list, asyncio_timer);
-static struct asyncio_timer_list asyncio_timers;
+static timerwheel_t asyncio_timers;
 
 static void tcp_do_write(asyncio_fd_t *af);
 static void tcp_do_recv(asyncio_fd_t *af);
@@ -159,19 +158,7 @@ asyncio_timer_init(asyncio_timer_t *at, void (*fn)(void *opaque),
 {
   at->at_fn = fn;
   at->at_opaque = opaque;
-  at->at_expire = 0;
-}
-
-
-/**
- *
- */
-static int
-at_compar(const asyncio_timer_t *a, const asyncio_timer_t *b)
-{
-  if(a->at_expire < b->at_expire)
-    return -1;
-  return 1;
+  at->at_timer.twt_slot = 0;
 }
 
 
@@ -181,12 +168,12 @@ at_compar(const asyncio_timer_t *a, const asyncio_timer_t *b)
 static void
 process_timers(int64_t now)
 {
-  asyncio_timer_t *at;
+  timerwheel_timer_t *twt;
+
+  timerwheel_advance(&asyncio_timers, now);
 
-  while((at = LIST_FIRST(&asyncio_timers)) != NULL &&
-        at->at_expire <= now) {
-    LIST_REMOVE(at, at_link);
-    at->at_expire = 0;
+  while((twt = timerwheel_expired(&asyncio_timers)) != NULL) {
+    asyncio_timer_t *at = (asyncio_timer_t *)twt;
     at->at_fn(at->at_opaque);
   }
 }
@@ -198,11 +185,7 @@ process_timers(int64_t now)
 void
 asyncio_timer_arm(asyncio_timer_t *at, int64_t expire)
 {
-  if(at->at_expire)
-    LIST_REMOVE(at, at_link);
-
-  at->at_expire = expire;
-  LIST_INSERT_SORTED(&asyncio_timers, at, at_link, at_compar, asyncio_timer_t);
+  timerwheel_arm(&asyncio_timers, &at->at_timer, expire);
 }
 
 
@@ -222,10 +205,7 @@ asyncio_timer_arm_delta_sec(asyncio_timer_t *at, int delta)
 void
 asyncio_timer_disarm(asyncio_timer_t *at)
 {
-  if(at->at_expire) {
-    LIST_REMOVE(at, at_link);
-    at->at_expire = 0;
-  }
+  timerwheel_disarm(&asyncio_timers, &at->at_timer);
 }
 
 
@@ -1147,6 +1127,7 @@ void
 asyncio_init_early(void)
 {
   pthread_t p;
+  timerwheel_init(&asyncio_timers, arch_get_ts());
   asyncio_msgloop = ppb_messageloop->Create(g_Instance);
   pthread_create(&p, NULL, asyncio_thread, NULL);
 }
@@ -34,6 +34,9 @@
 #include "prop/prop.h"
 #include "misc/minmax.h"
 
+#if ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 /**
  *
@@ -56,26 +59,33 @@ static void asyncio_ssl_handshake(asyncio_fd_t *af);
 
 LIST_HEAD(asyncio_fd_list, asyncio_fd);
 LIST_HEAD(asyncio_worker_list, asyncio_worker);
-LIST_HEAD(asyncio_timer_list, asyncio_timer);
 TAILQ_HEAD(asyncio_dns_req_queue, asyncio_dns_req);
 TAILQ_HEAD(asyncio_task_queue, asyncio_task);
 
 static hts_thread_t asyncio_thread_id;
 
-static struct asyncio_timer_list asyncio_timers;
+static timerwheel_t asyncio_timers;
 
 static hts_mutex_t asyncio_worker_mutex;
 static struct asyncio_worker_list asyncio_workers;
 
 static int asyncio_pipe[2];
 static struct asyncio_fd_list asyncio_fds;
+static struct asyncio_fd_list asyncio_pending_fds;
 static int asyncio_num_fds;
 
+#if ENABLE_EPOLL
+static int asyncio_epoll_fd;
+static struct asyncio_fd_list asyncio_ssl_fds;
+#define ASYNCIO_EPOLL_MAX_EVENTS 64
+#endif
+
 struct prop_courier *asyncio_courier;
 
 static hts_mutex_t asyncio_dns_mutex;
 static int asyncio_dns_worker;
 static struct asyncio_dns_req_queue asyncio_dns_pending;
+static struct asyncio_dns_req_queue asyncio_dns_inflight;
 static struct asyncio_dns_req_queue asyncio_dns_completed;
 
 static hts_mutex_t asyncio_task_mutex;
@@ -83,6 +93,10 @@ static struct asyncio_task_queue asyncio_tasks;
 
 static void adr_deliver_cb(void);
 
+#ifdef ASYNCIO_BENCHMARK
+static void asyncio_benchmark(void);
+#endif
+
 static int64_t async_now;
 
 static __inline void asyncio_verify_thread(void) {
@@ -105,6 +119,7 @@ typedef struct asyncio_worker {
  */
 struct asyncio_fd {
   LIST_ENTRY(asyncio_fd) af_link;
+  LIST_ENTRY(asyncio_fd) af_pending_link;
   asyncio_fd_callback_t *af_callback;
   void *af_opaque;
   char *af_name;
@@ -120,13 +135,19 @@ struct asyncio_fd {
   htsbuf_queue_t af_sendq;
   htsbuf_queue_t af_recvq;
 
-  int64_t af_timeout;
+  asyncio_timer_t af_timeout;
 
   int af_refcount;
   int af_fd;
   int af_poll_events;
   int af_pending_errno;
 
+#if ENABLE_EPOLL
+  LIST_ENTRY(asyncio_fd) af_ssl_link;
+  int af_epoll_fd;      // fd currently registered with epoll or -1
+  int af_epoll_events;  // poll events currently registered with epoll
+#endif
+
   uint16_t af_ext_events;
   uint8_t af_connected;
 
@@ -273,19 +294,7 @@ asyncio_timer_init(asyncio_timer_t *at, void (*fn)(void *opaque),
 {
   at->at_fn = fn;
   at->at_opaque = opaque;
-  at->at_expire = 0;
-}
-
-
-/**
- *
- */
-static int
-at_compar(const asyncio_timer_t *a, const asyncio_timer_t *b)
-{
-  if(a->at_expire < b->at_expire)
-    return -1;
-  return 1;
+  at->at_timer.twt_slot = 0;
 }
 
 
@@ -296,11 +305,7 @@ void
 asyncio_timer_arm(asyncio_timer_t *at, int64_t expire)
 {
   asyncio_verify_thread();
-  if(at->at_expire)
-    LIST_REMOVE(at, at_link);
-
-  at->at_expire = expire;
-  LIST_INSERT_SORTED(&asyncio_timers, at, at_link, at_compar, asyncio_timer_t);
+  timerwheel_arm(&asyncio_timers, &at->at_timer, expire);
 }
 
 
@@ -321,10 +326,7 @@ void
 asyncio_timer_disarm(asyncio_timer_t *at)
 {
   asyncio_verify_thread();
-  if(at->at_expire) {
-    LIST_REMOVE(at, at_link);
-    at->at_expire = 0;
-  }
+  timerwheel_disarm(&asyncio_timers, &at->at_timer);
 }
 
 
@@ -364,47 +366,240 @@ events_to_poll(int events)
     (events & ASYNCIO_ERROR ? (POLLHUP|POLLERR) : 0);
 }
 
+
 /**
- *
+ * Run expired timers
  */
 static void
-asyncio_dopoll(void)
+asyncio_run_timers(void)
 {
-  asyncio_timer_t *at;
+  timerwheel_timer_t *twt;
 
-  while((at = LIST_FIRST(&asyncio_timers)) != NULL &&
-        at->at_expire <= async_now) {
-    LIST_REMOVE(at, at_link);
-    at->at_expire = 0;
+  timerwheel_advance(&asyncio_timers, async_now);
+
+  while((twt = timerwheel_expired(&asyncio_timers)) != NULL) {
+    asyncio_timer_t *at = (asyncio_timer_t *)twt;
     at->at_fn(at->at_opaque);
   }
+}
 
+
+/**
+ * Poll timeout in ms until the next timer fires, -1 if none is armed
+ */
+static int
+asyncio_timer_timeout(void)
+{
+  const int64_t next = timerwheel_next_event(&asyncio_timers);
+  if(next == INT64_MAX)
+    return -1;
+  return MAX(0, MIN(INT32_MAX, (next - async_now + 999) / 1000));
+}
+
+
+/**
+ * Deliver errors that were detected outside of the poll loop
+ * (failed connect(), failed send(), etc)
+ */
+static void
+asyncio_run_pending(void)
+{
   asyncio_fd_t *af;
-  struct pollfd *fds = alloca(asyncio_num_fds * sizeof(struct pollfd));
-  asyncio_fd_t **afds  = alloca(asyncio_num_fds * sizeof(asyncio_fd_t *));
-  int n = 0;
 
-  int timeout = INT32_MAX;
+  while((af = LIST_FIRST(&asyncio_pending_fds)) != NULL) {
+    LIST_REMOVE(af, af_pending_link);
+    const int err = af->af_pending_errno;
+    af->af_pending_errno = 0;
+    af->af_refcount++;
+    af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, err);
+    af_release(af);
+  }
+}
 
-  LIST_FOREACH(af, &asyncio_fds, af_link) {
-    if(af->af_pending_errno) {
-      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, af->af_pending_errno);
-      goto release;
-    }
 
-    if(af->af_timeout) {
-      if(af->af_timeout <= async_now) {
-        af->af_timeout = 0;
-        af->af_callback(af, af->af_opaque, ASYNCIO_TIMEOUT, 0);
-        goto release;
+/**
+ *
+ */
+static void
+asyncio_dispatch(asyncio_fd_t *af, int revents, int poll_failed)
+{
+  if(af->af_callback == NULL || af->af_fd == -1)
+    return;
+
+  if(revents & POLLHUP) {
+    af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, ECONNRESET);
+    return;
+  }
+
+  if(revents & POLLERR || poll_failed) {
+    int err;
+    socklen_t errlen = sizeof(int);
+
+    if(getsockopt(af->af_fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen)) {
+      TRACE(TRACE_ERROR, "ASYNCIO", "getsockopt failed for %s 0x%x -- %s",
+            af->af_name, af->af_fd, strerror(errno));
+      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, ENOBUFS);
+    } else {
+      if(err) {
+        af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, err);
+        return;
       }
-      timeout = MIN(timeout, (af->af_timeout - async_now + 999) / 1000);
     }
+  }
+
+  const int events =
+    (revents & POLLIN  ? ASYNCIO_READ  : 0) |
+    (revents & POLLOUT ? ASYNCIO_WRITE : 0);
+
+  if(events)
+    af->af_callback(af, af->af_opaque, events, 0);
+}
+
+
+#if ENABLE_EPOLL
+
+/**
+ *
+ */
+static int
+poll_to_epoll(int events)
+{
+  return
+    (events & POLLIN  ? EPOLLIN  : 0) |
+    (events & POLLOUT ? EPOLLOUT : 0) |
+    (events & POLLHUP ? EPOLLHUP : 0) |
+    (events & POLLERR ? EPOLLERR : 0);
+}
+
+
+/**
+ *
+ */
+static int
+epoll_to_poll(int events)
+{
+  return
+    (events & EPOLLIN  ? POLLIN  : 0) |
+    (events & EPOLLOUT ? POLLOUT : 0) |
+    (events & EPOLLHUP ? POLLHUP : 0) |
+    (events & EPOLLERR ? POLLERR : 0);
+}
+
+
+/**
+ * Make sure the kernel's view of the fd matches af_fd and af_poll_events
+ */
+static void
+asyncio_epoll_update(asyncio_fd_t *af, int events)
+{
+  struct epoll_event ev = {0};
+
+  if(af->af_epoll_fd != -1 && af->af_epoll_fd != af->af_fd) {
+    epoll_ctl(asyncio_epoll_fd, EPOLL_CTL_DEL, af->af_epoll_fd, &ev);
+    af->af_epoll_fd = -1;
+  }
+
+  if(af->af_fd == -1)
+    return;
+
+  ev.events = poll_to_epoll(events);
+  ev.data.ptr = af;
+
+  if(af->af_epoll_fd == -1) {
+    if(epoll_ctl(asyncio_epoll_fd, EPOLL_CTL_ADD, af->af_fd, &ev)) {
+      TRACE(TRACE_ERROR, "ASYNCIO", "%s: Unable to add fd %d to epoll -- %s",
+            af->af_name, af->af_fd, strerror(errno));
+      return;
+    }
+    af->af_epoll_fd = af->af_fd;
+  } else if(af->af_epoll_events == events) {
+    return;
+  } else if(epoll_ctl(asyncio_epoll_fd, EPOLL_CTL_MOD, af->af_fd, &ev)) {
+    TRACE(TRACE_ERROR, "ASYNCIO", "%s: Unable to modify fd %d in epoll -- %s",
+          af->af_name, af->af_fd, strerror(errno));
+  }
+  af->af_epoll_events = events;
+}
 
+
+/**
+ *
+ */
+static void
+asyncio_dopoll(void)
+{
+  struct epoll_event ev[ASYNCIO_EPOLL_MAX_EVENTS];
+  asyncio_fd_t *afds[ASYNCIO_EPOLL_MAX_EVENTS];
+  asyncio_fd_t *af;
+
+  asyncio_run_timers();
+
+  asyncio_run_pending();
+
+  // Error callbacks above may have armed timers
+  int timeout = asyncio_timer_timeout();
+
+#if ENABLE_OPENSSL
+  // Wanted events for SSL sockets depend on the state of the SSL engine
+  LIST_FOREACH(af, &asyncio_ssl_fds, af_ssl_link)
+    if(af->af_fd != -1)
+      asyncio_epoll_update(af, asyncio_ssl_events(af));
+#endif
+
+  if(!LIST_EMPTY(&asyncio_pending_fds))
+    timeout = 0;
+
+  int n = epoll_wait(asyncio_epoll_fd, ev, ASYNCIO_EPOLL_MAX_EVENTS, timeout);
+
+  async_now = arch_get_ts();
+
+  if(n < 0) {
+    if(errno != EINTR)
+      TRACE(TRACE_ERROR, "ASYNCIO", "epoll_wait failed -- %s",
+            strerror(errno));
+    return;
+  }
+
+  // Hold a reference on everything we're about to dispatch, a callback
+  // may delete any other fd in this batch
+  for(int i = 0; i < n; i++) {
+    afds[i] = ev[i].data.ptr;
+    afds[i]->af_refcount++;
+  }
+
+  for(int i = 0; i < n; i++)
+    asyncio_dispatch(afds[i], epoll_to_poll(ev[i].events), 0);
+
+  for(int i = 0; i < n; i++)
+    af_release(afds[i]);
+}
+
+#else
+
+/**
+ *
+ */
+static void
+asyncio_dopoll(void)
+{
+  asyncio_fd_t *af;
+
+  asyncio_run_timers();
+
+  asyncio_run_pending();
+
+  // Error callbacks above may have armed timers
+  int timeout = asyncio_timer_timeout();
+
+  struct pollfd *fds = alloca(asyncio_num_fds * sizeof(struct pollfd));
+  asyncio_fd_t **afds  = alloca(asyncio_num_fds * sizeof(asyncio_fd_t *));
+  int n = 0;
+
+  LIST_FOREACH(af, &asyncio_fds, af_link) {
     if(af->af_fd == -1) {
       continue;
     }
-    
+
     fds[n].fd = af->af_fd;
 
 #if ENABLE_OPENSSL
@@ -421,66 +616,65 @@ asyncio_dopoll(void)
     n++;
   }
 
-  if((at = LIST_FIRST(&asyncio_timers)) != NULL)
-    timeout = MIN(timeout, (at->at_expire - async_now + 999) / 1000);
-
-  if(timeout == INT32_MAX)
-    timeout = -1;
+  if(!LIST_EMPTY(&asyncio_pending_fds))
+    timeout = 0;
 
   int err = poll(fds, n, timeout);
 
   async_now = arch_get_ts();
 
-  for(int i = 0; i < n; i++) {
-    af = afds[i];
-
-    if(af->af_callback == NULL)
-      continue;
+  for(int i = 0; i < n; i++)
+    asyncio_dispatch(afds[i], fds[i].revents, err < 0);
 
-    if(fds[i].revents & POLLHUP) {
-      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, ECONNRESET);
-      continue;
-    }
+  for(int i = 0; i < n; i++)
+    af_release(afds[i]);
+}
 
-    if(fds[i].revents & POLLERR || err < 0) {
-      int err;
-      socklen_t errlen = sizeof(int);
+#endif
 
-      if(getsockopt(af->af_fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen)) {
-        TRACE(TRACE_ERROR, "ASYNCIO", "getsockopt failed for %s 0x%x -- %s",
-              af->af_name, af->af_fd, strerror(errno));
-        af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, ENOBUFS);
-      } else {
-        if(err) {
-          af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, err);
-          continue;
-        }
-      }
-    }
 
-    const int events =
-      (fds[i].revents & POLLIN  ? ASYNCIO_READ  : 0) |
-      (fds[i].revents & POLLOUT ? ASYNCIO_WRITE : 0);
+/**
+ * Change the fd backing an asyncio_fd (-1 closes it)
+ */
+static void
+asyncio_set_fd(asyncio_fd_t *af, int fd)
+{
+  const int old = af->af_fd;
+  af->af_fd = fd;
+#if ENABLE_EPOLL
+  asyncio_epoll_update(af, af->af_poll_events);
+#endif
+  if(old != -1 && old != fd)
+    close(old);
+}
 
-    if(events)
-      af->af_callback(af, af->af_opaque, events, 0);
 
-    if(0) {
-      int64_t now = arch_get_ts();
+/**
+ *
+ */
+static void
+asyncio_set_pending_errno(asyncio_fd_t *af, int err)
+{
+  if(!af->af_pending_errno)
+    LIST_INSERT_HEAD(&asyncio_pending_fds, af, af_pending_link);
+  af->af_pending_errno = err;
+}
 
-      if(now - async_now > 10000) {
-        TRACE(TRACE_ERROR, "ASYNCIO", "Long callback on socktet %s (%d µs)",
-              af->af_name, (int) (now - async_now));
-      }
-      async_now = now;
-    }
-  }
 
+/**
+ *
+ */
+static void
+asyncio_fd_timeout(void *opaque)
+{
+  asyncio_fd_t *af = opaque;
 
- release:
+  if(af->af_callback == NULL)
+    return;
 
-  for(int i = 0; i < n; i++)
-    af_release(afds[i]);
+  af->af_refcount++;
+  af->af_callback(af, af->af_opaque, ASYNCIO_TIMEOUT, 0);
+  af_release(af);
 }
 
 
@@ -494,6 +688,13 @@ asyncio_set_events(asyncio_fd_t *af, int events)
   af->af_ext_events = events;
 
   af->af_poll_events = events_to_poll(events);
+#if ENABLE_EPOLL
+#if ENABLE_OPENSSL
+  if(af->af_ssl != NULL)
+    return;
+#endif
+  asyncio_epoll_update(af, af->af_poll_events);
+#endif
 }
 
 
@@ -531,6 +732,10 @@ asyncio_add_fd(int fd, int events, asyncio_fd_callback_t *cb, void *opaque,
   af->af_refcount = 1;
   af->af_fd = fd;
   af->af_name = strdup(name);
+#if ENABLE_EPOLL
+  af->af_epoll_fd = -1;
+#endif
+  asyncio_timer_init(&af->af_timeout, asyncio_fd_timeout, af);
   asyncio_set_events(af, events);
   af->af_callback = cb;
   af->af_opaque = opaque;
@@ -556,12 +761,18 @@ asyncio_del_fd(asyncio_fd_t *af)
     SSL_shutdown(af->af_ssl);
     SSL_free(af->af_ssl);
     af->af_ssl = NULL;
+#if ENABLE_EPOLL
+    LIST_REMOVE(af, af_ssl_link);
+#endif
   }
 #endif
 
-  if(af->af_fd != -1)
-    close(af->af_fd);
-  af->af_fd = -1;
+  asyncio_set_fd(af, -1);
+  asyncio_timer_disarm(&af->af_timeout);
+  if(af->af_pending_errno) {
+    LIST_REMOVE(af, af_pending_link);
+    af->af_pending_errno = 0;
+  }
   LIST_REMOVE(af, af_link);
   asyncio_num_fds--;
   af->af_callback = NULL;
@@ -575,7 +786,7 @@ asyncio_del_fd(asyncio_fd_t *af)
 void
 asyncio_set_timeout_delta_sec(asyncio_fd_t *af, int delta)
 {
-  af->af_timeout = delta * 1000000LL + async_now;
+  asyncio_timer_arm_delta_sec(&af->af_timeout, delta);
 }
 
 /**
@@ -662,6 +873,10 @@ asyncio_thread(void *aux)
 
   async_now = arch_get_ts();
 
+#ifdef ASYNCIO_BENCHMARK
+  asyncio_benchmark();
+#endif
+
   init_group(INIT_GROUP_ASYNCIO);
 
   asyncio_trig_network_change();
@@ -698,6 +913,7 @@ asyncio_init_early(void)
 {
   TAILQ_INIT(&asyncio_tasks);
   TAILQ_INIT(&asyncio_dns_pending);
+  TAILQ_INIT(&asyncio_dns_inflight);
   TAILQ_INIT(&asyncio_dns_completed);
   TAILQ_INIT(&asyncio_tasks);
 
@@ -705,8 +921,19 @@ asyncio_init_early(void)
   hts_mutex_init(&asyncio_dns_mutex);
   hts_mutex_init(&asyncio_task_mutex);
 
+  timerwheel_init(&asyncio_timers, arch_get_ts());
+
   arch_pipe(asyncio_pipe);
 
+#if ENABLE_EPOLL
+  asyncio_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if(asyncio_epoll_fd == -1) {
+    TRACE(TRACE_EMERG, "ASYNCIO", "Unable to create epoll fd -- %s",
+          strerror(errno));
+    exit(1);
+  }
+#endif
+
   asyncio_dns_worker = asyncio_add_worker(adr_deliver_cb);
 }
 
@@ -856,7 +1083,7 @@ asyncio_tcp_resume(asyncio_fd_t *af)
     return;
 
   net_change_nonblocking(fd, 1);
-  af->af_fd = fd;
+  asyncio_set_fd(af, fd);
   asyncio_set_events(af, ASYNCIO_READ);
   af->af_suspended = 0;
   TRACE(TRACE_INFO, "TCP", "%s: Resumed listening on port %d", af->af_name, asyncio_get_port(af));
@@ -922,7 +1149,7 @@ do_write(asyncio_fd_t *af)
 
     if(r == -1) {
       asyncio_rem_events(af, ASYNCIO_WRITE);
-      af->af_pending_errno = errno;
+      asyncio_set_pending_errno(af, errno);
       return;
     }
 
@@ -980,13 +1207,13 @@ asyncio_tcp_connected(asyncio_fd_t *af, void *opaque, int events, int error)
   if(events & ASYNCIO_ERROR) {
     char buf[256];
     snprintf(buf, sizeof(buf), "%s", strerror(error));
-    af->af_timeout = 0;
+    asyncio_timer_disarm(&af->af_timeout);
     af->af_error_callback(af->af_opaque, buf);
     return 0;
   }
 
   if(events & ASYNCIO_READ) {
-    af->af_timeout = 0;
+    asyncio_timer_disarm(&af->af_timeout);
 #if ENABLE_OPENSSL
     if(af->af_ssl != NULL) {
       asyncio_ssl_read(af);
@@ -1010,7 +1237,7 @@ asyncio_tcp_connected(asyncio_fd_t *af, void *opaque, int events, int error)
       return 0;
     }
 
-    af->af_timeout = 0;
+    asyncio_timer_disarm(&af->af_timeout);
 
     asyncio_rem_events(af, ASYNCIO_WRITE);
     int err;
@@ -1111,7 +1338,7 @@ asyncio_connect(const char *name, const net_addr_t *addr,
 
   af->af_error_callback = error_cb;
   af->af_read_callback  = read_cb;
-  af->af_timeout = arch_get_ts() + timeout * 1000;
+  asyncio_timer_arm(&af->af_timeout, arch_get_ts() + timeout * 1000);
   af->af_hostname = hostname ? strdup(hostname) : NULL;
 
 #if ENABLE_OPENSSL
@@ -1119,6 +1346,9 @@ asyncio_connect(const char *name, const net_addr_t *addr,
     af->af_ssl = SSL_new(tlsctx);
     if(hostname != NULL)
       SSL_set_tlsext_host_name(af->af_ssl, hostname);
+#if ENABLE_EPOLL
+    LIST_INSERT_HEAD(&asyncio_ssl_fds, af, af_ssl_link);
+#endif
   }
 #endif
 
@@ -1130,7 +1360,7 @@ asyncio_connect(const char *name, const net_addr_t *addr,
     } else {
       // Got fail directly, but we still want to notify the user about
       // the error asynchronously. Just to make things easier
-      af->af_pending_errno = errno;
+      asyncio_set_pending_errno(af, errno);
     }
   } else {
     asyncio_add_events(af, ASYNCIO_WRITE);
@@ -1163,11 +1393,13 @@ asyncio_attach(const char *name, int fd,
       TRACE(TRACE_ERROR, "ASYNCIO", "SSL: Unable to set FD");
     }
     SSL_set_accept_state(af->af_ssl);
+#if ENABLE_EPOLL
+    LIST_INSERT_HEAD(&asyncio_ssl_fds, af, af_ssl_link);
+#endif
   }
 #endif
 
   af->af_connected = 1;
-  af->af_fd = fd;
   af->af_error_callback = error_cb;
   af->af_read_callback  = read_cb;
   return af;
@@ -1190,8 +1422,14 @@ asyncio_get_port(asyncio_fd_t *af)
 
 /**
  * DNS handling
+ *
+ * Lookups are done by a small pool of resolver threads. Requests for a
+ * hostname that is already queued or being resolved are attached to
+ * that request (as followers) and completed together with it
  */
 
+#define ASYNCIO_DNS_THREADS 4
+
 struct asyncio_dns_req {
   TAILQ_ENTRY(asyncio_dns_req) adr_link;
   char *adr_hostname;
@@ -1203,10 +1441,13 @@ struct asyncio_dns_req {
   const void *adr_data;
   const char *adr_errmsg;
   net_addr_t adr_addr;
+
+  struct asyncio_dns_req_queue adr_followers;
 };
 
 
-static int adr_resolver_running;
+static int adr_resolvers_running;
+static int adr_num_pending;
 
 /**
  *
@@ -1218,37 +1459,75 @@ adr_resolve(asyncio_dns_req_t *adr)
 }
 
 
+/**
+ *
+ */
+static void
+adr_set_result(asyncio_dns_req_t *adr, int failed)
+{
+  if(failed) {
+    adr->adr_status = ASYNCIO_DNS_STATUS_FAILED;
+    adr->adr_data = adr->adr_errmsg;
+  } else {
+    adr->adr_status = ASYNCIO_DNS_STATUS_COMPLETED;
+    adr->adr_data = &adr->adr_addr;
+  }
+}
+
+
 /**
  *
  */
 static void *
 adr_resolver(void *aux)
 {
-  asyncio_dns_req_t *adr;
+  asyncio_dns_req_t *adr, *f;
   hts_mutex_lock(&asyncio_dns_mutex);
   while((adr = TAILQ_FIRST(&asyncio_dns_pending)) != NULL) {
     TAILQ_REMOVE(&asyncio_dns_pending, adr, adr_link);
+    TAILQ_INSERT_TAIL(&asyncio_dns_inflight, adr, adr_link);
+    adr_num_pending--;
 
     hts_mutex_unlock(&asyncio_dns_mutex);
 
-    
-    if(adr_resolve(adr)) {
-      adr->adr_status = ASYNCIO_DNS_STATUS_FAILED;
-      adr->adr_data = adr->adr_errmsg;
-    } else {
-      adr->adr_status = ASYNCIO_DNS_STATUS_COMPLETED;
-      adr->adr_data = &adr->adr_addr;
-    }
+    const int failed = adr_resolve(adr);
+    adr_set_result(adr, failed);
+
     hts_mutex_lock(&asyncio_dns_mutex);
+    TAILQ_REMOVE(&asyncio_dns_inflight, adr, adr_link);
+
+    while((f = TAILQ_FIRST(&adr->adr_followers)) != NULL) {
+      TAILQ_REMOVE(&adr->adr_followers, f, adr_link);
+      f->adr_addr = adr->adr_addr;
+      f->adr_errmsg = adr->adr_errmsg;
+      adr_set_result(f, failed);
+      TAILQ_INSERT_TAIL(&asyncio_dns_completed, f, adr_link);
+    }
+
     TAILQ_INSERT_TAIL(&asyncio_dns_completed, adr, adr_link);
     asyncio_wakeup(asyncio_dns_worker);
   }
 
-  adr_resolver_running = 0;
+  adr_resolvers_running--;
   hts_mutex_unlock(&asyncio_dns_mutex);
   return NULL;
 }
 
+
+/**
+ *
+ */
+static asyncio_dns_req_t *
+adr_find_leader(struct asyncio_dns_req_queue *q, const char *hostname)
+{
+  asyncio_dns_req_t *adr;
+  TAILQ_FOREACH(adr, q, adr_link)
+    if(!strcasecmp(adr->adr_hostname, hostname))
+      return adr;
+  return NULL;
+}
+
+
 /**
  *
  */
@@ -1259,19 +1538,41 @@ asyncio_dns_lookup_host(const char *hostname,
 				   const void *data),
 			void *opaque)
 {
-  asyncio_dns_req_t *adr;
+  asyncio_dns_req_t *adr, *leader;
 
   adr = calloc(1, sizeof(asyncio_dns_req_t));
   adr->adr_hostname = strdup(hostname);
   adr->adr_cb = cb;
   adr->adr_opaque = opaque;
-  
+  TAILQ_INIT(&adr->adr_followers);
+
+  int r = net_resolve_cached(hostname, &adr->adr_addr, &adr->adr_errmsg);
+
   hts_mutex_lock(&asyncio_dns_mutex);
-  TAILQ_INSERT_TAIL(&asyncio_dns_pending, adr, adr_link);
-  if(!adr_resolver_running) {
-    adr_resolver_running = 1;
-    hts_thread_create_detached("DNS resolver", adr_resolver, NULL, 
-			       THREAD_PRIO_BGTASK);
+
+  if(r != 1) {
+    // Answered from cache, still deliver via the worker so the callback
+    // is never invoked from within this function
+    adr_set_result(adr, r);
+    TAILQ_INSERT_TAIL(&asyncio_dns_completed, adr, adr_link);
+    asyncio_wakeup(asyncio_dns_worker);
+
+  } else if((leader = adr_find_leader(&asyncio_dns_inflight,
+                                      hostname)) != NULL ||
+            (leader = adr_find_leader(&asyncio_dns_pending,
+                                      hostname)) != NULL) {
+    TAILQ_INSERT_TAIL(&leader->adr_followers, adr, adr_link);
+
+  } else {
+    TAILQ_INSERT_TAIL(&asyncio_dns_pending, adr, adr_link);
+    adr_num_pending++;
+
+    if(adr_resolvers_running < ASYNCIO_DNS_THREADS &&
+       adr_resolvers_running < adr_num_pending) {
+      adr_resolvers_running++;
+      hts_thread_create_detached("DNS resolver", adr_resolver, NULL,
+                                 THREAD_PRIO_BGTASK);
+    }
   }
   hts_mutex_unlock(&asyncio_dns_mutex);
   return adr;
@@ -1387,7 +1688,7 @@ asyncio_udp_resume(asyncio_fd_t *af)
     return;
 
   net_change_nonblocking(fd, 1);
-  af->af_fd = fd;
+  asyncio_set_fd(af, fd);
   asyncio_set_events(af, af->af_ext_events);
   af->af_suspended = 0;
   TRACE(TRACE_INFO, "UDP", "%s: Resumed listening on port %d", af->af_name, asyncio_get_port(af));
@@ -1403,8 +1704,7 @@ asyncio_udp_event(asyncio_fd_t *af, void *opaque, int events, int error)
   static uint8_t udp_recv_buf[8192];
 
   if(events & ASYNCIO_ERROR) {
-    close(af->af_fd);
-    af->af_fd = -1;
+    asyncio_set_fd(af, -1);
     af->af_suspended = 1;
     return 0;
   }
@@ -1568,8 +1868,7 @@ asyncio_do_suspend(void *aux)
     if(af->af_fd == -1)
       continue;
     af->af_suspended = 1;
-    close(af->af_fd);
-    af->af_fd = -1;
+    asyncio_set_fd(af, -1);
   }
 }
 
@@ -1837,3 +2136,71 @@ asyncio_ssl_free(void *ctx)
 }
 
 #endif
+
+
+#ifdef ASYNCIO_BENCHMARK
+#include <sys/resource.h>
+
+static int asyncio_bench_wakeups;
+
+static int
+asyncio_bench_cb(asyncio_fd_t *af, void *opaque, int events, int error)
+{
+  char x;
+  if(read(af->af_fd, &x, 1) == 1)
+    asyncio_bench_wakeups++;
+  return 0;
+}
+
+
+/**
+ * Measure cost of a single fd wakeup with a varying number of idle
+ * registered fds
+ */
+static void
+asyncio_benchmark(void)
+{
+  static const int sizes[] = {10, 100, 1000};
+  const int rounds = 10000;
+  struct rlimit rl;
+
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  for(int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    const int num = sizes[s];
+    int *wfd = malloc(num * sizeof(int));
+    asyncio_fd_t **afs = malloc(num * sizeof(asyncio_fd_t *));
+    int n;
+
+    for(n = 0; n < num; n++) {
+      int fds[2];
+      if(pipe(fds))
+        break;
+      wfd[n] = fds[1];
+      afs[n] = asyncio_add_fd(fds[0], ASYNCIO_READ, asyncio_bench_cb,
+                              NULL, "bench");
+    }
+
+    asyncio_bench_wakeups = 0;
+    int64_t ts = arch_get_ts();
+    for(int i = 0; i < rounds; i++) {
+      if(write(wfd[i % n], "x", 1) != 1)
+        break;
+      asyncio_dopoll();
+    }
+    ts = arch_get_ts() - ts;
+
+    printf("asyncio: %4d fds: %d wakeups, %.2f µs/wakeup\n",
+           n, asyncio_bench_wakeups, (double)ts / rounds);
+
+    for(int i = 0; i < n; i++) {
+      asyncio_del_fd(afs[i]);
+      close(wfd[i]);
+    }
+    free(afs);
+    free(wfd);
+  }
+}
+#endif
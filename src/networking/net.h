@@ -59,6 +59,8 @@ tcpcon_t *tcp_from_fd(int fd);
 
 int tcp_get_fd(const tcpcon_t *tc);
 
+int tcp_ssl_resumed(const tcpcon_t *tc);
+
 int tcp_write_queue(tcpcon_t *nc, htsbuf_queue_t *q);
 
 int tcp_write_queue_dontfree(tcpcon_t *nc, htsbuf_queue_t *q);
@@ -91,6 +93,11 @@ void tcp_set_read_timeout(tcpcon_t *tc, int ms);
 
 int net_resolve(const char *hostname, net_addr_t *addr, const char **errmsg);
 
+int net_resolve_cached(const char *hostname, net_addr_t *addr,
+                       const char **errmsg);
+
+void net_dns_flush(void);
+
 int net_resolve_numeric(const char *hostname, net_addr_t *addr);
 
 void net_change_nonblocking(int fd, int on);
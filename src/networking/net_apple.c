@@ -97,7 +97,7 @@ ssl_write_func(SSLConnectionRef connection, const void *data, size_t *len)
  */
 int
 tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen, const char *hostname,
-             int verify)
+             int port, int verify)
 {
   tc->ssl = SSLCreateContext(NULL, kSSLClientSide, kSSLStreamType);
 
@@ -112,9 +112,15 @@ tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen, const char *hostname,
   SSLSetIOFuncs(tc->ssl, ssl_read_func, ssl_write_func);
   SSLSetConnection(tc->ssl, tc);
 
-  if(hostname != NULL)
+  if(hostname != NULL) {
     SSLSetPeerDomainName(tc->ssl, hostname, strlen(hostname));
 
+    // Lets Secure Transport resume sessions from its own cache
+    char peerid[512];
+    snprintf(peerid, sizeof(peerid), "%s:%d", hostname, port);
+    SSLSetPeerID(tc->ssl, peerid, strlen(peerid));
+  }
+
   OSStatus retValue = SSLHandshake(tc->ssl);
 
   if(retValue != noErr) {
@@ -332,6 +332,16 @@ tcp_get_fd(const tcpcon_t *tc)
 }
 
 
+/**
+ *
+ */
+int
+tcp_ssl_resumed(const tcpcon_t *tc)
+{
+  return tc->ssl_resumed;
+}
+
+
 /**
  *
  */
@@ -528,7 +538,8 @@ tcp_connect(const char *hostname, int port,
  connected:
   if(flags & TCP_SSL) {
 
-    if(tcp_ssl_open(tc, errbuf, errlen, hostname, flags & TCP_SSL_VERIFY)) {
+    if(tcp_ssl_open(tc, errbuf, errlen, hostname, port,
+                    flags & TCP_SSL_VERIFY)) {
       tcp_close(tc);
       return NULL;
     }
@@ -571,6 +582,9 @@ net_is_addr_in_netif(const netif_t *ni, const net_addr_t *na)
 void
 net_refresh_network_status(void)
 {
+  // Cached lookups may not be valid on the new network
+  net_dns_flush();
+
   netif_t *ni = net_get_interfaces();
   char tmp[32];
   prop_t *np = prop_create(prop_get_global(), "net");
@@ -0,0 +1,417 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "net_i.h"
+#include "misc/callout.h"
+#include "prop/prop.h"
+
+/**
+ * DNS cache shared by tcp_connect() and the asyncio DNS lookups.
+ *
+ * The system resolvers we use don't tell us the TTL of the records so
+ * entries are kept for a fixed time. A positive entry that has expired
+ * is still returned for a while (DNS_STALE_TIME) while it's refreshed
+ * in the background. Lookups of a hostname that is already being
+ * resolved wait for that lookup instead of asking the resolver again
+ */
+
+#define DNS_CACHE_SIZE   256
+#define DNS_HASH_SIZE    64
+
+#define DNS_POSITIVE_TTL (60 * 1000000LL)
+#define DNS_NEGATIVE_TTL (10 * 1000000LL)
+#define DNS_STALE_TIME   (600 * 1000000LL)
+
+LIST_HEAD(dns_entry_list, dns_entry);
+
+typedef struct dns_entry {
+  LIST_ENTRY(dns_entry) de_link;
+  char *de_hostname;
+
+  int64_t de_expire;
+  net_addr_t de_addr;
+  const char *de_errmsg;  // Set for negative entries
+
+  char de_valid;          // de_addr or de_errmsg is set
+  char de_resolving;      // Lookup in progress
+
+} dns_entry_t;
+
+static struct dns_entry_list dns_entries[DNS_HASH_SIZE];
+static int dns_num_entries;
+static int dns_generation;
+static hts_mutex_t dns_mutex;
+static hts_cond_t dns_cond;
+
+static atomic_t dns_stat_hits;
+static atomic_t dns_stat_stale_hits;
+static atomic_t dns_stat_negative_hits;
+static atomic_t dns_stat_misses;
+static atomic_t dns_stat_coalesced;
+
+#define DNS_CACHED   0
+#define DNS_MISS     1
+#define DNS_BUSY     2
+
+
+/**
+ * Hostnames are case insensitive, see dns_find()
+ */
+static unsigned int
+dns_hash(const char *hostname)
+{
+  unsigned int h = 0;
+  while(*hostname)
+    h = h * 33 ^ tolower((uint8_t)*hostname++);
+  return h % DNS_HASH_SIZE;
+}
+
+
+/**
+ *
+ */
+static dns_entry_t *
+dns_find(const char *hostname)
+{
+  dns_entry_t *de;
+  LIST_FOREACH(de, &dns_entries[dns_hash(hostname)], de_link)
+    if(!strcasecmp(de->de_hostname, hostname))
+      return de;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+dns_destroy(dns_entry_t *de)
+{
+  LIST_REMOVE(de, de_link);
+  free(de->de_hostname);
+  free(de);
+  dns_num_entries--;
+}
+
+
+/**
+ * Make room by dropping the entry that expires first
+ */
+static void
+dns_evict(void)
+{
+  dns_entry_t *de, *victim = NULL;
+
+  for(int i = 0; i < DNS_HASH_SIZE; i++) {
+    LIST_FOREACH(de, &dns_entries[i], de_link) {
+      if(de->de_resolving)
+        continue;
+      if(victim == NULL || de->de_expire < victim->de_expire)
+        victim = de;
+    }
+  }
+  if(victim != NULL)
+    dns_destroy(victim);
+}
+
+
+/**
+ *
+ */
+static dns_entry_t *
+dns_create(const char *hostname)
+{
+  if(dns_num_entries >= DNS_CACHE_SIZE)
+    dns_evict();
+
+  dns_entry_t *de = calloc(1, sizeof(dns_entry_t));
+  de->de_hostname = strdup(hostname);
+  LIST_INSERT_HEAD(&dns_entries[dns_hash(hostname)], de, de_link);
+  dns_num_entries++;
+  return de;
+}
+
+
+/**
+ * Store result of a lookup. Must be called with dns_mutex held
+ */
+static void
+dns_complete(const char *hostname, int generation, int r,
+             const net_addr_t *addr, const char *errmsg)
+{
+  hts_cond_broadcast(&dns_cond);
+
+  if(generation != dns_generation)
+    return; // Flushed while we were resolving, result may be stale
+
+  dns_entry_t *de = dns_find(hostname);
+  if(de == NULL)
+    return;
+
+  de->de_resolving = 0;
+
+  if(r) {
+    // Keep serving a stale address if the refresh fails
+    if(de->de_valid && de->de_errmsg == NULL)
+      return;
+    de->de_errmsg = errmsg;
+    de->de_expire = arch_get_ts() + DNS_NEGATIVE_TTL;
+  } else {
+    de->de_addr = *addr;
+    de->de_errmsg = NULL;
+    de->de_expire = arch_get_ts() + DNS_POSITIVE_TTL;
+  }
+  de->de_valid = 1;
+}
+
+
+/**
+ *
+ */
+typedef struct dns_refresh {
+  char *dr_hostname;
+  int dr_generation;
+} dns_refresh_t;
+
+
+/**
+ *
+ */
+static void *
+dns_refresh_thread(void *aux)
+{
+  dns_refresh_t *dr = aux;
+  net_addr_t addr;
+  const char *errmsg;
+
+  int r = net_resolve_arch(dr->dr_hostname, &addr, &errmsg);
+
+  hts_mutex_lock(&dns_mutex);
+  dns_complete(dr->dr_hostname, dr->dr_generation, r, &addr,
+               r ? errmsg : NULL);
+  hts_mutex_unlock(&dns_mutex);
+
+  free(dr->dr_hostname);
+  free(dr);
+  return NULL;
+}
+
+
+/**
+ * Must be called with dns_mutex held
+ */
+static int
+dns_lookup_locked(const char *hostname, net_addr_t *addr,
+                  const char **errmsg, int *rp)
+{
+  dns_entry_t *de = dns_find(hostname);
+
+  if(de == NULL)
+    return DNS_MISS;
+
+  if(de->de_valid) {
+    const int64_t now = arch_get_ts();
+
+    if(now < de->de_expire) {
+
+      if(de->de_errmsg != NULL) {
+        atomic_inc(&dns_stat_negative_hits);
+        *errmsg = de->de_errmsg;
+        *rp = -1;
+      } else {
+        atomic_inc(&dns_stat_hits);
+        *addr = de->de_addr;
+        *rp = 0;
+      }
+      return DNS_CACHED;
+    }
+
+    if(de->de_errmsg == NULL && now < de->de_expire + DNS_STALE_TIME) {
+
+      if(!de->de_resolving) {
+        de->de_resolving = 1;
+        dns_refresh_t *dr = malloc(sizeof(dns_refresh_t));
+        dr->dr_hostname = strdup(hostname);
+        dr->dr_generation = dns_generation;
+        hts_thread_create_detached("DNS refresh", dns_refresh_thread, dr,
+                                   THREAD_PRIO_BGTASK);
+      }
+
+      atomic_inc(&dns_stat_stale_hits);
+      *addr = de->de_addr;
+      *rp = 0;
+      return DNS_CACHED;
+    }
+  }
+
+  return de->de_resolving ? DNS_BUSY : DNS_MISS;
+}
+
+
+/**
+ * Resolve hostname, using the cache if possible
+ */
+int
+net_resolve(const char *hostname, net_addr_t *addr, const char **errmsg)
+{
+  int r, waited = 0;
+
+  if(!net_resolve_numeric(hostname, addr))
+    return 0;
+
+  hts_mutex_lock(&dns_mutex);
+
+  while(1) {
+    switch(dns_lookup_locked(hostname, addr, errmsg, &r)) {
+    case DNS_CACHED:
+      hts_mutex_unlock(&dns_mutex);
+      return r;
+
+    case DNS_BUSY:
+      if(!waited++)
+        atomic_inc(&dns_stat_coalesced);
+      hts_cond_wait(&dns_cond, &dns_mutex);
+      continue;
+    }
+    break;
+  }
+
+  dns_entry_t *de = dns_find(hostname) ?: dns_create(hostname);
+  de->de_resolving = 1;
+  const int generation = dns_generation;
+  atomic_inc(&dns_stat_misses);
+
+  hts_mutex_unlock(&dns_mutex);
+
+  r = net_resolve_arch(hostname, addr, errmsg);
+
+  hts_mutex_lock(&dns_mutex);
+  dns_complete(hostname, generation, r, addr, r ? *errmsg : NULL);
+  hts_mutex_unlock(&dns_mutex);
+  return r;
+}
+
+
+/**
+ * Like net_resolve() but never blocks. Returns 1 if the hostname
+ * needs to be looked up
+ */
+int
+net_resolve_cached(const char *hostname, net_addr_t *addr,
+                   const char **errmsg)
+{
+  int r;
+
+  if(!net_resolve_numeric(hostname, addr))
+    return 0;
+
+  hts_mutex_lock(&dns_mutex);
+  if(dns_lookup_locked(hostname, addr, errmsg, &r) != DNS_CACHED)
+    r = 1;
+  hts_mutex_unlock(&dns_mutex);
+  return r;
+}
+
+
+/**
+ * Drop all cached entries, called when network configuration changes
+ */
+void
+net_dns_flush(void)
+{
+  dns_entry_t *de;
+
+  hts_mutex_lock(&dns_mutex);
+  dns_generation++;
+  for(int i = 0; i < DNS_HASH_SIZE; i++)
+    while((de = LIST_FIRST(&dns_entries[i])) != NULL)
+      dns_destroy(de);
+  // Wake up anyone waiting for a lookup we just forgot about
+  hts_cond_broadcast(&dns_cond);
+  hts_mutex_unlock(&dns_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+net_dns_init(void)
+{
+  hts_mutex_init(&dns_mutex);
+  hts_cond_init(&dns_cond, &dns_mutex);
+}
+
+// Before net_refresh_network_status() which flushes the cache
+INITME(INIT_GROUP_NET, net_dns_init, NULL, -1);
+
+
+/**
+ * Statistics exposed in global.system.dns
+ */
+static prop_t *dns_stats_entries;
+static prop_t *dns_stats_hits;
+static prop_t *dns_stats_stale_hits;
+static prop_t *dns_stats_negative_hits;
+static prop_t *dns_stats_misses;
+static prop_t *dns_stats_coalesced;
+
+
+/**
+ *
+ */
+static void
+dns_stats_update(void)
+{
+  hts_mutex_lock(&dns_mutex);
+  prop_set_int(dns_stats_entries, dns_num_entries);
+  hts_mutex_unlock(&dns_mutex);
+
+  prop_set_int(dns_stats_hits, atomic_get(&dns_stat_hits));
+  prop_set_int(dns_stats_stale_hits, atomic_get(&dns_stat_stale_hits));
+  prop_set_int(dns_stats_negative_hits, atomic_get(&dns_stat_negative_hits));
+  prop_set_int(dns_stats_misses, atomic_get(&dns_stat_misses));
+  prop_set_int(dns_stats_coalesced, atomic_get(&dns_stat_coalesced));
+}
+
+
+/**
+ *
+ */
+static void
+dns_stats_init(void)
+{
+  prop_t *root = prop_create(prop_create(prop_get_global(), "system"),
+                             "dns");
+
+  dns_stats_entries       = prop_create(root, "entries");
+  dns_stats_hits          = prop_create(root, "hits");
+  dns_stats_stale_hits    = prop_create(root, "staleHits");
+  dns_stats_negative_hits = prop_create(root, "negativeHits");
+  dns_stats_misses        = prop_create(root, "misses");
+  dns_stats_coalesced     = prop_create(root, "coalesced");
+  callout_stats_register(dns_stats_update);
+}
+
+INITME(INIT_GROUP_API, dns_stats_init, NULL, 0);
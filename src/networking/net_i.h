@@ -63,6 +63,9 @@ struct tcpcon {
 
   cancellable_t *cancellable;
 
+  // TLS handshake resumed a previous session
+  char ssl_resumed;
+
 };
 
 void tcp_cancel(void *aux);
@@ -73,7 +76,10 @@ tcpcon_t *tcp_connect_arch(const net_addr_t *addr, char *errbuf,
 
 void tcp_close_arch(tcpcon_t *tc);
 
+int net_resolve_arch(const char *hostname, net_addr_t *addr,
+                     const char **err);
+
 int tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen,
-                 const char *hostname, int verify);
+                 const char *hostname, int port, int verify);
 
 void tcp_ssl_close(tcpcon_t *tc);
@@ -28,6 +28,26 @@
 static SSL_CTX *app_ssl_ctx;
 static pthread_mutex_t *ssl_locks;
 
+
+/**
+ * Client side session cache, keyed on host:port. Lets us resume a
+ * previous session (via session ID or session ticket) instead of doing
+ * a full handshake each time we connect to the same server
+ */
+#define SSL_SESSION_CACHE_SIZE 32
+
+LIST_HEAD(ssl_session_entry_list, ssl_session_entry);
+
+typedef struct ssl_session_entry {
+  LIST_ENTRY(ssl_session_entry) sse_link;
+  char *sse_key;
+  SSL_SESSION *sse_session;
+} ssl_session_entry_t;
+
+static struct ssl_session_entry_list ssl_sessions;
+static int ssl_num_sessions;
+static hts_mutex_t ssl_sessions_mutex;
+
 static unsigned long
 ssl_tid_fn(void)
 {
@@ -46,6 +66,99 @@ ssl_lock_fn(int mode, int n, const char *file, int line)
 
 
 
+/**
+ *
+ */
+static ssl_session_entry_t *
+ssl_session_find(const char *key)
+{
+  ssl_session_entry_t *sse;
+  LIST_FOREACH(sse, &ssl_sessions, sse_link)
+    if(!strcmp(sse->sse_key, key))
+      return sse;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+ssl_session_destroy(ssl_session_entry_t *sse)
+{
+  LIST_REMOVE(sse, sse_link);
+  SSL_SESSION_free(sse->sse_session);
+  free(sse->sse_key);
+  free(sse);
+  ssl_num_sessions--;
+}
+
+
+/**
+ * Offer a cached session for resumption, if we have one
+ */
+static void
+ssl_session_load(SSL *ssl, const char *key)
+{
+  hts_mutex_lock(&ssl_sessions_mutex);
+  ssl_session_entry_t *sse = ssl_session_find(key);
+  if(sse != NULL) {
+    // SSL_set_session() takes its own reference
+    SSL_set_session(ssl, sse->sse_session);
+    LIST_REMOVE(sse, sse_link);
+    LIST_INSERT_HEAD(&ssl_sessions, sse, sse_link);
+  }
+  hts_mutex_unlock(&ssl_sessions_mutex);
+}
+
+
+/**
+ * Remember the session after a successful (and verified) handshake
+ */
+static void
+ssl_session_store(SSL *ssl, const char *key)
+{
+  SSL_SESSION *sess = SSL_get1_session(ssl);
+  if(sess == NULL)
+    return;
+
+  hts_mutex_lock(&ssl_sessions_mutex);
+  ssl_session_entry_t *sse = ssl_session_find(key);
+  if(sse == NULL) {
+    sse = calloc(1, sizeof(ssl_session_entry_t));
+    sse->sse_key = strdup(key);
+    ssl_num_sessions++;
+  } else {
+    LIST_REMOVE(sse, sse_link);
+    SSL_SESSION_free(sse->sse_session);
+  }
+  sse->sse_session = sess;
+  LIST_INSERT_HEAD(&ssl_sessions, sse, sse_link);
+
+  if(ssl_num_sessions > SSL_SESSION_CACHE_SIZE) {
+    ssl_session_entry_t *last = sse;
+    while(LIST_NEXT(last, sse_link) != NULL)
+      last = LIST_NEXT(last, sse_link);
+    ssl_session_destroy(last);
+  }
+  hts_mutex_unlock(&ssl_sessions_mutex);
+}
+
+
+/**
+ * Don't try to resume a session that just failed us
+ */
+static void
+ssl_session_forget(const char *key)
+{
+  hts_mutex_lock(&ssl_sessions_mutex);
+  ssl_session_entry_t *sse = ssl_session_find(key);
+  if(sse != NULL)
+    ssl_session_destroy(sse);
+  hts_mutex_unlock(&ssl_sessions_mutex);
+}
+
+
 /**
  *
  */
@@ -86,13 +199,16 @@ ssl_write(tcpcon_t *tc, const void *data, size_t len)
 
 int
 tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen, const char *hostname,
-             int verify)
+             int port, int verify)
 {
   if(app_ssl_ctx == NULL) {
     snprintf(errbuf, errlen, "SSL not initialized");
     return -1;
   }
   char errmsg[120];
+  char key[512];
+
+  snprintf(key, sizeof(key), "%s:%d", hostname, port);
 
   if((tc->ssl = SSL_new(app_ssl_ctx)) == NULL) {
     ERR_error_string(ERR_get_error(), errmsg);
@@ -107,17 +223,25 @@ tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen, const char *hostname,
     return -1;
   }
 
+  ssl_session_load(tc->ssl, key);
+
   if(SSL_connect(tc->ssl) <= 0) {
     ERR_error_string(ERR_get_error(), errmsg);
     snprintf(errbuf, errlen, "SSL connect: %s", errmsg);
+    ssl_session_forget(key);
     return -1;
   }
 
   if(verify) {
-    if(openssl_verify_connection(tc->ssl, hostname, errbuf, errlen, 1))
+    if(openssl_verify_connection(tc->ssl, hostname, errbuf, errlen, 1)) {
+      ssl_session_forget(key);
       return -1;
+    }
   }
 
+  tc->ssl_resumed = SSL_session_reused(tc->ssl);
+  ssl_session_store(tc->ssl, key);
+
   SSL_set_mode(tc->ssl, SSL_MODE_AUTO_RETRY);
   tc->read = ssl_read;
   tc->write = ssl_write;
@@ -245,6 +369,8 @@ net_ssl_init(void)
 
   SSL_CTX_load_verify_locations(app_ssl_ctx, NULL, "/etc/ssl/certs");
 
+  hts_mutex_init(&ssl_sessions_mutex);
+
   int i, n = CRYPTO_num_locks();
   ssl_locks = malloc(sizeof(pthread_mutex_t) * n);
   for(i = 0; i < n; i++)
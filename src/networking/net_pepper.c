@@ -161,7 +161,7 @@ pepper_Resolver_to_net_addr(struct net_addr *addr, PP_Resource res)
  *
  */
 int
-net_resolve(const char *hostname, net_addr_t *addr, const char **err)
+net_resolve_arch(const char *hostname, net_addr_t *addr, const char **err)
 {
   int rval = -1;
   PP_Resource res = ppb_hostresolver->Create(g_Instance);
@@ -25,6 +25,121 @@
 #include "polarssl/entropy.h"
 #include "polarssl/error.h"
 
+
+/**
+ * Client side session cache, keyed on host:port, so reconnects to the
+ * same server can resume instead of doing a full handshake
+ */
+#define SSL_SESSION_CACHE_SIZE 32
+
+LIST_HEAD(ssl_session_entry_list, ssl_session_entry);
+
+typedef struct ssl_session_entry {
+  LIST_ENTRY(ssl_session_entry) sse_link;
+  char *sse_key;
+  ssl_session sse_session;
+} ssl_session_entry_t;
+
+static struct ssl_session_entry_list ssl_sessions;
+static int ssl_num_sessions;
+static hts_mutex_t ssl_sessions_mutex;
+
+
+/**
+ *
+ */
+static ssl_session_entry_t *
+ssl_session_find(const char *key)
+{
+  ssl_session_entry_t *sse;
+  LIST_FOREACH(sse, &ssl_sessions, sse_link)
+    if(!strcmp(sse->sse_key, key))
+      return sse;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+ssl_session_destroy(ssl_session_entry_t *sse)
+{
+  LIST_REMOVE(sse, sse_link);
+  ssl_session_free(&sse->sse_session);
+  free(sse->sse_key);
+  free(sse);
+  ssl_num_sessions--;
+}
+
+
+/**
+ * Offer a cached session for resumption. Copies out the master secret
+ * of the offered session, it's kept if the server accepts to resume.
+ * (With session tickets the session ID is random so we can't use that)
+ */
+static int
+ssl_session_load(ssl_context *ssl, const char *key, uint8_t *master)
+{
+  int r = 0;
+  hts_mutex_lock(&ssl_sessions_mutex);
+  ssl_session_entry_t *sse = ssl_session_find(key);
+  if(sse != NULL && ssl_set_session(ssl, &sse->sse_session) == 0) {
+    memcpy(master, sse->sse_session.master, 48);
+    LIST_REMOVE(sse, sse_link);
+    LIST_INSERT_HEAD(&ssl_sessions, sse, sse_link);
+    r = 1;
+  }
+  hts_mutex_unlock(&ssl_sessions_mutex);
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+ssl_session_store(const ssl_context *ssl, const char *key)
+{
+  hts_mutex_lock(&ssl_sessions_mutex);
+  ssl_session_entry_t *sse = ssl_session_find(key);
+  if(sse == NULL) {
+    sse = calloc(1, sizeof(ssl_session_entry_t));
+    sse->sse_key = strdup(key);
+    ssl_num_sessions++;
+  } else {
+    LIST_REMOVE(sse, sse_link);
+    ssl_session_free(&sse->sse_session);
+  }
+  ssl_session_init(&sse->sse_session);
+  LIST_INSERT_HEAD(&ssl_sessions, sse, sse_link);
+
+  if(ssl_get_session(ssl, &sse->sse_session)) {
+    ssl_session_destroy(sse);
+  } else if(ssl_num_sessions > SSL_SESSION_CACHE_SIZE) {
+    ssl_session_entry_t *last = sse;
+    while(LIST_NEXT(last, sse_link) != NULL)
+      last = LIST_NEXT(last, sse_link);
+    ssl_session_destroy(last);
+  }
+  hts_mutex_unlock(&ssl_sessions_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+ssl_session_forget(const char *key)
+{
+  hts_mutex_lock(&ssl_sessions_mutex);
+  ssl_session_entry_t *sse = ssl_session_find(key);
+  if(sse != NULL)
+    ssl_session_destroy(sse);
+  hts_mutex_unlock(&ssl_sessions_mutex);
+}
+
+
 /**
  *
  */
@@ -99,9 +214,14 @@ printdbg(void *aux, int level, const char *txt)
  */
 int
 tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen, const char *hostname,
-             int verify)
+             int port, int verify)
 {
   int ret;
+  char key[512];
+  uint8_t master[48];
+  int offered;
+
+  snprintf(key, sizeof(key), "%s:%d", hostname ?: "", port);
   entropy_context entropy;
   entropy_init(&entropy);
 
@@ -141,14 +261,21 @@ tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen, const char *hostname,
 
   ssl_set_bio(tc->ssl, raw_recv, tc, raw_send, tc);
 
+  offered = ssl_session_load(tc->ssl, key, master);
+
   while((ret = ssl_handshake(tc->ssl)) != 0) {
     if(ret != POLARSSL_ERR_NET_WANT_READ &&
        ret != POLARSSL_ERR_NET_WANT_WRITE) {
       polarssl_strerror(ret, errbuf, errlen);
+      ssl_session_forget(key);
       return -1;
     }
   }
 
+  tc->ssl_resumed = offered && !memcmp(tc->ssl->session->master, master, 48);
+
+  ssl_session_store(tc->ssl, key);
+
   tc->read = polarssl_read;
   tc->write = polarssl_write;
 
@@ -166,3 +293,16 @@ tcp_ssl_close(tcpcon_t *tc)
   free(tc->ssl);
   free(tc->rndstate);
 }
+
+
+/**
+ *
+ */
+static void
+net_polarssl_init(void)
+{
+  hts_mutex_init(&ssl_sessions_mutex);
+}
+
+
+INITME(INIT_GROUP_NET, net_polarssl_init, NULL, 0);
@@ -150,7 +150,7 @@ tcp_from_fd(int fd)
  *
  */
 int
-net_resolve(const char *hostname, net_addr_t *addr, const char **err)
+net_resolve_arch(const char *hostname, net_addr_t *addr, const char **err)
 {
   struct hostent *hp;
   char *tmphstbuf;
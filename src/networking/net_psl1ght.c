@@ -121,7 +121,7 @@ getstreamsocket(int family, char *errbuf, size_t errbufsize)
  *
  */
 int
-net_resolve(const char *hostname, net_addr_t *addr, const char **err)
+net_resolve_arch(const char *hostname, net_addr_t *addr, const char **err)
 {
   struct net_hostent *hp;
   int herr;
@@ -131,6 +131,8 @@ static prop_t *playqueue_nodes;
 
 static void *player_thread(void *aux);
 
+static void pq_boundary_reached(void *opaque, const char *str);
+
 static media_pipe_t *playqueue_mp;
 
 
@@ -148,6 +150,20 @@ static int playqueue_length;
 
 playqueue_entry_t *pqe_current;
 
+/**
+ * Props of pqe_current linked into the UI. With gapless playback the
+ * next track is demuxed while the tail of the current one is still
+ * queued, it's stored in pq_pending until the audio decoder passes the
+ * track boundary and sets pq_boundary to pq_pending_seq
+ */
+static prop_t *pq_current_metadata;
+static prop_t *pq_current_media;
+static prop_t *pq_current_playing;
+
+static playqueue_entry_t *pq_pending;
+static int pq_pending_seq;
+static prop_t *pq_boundary;
+
 
 /**
  *
@@ -844,6 +860,14 @@ playqueue_init(void)
   prop_set_int(playqueue_mp->mp_prop_canShuffle, 1);
   prop_set_int(playqueue_mp->mp_prop_canRepeat, 1);
 
+  pq_boundary = prop_create_root(NULL);
+
+  prop_subscribe(PROP_SUB_NO_INITIAL_UPDATE,
+                 PROP_TAG_CALLBACK_STRING, pq_boundary_reached, NULL,
+                 PROP_TAG_ROOT, pq_boundary,
+                 PROP_TAG_MUTEX, &playqueue_mutex,
+                 NULL);
+
   prop_subscribe(0,
 		 PROP_TAG_NAME("self", "shuffle"),
 		 PROP_TAG_CALLBACK_INT, playqueue_set_shuffle, NULL,
@@ -1035,6 +1059,109 @@ playqueue_advance(playqueue_entry_t *pqe, int reverse)
 }
 
 
+/**
+ * Unlink current track from the UI
+ */
+static void
+pq_current_hide(void)
+{
+  playqueue_entry_t *pqe = pqe_current;
+
+  if(pqe == NULL)
+    return;
+
+  prop_set_int(pq_current_playing, 0);
+  prop_ref_dec(pq_current_playing);
+
+  // Unlink $self.media
+  prop_unlink(pq_current_media);
+  prop_ref_dec(pq_current_media);
+
+  prop_ref_dec(pq_current_metadata);
+
+  pqe_current = NULL;
+  pqe_unref(pqe);
+}
+
+
+/**
+ * Make 'pqe' the current track in the UI
+ */
+static void
+pq_current_show(playqueue_entry_t *pqe)
+{
+  media_pipe_t *mp = playqueue_mp;
+
+  pq_current_hide();
+
+  prop_t *sm = prop_get_by_name(PNVEC("self", "metadata"), 1,
+                                PROP_TAG_NAMED_ROOT, pqe->pqe_node, "self",
+                                NULL);
+  prop_link_ex(sm, mp->mp_prop_metadata, NULL, PROP_LINK_XREFED, 0);
+
+  mp->mp_prop_metadata_source = sm;
+  pq_current_metadata = sm;
+
+  pq_current_media = prop_get_by_name(PNVEC("self", "media"), 1,
+                                      PROP_TAG_NAMED_ROOT, pqe->pqe_node,
+                                      "self", NULL);
+  prop_link(mp->mp_prop_root, pq_current_media);
+
+  mp_set_url(mp, pqe->pqe_url, NULL, NULL);
+  pqe_ref(pqe);
+  pqe_current = pqe;
+  update_pq_meta();
+
+  if(playqueue_advance0(pqe, 0) == NULL && playqueue_source_sub != NULL)
+    prop_want_more_childs(playqueue_source_sub);
+
+  pq_current_playing = prop_get_by_name(PNVEC("self", "playing"), 1,
+                                        PROP_TAG_NAMED_ROOT, pqe->pqe_node,
+                                        "self", NULL);
+  prop_set_int(pq_current_playing, 1);
+}
+
+
+/**
+ * Forget about any track waiting for its boundary
+ */
+static void
+pq_pending_clear(void)
+{
+  if(pq_pending == NULL)
+    return;
+  pqe_unref(pq_pending);
+  pq_pending = NULL;
+}
+
+
+/**
+ * Audio decoder reached the start of a track appended without flush
+ */
+static void
+pq_boundary_reached(void *opaque, const char *str)
+{
+  if(str == NULL || pq_pending == NULL || atoi(str) != pq_pending_seq)
+    return;
+
+  pq_current_show(pq_pending);
+  pq_pending_clear();
+}
+
+
+/**
+ * Return 1 if audio from the previous track is still queued
+ */
+static int
+pq_audio_queued(media_pipe_t *mp)
+{
+  hts_mutex_lock(&mp->mp_mutex);
+  int r = TAILQ_FIRST(&mp->mp_audio.mq_q_data) != NULL;
+  hts_mutex_unlock(&mp->mp_mutex);
+  return r;
+}
+
+
 /**
  * Thread for actual playback
  */
@@ -1045,21 +1172,25 @@ player_thread(void *aux)
   playqueue_entry_t *pqe = NULL;
   playqueue_event_t *pe;
   event_t *e;
-  prop_t *p, *m;
   char errbuf[512];
   int startpaused = 0;
+  int gapless = 0; // Previous track returned with its tail still queued
+
   while(1) {
     
     while(pqe == NULL) {
       /* Got nothing to play, enter STOP mode */
 
+      /* Drain queues */
+      e = mp_wait_for_empty_queues(mp);
+      gapless = 0;
+
       hts_mutex_lock(&playqueue_mutex);
-      pqe_current = NULL;
+      pq_pending_clear();
+      pq_current_hide();
       update_pq_meta();
       hts_mutex_unlock(&playqueue_mutex);
 
-      /* Drain queues */
-      e = mp_wait_for_empty_queues(mp);
       if(e != NULL) {
 	/* Got event while waiting for drain */
 	mp_flush(mp);
@@ -1107,35 +1238,28 @@ player_thread(void *aux)
 
     prop_set(playqueue_root, "active", PROP_SET_INT, 1);
     mp_reset(mp);
-
-    prop_t *sm = prop_get_by_name(PNVEC("self", "metadata"), 1,
-                                  PROP_TAG_NAMED_ROOT, pqe->pqe_node, "self",
-                                  NULL);
-    prop_link_ex(sm, mp->mp_prop_metadata, NULL, PROP_LINK_XREFED, 0);
-
-    mp->mp_prop_metadata_source = sm;
-
-    m = prop_get_by_name(PNVEC("self", "media"), 1,
-			 PROP_TAG_NAMED_ROOT, pqe->pqe_node, "self",
-			 NULL);
-    prop_link(mp->mp_prop_root, m);
+    mp->mp_gapless_preload = gconf.audio_gapless_preload * 1000000LL;
 
     hts_mutex_lock(&playqueue_mutex);
 
-    mp_set_url(mp, pqe->pqe_url, NULL, NULL);
-    pqe_current = pqe;
-    update_pq_meta();
-
-    if(playqueue_advance0(pqe, 0) == NULL && playqueue_source_sub != NULL)
-      prop_want_more_childs(playqueue_source_sub);
+    if(gapless) {
+      char seq[16];
 
-    hts_mutex_unlock(&playqueue_mutex);
+      // Boundary of previous track not reached yet (very short track)
+      if(pq_pending != NULL) {
+        pq_current_show(pq_pending);
+        pq_pending_clear();
+      }
 
-    p = prop_get_by_name(PNVEC("self", "playing"), 1,
-			 PROP_TAG_NAMED_ROOT, pqe->pqe_node, "self",
-			 NULL);
+      pqe_ref(pqe);
+      pq_pending = pqe;
+      snprintf(seq, sizeof(seq), "%d", ++pq_pending_seq);
+      mp_send_prop_set_string(mp, &mp->mp_audio, pq_boundary, seq);
+    } else {
+      pq_current_show(pqe);
+    }
 
-    prop_set_int(p, 1);
+    hts_mutex_unlock(&playqueue_mutex);
 
     if(startpaused)
       mp_hold(mp, MP_HOLD_PAUSE, NULL);
@@ -1144,21 +1268,25 @@ player_thread(void *aux)
 
     e = backend_play_audio(pqe->pqe_url, mp, errbuf, sizeof(errbuf),
 			   startpaused, NULL);
-    prop_ref_dec(sm);
     startpaused = 0;
 
-    prop_set_int(p, 0);
-    prop_ref_dec(p);
-
-    // Unlink $self.media
-    prop_unlink(m);
-    prop_ref_dec(m);
+    gapless = mp->mp_gapless_preload &&
+      (e == NULL || event_is_type(e, EVENT_EOF)) && pq_audio_queued(mp);
 
     hts_mutex_lock(&playqueue_mutex);
-    pqe_current = NULL;
+
+    if(e == NULL && pq_pending == pqe)
+      pq_pending_clear();
+
+    if(!gapless) {
+      pq_pending_clear();
+      pq_current_hide();
+    }
+
     hts_mutex_unlock(&playqueue_mutex);
 
-    prop_set(mp->mp_prop_root, "format", PROP_SET_VOID);
+    if(!gapless)
+      prop_set(mp->mp_prop_root, "format", PROP_SET_VOID);
 
     if(e == NULL) {
       TRACE(TRACE_ERROR, "Playqueue", "Unable to play %s -- %s", pqe->pqe_url, errbuf);
@@ -663,9 +663,14 @@ plugin_load(const char *url, char *errbuf, size_t errlen, int flags)
       if(htsmsg_get_u32_or_default(e, "bypassFileACLWrite", 0))
         pflags |= ECMASCRIPT_FILE_BYPASS_ACL_WRITE;
     }
+    // Optional per plugin heap cap in MB
+    uint64_t memlimit =
+      (uint64_t)htsmsg_get_u32_or_default(ctrl, "memoryLimit", 0) << 20;
+
     hts_mutex_unlock(&plugin_mutex);
     r = ecmascript_plugin_load(id, fullpath, errbuf, errlen, version,
-                               buf_cstr(b), pflags);
+                               buf_cstr(b), pflags,
+                               MIN(memlimit, SIZE_MAX));
     hts_mutex_lock(&plugin_mutex);
     if(!r)
       pl->pl_unload = plugin_unload_ecmascript;
@@ -36,6 +36,7 @@
 typedef struct prop_courier prop_courier_t;
 typedef struct prop prop_t;
 typedef struct prop_sub prop_sub_t;
+typedef struct prop_atom prop_atom_t;
 TAILQ_HEAD(prop_notify_queue, prop_notify);
 
 
@@ -143,6 +144,7 @@ void prop_init_late(void);
 #define PROP_SUB_SEND_VALUE_PROP      0x100
 #define PROP_SUB_NO_INITIAL_UPDATE    0x200
 #define PROP_SUB_EARLY_DEL_CHILD      0x400
+#define PROP_SUB_COALESCE             0x800
 // Remember that flags field is uint16_t in prop_i.h so don't go above 0x8000
 // for persistent flags
 
@@ -179,6 +181,7 @@ enum {
   PROP_TAG_MUTEX,
   PROP_TAG_LOCKMGR,
   PROP_TAG_NAMESTR,
+  PROP_TAG_ATOM_VECTOR,
 #ifdef PROP_SUB_RECORD_SOURCE
   PROP_TAG_SOURCE,
 #endif
@@ -205,20 +208,41 @@ void prop_unsubscribe(prop_sub_t *s);
 void prop_sub_reemit(prop_sub_t *s);
 
 prop_t *prop_create_ex(prop_t *parent, const char *name,
-		       prop_sub_t *skipme, int noalloc, int incref)
+		       prop_sub_t *skipme, int incref)
      attribute_malloc;
 
-#define prop_create(parent, name) \
-  prop_create_ex(parent, name, NULL, __builtin_constant_p(name), 0)
+#define prop_create(parent, name) prop_create_ex(parent, name, NULL, 0)
 
-#define prop_create_r(parent, name) \
-  prop_create_ex(parent, name, NULL, __builtin_constant_p(name), 1)
+#define prop_create_r(parent, name) prop_create_ex(parent, name, NULL, 1)
 
-prop_t *prop_create_root_ex(const char *name, int noalloc)
-  attribute_malloc;
+prop_t *prop_create_root(const char *name) attribute_malloc;
 
-#define prop_create_root(name) \
-  prop_create_root_ex(name, __builtin_constant_p(name))
+/**
+ * Prop names are interned into atoms. Code that creates or subscribes
+ * to the same names over and over again can resolve them once and
+ * skip the name lookup (see also PROP_TAG_ATOM_VECTOR)
+ */
+prop_atom_t *prop_atom_get(const char *str);
+
+prop_atom_t *prop_atom_dup(prop_atom_t *pa);
+
+void prop_atom_release(prop_atom_t *pa);
+
+const char *prop_atom_str(const prop_atom_t *pa);
+
+prop_atom_t **prop_atom_vec_split(const char *str, char sep);
+
+void prop_atom_vec_free(prop_atom_t **vec);
+
+prop_t *prop_create_atom_ex(prop_t *parent, prop_atom_t *name,
+                            prop_sub_t *skipme, int incref)
+     attribute_malloc;
+
+#define prop_create_atom(parent, name) \
+  prop_create_atom_ex(parent, name, NULL, 0)
+
+#define prop_create_atom_r(parent, name) \
+  prop_create_atom_ex(parent, name, NULL, 1)
 
 prop_t *prop_create_after(prop_t *parent, const char *name, prop_t *after,
 			  prop_sub_t *skipme);
@@ -233,6 +257,8 @@ void prop_destroy_first(prop_t *p);
 
 prop_t *prop_follow(prop_t *p);
 
+int prop_get_ancestors(prop_t *p, prop_t **vec, int max);
+
  // Resolve a PROP_PROP into what it's pointing to
 prop_t *prop_get_prop(prop_t *p);
 
@@ -246,12 +272,12 @@ void prop_setv_ex(prop_sub_t *skipme, prop_t *p, ...);
 
 #define prop_setv(p, ...) prop_setv_ex(NULL, p, ##__VA_ARGS__)
 
-void prop_set_ex(prop_t *p, const char *name, int noalloc, ...);
+void prop_set(prop_t *p, const char *name, ...);
+
+void prop_set_atom(prop_t *p, prop_atom_t *name, ...);
 
 void prop_setdn(prop_sub_t *skipme, prop_t *p, const char *str, ...);
 
-#define prop_set(p, name, type, ...) \
-  prop_set_ex(p, name, __builtin_constant_p(name), type, ##__VA_ARGS__)
 
 void prop_set_string_ex(prop_t *p, prop_sub_t *skipme, const char *str,
 			prop_str_type_t type);
@@ -454,6 +480,9 @@ void prop_notify_dispatch(struct prop_notify_queue *q, const char *tracename);
 
 void prop_courier_stop(prop_courier_t *pc);
 
+void prop_courier_get_stats(prop_courier_t *pc, int *delivered,
+                            int *coalesced);
+
 // Does not create properties, can't be used over remote connections
 prop_t *prop_find(prop_t *parent, ...) attribute_null_sentinel;
 
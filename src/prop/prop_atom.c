@@ -0,0 +1,272 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "prop_i.h"
+
+/**
+ * Atom table for prop names
+ *
+ * The table is split into stripes, each with its own mutex and hash
+ * buckets. Taking a reference on an atom that is already referenced
+ * and dropping a reference that is not the last one are done with
+ * atomic ops only. The stripe lock is needed when an atom is created
+ * and when the last reference goes away (so a concurrent lookup can't
+ * resurrect an atom that is being freed)
+ */
+
+#define PROP_ATOM_STRIPES 16
+
+typedef struct prop_atom_stripe {
+  hts_mutex_t pas_mutex;
+  prop_atom_t **pas_buckets;
+  unsigned int pas_mask;
+  unsigned int pas_count;
+} prop_atom_stripe_t;
+
+static prop_atom_stripe_t prop_atom_stripes[PROP_ATOM_STRIPES];
+
+
+/**
+ *
+ */
+static prop_atom_stripe_t *
+prop_atom_stripe(unsigned int hash)
+{
+  return &prop_atom_stripes[hash & (PROP_ATOM_STRIPES - 1)];
+}
+
+
+/**
+ *
+ */
+static unsigned int
+prop_atom_bucket(const prop_atom_stripe_t *pas, unsigned int hash)
+{
+  return (hash / PROP_ATOM_STRIPES) & pas->pas_mask;
+}
+
+
+/**
+ *
+ */
+static void
+prop_atom_grow(prop_atom_stripe_t *pas)
+{
+  unsigned int oldsize = pas->pas_mask + 1;
+  prop_atom_t **old = pas->pas_buckets;
+  prop_atom_t *pa, *next;
+
+  pas->pas_mask = oldsize * 2 - 1;
+  pas->pas_buckets = calloc(oldsize * 2, sizeof(prop_atom_t *));
+
+  for(int i = 0; i < oldsize; i++) {
+    for(pa = old[i]; pa != NULL; pa = next) {
+      next = pa->pa_next;
+      unsigned int b = prop_atom_bucket(pas, pa->pa_hash);
+      pa->pa_next = pas->pas_buckets[b];
+      pas->pas_buckets[b] = pa;
+    }
+  }
+  free(old);
+}
+
+
+/**
+ * Lookup (and create if 'create' is set) an atom
+ *
+ * Returns a referenced atom
+ */
+static prop_atom_t *
+prop_atom_lookup(const char *str, int create)
+{
+  const unsigned int hash = mystrhash(str);
+  prop_atom_stripe_t *pas = prop_atom_stripe(hash);
+  prop_atom_t *pa;
+
+  hts_mutex_lock(&pas->pas_mutex);
+
+  const unsigned int b = prop_atom_bucket(pas, hash);
+
+  for(pa = pas->pas_buckets[b]; pa != NULL; pa = pa->pa_next)
+    if(pa->pa_hash == hash && !strcmp(pa->pa_str, str))
+      break;
+
+  if(pa != NULL) {
+    atomic_inc(&pa->pa_refcount);
+  } else if(create) {
+    size_t len = strlen(str);
+    pa = malloc(sizeof(prop_atom_t) + len + 1);
+    atomic_set(&pa->pa_refcount, 1);
+    pa->pa_hash = hash;
+    memcpy(pa->pa_str, str, len + 1);
+    pa->pa_next = pas->pas_buckets[b];
+    pas->pas_buckets[b] = pa;
+    pas->pas_count++;
+    if(pas->pas_count > pas->pas_mask)
+      prop_atom_grow(pas);
+  }
+
+  hts_mutex_unlock(&pas->pas_mutex);
+  return pa;
+}
+
+
+/**
+ *
+ */
+prop_atom_t *
+prop_atom_get(const char *str)
+{
+  return prop_atom_lookup(str, 1);
+}
+
+
+/**
+ * Returns NULL if the atom does not exist. This also means that there
+ * can be no prop with that name
+ */
+prop_atom_t *
+prop_atom_find(const char *str)
+{
+  return prop_atom_lookup(str, 0);
+}
+
+
+/**
+ *
+ */
+prop_atom_t *
+prop_atom_dup(prop_atom_t *pa)
+{
+  if(pa != NULL)
+    atomic_inc(&pa->pa_refcount);
+  return pa;
+}
+
+
+/**
+ *
+ */
+void
+prop_atom_release(prop_atom_t *pa)
+{
+  if(pa == NULL)
+    return;
+
+  while(1) {
+    int v = atomic_get(&pa->pa_refcount);
+    if(v == 1)
+      break;
+    if(atomic_cas(&pa->pa_refcount, v, v - 1))
+      return;
+  }
+
+  // Might be the last reference, need to hold the lock to drop it
+
+  prop_atom_stripe_t *pas = prop_atom_stripe(pa->pa_hash);
+  hts_mutex_lock(&pas->pas_mutex);
+
+  if(!atomic_dec(&pa->pa_refcount)) {
+    prop_atom_t **pp = &pas->pas_buckets[prop_atom_bucket(pas, pa->pa_hash)];
+    while(*pp != pa)
+      pp = &(*pp)->pa_next;
+    *pp = pa->pa_next;
+    pas->pas_count--;
+    free(pa);
+  }
+  hts_mutex_unlock(&pas->pas_mutex);
+}
+
+
+/**
+ *
+ */
+const char *
+prop_atom_str(const prop_atom_t *pa)
+{
+  return pa ? pa->pa_str : NULL;
+}
+
+
+/**
+ * Split a path such as "node.metadata.title" into a NULL terminated
+ * vector of atoms. Empty segments are skipped
+ */
+prop_atom_t **
+prop_atom_vec_split(const char *str, char sep)
+{
+  int segments = 1, n = 0;
+  const char *s;
+
+  for(s = str; *s; s++)
+    if(*s == sep)
+      segments++;
+
+  prop_atom_t **vec = malloc((segments + 1) * sizeof(prop_atom_t *));
+  char *tmp = alloca(strlen(str) + 1);
+
+  while(1) {
+    s = strchr(str, sep);
+    const int len = s ? s - str : strlen(str);
+    if(len > 0) {
+      memcpy(tmp, str, len);
+      tmp[len] = 0;
+      vec[n++] = prop_atom_get(tmp);
+    }
+    if(s == NULL)
+      break;
+    str = s + 1;
+  }
+  vec[n] = NULL;
+  return vec;
+}
+
+
+/**
+ *
+ */
+void
+prop_atom_vec_free(prop_atom_t **vec)
+{
+  if(vec == NULL)
+    return;
+  for(int i = 0; vec[i] != NULL; i++)
+    prop_atom_release(vec[i]);
+  free(vec);
+}
+
+
+/**
+ *
+ */
+void
+prop_atom_init(void)
+{
+  for(int i = 0; i < PROP_ATOM_STRIPES; i++) {
+    prop_atom_stripe_t *pas = &prop_atom_stripes[i];
+    hts_mutex_init(&pas->pas_mutex);
+    pas->pas_mask = 63;
+    pas->pas_buckets = calloc(pas->pas_mask + 1, sizeof(prop_atom_t *));
+  }
+}
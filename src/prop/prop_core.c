@@ -30,6 +30,7 @@
 #include "main.h"
 #include "prop_i.h"
 #include "misc/str.h"
+#include "misc/callout.h"
 #include "event.h"
 
 #include "prop_proxy.h"
@@ -39,10 +40,21 @@ int prop_trace;
 static prop_sub_t *track_sub;
 #endif
 
+/**
+ * Protects the entire tree: values, structure, subscriptions and the
+ * hp_originator links between subtrees. Couriers have their own lock
+ * for their queues, see struct prop_courier
+ */
 hts_mutex_t prop_mutex;
 hts_mutex_t prop_tag_mutex;
 static prop_t *prop_global;
 
+// Totals over all couriers, published in global.system.prop
+static atomic_t prop_stat_delivered;
+static atomic_t prop_stat_coalesced;
+static prop_t *prop_stats_delivered;
+static prop_t *prop_stats_coalesced;
+
 
 pool_t *prop_pool;
 pool_t *notify_pool;
@@ -256,8 +268,8 @@ prop_ref_dec_traced(prop_t *p, const char *file, int line)
     printf("Prop %p was finalized by %s:%d\n", p, file, line);
   assert(p->hp_type == PROP_ZOMBIE);
 
-  if(!(p->hp_flags & PROP_NAME_NOT_ALLOCATED))
-    free((void *)p->hp_name);
+  if(p->hp_name != NULL)
+    prop_atom_release(prop_name_atom(p->hp_name));
 
   extern void prop_tag_dump(prop_t *p);
   prop_tag_dump(p);
@@ -298,8 +310,8 @@ prop_ref_dec_traced_locked(prop_t *p, const char *file, int line)
     printf("Prop %p was finalized by %s:%d\n", p, file, line);
   assert(p->hp_type == PROP_ZOMBIE);
 
-  if(!(p->hp_flags & PROP_NAME_NOT_ALLOCATED))
-    free((void *)p->hp_name);
+  if(p->hp_name != NULL)
+    prop_atom_release(prop_name_atom(p->hp_name));
 
   extern void prop_tag_dump(prop_t *p);
   prop_tag_dump(p);
@@ -374,8 +386,8 @@ prop_ref_dec(prop_t *p)
   assert(p->hp_type == PROP_ZOMBIE);
   assert(p->hp_tags == NULL);
 
-  if(!(p->hp_flags & PROP_NAME_NOT_ALLOCATED))
-    free((void *)p->hp_name);
+  if(p->hp_name != NULL)
+    prop_atom_release(prop_name_atom(p->hp_name));
 
 #ifdef PROP_DEBUG
   assert(p->hp_magic == PROP_MAGIC);
@@ -398,8 +410,8 @@ prop_ref_dec_locked(prop_t *p)
   assert(p->hp_type == PROP_ZOMBIE);
   assert(p->hp_tags == NULL);
 
-  if(!(p->hp_flags & PROP_NAME_NOT_ALLOCATED))
-    free((void *)p->hp_name);
+  if(p->hp_name != NULL)
+    prop_atom_release(prop_name_atom(p->hp_name));
 
 #ifdef PROP_DEBUG
   assert(p->hp_magic == PROP_MAGIC);
@@ -923,6 +935,20 @@ prop_dispatch_one(prop_notify_t *n, int lockmode)
 
   assert((s->hps_flags & PROP_SUB_INTERNAL) == 0);
 
+  if(s->hps_dispatch_mode == PROP_SUB_DISPATCH_MODE_COURIER) {
+    prop_courier_t *pc = s->hps_dispatch;
+
+    if(unlikely(n->hpn_coalesce)) {
+      // Picked up, no more values may be merged into it
+      hts_mutex_lock(&pc->pc_mutex);
+      if(n->hpn_coalesce) {
+        s->hps_pending_value = NULL;
+        n->hpn_coalesce = 0;
+      }
+      hts_mutex_unlock(&pc->pc_mutex);
+    }
+  }
+
   if(s->hps_lock != NULL) {
     if(s->hps_lockmgr(s->hps_lock, lockmode)) {
       assert(lockmode == LOCKMGR_TRY);
@@ -939,6 +965,11 @@ prop_dispatch_one(prop_notify_t *n, int lockmode)
     return 0;
   }
 
+  if(s->hps_dispatch_mode == PROP_SUB_DISPATCH_MODE_COURIER) {
+    ((prop_courier_t *)s->hps_dispatch)->pc_num_delivered++;
+    atomic_inc(&prop_stat_delivered);
+  }
+
   notify_invoke(s, n);
 
   if(s->hps_lock != NULL)
@@ -948,12 +979,13 @@ prop_dispatch_one(prop_notify_t *n, int lockmode)
 }
 
 /**
- *
+ * Invoke all notifications in queue, returns number of notifications
  */
-void
-prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
+static int
+prop_notify_dispatch0(struct prop_notify_queue *q, const char *trace_name)
 {
-  prop_notify_t *n, *next;
+  prop_notify_t *n;
+  int cnt = 0;
 
   if(trace_name) {
     TAILQ_FOREACH(n, q, hpn_link) {
@@ -972,12 +1004,28 @@ prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
               "PROP", "%s: Dispatch of [%s] took %d us",
               trace_name, info, (int)ts);
       }
+      cnt++;
     }
 
   } else {
-    TAILQ_FOREACH(n, q, hpn_link)
+    TAILQ_FOREACH(n, q, hpn_link) {
       prop_dispatch_one(n, LOCKMGR_LOCK);
+      cnt++;
+    }
   }
+  return cnt;
+}
+
+
+/**
+ *
+ */
+void
+prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
+{
+  prop_notify_t *n, *next;
+
+  prop_notify_dispatch0(q, trace_name);
 
   hts_mutex_lock(&prop_mutex);
 
@@ -992,6 +1040,37 @@ prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
 
 
 
+/**
+ * Return dispatched notifications parked on the courier's free queue.
+ *
+ * Unless 'force' is set we only do this if prop_mutex is uncontended
+ */
+void
+prop_courier_release_free(prop_courier_t *pc, int force)
+{
+  prop_notify_t *n, *next;
+
+  if(TAILQ_FIRST(&pc->pc_free_queue) == NULL)
+    return;
+
+  if(force || pc->pc_num_free >= PROP_COURIER_MAX_FREE)
+    hts_mutex_lock(&prop_mutex);
+  else if(hts_mutex_trylock(&prop_mutex))
+    return;
+
+  for(n = TAILQ_FIRST(&pc->pc_free_queue); n != NULL; n = next) {
+    next = TAILQ_NEXT(n, hpn_link);
+
+    prop_sub_ref_dec_locked(n->hpn_sub);
+    pool_put(notify_pool, n);
+  }
+  TAILQ_INIT(&pc->pc_free_queue);
+  pc->pc_num_free = 0;
+
+  hts_mutex_unlock(&prop_mutex);
+}
+
+
 /**
  * Thread for dispatching prop_notify entries
  */
@@ -1001,17 +1080,27 @@ prop_courier(void *aux)
   prop_courier_t *pc = aux;
   struct prop_notify_queue q_exp, q_nor;
   prop_notify_t *n;
+  void (*epilogue)(void) = pc->pc_epilogue;
 
   if(pc->pc_prologue)
     pc->pc_prologue();
-  
-  hts_mutex_lock(&prop_mutex);
+
+  hts_mutex_lock(&pc->pc_mutex);
 
   while(pc->pc_run) {
 
     if(TAILQ_FIRST(&pc->pc_queue_exp) == NULL &&
        TAILQ_FIRST(&pc->pc_queue_nor) == NULL) {
-      hts_cond_wait(&pc->pc_cond, &prop_mutex);
+
+      if(TAILQ_FIRST(&pc->pc_free_queue) != NULL) {
+        // Going idle, don't keep subscriptions alive while we sleep
+        hts_mutex_unlock(&pc->pc_mutex);
+        prop_courier_release_free(pc, 1);
+        hts_mutex_lock(&pc->pc_mutex);
+        continue;
+      }
+
+      hts_cond_wait(&pc->pc_cond, &pc->pc_mutex);
       continue;
     }
 
@@ -1026,29 +1115,54 @@ prop_courier(void *aux)
 
     const char *tt = pc->pc_flags & PROP_COURIER_TRACE_TIMES ?
       pc->pc_name : NULL;
-    hts_mutex_unlock(&prop_mutex);
-    prop_notify_dispatch(&q_exp, tt);
-    prop_notify_dispatch(&q_nor, tt);
-    hts_mutex_lock(&prop_mutex);
+    hts_mutex_unlock(&pc->pc_mutex);
+
+    pc->pc_num_free += prop_notify_dispatch0(&q_exp, tt);
+    TAILQ_MERGE(&pc->pc_free_queue, &q_exp, hpn_link);
+    pc->pc_num_free += prop_notify_dispatch0(&q_nor, tt);
+    TAILQ_MERGE(&pc->pc_free_queue, &q_nor, hpn_link);
+
+    prop_courier_release_free(pc, 0);
+
+    hts_mutex_lock(&pc->pc_mutex);
   }
+  hts_mutex_unlock(&pc->pc_mutex);
+
+  hts_mutex_lock(&prop_mutex);
+  hts_mutex_lock(&pc->pc_mutex);
 
   while((n = TAILQ_FIRST(&pc->pc_queue_exp)) != NULL) {
     TAILQ_REMOVE(&pc->pc_queue_exp, n, hpn_link);
+    if(n->hpn_coalesce)
+      n->hpn_sub->hps_pending_value = NULL;
     prop_notify_free(n);
   }
 
   while((n = TAILQ_FIRST(&pc->pc_queue_nor)) != NULL) {
     TAILQ_REMOVE(&pc->pc_queue_nor, n, hpn_link);
+    if(n->hpn_coalesce)
+      n->hpn_sub->hps_pending_value = NULL;
     prop_notify_free(n);
   }
 
-  if(pc->pc_detached)
+  while((n = TAILQ_FIRST(&pc->pc_free_queue)) != NULL) {
+    TAILQ_REMOVE(&pc->pc_free_queue, n, hpn_link);
+    prop_sub_ref_dec_locked(n->hpn_sub);
+    pool_put(notify_pool, n);
+  }
+  pc->pc_num_free = 0;
+
+  hts_mutex_unlock(&pc->pc_mutex);
+
+  if(pc->pc_detached) {
+    hts_mutex_destroy(&pc->pc_mutex);
     free(pc);
+  }
 
   hts_mutex_unlock(&prop_mutex);
 
-  if(pc->pc_epilogue)
-    pc->pc_epilogue();
+  if(epilogue)
+    epilogue();
 
   return NULL;
 }
@@ -1175,19 +1289,6 @@ prop_global_dispatch_wakeup(void)
   }
 }
 
-/**
- *
- */
-static void
-courier_notify(prop_courier_t *pc)
-{
-  if(pc->pc_has_cond)
-    hts_cond_signal(&pc->pc_cond);
-  else if(pc->pc_notify != NULL)
-    pc->pc_notify(pc->pc_opaque);
-}
-
-
 /**
  *
  */
@@ -1201,12 +1302,24 @@ courier_enqueue0(prop_sub_t *s, prop_notify_t *n, int expedite)
   case PROP_SUB_DISPATCH_MODE_COURIER:
     pc = s->hps_dispatch;
 
+    hts_mutex_lock(&pc->pc_mutex);
     if(expedite)
       TAILQ_INSERT_TAIL(&pc->pc_queue_exp, n, hpn_link);
     else
       TAILQ_INSERT_TAIL(&pc->pc_queue_nor, n, hpn_link);
 
-    courier_notify(pc);
+    // Anything queued after a pending value must not be reordered with it
+    if(s->hps_pending_value != NULL)
+      s->hps_pending_value->hpn_coalesce = 0;
+    s->hps_pending_value = n->hpn_coalesce ? n : NULL;
+
+    if(pc->pc_has_cond)
+      hts_cond_signal(&pc->pc_cond);
+    hts_mutex_unlock(&pc->pc_mutex);
+
+    // Callback is invoked without pc_mutex held so it can poll the courier
+    if(!pc->pc_has_cond && pc->pc_notify != NULL)
+      pc->pc_notify(pc->pc_opaque);
     break;
 
 
@@ -1254,10 +1367,66 @@ prop_get_notify(prop_sub_t *s)
   prop_notify_t *n = pool_get(notify_pool);
   atomic_inc(&s->hps_refcount);
   n->hpn_sub = s;
+  n->hpn_coalesce = 0;
   return n;
 }
 
 
+/**
+ *
+ */
+static void
+prop_notify_set_value(prop_notify_t *n, prop_t *p)
+{
+  switch(p->hp_type) {
+  case PROP_RSTRING:
+    assert(p->hp_rstring != NULL);
+    n->hpn_rstring = rstr_dup(p->hp_rstring);
+    n->hpn_rstrtype = p->hp_rstrtype;
+    n->hpn_event = PROP_SET_RSTRING;
+    break;
+
+  case PROP_CSTRING:
+    n->hpn_cstring = p->hp_cstring;
+    n->hpn_event = PROP_SET_CSTRING;
+    break;
+
+  case PROP_URI:
+    n->hpn_uri_title = rstr_dup(p->hp_uri_title);
+    n->hpn_uri       = rstr_dup(p->hp_uri);
+    n->hpn_event = PROP_SET_URI;
+    break;
+
+  case PROP_FLOAT:
+    n->hpn_float = p->hp_float;
+    n->hpn_event = PROP_SET_FLOAT;
+    break;
+
+  case PROP_INT:
+    n->hpn_float = p->hp_float;
+    n->hpn_event = PROP_SET_INT;
+    break;
+
+  case PROP_DIR:
+    n->hpn_event = PROP_SET_DIR;
+    break;
+
+  case PROP_VOID:
+    n->hpn_event = PROP_SET_VOID;
+    break;
+
+  case PROP_PROP:
+    n->hpn_prop = prop_ref_inc(p->hp_prop);
+    n->hpn_event = PROP_SET_PROP;
+    break;
+
+  case PROP_ZOMBIE:
+  case PROP_PROXY:
+    abort();
+  }
+}
+
+
 /**
  *
  */
@@ -1403,55 +1572,33 @@ prop_build_notify_value(prop_sub_t *s, int direct, const char *origin,
     }
   }
 
-  n = prop_get_notify(s);
-
-  switch(p->hp_type) {
-  case PROP_RSTRING:
-    assert(p->hp_rstring != NULL);
-    n->hpn_rstring = rstr_dup(p->hp_rstring);
-    n->hpn_rstrtype = p->hp_rstrtype;
-    n->hpn_event = PROP_SET_RSTRING;
-    break;
-
-  case PROP_CSTRING:
-    n->hpn_cstring = p->hp_cstring;
-    n->hpn_event = PROP_SET_CSTRING;
-    break;
-
-  case PROP_URI:
-    n->hpn_uri_title = rstr_dup(p->hp_uri_title);
-    n->hpn_uri       = rstr_dup(p->hp_uri);
-    n->hpn_event = PROP_SET_URI;
-    break;
-
-  case PROP_FLOAT:
-    n->hpn_float = p->hp_float;
-    n->hpn_event = PROP_SET_FLOAT;
-    break;
-
-  case PROP_INT:
-    n->hpn_float = p->hp_float;
-    n->hpn_event = PROP_SET_INT;
-    break;
-
-  case PROP_DIR:
-    n->hpn_event = PROP_SET_DIR;
-    break;
-
-  case PROP_VOID:
-    n->hpn_event = PROP_SET_VOID;
-    break;
+  if(s->hps_flags & PROP_SUB_COALESCE && pnq == NULL &&
+     s->hps_dispatch_mode == PROP_SUB_DISPATCH_MODE_COURIER) {
+    prop_courier_t *pc = s->hps_dispatch;
 
-  case PROP_PROP:
-    n->hpn_prop = prop_ref_inc(p->hp_prop);
-    n->hpn_event = PROP_SET_PROP;
-    break;
+    hts_mutex_lock(&pc->pc_mutex);
+    n = s->hps_pending_value;
+    if(n != NULL) {
+      // Overwrite the value still waiting in the queue
+      prop_notify_free_payload(n);
+      prop_notify_set_value(n, p);
+      pc->pc_num_coalesced++;
+      atomic_inc(&prop_stat_coalesced);
+      hts_mutex_unlock(&pc->pc_mutex);
+      return;
+    }
+    hts_mutex_unlock(&pc->pc_mutex);
 
-  case PROP_ZOMBIE:
-  case PROP_PROXY:
-    abort();
+    n = prop_get_notify(s);
+    prop_notify_set_value(n, p);
+    n->hpn_coalesce = 1;
+    prop_courier_enqueue(s, n);
+    return;
   }
 
+  n = prop_get_notify(s);
+  prop_notify_set_value(n, p);
+
   if(pnq) {
     TAILQ_INSERT_TAIL(pnq, n, hpn_link);
   } else {
@@ -1881,17 +2028,283 @@ prop_make_dir(prop_t *p, prop_sub_t *skipme, const char *origin)
   TAILQ_INIT(&p->hp_childs);
   p->hp_selected = NULL;
   p->hp_type = PROP_DIR;
-  
+
   prop_notify_value(p, skipme, origin);
 }
 
 
+#define PROP_CHILD_INDEX_HASH_SIZE 64
+
+static prop_child_index_t *prop_child_indexes[PROP_CHILD_INDEX_HASH_SIZE];
+
+#define prop_child_index_bucket(p) \
+  (&prop_child_indexes[((uintptr_t)(p) >> 4) % PROP_CHILD_INDEX_HASH_SIZE])
+
+
+/**
+ *
+ */
+static prop_child_index_t *
+prop_child_index_get(const prop_t *p)
+{
+  prop_child_index_t *pci;
+
+  if(!(p->hp_flags & PROP_HAS_CHILD_INDEX))
+    return NULL;
+
+  for(pci = *prop_child_index_bucket(p); pci != NULL; pci = pci->pci_next)
+    if(pci->pci_dir == p)
+      return pci;
+  abort();
+}
+
+
+/**
+ * Insert child into hash slots, caller must make sure there is room
+ */
+static void
+prop_child_index_put(prop_child_index_t *pci, prop_t *c)
+{
+  unsigned int i = prop_name_atom(c->hp_name)->pa_hash & pci->pci_mask;
+  while(pci->pci_slots[i] != NULL)
+    i = (i + 1) & pci->pci_mask;
+  pci->pci_slots[i] = c;
+  pci->pci_count++;
+}
+
+
+/**
+ *
+ */
+static int
+prop_child_index_slot(const prop_child_index_t *pci, const char *name)
+{
+  unsigned int i = prop_name_atom(name)->pa_hash & pci->pci_mask;
+  prop_t *c;
+  while((c = pci->pci_slots[i]) != NULL) {
+    if(c->hp_name == name)
+      return i;
+    i = (i + 1) & pci->pci_mask;
+  }
+  return -1;
+}
+
+
+/**
+ * Give up on hashing this directory (we've seen duplicate names)
+ */
+static void
+prop_child_index_disable(prop_child_index_t *pci)
+{
+  free(pci->pci_slots);
+  pci->pci_slots = NULL;
+  pci->pci_count = 0;
+}
+
+
+/**
+ *
+ */
+static void
+prop_child_index_add(prop_t *parent, prop_t *c)
+{
+  prop_child_index_t *pci = prop_child_index_get(parent);
+
+  if(pci == NULL || pci->pci_slots == NULL || c->hp_name == NULL)
+    return;
+
+  if(prop_child_index_slot(pci, c->hp_name) != -1) {
+    prop_child_index_disable(pci);
+    return;
+  }
+
+  if((pci->pci_count + 1) * 2 > pci->pci_mask) {
+    // Grow, keep load factor below 50%
+    prop_t **old = pci->pci_slots;
+    unsigned int oldsize = pci->pci_mask + 1;
+
+    pci->pci_mask = oldsize * 2 - 1;
+    pci->pci_slots = calloc(oldsize * 2, sizeof(prop_t *));
+    pci->pci_count = 0;
+
+    for(int i = 0; i < oldsize; i++)
+      if(old[i] != NULL)
+        prop_child_index_put(pci, old[i]);
+    free(old);
+  }
+  prop_child_index_put(pci, c);
+}
+
+
+/**
+ * Remove a child, backward shift deletion so we don't need tombstones
+ */
+static void
+prop_child_index_del(prop_t *parent, prop_t *c)
+{
+  prop_child_index_t *pci = prop_child_index_get(parent);
+
+  if(pci == NULL || pci->pci_slots == NULL || c->hp_name == NULL)
+    return;
+
+  int i = prop_child_index_slot(pci, c->hp_name);
+  if(i == -1 || pci->pci_slots[i] != c)
+    return;
+
+  unsigned int hole = i, j = i;
+  while(1) {
+    j = (j + 1) & pci->pci_mask;
+    prop_t *n = pci->pci_slots[j];
+    if(n == NULL)
+      break;
+    unsigned int home = prop_name_atom(n->hp_name)->pa_hash & pci->pci_mask;
+    // Move n into the hole unless its home slot is cyclically in (hole, j]
+    if(((j - home) & pci->pci_mask) >= ((j - hole) & pci->pci_mask)) {
+      pci->pci_slots[hole] = n;
+      hole = j;
+    }
+  }
+  pci->pci_slots[hole] = NULL;
+  pci->pci_count--;
+}
+
+
+/**
+ *
+ */
+static void
+prop_child_index_destroy(prop_t *p)
+{
+  prop_child_index_t **pp, *pci;
+
+  if(!(p->hp_flags & PROP_HAS_CHILD_INDEX))
+    return;
+
+  for(pp = prop_child_index_bucket(p); (pci = *pp)->pci_dir != p;
+      pp = &pci->pci_next) {}
+
+  *pp = pci->pci_next;
+  p->hp_flags &= ~PROP_HAS_CHILD_INDEX;
+  free(pci->pci_slots);
+  free(pci);
+}
+
+
+/**
+ *
+ */
+static void
+prop_child_index_create(prop_t *p, int count)
+{
+  prop_child_index_t *pci = malloc(sizeof(prop_child_index_t));
+  prop_t *c;
+  unsigned int size = 64;
+
+  while(size < count * 2)
+    size *= 2;
+
+  pci->pci_slots = calloc(size, sizeof(prop_t *));
+  pci->pci_mask = size - 1;
+  pci->pci_count = 0;
+  pci->pci_dir = p;
+
+  prop_child_index_t **bucket = prop_child_index_bucket(p);
+  pci->pci_next = *bucket;
+  *bucket = pci;
+  p->hp_flags |= PROP_HAS_CHILD_INDEX;
+
+  TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
+    prop_child_index_add(p, c);
+    if(pci->pci_slots == NULL)
+      break;
+  }
+}
+
+
+/**
+ * Find child in a PROP_DIR given the name atom
+ *
+ * Large directories get a hash index the first time a lookup has to
+ * walk past PROP_CHILD_INDEX_THRESHOLD children
+ */
+static prop_t *
+prop_find_child_atom(prop_t *p, prop_atom_t *pa)
+{
+  prop_child_index_t *pci = prop_child_index_get(p);
+  const char *name = pa->pa_str;
+  prop_t *c;
+  int count = 0;
+
+  if(pci != NULL && pci->pci_slots != NULL) {
+    int i = prop_child_index_slot(pci, name);
+    return i == -1 ? NULL : pci->pci_slots[i];
+  }
+
+  TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
+    if(c->hp_name == name)
+      break;
+    count++;
+  }
+
+  if(count >= PROP_CHILD_INDEX_THRESHOLD && pci == NULL)
+    prop_child_index_create(p, count);
+  return c;
+}
+
+
+/**
+ * Atoms for recently used names. Each entry holds a reference on its
+ * atom, so a hit needs neither the atom stripe lock nor any refcount
+ * changes. The returned atom is only valid while the global mutex is
+ * held, anything keeping it must prop_atom_dup() it.
+ *
+ * Protected by global mutex
+ */
+#define PROP_NAME_CACHE_SIZE 1024
+
+static prop_atom_t *prop_name_cache[PROP_NAME_CACHE_SIZE];
+
+static prop_atom_t *
+prop_name_lookup(const char *name, int create)
+{
+  const unsigned int hash = mystrhash(name);
+  prop_atom_t **slot = &prop_name_cache[hash & (PROP_NAME_CACHE_SIZE - 1)];
+  prop_atom_t *pa = *slot;
+
+  if(pa != NULL && pa->pa_hash == hash && !strcmp(pa->pa_str, name))
+    return pa;
+
+  pa = create ? prop_atom_get(name) : prop_atom_find(name);
+  if(pa == NULL)
+    return NULL;
+
+  prop_atom_release(*slot);
+  *slot = pa;
+  return pa;
+}
+
+
+/**
+ * Find named child in a PROP_DIR
+ */
+static prop_t *
+prop_find_child(prop_t *p, const char *name)
+{
+  prop_atom_t *pa = prop_name_lookup(name, 0);
+  if(pa == NULL)
+    return NULL; // No prop anywhere has this name
+  return prop_find_child_atom(p, pa);
+}
+
+
 /**
  *
  */
 static void
 prop_insert(prop_t *p, prop_t *parent, prop_t *before, prop_sub_t *skipme)
 {
+  prop_child_index_add(parent, p);
+
   if(before != NULL) {
     assert(before->hp_parent == parent);
     TAILQ_INSERT_BEFORE(before, p, hp_parent_link);
@@ -1904,25 +2317,22 @@ prop_insert(prop_t *p, prop_t *parent, prop_t *before, prop_sub_t *skipme)
 
 
 /**
- *
+ * Create a new prop, takes over the reference to the name atom
  */
-prop_t *
-prop_make(const char *name, int noalloc, prop_t *parent)
+static prop_t *
+prop_make_atom(prop_atom_t *pa, prop_t *parent)
 {
   prop_t *hp = pool_get(prop_pool);
 #ifdef PROP_DEBUG
   hp->hp_magic = PROP_MAGIC;
   SIMPLEQ_INIT(&hp->hp_ref_trace);
 #endif
-  hp->hp_flags = noalloc ? PROP_NAME_NOT_ALLOCATED : 0;
+  hp->hp_flags = 0;
   hp->hp_originator = NULL;
   atomic_set(&hp->hp_refcount, 1);
   hp->hp_xref = 1;
   hp->hp_type = PROP_VOID;
-  if(noalloc)
-    hp->hp_name = name;
-  else
-    hp->hp_name = name ? strdup(name) : NULL;
+  hp->hp_name = prop_atom_str(pa);
 
   hp->hp_tags = NULL;
   LIST_INIT(&hp->hp_targets);
@@ -1933,39 +2343,39 @@ prop_make(const char *name, int noalloc, prop_t *parent)
   return hp;
 }
 
+
 /**
  *
  */
 prop_t *
-prop_create0(prop_t *parent, const char *name, prop_sub_t *skipme, int noalloc)
+prop_make(const char *name, prop_t *parent)
+{
+  return prop_make_atom(name ? prop_atom_get(name) : NULL, parent);
+}
+
+
+/**
+ * Does not consume the reference to 'pa'
+ */
+prop_t *
+prop_create_atom0(prop_t *parent, prop_atom_t *pa, prop_sub_t *skipme)
 {
   prop_t *hp;
 
   assert(parent->hp_type != PROP_ZOMBIE);
 
   if(parent->hp_type == PROP_PROXY)
-    return prop_proxy_create(parent, name);
+    return prop_proxy_create(parent, prop_atom_str(pa));
 
   prop_make_dir(parent, skipme, "prop_create()");
 
-  if(name != NULL) {
-    TAILQ_FOREACH(hp, &parent->hp_childs, hp_parent_link) {
-      if(hp->hp_name != NULL && !strcmp(hp->hp_name, name)) {
-
-	if(!(hp->hp_flags & PROP_NAME_NOT_ALLOCATED) && noalloc) {
-	  // Trick: We have a pointer to a compile time constant string
-	  // and the current prop does not have that, we could switch to
-	  // it and thus save some memory allocation
-	  free((void *)hp->hp_name);
-	  hp->hp_name = name;
-	  hp->hp_flags |= PROP_NAME_NOT_ALLOCATED;
-	}
-	return hp;
-      }
-    }
+  if(pa != NULL) {
+    hp = prop_find_child_atom(parent, pa);
+    if(hp != NULL)
+      return hp;
   }
 
-  hp = prop_make(name, noalloc, parent);
+  hp = prop_make_atom(prop_atom_dup(pa), parent);
 
   if(parent->hp_flags & (PROP_MULTI_SUB | PROP_MULTI_NOTIFY))
     prop_flood_flag(hp, PROP_MULTI_NOTIFY, 0);
@@ -1975,18 +2385,29 @@ prop_create0(prop_t *parent, const char *name, prop_sub_t *skipme, int noalloc)
 }
 
 
+/**
+ *
+ */
+prop_t *
+prop_create0(prop_t *parent, const char *name, prop_sub_t *skipme)
+{
+  return prop_create_atom0(parent, name ? prop_name_lookup(name, 1) : NULL,
+                           skipme);
+}
+
+
 
 /**
  *
  */
 prop_t *
 prop_create_ex(prop_t *parent, const char *name, prop_sub_t *skipme,
-	       int noalloc, int incref)
+	       int incref)
 {
   prop_t *p;
   hts_mutex_lock(&prop_mutex);
   if(parent != NULL && parent->hp_type != PROP_ZOMBIE) {
-    p = prop_create0(parent, name, skipme, noalloc);
+    p = prop_create0(parent, name, skipme);
   } else {
     p = NULL;
   }
@@ -2001,10 +2422,31 @@ prop_create_ex(prop_t *parent, const char *name, prop_sub_t *skipme,
  *
  */
 prop_t *
-prop_create_root_ex(const char *name, int noalloc)
+prop_create_atom_ex(prop_t *parent, prop_atom_t *name, prop_sub_t *skipme,
+                    int incref)
 {
+  prop_t *p;
   hts_mutex_lock(&prop_mutex);
-  prop_t *p = prop_make(name, noalloc, NULL);
+  if(parent != NULL && parent->hp_type != PROP_ZOMBIE) {
+    p = prop_create_atom0(parent, name, skipme);
+  } else {
+    p = NULL;
+  }
+  if(incref)
+    p = prop_ref_inc(p);
+  hts_mutex_unlock(&prop_mutex);
+  return p;
+}
+
+
+/**
+ *
+ */
+prop_t *
+prop_create_root(const char *name)
+{
+  hts_mutex_lock(&prop_mutex);
+  prop_t *p = prop_make(name, NULL);
   hts_mutex_unlock(&prop_mutex);
   return p;
 }
@@ -2032,7 +2474,7 @@ prop_create_multi(prop_t *p, ...)
   }
 
   while((name = va_arg(ap, const char *)) != NULL)
-    p = prop_create0(p, name, NULL, 0);
+    p = prop_create0(p, name, NULL);
 
   p = prop_ref_inc(p);
   hts_mutex_unlock(&prop_mutex);
@@ -2054,14 +2496,13 @@ prop_create_after(prop_t *parent, const char *name, prop_t *after,
 
     prop_make_dir(parent, skipme, "prop_create_after()");
 
-    TAILQ_FOREACH(p, &parent->hp_childs, hp_parent_link)
-      if(p->hp_name != NULL && !strcmp(p->hp_name, name))
-	break;
+    p = prop_find_child(parent, name);
 
     if(p == NULL) {
 
-      p = prop_make(name, 0, parent);
-  
+      p = prop_make(name, parent);
+      prop_child_index_add(parent, p);
+
       if(after == NULL) {
 	TAILQ_INSERT_HEAD(&parent->hp_childs, p, hp_parent_link);
       } else {
@@ -2181,6 +2622,7 @@ prop_set_parent_vector(prop_vec_t *pv, prop_t *parent, prop_t *before,
       } else {
 	TAILQ_INSERT_TAIL(&parent->hp_childs, p, hp_parent_link);
       }
+      prop_child_index_add(parent, p);
     }
     prop_notify_childv(pv, parent, before ? PROP_ADD_CHILD_VECTOR_BEFORE : 
 		       PROP_ADD_CHILD_VECTOR, skipme, before);
@@ -2204,8 +2646,9 @@ prop_unparent0(prop_t *p, prop_sub_t *skipme)
   prop_notify_child(p, parent, PROP_DEL_CHILD, NULL, 0);
   
   TAILQ_REMOVE(&parent->hp_childs, p, hp_parent_link);
+  prop_child_index_del(parent, p);
   p->hp_parent = NULL;
-  
+
   if(parent->hp_selected == p)
     parent->hp_selected = NULL;
 }
@@ -2248,6 +2691,7 @@ prop_destroy_child(prop_t *p, prop_t *c)
   if(!prop_destroy0(c)) {
     prop_notify_child(c, p, PROP_DEL_CHILD, NULL, 0);
     TAILQ_REMOVE(&p->hp_childs, c, hp_parent_link);
+    prop_child_index_del(p, c);
     c->hp_parent = NULL;
   }
 }
@@ -2311,6 +2755,7 @@ prop_destroy0(prop_t *p)
     abort();
 
   case PROP_DIR:
+    prop_child_index_destroy(p);
     for(c = TAILQ_FIRST(&p->hp_childs); c != NULL; c = next) {
       next = TAILQ_NEXT(c, hp_parent_link);
       prop_destroy_child(p, c);
@@ -2386,6 +2831,7 @@ prop_destroy0(prop_t *p)
         prop_build_notify_child(s, p, PROP_DEL_CHILD, 0, 0);
 
     TAILQ_REMOVE(&parent->hp_childs, p, hp_parent_link);
+    prop_child_index_del(parent, p);
     p->hp_parent = NULL;
 
     if(parent->hp_selected == p)
@@ -2423,6 +2869,7 @@ prop_destroy_childs0(prop_t *p)
   prop_sub_t *s;
 
   struct prop_queue childs;
+  prop_child_index_destroy(p);
   TAILQ_MOVE(&childs, &p->hp_childs, hp_parent_link);
   TAILQ_INIT(&p->hp_childs);
 
@@ -2510,12 +2957,9 @@ prop_destroy_by_name(prop_t *p, const char *name)
 	  prop_destroy_child(p, c);
       }
     } else {
-      TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
-	if(c->hp_name != NULL && !strcmp(c->hp_name, name)) {
-	  prop_destroy_child(p, c);
-	  break;
-	}
-      }
+      c = prop_find_child(p, name);
+      if(c != NULL)
+        prop_destroy_child(p, c);
     }
   }
   hts_mutex_unlock(&prop_mutex);
@@ -2679,13 +3123,15 @@ prop_req_move(prop_t *p, prop_t *before)
  *
  */
 static prop_t *
-prop_subfind(prop_t *p, const char **name, int follow_symlinks,
-             int allow_indexing, prop_t **origin_chain)
+prop_subfind(prop_t *p, const char **name, prop_atom_t **atoms,
+             int follow_symlinks, int allow_indexing, prop_t **origin_chain)
 {
   prop_t *c;
   int ocnum = 0;
 
-  while(name[0] != NULL) {
+  while(atoms != NULL ? atoms[0] != NULL : name[0] != NULL) {
+    const char *n = atoms != NULL ? prop_atom_str(atoms[0]) : name[0];
+
     while(follow_symlinks && p->hp_originator != NULL) {
       if(origin_chain)
 	origin_chain[ocnum++] = p;
@@ -2708,8 +3154,8 @@ prop_subfind(prop_t *p, const char **name, int follow_symlinks,
       prop_notify_value(p, NULL, "prop_subfind()");
     }
 
-    if(allow_indexing && name[0][0] == '*') {
-      unsigned int i = atoi(name[0]+1);
+    if(allow_indexing && n[0] == '*') {
+      unsigned int i = atoi(n + 1);
       TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
 	if(i == 0)
 	  break;
@@ -2720,15 +3166,16 @@ prop_subfind(prop_t *p, const char **name, int follow_symlinks,
           origin_chain[0] = NULL;
 	return NULL;
       }
+      p = c;
     } else {
-
-      TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
-	if(c->hp_name != NULL && !strcmp(c->hp_name, name[0]))
-	  break;
-      }
+      p = prop_create_atom0(p, atoms != NULL ? atoms[0] :
+                            prop_name_lookup(n, 1), NULL);
     }
-    p = c ?: prop_create0(p, name[0], NULL, 0);    
-    name++;
+
+    if(atoms != NULL)
+      atoms++;
+    else
+      name++;
   }
 
   while(follow_symlinks && p->hp_originator != NULL) {
@@ -2883,7 +3330,7 @@ prop_get_by_name(const char **name, int follow_symlinks, ...)
 
   } else {
 
-    p = prop_subfind(p, name, follow_symlinks, 1, NULL);
+    p = prop_subfind(p, name, NULL, follow_symlinks, 1, NULL);
 
   }
 
@@ -2921,6 +3368,7 @@ prop_subscribe_ex(const char *file, int line, int flags, ...)
   int notify_now = !(flags & PROP_SUB_NO_INITIAL_UPDATE);
   int tag;
   const char **name = NULL;
+  prop_atom_t **atoms = NULL;
   void *opaque = NULL;
   prop_courier_t *pc = NULL;
   prop_sub_dispatch_t *psd = NULL;
@@ -2952,14 +3400,21 @@ prop_subscribe_ex(const char *file, int line, int flags, ...)
     tag = va_arg(ap, int);
     switch(tag) {
     case PROP_TAG_NAME_VECTOR:
-      if(name != NULL)
+      if(name != NULL || atoms != NULL)
         (void)va_arg(ap, const char **);
       else
         name = va_arg(ap,  const char **);
       break;
 
+    case PROP_TAG_ATOM_VECTOR:
+      if(name != NULL || atoms != NULL)
+        (void)va_arg(ap, prop_atom_t **);
+      else
+        atoms = va_arg(ap, prop_atom_t **);
+      break;
+
     case PROP_TAG_NAMESTR:
-      if(name != NULL) {
+      if(name != NULL || atoms != NULL) {
         (void)va_arg(ap, const char *);
       } else {
 	const char *s, *s0 = va_arg(ap, const char *);
@@ -3122,7 +3577,7 @@ prop_subscribe_ex(const char *file, int line, int flags, ...)
 
   va_end(ap);
 
-  if(name == NULL) {
+  if(name == NULL && atoms == NULL) {
     /* No name given, just subscribe to the supplied prop */
 
     pr = LIST_FIRST(&proproots);
@@ -3150,8 +3605,14 @@ prop_subscribe_ex(const char *file, int line, int flags, ...)
     if(flags & PROP_SUB_ALT_PATH) {
       p = LIST_FIRST(&proproots) ? LIST_FIRST(&proproots)->p : NULL;
     } else {
-      p = prop_resolve_tree(name[0], &proproots, prv, prvlen);
-      name++;
+      if(atoms != NULL) {
+        p = prop_resolve_tree(prop_atom_str(atoms[0]), &proproots,
+                              prv, prvlen);
+        atoms++;
+      } else {
+        p = prop_resolve_tree(name[0], &proproots, prv, prvlen);
+        name++;
+      }
     }
 
     if(dolock)
@@ -3166,10 +3627,10 @@ prop_subscribe_ex(const char *file, int line, int flags, ...)
 
     } else {
       /* Canonical name is the resolved props without following symlinks */
-      canonical = prop_subfind(p, name, 0, 0, NULL);
+      canonical = prop_subfind(p, name, atoms, 0, 0, NULL);
 
       /* ... and value will follow links */
-      value     = prop_subfind(p, name, 1, 0, origin_chain);
+      value     = prop_subfind(p, name, atoms, 1, 0, origin_chain);
     }
   }
 
@@ -3203,6 +3664,7 @@ prop_subscribe_ex(const char *file, int line, int flags, ...)
   s->hps_origin = NULL;
   s->hps_zombie = 0;
   s->hps_flags = flags;
+  s->hps_pending_value = NULL;
   s->hps_trampoline = trampoline;
   s->hps_callback = cb;
   s->hps_opaque = opaque;
@@ -3273,6 +3735,14 @@ prop_subscribe_ex(const char *file, int line, int flags, ...)
 
     // Subscribe via external proxy
     s->hps_proxy = 1;
+    if(atoms != NULL) {
+      int n = 0;
+      while(atoms[n] != NULL)
+        n++;
+      name = alloca((n + 1) * sizeof(const char *));
+      for(int i = 0; i <= n; i++)
+        name[i] = prop_atom_str(atoms[i]);
+    }
     prop_proxy_subscribe(ppc, s, value, name);
 
   } else {
@@ -3512,6 +3982,8 @@ prop_init(void)
   TAILQ_INIT(&prop_global_dispatch_dispatching_queue);
 
 
+  prop_atom_init();
+
   prop_pool   = pool_create("prop", sizeof(prop_t), 0);
   notify_pool = pool_create("notify", sizeof(prop_notify_t), 0);
   sub_pool    = pool_create("subs", sizeof(prop_sub_t), 0);
@@ -3519,7 +3991,7 @@ prop_init(void)
   psd_pool    = pool_create("psds", sizeof(prop_sub_dispatch_t), 0);
 
   hts_mutex_lock(&prop_mutex);
-  prop_global = prop_make("global", 1, NULL);
+  prop_global = prop_make("global", NULL);
   hts_mutex_unlock(&prop_mutex);
 }
 
@@ -4512,8 +4984,7 @@ relink_subscriptions(prop_t *src, prop_t *dst, prop_sub_t *skipme,
     if(c->hp_name == NULL)
       continue;
 
-    prop_t *z = prop_create0(src, c->hp_name, NULL,
-                             c->hp_flags & PROP_NAME_NOT_ALLOCATED);
+    prop_t *z = prop_create_atom0(src, prop_name_atom(c->hp_name), NULL);
 
     if(c->hp_type == PROP_DIR)
       prop_make_dir(z, skipme, origin);
@@ -4649,8 +5120,7 @@ restore_and_descend(prop_t *dst, prop_t *src, prop_sub_t *skipme,
     if(!search_for_linkage(s, broken_link))
       continue;
 
-    prop_t *z = prop_create0(dst, c->hp_name, NULL,
-                             c->hp_flags & PROP_NAME_NOT_ALLOCATED);
+    prop_t *z = prop_create_atom0(dst, prop_name_atom(c->hp_name), NULL);
 
     if(c->hp_type == PROP_DIR)
       prop_make_dir(z, skipme, origin);
@@ -4902,6 +5372,27 @@ prop_follow(prop_t *p)
 }
 
 
+/**
+ * Store p and up to max - 1 of its ancestors in vec. No references are
+ * taken so the pointers should only be used for comparison
+ */
+int
+prop_get_ancestors(prop_t *p, prop_t **vec, int max)
+{
+  int n = 0;
+  hts_mutex_lock(&prop_mutex);
+
+  while(p != NULL && n < max &&
+        p->hp_type != PROP_ZOMBIE && p->hp_type != PROP_PROXY) {
+    vec[n++] = p;
+    p = p->hp_parent;
+  }
+
+  hts_mutex_unlock(&prop_mutex);
+  return n;
+}
+
+
 /**
  *
  */
@@ -4998,10 +5489,7 @@ prop_select_by_value_ex(prop_t *p, const char *name, prop_sub_t *skipme)
   hts_mutex_lock(&prop_mutex);
 
   if(p->hp_type == PROP_DIR) {
-    prop_t *c;
-    TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-      if(c->hp_name != NULL && !strcmp(c->hp_name, name))
-        break;
+    prop_t *c = prop_find_child(p, name);
 
     prop_notify_child2(c, p, NULL, PROP_SELECT_CHILD, skipme, 0);
     p->hp_selected = c;
@@ -5063,9 +5551,7 @@ prop_findv(prop_t *p, char **names)
       break;
     }
 
-    TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-      if(c->hp_name != NULL && !strcmp(c->hp_name, n))
-	break;
+    c = prop_find_child(p, n);
     if(c == NULL)
       break;
 
@@ -5095,9 +5581,7 @@ prop_find0(prop_t *p, va_list ap)
       break;
     }
 
-    TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-      if(c->hp_name != NULL && !strcmp(c->hp_name, n))
-	break;
+    c = prop_find_child(p, n);
     if(c == NULL)
 	return NULL;
     p = c;
@@ -5202,6 +5686,7 @@ static prop_courier_t *
 prop_courier_create(void)
 {
   prop_courier_t *pc = calloc(1, sizeof(prop_courier_t));
+  hts_mutex_init(&pc->pc_mutex);
   TAILQ_INIT(&pc->pc_queue_nor);
   TAILQ_INIT(&pc->pc_queue_exp);
   TAILQ_INIT(&pc->pc_dispatch_queue);
@@ -5223,7 +5708,7 @@ prop_courier_create_thread(hts_mutex_t *entrymutex, const char *name,
   snprintf(buf, sizeof(buf), "PC:%s", name);
   pc->pc_flags = flags;
   pc->pc_has_cond = 1;
-  hts_cond_init(&pc->pc_cond, &prop_mutex);
+  hts_cond_init(&pc->pc_cond, &pc->pc_mutex);
 
   pc->pc_name = strdup(name);
   pc->pc_run = 1;
@@ -5268,7 +5753,7 @@ prop_courier_create_waitable(void)
   prop_courier_t *pc = prop_courier_create();
   
   pc->pc_has_cond = 1;
-  hts_cond_init(&pc->pc_cond, &prop_mutex);
+  hts_cond_init(&pc->pc_cond, &pc->pc_mutex);
 
   return pc;
 }
@@ -5281,18 +5766,18 @@ int
 prop_courier_wait(prop_courier_t *pc, struct prop_notify_queue *q, int timeout)
 {
   int r = 0;
-  hts_mutex_lock(&prop_mutex);
+  hts_mutex_lock(&pc->pc_mutex);
   if(TAILQ_FIRST(&pc->pc_queue_exp) == NULL &&
      TAILQ_FIRST(&pc->pc_queue_nor) == NULL) {
     if(timeout)
-      r = hts_cond_wait_timeout(&pc->pc_cond, &prop_mutex, timeout);
+      r = hts_cond_wait_timeout(&pc->pc_cond, &pc->pc_mutex, timeout);
     else
-      hts_cond_wait(&pc->pc_cond, &prop_mutex);
+      hts_cond_wait(&pc->pc_cond, &pc->pc_mutex);
   }
 
   TAILQ_MOVE(q, &pc->pc_queue_exp, hpn_link);
   TAILQ_MERGE(q, &pc->pc_queue_nor, hpn_link);
-  hts_mutex_unlock(&prop_mutex);
+  hts_mutex_unlock(&pc->pc_mutex);
   return r;
 }
 
@@ -5347,17 +5832,21 @@ prop_courier_destroy(prop_courier_t *pc)
   }
 
   if(pc->pc_run) {
-    hts_mutex_lock(&prop_mutex);
+    hts_mutex_lock(&pc->pc_mutex);
     pc->pc_run = 0;
     hts_cond_signal(&pc->pc_cond);
-    hts_mutex_unlock(&prop_mutex);
+    hts_mutex_unlock(&pc->pc_mutex);
 
     hts_thread_join(&pc->pc_thread);
   }
 
+  prop_courier_release_free(pc, 1);
+
   if(pc->pc_has_cond)
     hts_cond_destroy(&pc->pc_cond);
 
+  hts_mutex_destroy(&pc->pc_mutex);
+
   free(pc->pc_name);
 
   free(pc);
@@ -5371,8 +5860,25 @@ void
 prop_courier_stop(prop_courier_t *pc)
 {
   hts_thread_detach(&pc->pc_thread);
+  hts_mutex_lock(&pc->pc_mutex);
   pc->pc_run = 0;
   pc->pc_detached = 1;
+  hts_cond_signal(&pc->pc_cond);
+  hts_mutex_unlock(&pc->pc_mutex);
+}
+
+
+/**
+ * Number of notifications dispatched and number of value updates that
+ * were merged into an already queued notification (PROP_SUB_COALESCE)
+ */
+void
+prop_courier_get_stats(prop_courier_t *pc, int *delivered, int *coalesced)
+{
+  hts_mutex_lock(&pc->pc_mutex);
+  *delivered = pc->pc_num_delivered;
+  *coalesced = pc->pc_num_coalesced;
+  hts_mutex_unlock(&pc->pc_mutex);
 }
 
 
@@ -5383,10 +5889,10 @@ void
 prop_courier_poll(prop_courier_t *pc)
 {
   struct prop_notify_queue q;
-  hts_mutex_lock(&prop_mutex);
+  hts_mutex_lock(&pc->pc_mutex);
   TAILQ_MOVE(&q, &pc->pc_queue_exp, hpn_link);
   TAILQ_MERGE(&q, &pc->pc_queue_nor, hpn_link);
-  hts_mutex_unlock(&prop_mutex);
+  hts_mutex_unlock(&pc->pc_mutex);
   prop_notify_dispatch(&q, 0);
 }
 
@@ -5400,22 +5906,14 @@ prop_courier_poll_timed(prop_courier_t *pc, int maxtime)
   if(maxtime == -1)
     return prop_courier_poll(pc);
 
-  prop_notify_t *n, *next;
-
-  if(!hts_mutex_trylock(&prop_mutex)) {
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_exp, hpn_link);
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_nor, hpn_link);
+  prop_notify_t *n;
 
-    for(n = TAILQ_FIRST(&pc->pc_free_queue); n != NULL; n = next) {
-      next = TAILQ_NEXT(n, hpn_link);
+  hts_mutex_lock(&pc->pc_mutex);
+  TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_exp, hpn_link);
+  TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_nor, hpn_link);
+  hts_mutex_unlock(&pc->pc_mutex);
 
-      prop_sub_ref_dec_locked(n->hpn_sub);
-      pool_put(notify_pool, n);
-    }
-    TAILQ_INIT(&pc->pc_free_queue);
-
-    hts_mutex_unlock(&prop_mutex);
-  }
+  prop_courier_release_free(pc, 0);
 
   int64_t ts = arch_get_ts();
 
@@ -5423,6 +5921,7 @@ prop_courier_poll_timed(prop_courier_t *pc, int maxtime)
     prop_dispatch_one(n, LOCKMGR_LOCK);
     TAILQ_REMOVE(&pc->pc_dispatch_queue, n, hpn_link);
     TAILQ_INSERT_TAIL(&pc->pc_free_queue, n, hpn_link);
+    pc->pc_num_free++;
     if(arch_get_ts() > ts + maxtime)
       break;
   }
@@ -5435,9 +5934,9 @@ prop_courier_poll_timed(prop_courier_t *pc, int maxtime)
 int
 prop_courier_check(prop_courier_t *pc)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_mutex_lock(&pc->pc_mutex);
   int r = TAILQ_FIRST(&pc->pc_queue_exp) || TAILQ_FIRST(&pc->pc_queue_nor);
-  hts_mutex_unlock(&prop_mutex);
+  hts_mutex_unlock(&pc->pc_mutex);
   return r;
 
 }
@@ -5605,13 +6104,11 @@ prop_setv_ex(prop_sub_t *skipme, prop_t *p, ...)
     if(p->hp_type == PROP_ZOMBIE)
       goto bad;
     if(p->hp_type == PROP_DIR) {
-      TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-	if(c->hp_name != NULL && !strcmp(c->hp_name, n))
-	  break;
+      c = prop_find_child(p, n);
     } else 
       c = NULL;
     if(c == NULL)
-      c = prop_create0(p, n, skipme, 0);
+      c = prop_create0(p, n, skipme);
     p = c;
   }
 
@@ -5657,13 +6154,11 @@ prop_setdn(prop_sub_t *skipme, prop_t *p, const char *str, ...)
 
 
     if(p->hp_type == PROP_DIR) {
-      TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-	if(c->hp_name != NULL && !strcmp(c->hp_name, str))
-	  break;
+      c = prop_find_child(p, str);
     } else 
       c = NULL;
     if(c == NULL)
-      c = prop_create0(p, str, skipme, 0);
+      c = prop_create0(p, str, skipme);
     p = c;
     str = s2;
   }
@@ -5681,7 +6176,7 @@ prop_setdn(prop_sub_t *skipme, prop_t *p, const char *str, ...)
  *
  */
 void
-prop_set_ex(prop_t *p, const char *name, int noalloc, ...)
+prop_set(prop_t *p, const char *name, ...)
 {
   va_list ap;
 
@@ -5691,8 +6186,31 @@ prop_set_ex(prop_t *p, const char *name, int noalloc, ...)
   hts_mutex_lock(&prop_mutex);
 
   if(p->hp_type != PROP_ZOMBIE) {
-    p = prop_create0(p, name, NULL, noalloc);
-    va_start(ap, noalloc);
+    p = prop_create0(p, name, NULL);
+    va_start(ap, name);
+    prop_seti(NULL, p, ap);
+    va_end(ap);
+  }
+  hts_mutex_unlock(&prop_mutex);
+}
+
+
+/**
+ *
+ */
+void
+prop_set_atom(prop_t *p, prop_atom_t *name, ...)
+{
+  va_list ap;
+
+  if(p == NULL)
+    return;
+
+  hts_mutex_lock(&prop_mutex);
+
+  if(p->hp_type != PROP_ZOMBIE) {
+    p = prop_create_atom0(p, name, NULL);
+    va_start(ap, name);
     prop_seti(NULL, p, ap);
     va_end(ap);
   }
@@ -6010,8 +6528,6 @@ prop_print_tree(prop_t *p, int followlinks)
 
 
 #ifdef PROP_SUB_STATS
-#include "misc/callout.h"
-
 static callout_t prop_stats_callout;
 
 static void
@@ -6055,11 +6571,27 @@ prop_report_stats(callout_t *c, void *aux)
 
 #endif
 
+/**
+ *
+ */
+static void
+prop_stats_update(void)
+{
+  prop_set_int(prop_stats_delivered, atomic_get(&prop_stat_delivered));
+  prop_set_int(prop_stats_coalesced, atomic_get(&prop_stat_coalesced));
+}
+
+
 extern void prop_test(void);
 
 void
 prop_init_late(void)
 {
+  prop_t *root = prop_create(prop_create(prop_global, "system"), "prop");
+  prop_stats_delivered = prop_create(root, "delivered");
+  prop_stats_coalesced = prop_create(root, "coalesced");
+  callout_stats_register(prop_stats_update);
+
 #ifdef PROP_SUB_STATS
   callout_arm(&prop_stats_callout, prop_report_stats, NULL, 1);
 #endif
@@ -96,10 +96,10 @@ group_find(prop_grouper_t *pg, const char *name)
   pgg = calloc(1, sizeof(pg_group_t));
   LIST_INSERT_HEAD(&pg->pg_groups, pgg, pgg_link);
   pgg->pgg_name = strdup(name);
-  pgg->pgg_root = prop_create0(pg->pg_dst, NULL, NULL, 0);
-  prop_set_string_exl(prop_create0(pgg->pgg_root, "name", NULL, 0), 
+  pgg->pgg_root = prop_create0(pg->pg_dst, NULL, NULL);
+  prop_set_string_exl(prop_create0(pgg->pgg_root, "name", NULL), 
 		      NULL, name, PROP_STR_UTF8);
-  pgg->pgg_nodes = prop_create0(pgg->pgg_root, "nodes", NULL, 0);
+  pgg->pgg_nodes = prop_create0(pgg->pgg_root, "nodes", NULL);
   return pgg;
 }
 
@@ -151,7 +151,7 @@ node_update_group(pg_node_t *pgn, const char *group)
   pgn->pgn_group = group_find(pgn->pgn_grouper, group);
   LIST_INSERT_HEAD(&pgn->pgn_group->pgg_entries, pgn, pgn_group_link);
 
-  pgn->pgn_out = prop_make(NULL, 0, NULL);
+  pgn->pgn_out = prop_make(NULL, NULL);
   prop_link0(pgn->pgn_in, pgn->pgn_out, NULL, 0, 0);
 
   prop_set_parent0(pgn->pgn_out, pgn->pgn_group->pgg_nodes, NULL, NULL);
@@ -21,6 +21,8 @@
 #define PROP_I_H__
 
 
+#include <stddef.h>
+
 #include "prop.h"
 #include "misc/pool.h"
 #include "misc/redblack.h"
@@ -43,15 +45,29 @@ TAILQ_HEAD(prop_sub_dispatch_queue, prop_sub_dispatch);
 
 
 /**
+ * pc_mutex protects the courier's pending queues (pc_queue_nor,
+ * pc_queue_exp) and pc_run so the dispatching thread never needs
+ * prop_mutex just to pick up work. The tree itself is not split,
+ * all mutations still serialize on prop_mutex.
  *
+ * Lock order is prop_mutex -> pc_mutex. Notifications are enqueued with
+ * both held, but the courier side only ever holds pc_mutex when
+ * dequeuing. Used notifications are parked on pc_free_queue (owned by
+ * the dispatching thread) and returned in batches under prop_mutex
  */
 struct prop_courier {
 
+  hts_mutex_t pc_mutex;
+
   struct prop_notify_queue pc_queue_nor;
   struct prop_notify_queue pc_queue_exp;
 
   struct prop_notify_queue pc_dispatch_queue;
   struct prop_notify_queue pc_free_queue;
+  int pc_num_free;
+
+  int pc_num_coalesced;  // Protected by pc_mutex
+  int pc_num_delivered;  // Updated by the dispatching side only
 
   void *pc_entry_lock;
   lockmgr_fn_t *pc_lockmgr;
@@ -118,12 +134,17 @@ typedef struct prop_notify {
 
   prop_t *hpn_prop_extra;
   int hpn_flags;
+  uint8_t hpn_coalesce; // Is hps_pending_value of its sub (see below)
 
 } prop_notify_t;
 
 
 prop_notify_t *prop_get_notify(prop_sub_t *s);
 
+#define PROP_COURIER_MAX_FREE 256
+
+void prop_courier_release_free(prop_courier_t *pc, int force);
+
 
 
 /**
@@ -162,7 +183,9 @@ struct prop {
   atomic_t hp_refcount;
 
   /**
-   * Property name. Protected by mutex
+   * Property name. Points to the string of a prop_atom_t we hold a
+   * reference to, so names can be compared by pointer.
+   * Protected by mutex
    */
   const char *hp_name;
 
@@ -246,12 +269,6 @@ struct prop {
    */
 #define PROP_CLIPPED_VALUE         0x1
 
-  /**
-   * hp_name is not malloc()ed but rather points to a compile const string
-   * that should not be free()d upon prop finalization
-   */
-#define PROP_NAME_NOT_ALLOCATED    0x2
-
   /**
    * We hold an xref to prop pointed to by hp_originator.
    * So do a prop_destroy0() when we unlink/destroy this prop
@@ -313,6 +330,12 @@ struct prop {
 #define PROP_HAVE_MORE               0x1000
 #define PROP_HAVE_MORE_YES           0x2000
 
+  /**
+   * This PROP_DIR has an entry in the child index table
+   * (see prop_child_index_t)
+   */
+#define PROP_HAS_CHILD_INDEX         0x4000
+
   /**
    * Tags. Protected by prop_tag_mutex
    */
@@ -377,6 +400,53 @@ struct prop {
 };
 
 
+/**
+ * Interned name
+ */
+struct prop_atom {
+  struct prop_atom *pa_next;
+  atomic_t pa_refcount;
+  unsigned int pa_hash;
+  char pa_str[0];
+};
+
+#define prop_name_atom(name) \
+  ((prop_atom_t *)((name) - offsetof(prop_atom_t, pa_str)))
+
+prop_atom_t *prop_atom_find(const char *str);
+
+void prop_atom_init(void);
+
+
+/**
+ * Hash index over the named children of a PROP_DIR
+ *
+ * Created lazily once a directory grows large (see
+ * PROP_CHILD_INDEX_THRESHOLD) and maintained on insert and unlink.
+ * Open addressing with linear probing keyed on the name atom.
+ *
+ * Only a few directories ever get this large so the indexes are kept
+ * in a separate table keyed on the directory instead of in prop_t.
+ * PROP_HAS_CHILD_INDEX in hp_flags tells if there is one.
+ *
+ * Lookups must return the same child as a walk of hp_childs would,
+ * so if two children share a name pci_slots is freed and the directory
+ * falls back to linear search for the rest of its life.
+ *
+ * Protected by global mutex
+ */
+typedef struct prop_child_index {
+  struct prop_child_index *pci_next;
+  struct prop *pci_dir;
+  struct prop **pci_slots;
+  unsigned int pci_mask;
+  unsigned int pci_count;
+} prop_child_index_t;
+
+#define PROP_CHILD_INDEX_THRESHOLD 64
+
+
+
 /**
  * This struct is used in the global dispatch (ie, where we don't
  * have a appointed courier) to maintain partial ordering of
@@ -533,6 +603,15 @@ struct prop_sub {
    */
   uint16_t hps_flags;
 
+  /**
+   * With PROP_SUB_COALESCE this is the most recent value notification
+   * still sitting in the courier queue. A new value is written into it
+   * instead of queueing another one. Cleared as soon as anything else is
+   * queued for the subscription or when the notification is picked up
+   * for dispatch. Protected by pc_mutex of the courier
+   */
+  prop_notify_t *hps_pending_value;
+
   /**
    * Extra value for use by caller
    */
@@ -554,10 +633,11 @@ void prop_ref_dec_traced_locked(prop_t *p, const char *file, int line);
 void prop_ref_dec_locked(prop_t *p);
 #endif
 
-prop_t *prop_create0(prop_t *parent, const char *name, prop_sub_t *skipme, 
-		     int flags);
+prop_t *prop_create0(prop_t *parent, const char *name, prop_sub_t *skipme);
+
+prop_t *prop_create_atom0(prop_t *parent, prop_atom_t *pa, prop_sub_t *skipme);
 
-prop_t *prop_make(const char *name, int noalloc, prop_t *parent);
+prop_t *prop_make(const char *name, prop_t *parent);
 
 void prop_make_dir(prop_t *p, prop_sub_t *skipme, const char *origin);
 
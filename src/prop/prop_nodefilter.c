@@ -31,11 +31,24 @@
 #include "prop_i.h"
 #include "prop_nodefilter.h"
 #include "misc/str.h"
+#include "misc/minmax.h"
 #include "misc/redblack.h"
 
 #define MAX_SORT_KEYS 4
 
+/**
+ * Each node keeps a 256 bit signature of the trigrams in its casefolded
+ * text. A node can only contain the filter string if its signature
+ * covers all bits of the filter's signature.
+ */
+#define NF_SIG_WORDS 4
+
+typedef struct nf_sig {
+  uint64_t w[NF_SIG_WORDS];
+} nf_sig_t;
+
 TAILQ_HEAD(nfnode_queue, nfnode);
+LIST_HEAD(nfnode_list, nfnode);
 LIST_HEAD(nfn_pred_list, nfn_pred);
 LIST_HEAD(prop_nf_pred_list, prop_nf_pred);
 RB_HEAD(nfnode_tree, nfnode);
@@ -80,10 +93,15 @@ typedef struct nfnode {
 
   struct prop_nf *nf;
   char inserted:1;
+  char fmatch;     // On nf->fmatches
+
+  char *ftext;    // Casefolded strings of the subtree, NULL when stale
+  nf_sig_t fsig;  // Trigram signature of ftext
+  LIST_ENTRY(nfnode) fmatch_link;
   char sortkey_type[MAX_SORT_KEYS];
 
 #define SORTKEY_NONE  0
-#define SORTKEY_RSTR  1
+#define SORTKEY_STR   1
 #define SORTKEY_INT   2
 #define SORTKEY_FLOAT 3
 #define SORTKEY_CSTR  4
@@ -92,7 +110,7 @@ typedef struct nfnode {
   prop_sub_t *sortsub[MAX_SORT_KEYS];
 
   union {
-    rstr_t *rstr;
+    char *key;     // From dictcmp_key()
     const char *cstr;
     int i;
     float f;
@@ -106,7 +124,7 @@ typedef struct nfnode {
 typedef struct prop_nf_pred {
   LIST_ENTRY(prop_nf_pred) pnp_link;
 
-  char **pnp_path;
+  prop_atom_t **pnp_path;
   prop_nf_cmp_t pnp_cf;
   prop_nf_mode_t pnp_mode;
   prop_sub_t *pnp_enable_sub;
@@ -145,8 +163,12 @@ typedef struct prop_nf {
   struct nfnode_tree out_tree;
 
   char *filter;
+  char *filter_folded;
+  nf_sig_t filter_sig;
+  struct nfnode_list fmatches;  // Nodes matching the current filter
 
   char *sortkey[MAX_SORT_KEYS];
+  prop_atom_t **sortpath[MAX_SORT_KEYS];
   sortmap_t *sortmap[MAX_SORT_KEYS];
 
 
@@ -239,10 +261,19 @@ eval_preds(nfnode_t *nfn)
 /**
  *
  */
-static int
-filterstr(const char *s, const char *q)
+static void
+nf_sig_compute(nf_sig_t *sig, const char *s)
 {
-  return !!mystrstr(s, q);
+  const uint8_t *p = (const uint8_t *)s;
+  memset(sig, 0, sizeof(nf_sig_t));
+
+  if(p[0] == 0 || p[1] == 0)
+    return;
+
+  for(; p[2] != 0; p++) {
+    const uint32_t t = (p[0] << 16 | p[1] << 8 | p[2]) * 2654435761U;
+    sig->w[t >> 30] |= 1ULL << ((t >> 24) & 63);
+  }
 }
 
 
@@ -250,7 +281,48 @@ filterstr(const char *s, const char *q)
  *
  */
 static int
-nf_filtercheck(prop_t *p, const char *q)
+nf_sig_covers(const nf_sig_t *node, const nf_sig_t *query)
+{
+  int i;
+  for(i = 0; i < NF_SIG_WORDS; i++)
+    if((node->w[i] & query->w[i]) != query->w[i])
+      return 0;
+  return 1;
+}
+
+
+/**
+ *
+ */
+typedef struct nf_text {
+  char *buf;
+  size_t len;
+  size_t size;
+} nf_text_t;
+
+
+/**
+ *
+ */
+static void
+nf_text_add(nf_text_t *t, const char *str)
+{
+  const size_t need = t->len + strlen(str) * 3 + 2;
+  if(need > t->size) {
+    t->size = MAX(need, t->size * 2);
+    t->buf = realloc(t->buf, t->size);
+  }
+  if(t->len > 0)
+    t->buf[t->len++] = '\n';
+  t->len += utf8_casefold(t->buf + t->len, str);
+}
+
+
+/**
+ * Collect all strings in the subtree
+ */
+static void
+nf_text_collect(nf_text_t *t, prop_t *p)
 {
   prop_t *c;
 
@@ -259,23 +331,67 @@ nf_filtercheck(prop_t *p, const char *q)
 
   switch(p->hp_type) {
   case PROP_RSTRING:
-    return filterstr(rstr_get(p->hp_rstring), q);
+    nf_text_add(t, rstr_get(p->hp_rstring));
+    break;
 
   case PROP_CSTRING:
-    return filterstr(p->hp_cstring, q);
+    nf_text_add(t, p->hp_cstring);
+    break;
 
   case PROP_URI:
-    return filterstr(rstr_get(p->hp_uri_title), q);
+    nf_text_add(t, rstr_get(p->hp_uri_title) ?: "");
+    break;
 
   case PROP_DIR:
     TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-      if(nf_filtercheck(c, q))
-	return 1;
+      nf_text_collect(t, c);
     break;
   default:
     break;
   }
-  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+nfn_filter_clear(prop_nf_t *nf, nfnode_t *nfn)
+{
+  free(nfn->ftext);
+  nfn->ftext = NULL;
+  if(nfn->fmatch) {
+    LIST_REMOVE(nfn, fmatch_link);
+    nfn->fmatch = 0;
+  }
+}
+
+
+/**
+ * Check node against the current filter, (re)building the casefolded
+ * text of the node if it has changed since last time
+ */
+static int
+nf_filtercheck(prop_nf_t *nf, nfnode_t *nfn)
+{
+  if(nfn->ftext == NULL) {
+    nf_text_t t = {0};
+    nf_text_collect(&t, nfn->in);
+    nfn->ftext = t.buf ? realloc(t.buf, t.len + 1) : strdup("");
+    nf_sig_compute(&nfn->fsig, nfn->ftext);
+  }
+
+  const int m = nf_sig_covers(&nfn->fsig, &nf->filter_sig) &&
+    strstr(nfn->ftext, nf->filter_folded) != NULL;
+
+  if(m != nfn->fmatch) {
+    if(m)
+      LIST_INSERT_HEAD(&nf->fmatches, nfn, fmatch_link);
+    else
+      LIST_REMOVE(nfn, fmatch_link);
+    nfn->fmatch = m;
+  }
+  return m;
 }
 
 
@@ -295,8 +411,8 @@ nf_egress_cmp(const nfnode_t *a, const nfnode_t *b)
       return a->sortkey_type[i] - b->sortkey_type[i];
 
     switch(a->sortkey_type[i]) {
-    case SORTKEY_RSTR:
-      r = dictcmp(rstr_get(a->sk[i].rstr), rstr_get(b->sk[i].rstr));
+    case SORTKEY_STR:
+      r = strcmp(a->sk[i].key, b->sk[i].key);
       break;
 
     case SORTKEY_CSTR:
@@ -399,8 +515,8 @@ nf_update_egress(prop_nf_t *nf, nfnode_t *nfn)
        nf->sort_hide_on_missing[i])
       en = 0;
 
-  // Check filtering
-  if(en && nf->filter != NULL && !nf_filtercheck(nfn->in, nf->filter))
+  // Check filtering, always done so fmatch is kept current
+  if(nf->filter != NULL && !nf_filtercheck(nf, nfn))
     en = 0;
 
   if(eval_preds(nfn))
@@ -411,7 +527,7 @@ nf_update_egress(prop_nf_t *nf, nfnode_t *nfn)
 
   if(en) {
     assert(nfn->out == NULL);
-    nfn->out = prop_make(nfn->in->hp_name, 1, NULL);
+    nfn->out = prop_make(nfn->in->hp_name, NULL);
     prop_link0(nfn->in, nfn->out, NULL, 0, 0);
 
     b = nfn;
@@ -442,6 +558,8 @@ nf_multi_filter(void *opaque, prop_event_t event, ...)
   nfnode_t *nfn = opaque;
   prop_nf_t *nf = nfn->nf;
 
+  free(nfn->ftext);
+  nfn->ftext = NULL;
   nf_update_egress(nf, nfn);
 }
 
@@ -467,6 +585,7 @@ nf_update_multisub(prop_nf_t *nf, nfnode_t *nfn)
 
     prop_unsubscribe0(nfn->multisub);
     nfn->multisub = NULL;
+    nfn_filter_clear(nf, nfn);
   }
 }
 
@@ -543,14 +662,14 @@ nfn_insert_pred(prop_nf_t *nf, nfnode_t *nfn, prop_nf_pred_t *pnp)
       prop_subscribe(PROP_SUB_INTERNAL | PROP_SUB_DONTLOCK,
 		     PROP_TAG_CALLBACK_STRING, nfnp_update_str, nfnp,
 		     PROP_TAG_NAMED_ROOT, nfn->in, "node",
-		     PROP_TAG_NAME_VECTOR, pnp->pnp_path,
+		     PROP_TAG_ATOM_VECTOR, pnp->pnp_path,
 		     NULL);
   } else {
     nfnp->nfnp_sub =
       prop_subscribe(PROP_SUB_INTERNAL | PROP_SUB_DONTLOCK,
 		     PROP_TAG_CALLBACK_INT, nfnp_update_int, nfnp,
 		     PROP_TAG_NAMED_ROOT, nfn->in, "node",
-		     PROP_TAG_NAME_VECTOR, pnp->pnp_path,
+		     PROP_TAG_ATOM_VECTOR, pnp->pnp_path,
 		     NULL);
   }
 }
@@ -573,8 +692,8 @@ static void
 nf_set_sortkey_x(int x, nfnode_t *nfn, prop_event_t event, va_list ap)
 {
   rstr_t *r;
-  if(nfn->sortkey_type[x] == SORTKEY_RSTR)
-    rstr_release(nfn->sk[x].rstr);
+  if(nfn->sortkey_type[x] == SORTKEY_STR)
+    free(nfn->sk[x].key);
 
   switch(event) {
   case PROP_SET_RSTRING:
@@ -589,8 +708,8 @@ nf_set_sortkey_x(int x, nfnode_t *nfn, prop_event_t event, va_list ap)
       nfn->sk[x].i = map->val;
       nfn->sortkey_type[x] = SORTKEY_INT;
     } else {
-      nfn->sk[x].rstr = rstr_dup(r);
-      nfn->sortkey_type[x] = SORTKEY_RSTR;
+      nfn->sk[x].key = dictcmp_key(rstr_get(r));
+      nfn->sortkey_type[x] = SORTKEY_STR;
     }
     break;
 
@@ -681,8 +800,8 @@ nf_update_order_x(prop_nf_t *nf, nfnode_t *nfn, int x)
 
   if(nf->sortkey[x] == NULL) {
 
-    if(nfn->sortkey_type[x] == SORTKEY_RSTR)
-      rstr_release(nfn->sk[x].rstr);
+    if(nfn->sortkey_type[x] == SORTKEY_STR)
+      free(nfn->sk[x].key);
     nfn->sortkey_type[x] = SORTKEY_NONE;
 
     nf_insert_node(nf, nfn);
@@ -697,7 +816,7 @@ nf_update_order_x(prop_nf_t *nf, nfnode_t *nfn, int x)
 		     x == 2 ? nf_set_sortkey_2 :
 		     nf_set_sortkey_3, nfn,
 		     PROP_TAG_NAMED_ROOT, nfn->in, "node",
-		     PROP_TAG_NAMESTR, nf->sortkey[x],
+		     PROP_TAG_ATOM_VECTOR, nf->sortpath[x],
 		     NULL);
   }
 }
@@ -800,6 +919,8 @@ nf_del_node(prop_nf_t *nf, nfnode_t *nfn)
   if(nfn->multisub != NULL)
     prop_unsubscribe0(nfn->multisub);
 
+  nfn_filter_clear(nf, nfn);
+
   for(i = 0; i < MAX_SORT_KEYS; i++) {
     if(nfn->sortsub[i] != NULL)
       prop_unsubscribe0(nfn->sortsub[i]);
@@ -809,8 +930,8 @@ nf_del_node(prop_nf_t *nf, nfnode_t *nfn)
     nfnp_destroy(nfnp);
 
   for(i = 0; i < MAX_SORT_KEYS; i++)
-    if(nfn->sortkey_type[i] == SORTKEY_RSTR)
-      rstr_release(nfn->sk[i].rstr);
+    if(nfn->sortkey_type[i] == SORTKEY_STR)
+      free(nfn->sk[i].key);
 
   free(nfn);
 }
@@ -855,7 +976,7 @@ static void
 nf_destroy_pred(struct prop_nf_pred *pnp)
 {
   LIST_REMOVE(pnp, pnp_link);
-  strvec_free(pnp->pnp_path);
+  prop_atom_vec_free(pnp->pnp_path);
   if(pnp->pnp_enable_sub != NULL)
     prop_unsubscribe0(pnp->pnp_enable_sub);
   free(pnp->pnp_str);
@@ -924,10 +1045,12 @@ prop_nf_release0(struct prop_nf *pnf)
 
   for(i = 0; i < MAX_SORT_KEYS; i++) {
     free(pnf->sortkey[i]);
+    prop_atom_vec_free(pnf->sortpath[i]);
     sortmap_free(pnf->sortmap[i]);
   }
 
   free(pnf->filter);
+  free(pnf->filter_folded);
 
   nf_destroy_preds(pnf);
   free(pnf);
@@ -1123,13 +1246,21 @@ static void
 nf_set_filter(void *opaque, const char *str)
 {
   prop_nf_t *nf = opaque;
-  nfnode_t *nfn;
+  nfnode_t *nfn, *next;
+  char *prev = nf->filter_folded;
 
   if(str != NULL && str[0] == 0)
     str = NULL;
 
   mystrset(&nf->filter, str);
 
+  nf->filter_folded = NULL;
+  if(nf->filter != NULL) {
+    nf->filter_folded = malloc(strlen(nf->filter) * 3 + 1);
+    utf8_casefold(nf->filter_folded, nf->filter);
+    nf_sig_compute(&nf->filter_sig, nf->filter_folded);
+  }
+
   if(nf->filter == NULL && nf->pending_have_more) {
     prop_have_more_childs0(nf->dst,
                            nf->pending_have_more == PROP_HAVE_MORE_CHILDS_YES);
@@ -1137,10 +1268,23 @@ nf_set_filter(void *opaque, const char *str)
   }
 
 
-  TAILQ_FOREACH(nfn, &nf->in, in_link) {
-    nf_update_multisub(nf, nfn);
-    nf_update_egress(nf, nfn);
+  if(prev != NULL && nf->filter_folded != NULL &&
+     strstr(nf->filter_folded, prev) != NULL) {
+    // Filter got narrower, only current matches can still match
+    for(nfn = LIST_FIRST(&nf->fmatches); nfn != NULL; nfn = next) {
+      next = LIST_NEXT(nfn, fmatch_link);
+      nf_update_egress(nf, nfn);
+    }
+  } else {
+    TAILQ_FOREACH(nfn, &nf->in, in_link)
+      nf_update_multisub(nf, nfn);
+
+    // Walk backwards so the successor of each node is already in place
+    for(nfn = TAILQ_LAST(&nf->in, nfnode_queue); nfn != NULL;
+        nfn = TAILQ_PREV(nfn, nfnode_queue, in_link))
+      nf_update_egress(nf, nfn);
   }
+  free(prev);
 }
 
 
@@ -1154,6 +1298,7 @@ prop_nf_create(prop_t *dst, prop_t *src, prop_t *filter, int flags)
   prop_nf_t *nf = calloc(1, sizeof(prop_nf_t));
   nf->flags = flags;
   TAILQ_INIT(&nf->in);
+  LIST_INIT(&nf->fmatches);
   TAILQ_INIT(&nf->out_queue);
   nf->pnf_refcount = 1 + (flags & PROP_NF_AUTODESTROY ? 1 : 0);
 
@@ -1247,7 +1392,7 @@ prop_nf_pred_add(struct prop_nf *nf,
   nfnode_t *nfn;
 
   pnp->pnp_id = ++nf->pred_tally;
-  pnp->pnp_path = strvec_split(path, '.');
+  pnp->pnp_path = prop_atom_vec_split(path, '.');
   pnp->pnp_cf = cf;
   pnp->pnp_mode = mode;
   pnp->pnp_nf = nf;
@@ -1372,6 +1517,7 @@ prop_nf_sort(struct prop_nf *nf, const char *path, int desc, unsigned int idx,
     if(path && !strcmp(path, nf->sortkey[idx]) && nf->sortorder[idx] == m)
       goto done;
     free(nf->sortkey[idx]);
+    prop_atom_vec_free(nf->sortpath[idx]);
   } else {
     if(path == NULL)
       goto done;
@@ -1383,10 +1529,12 @@ prop_nf_sort(struct prop_nf *nf, const char *path, int desc, unsigned int idx,
 
   if(path) {
     nf->sortkey[idx] = strdup(path);
+    nf->sortpath[idx] = prop_atom_vec_split(path, '.');
     nf->sortorder[idx] = m;
     nf->sort_hide_on_missing[idx] = hide_on_missing;
   } else {
     nf->sortkey[idx] = NULL;
+    nf->sortpath[idx] = NULL;
     nf->sortorder[idx] = 0;
     nf->sort_hide_on_missing[idx] = 0;
   }
@@ -44,22 +44,14 @@ int alarm_fired = 0;
 void
 prop_courier_poll_with_alarm(prop_courier_t *pc, int maxtime)
 {
-  prop_notify_t *n, *next;
+  prop_notify_t *n;
 
-  if(!hts_mutex_trylock(&prop_mutex)) {
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_exp, hpn_link);
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_nor, hpn_link);
+  hts_mutex_lock(&pc->pc_mutex);
+  TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_exp, hpn_link);
+  TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_nor, hpn_link);
+  hts_mutex_unlock(&pc->pc_mutex);
 
-    for(n = TAILQ_FIRST(&pc->pc_free_queue); n != NULL; n = next) {
-      next = TAILQ_NEXT(n, hpn_link);
-
-      prop_sub_ref_dec_locked(n->hpn_sub);
-      pool_put(notify_pool, n);
-    }
-    TAILQ_INIT(&pc->pc_free_queue);
-
-    hts_mutex_unlock(&prop_mutex);
-  }
+  prop_courier_release_free(pc, 0);
 
   if(TAILQ_FIRST(&pc->pc_dispatch_queue) == NULL)
     return;
@@ -78,6 +70,7 @@ prop_courier_poll_with_alarm(prop_courier_t *pc, int maxtime)
     prop_dispatch_one(n, LOCKMGR_LOCK);
     TAILQ_REMOVE(&pc->pc_dispatch_queue, n, hpn_link);
     TAILQ_INSERT_TAIL(&pc->pc_free_queue, n, hpn_link);
+    pc->pc_num_free++;
   }
 
   it.it_value.tv_usec = 0;
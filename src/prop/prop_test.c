@@ -24,12 +24,15 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <math.h>
+#include <ctype.h>
 #include <sys/time.h>
 
 #include "arch/atomic.h"
 
+#include "main.h"
 #include "prop.h"
 #include "prop_i.h"
+#include "prop_nodefilter.h"
 
 #ifdef PROP_DEBUG
 
@@ -318,6 +321,401 @@ prop_test2(void)
 
 
 
+/**
+ * Populate a directory with a lot of named children and look them up
+ */
+static void
+prop_test_childindex(void)
+{
+  const int num = 100000;
+  char name[32];
+  int64_t ts;
+  int i;
+
+  printf("Running child index test\n");
+
+  prop_t *r = prop_create_root(NULL);
+  prop_t **v = malloc(sizeof(prop_t *) * num);
+
+  ts = arch_get_ts();
+  for(i = 0; i < num; i++) {
+    snprintf(name, sizeof(name), "child%d", i);
+    v[i] = prop_create(r, name);
+  }
+  printf("  create: %.1f ns/child\n", (arch_get_ts() - ts) * 1000.0 / num);
+
+  ts = arch_get_ts();
+  for(i = 0; i < num; i++) {
+    snprintf(name, sizeof(name), "child%d", (i * 7919) % num);
+    prop_t *c = prop_find(r, name, NULL);
+    if(c != v[(i * 7919) % num]) {
+      printf("Lookup of %s failed\n", name);
+      exit(1);
+    }
+    prop_ref_dec(c);
+  }
+  printf("  find:   %.1f ns/child\n", (arch_get_ts() - ts) * 1000.0 / num);
+
+  // Remove every other child and make sure the rest are still found
+  ts = arch_get_ts();
+  for(i = 0; i < num; i += 2)
+    prop_destroy(v[i]);
+  printf("  delete: %.1f ns/child\n",
+         (arch_get_ts() - ts) * 1000.0 / (num / 2));
+
+  for(i = 0; i < num; i++) {
+    snprintf(name, sizeof(name), "child%d", i);
+    prop_t *c = prop_find(r, name, NULL);
+    if(c != (i & 1 ? v[i] : NULL)) {
+      printf("Lookup of %s after delete failed\n", name);
+      exit(1);
+    }
+    prop_ref_dec(c);
+  }
+
+  // Iteration order must be unaffected
+  prop_t *c;
+  i = 1;
+  TAILQ_FOREACH(c, &r->hp_childs, hp_parent_link) {
+    if(c != v[i]) {
+      printf("Child order broken at %d\n", i);
+      exit(1);
+    }
+    i += 2;
+  }
+
+  prop_destroy(r);
+  free(v);
+}
+
+
+/**
+ *
+ */
+static long
+prop_test_rss(void)
+{
+  long pages = 0, rss = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if(fp == NULL)
+    return 0;
+  if(fscanf(fp, "%ld %ld", &pages, &rss) != 2)
+    rss = 0;
+  fclose(fp);
+  return rss * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+
+/**
+ * Build something that looks like a 50k item browse page with names
+ * that are not compile time constants (as if they came from a plugin)
+ */
+static void
+prop_test_names(void)
+{
+  static const char *itemnames[] = {
+    "type", "url", "metadata", "canDelete", "enabled", NULL
+  };
+  static const char *metanames[] = {
+    "title", "album", "artist", "duration", "icon", "description", NULL
+  };
+  const int num = 50000;
+  int i, j;
+
+  printf("Running name test\n");
+
+  long rss0 = prop_test_rss();
+  int64_t ts = arch_get_ts();
+
+  prop_t *r = prop_create_root(NULL);
+  prop_t *nodes = prop_create(r, "nodes");
+
+  for(i = 0; i < num; i++) {
+    prop_t *item = prop_create(nodes, NULL);
+    prop_t *metadata = NULL;
+    for(j = 0; itemnames[j] != NULL; j++) {
+      prop_t *c = prop_create(item, itemnames[j]);
+      if(!strcmp(itemnames[j], "metadata"))
+        metadata = c;
+    }
+    for(j = 0; metanames[j] != NULL; j++)
+      prop_set_int(prop_create(metadata, metanames[j]), i);
+  }
+
+  printf("  create: %.1f ns/item, RSS grew by %ld kB\n",
+         (arch_get_ts() - ts) * 1000.0 / num, prop_test_rss() - rss0);
+
+  // All items should share the same name atoms
+  prop_t *a = TAILQ_FIRST(&nodes->hp_childs);
+  prop_t *b = TAILQ_NEXT(a, hp_parent_link);
+  if(TAILQ_FIRST(&a->hp_childs)->hp_name !=
+     TAILQ_FIRST(&b->hp_childs)->hp_name) {
+    printf("Names are not interned\n");
+    exit(1);
+  }
+
+  // Named lookups of children that already exist
+  ts = arch_get_ts();
+  for(i = 0; i < num; i++)
+    prop_create(prop_create(a, "metadata"), metanames[i % 6]);
+  printf("  lookup: %.1f ns/item\n", (arch_get_ts() - ts) * 1000.0 / num);
+
+  // Same lookups with names resolved up front
+  prop_atom_t *metadata = prop_atom_get("metadata");
+  prop_atom_t *metaatoms[6];
+  for(j = 0; j < 6; j++)
+    metaatoms[j] = prop_atom_get(metanames[j]);
+
+  ts = arch_get_ts();
+  for(i = 0; i < num; i++)
+    prop_create_atom(prop_create_atom(a, metadata), metaatoms[i % 6]);
+  printf("  atom lookup: %.1f ns/item\n",
+         (arch_get_ts() - ts) * 1000.0 / num);
+
+  if(prop_create_atom(a, metadata) != prop_create(a, "metadata")) {
+    printf("Atom and named lookup disagree\n");
+    exit(1);
+  }
+
+  for(j = 0; j < 6; j++)
+    prop_atom_release(metaatoms[j]);
+  prop_atom_release(metadata);
+
+  prop_destroy(r);
+}
+
+
+/**
+ * Multithreaded contention: Each thread updates a value in its own
+ * subtree that is observed via its own courier
+ */
+#define CONTENTION_UPDATES 100000
+
+typedef struct contention_thread {
+  prop_t *value;
+  prop_courier_t *pc;
+  prop_sub_t *sub;
+  atomic_t delivered;
+  int last;
+  hts_thread_t tid;
+} contention_thread_t;
+
+
+static void
+contention_cb(void *opaque, int value)
+{
+  contention_thread_t *ct = opaque;
+  ct->last = value;
+  atomic_inc(&ct->delivered);
+}
+
+
+static void *
+contention_writer(void *aux)
+{
+  contention_thread_t *ct = aux;
+  for(int i = 1; i <= CONTENTION_UPDATES; i++)
+    prop_set_int(ct->value, i);
+  return NULL;
+}
+
+
+static void
+prop_test_contention(void)
+{
+  char name[32];
+
+  printf("Running contention test\n");
+
+  for(int num = 1; num <= 8; num *= 2) {
+    prop_t *r = prop_create_root(NULL);
+    contention_thread_t *v = calloc(num, sizeof(contention_thread_t));
+
+    for(int i = 0; i < num; i++) {
+      contention_thread_t *ct = &v[i];
+      snprintf(name, sizeof(name), "thread%d", i);
+      ct->value = prop_create(prop_create(r, name), "value");
+      snprintf(name, sizeof(name), "contention%d", i);
+      ct->pc = prop_courier_create_thread(NULL, name, 0);
+      ct->sub = prop_subscribe(0,
+                               PROP_TAG_CALLBACK_INT, contention_cb, ct,
+                               PROP_TAG_ROOT, ct->value,
+                               PROP_TAG_COURIER, ct->pc,
+                               NULL);
+    }
+
+    int64_t ts = arch_get_ts();
+
+    for(int i = 0; i < num; i++) {
+      snprintf(name, sizeof(name), "writer%d", i);
+      hts_thread_create_joinable(name, &v[i].tid, contention_writer, &v[i],
+                                 THREAD_PRIO_MODEL);
+    }
+
+    for(int i = 0; i < num; i++)
+      hts_thread_join(&v[i].tid);
+
+    int64_t written = arch_get_ts();
+
+    for(int i = 0; i < num; i++)
+      while(v[i].last != CONTENTION_UPDATES)
+        usleep(1000);
+
+    int64_t drained = arch_get_ts();
+    int delivered = 0;
+
+    for(int i = 0; i < num; i++) {
+      prop_unsubscribe(v[i].sub);
+      prop_courier_destroy(v[i].pc);
+      delivered += atomic_get(&v[i].delivered);
+    }
+
+    printf("  %d threads: %.2f M updates/s, %.2f M notifications/s\n",
+           num,
+           num * CONTENTION_UPDATES / (double)(written - ts),
+           delivered / (double)(drained - ts));
+
+    prop_destroy(r);
+    free(v);
+  }
+}
+
+
+/**
+ * Value updates to a PROP_SUB_COALESCE subscription should merge into
+ * the notification that is already queued
+ */
+static void
+prop_test_coalesce(void)
+{
+  int delivered, coalesced;
+  const int num = 10000;
+
+  printf("Running coalesce test\n");
+
+  prop_t *r = prop_create_root(NULL);
+  prop_courier_t *pc = prop_courier_create_passive();
+
+  prop_sub_t *s = prop_subscribe(PROP_SUB_COALESCE,
+                                 PROP_TAG_CALLBACK_INT, set_testval, NULL,
+                                 PROP_TAG_ROOT, r,
+                                 PROP_TAG_COURIER, pc,
+                                 NULL);
+
+  for(int i = 1; i <= num; i++)
+    prop_set_int(r, i);
+
+  prop_courier_poll(pc);
+  CHECKTESTVAL(num);
+
+  prop_courier_get_stats(pc, &delivered, &coalesced);
+  printf("  %d updates, %d delivered, %d coalesced\n",
+         num, delivered, coalesced);
+  if(delivered != 1 || coalesced != num) {
+    printf("Coalescing failed\n");
+    exit(1);
+  }
+
+  // Nothing may be merged into a notification that has been dispatched
+  prop_set_int(r, 1);
+  prop_courier_poll(pc);
+  CHECKTESTVAL(1);
+
+  prop_unsubscribe(s);
+  prop_courier_destroy(pc);
+  prop_destroy(r);
+}
+
+
+/**
+ *
+ */
+static int
+count_childs(prop_t *p)
+{
+  prop_t *c;
+  int cnt = 0;
+  TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
+    cnt++;
+  return cnt;
+}
+
+
+/**
+ * Type a search query into a nodefilter over 50k nodes and measure how
+ * long each keystroke takes to update the output
+ */
+static void
+prop_test_nodefilter_search(void)
+{
+  static const char *words[] = {
+    "Love", "night", "Blue", "Moon", "Dance", "heart", "Fire", "rain",
+    "Summer", "dream", "Light", "Road", "Song", "Beat", "Sky", "Gold",
+  };
+  static const char *keys[] = {
+    "l", "lo", "lov", "love", "love ", "love s", "love", "lo", "sky",
+    "xyzzy", "",
+  };
+  const int num = 50000;
+  const int nwords = sizeof(words) / sizeof(words[0]);
+  char title[128], artist[64], text[sizeof(artist) + sizeof(title) + 1];
+  int i, j;
+
+  printf("Running nodefilter search test\n");
+
+  prop_t *src = prop_create_root(NULL);
+  prop_t *dst = prop_create_root(NULL);
+  prop_t *filter = prop_create_root(NULL);
+  char **texts = malloc(sizeof(char *) * num);
+
+  for(i = 0; i < num; i++) {
+    snprintf(title, sizeof(title), "%s %s %d",
+             words[rand() % nwords], words[rand() % nwords], i);
+    snprintf(artist, sizeof(artist), "The %s",
+             words[rand() % nwords]);
+    prop_t *n = prop_create_root(NULL);
+    prop_t *m = prop_create(n, "metadata");
+    prop_set(m, "title", PROP_SET_STRING, title);
+    prop_set(m, "artist", PROP_SET_STRING, artist);
+    if(prop_set_parent(n, src))
+      abort();
+    snprintf(text, sizeof(text), "%s\n%s", artist, title);
+    for(j = 0; text[j]; j++)
+      text[j] = tolower(text[j]);
+    texts[i] = strdup(text);
+  }
+
+  struct prop_nf *nf = prop_nf_create(dst, src, filter, 0);
+
+  for(j = 0; j < sizeof(keys) / sizeof(keys[0]); j++) {
+    int64_t ts = arch_get_ts();
+    prop_set_string(filter, keys[j]);
+    ts = arch_get_ts() - ts;
+
+    int expect = 0;
+    for(i = 0; i < num; i++)
+      if(strstr(texts[i], keys[j]))
+        expect++;
+
+    const int got = count_childs(dst);
+    printf("  %-8s %5d matches %6.2f ms\n",
+           keys[j][0] ? keys[j] : "(none)", got, ts / 1000.0);
+    if(got != expect) {
+      printf("Expected %d matches\n", expect);
+      exit(1);
+    }
+  }
+
+  prop_nf_release(nf);
+  prop_destroy(filter);
+  prop_destroy(dst);
+  prop_destroy(src);
+  for(i = 0; i < num; i++)
+    free(texts[i]);
+  free(texts);
+}
+
+
 /**
  *
  */
@@ -326,5 +724,10 @@ prop_test(void)
 {
   prop_test1();
   prop_test2();
+  prop_test_childindex();
+  prop_test_names();
+  prop_test_contention();
+  prop_test_coalesce();
+  prop_test_nodefilter_search();
 }
 #endif
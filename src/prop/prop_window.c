@@ -98,7 +98,7 @@ add_child(prop_window_t *pw, prop_t *p, prop_t *before)
   if(pw->pw_count >= pw->pw_win_start &&
      pw->pw_count < pw->pw_win_start + pw->pw_win_length) {
 
-    pwn->pwn_out = prop_make(NULL, 0, NULL);
+    pwn->pwn_out = prop_make(NULL, NULL);
     prop_link0(p, pwn->pwn_out, NULL, 0, 0);
     prop_set_parent0(pwn->pwn_out, pw->pw_dst, NULL, NULL);
 
@@ -21,12 +21,18 @@
 
 #include "main.h"
 #include "arch/threads.h"
+#include "arch/atomic.h"
 
 #include "task.h"
+#include "prop/prop.h"
+#include "misc/callout.h"
 #include "misc/queue.h"
 
 #define MAX_TASK_THREADS 16
 #define MAX_IDLE_TASK_THREADS 2
+#define MAX_BACKGROUND_TASK_THREADS 4
+
+#define TASK_LATENCY_BUCKETS 5
 
 TAILQ_HEAD(task_queue, task);
 TAILQ_HEAD(task_group_queue, task_group);
@@ -43,16 +49,54 @@ typedef struct task {
   task_fn_t *t_fn;
   void *t_opaque;
   task_group_t *t_group;
+  int64_t t_enqueued;
+  int t_prio;
 } task_t;
 
 
-static struct task_queue tasks = TAILQ_HEAD_INITIALIZER(tasks);
+/**
+ * Each worker thread has its own queues. Tasks created from within a
+ * task are put on the worker's own queues and executed newest first.
+ * Idle workers steal the oldest tasks from other workers.
+ *
+ * Tasks created from other threads and task groups go on the global
+ * queues protected by task_mutex
+ */
+typedef struct task_worker {
+  hts_mutex_t tw_mutex;
+  struct task_queue tw_tasks[TASK_PRIO_num];
+  atomic_t tw_num_tasks[TASK_PRIO_num];
+  hts_thread_t tw_thread;
+  int tw_used;   // Slot taken, protected by task_mutex
+  int tw_active; // tw_thread is valid
+} task_worker_t;
+
+static task_worker_t task_workers[MAX_TASK_THREADS];
+
+static struct task_queue tasks[TASK_PRIO_num];
 static struct task_group_queue task_groups =TAILQ_HEAD_INITIALIZER(task_groups);
-static unsigned int num_task_threads;
-static unsigned int num_task_threads_avail;
+static atomic_t num_task_threads;
+static atomic_t num_task_threads_avail;
+static atomic_t num_background_running;
 static hts_mutex_t task_mutex;
 static hts_cond_t task_cond;
 
+/**
+ * Number of runnable tasks (for groups, the number of groups in
+ * task_groups) per priority
+ */
+static atomic_t tasks_pending[TASK_PRIO_num];
+
+// Statistics
+static atomic_t tasks_executed[TASK_PRIO_num];
+static atomic_t task_latency[TASK_PRIO_num][TASK_LATENCY_BUCKETS];
+
+static void *task_thread(void *aux);
+
+static const int task_latency_limits[TASK_LATENCY_BUCKETS - 1] = {
+  1000, 10000, 100000, 1000000
+};
+
 
 /**
  *
@@ -67,68 +111,297 @@ task_group_release(task_group_t *tg)
 }
 
 
+/**
+ * Return the worker the calling thread is running, NULL if not a
+ * task thread. Only used to pick a queue so a stale answer just costs
+ * some locality
+ */
+static task_worker_t *
+task_current_worker(void)
+{
+  hts_thread_t self = hts_thread_current();
+  for(int i = 0; i < MAX_TASK_THREADS; i++) {
+    task_worker_t *tw = &task_workers[i];
+    if(tw->tw_active && tw->tw_thread == self)
+      return tw;
+  }
+  return NULL;
+}
+
+
 /**
  *
  */
-static void *
-task_thread(void *aux)
+static task_t *
+task_create(task_fn_t *fn, void *opaque, int prio)
+{
+  task_t *t = calloc(1, sizeof(task_t));
+  t->t_fn = fn;
+  t->t_opaque = opaque;
+  t->t_prio = prio;
+  t->t_enqueued = arch_get_ts();
+  return t;
+}
+
+
+/**
+ *
+ */
+static void
+task_execute(task_t *t)
+{
+  int64_t latency = arch_get_ts() - t->t_enqueued;
+  int i;
+
+  for(i = 0; i < TASK_LATENCY_BUCKETS - 1; i++)
+    if(latency < task_latency_limits[i])
+      break;
+
+  atomic_inc(&task_latency[t->t_prio][i]);
+  atomic_inc(&tasks_executed[t->t_prio]);
+  t->t_fn(t->t_opaque);
+}
+
+
+/**
+ * Check if there is anything for an idle worker to do
+ */
+static int
+task_runnable(void)
+{
+  return atomic_get(&tasks_pending[TASK_PRIO_INTERACTIVE]) > 0 ||
+    (atomic_get(&tasks_pending[TASK_PRIO_BACKGROUND]) > 0 &&
+     atomic_get(&num_background_running) < MAX_BACKGROUND_TASK_THREADS);
+}
+
+
+/**
+ * Wake up an idle worker or start a new one
+ */
+static void
+task_schedule(void)
+{
+  if(atomic_get(&num_task_threads_avail) == 0 &&
+     atomic_get(&num_task_threads) >= MAX_TASK_THREADS)
+    return;
+
+  hts_mutex_lock(&task_mutex);
+
+  if(atomic_get(&num_task_threads_avail) > 0) {
+    hts_cond_signal(&task_cond);
+  } else if(atomic_get(&num_task_threads) < MAX_TASK_THREADS) {
+    for(int i = 0; i < MAX_TASK_THREADS; i++) {
+      task_worker_t *tw = &task_workers[i];
+      if(tw->tw_used)
+        continue;
+      tw->tw_used = 1;
+      atomic_inc(&num_task_threads);
+      hts_thread_create_detached("tasks", task_thread, tw,
+                                 THREAD_PRIO_BGTASK);
+      break;
+    }
+  }
+  hts_mutex_unlock(&task_mutex);
+}
+
+
+/**
+ * Take the oldest task from a worker queue
+ */
+static task_t *
+task_steal(task_worker_t *tw, int prio)
 {
   task_t *t;
+
+  if(atomic_get(&tw->tw_num_tasks[prio]) == 0)
+    return NULL;
+
+  hts_mutex_lock(&tw->tw_mutex);
+  t = TAILQ_FIRST(&tw->tw_tasks[prio]);
+  if(t != NULL) {
+    TAILQ_REMOVE(&tw->tw_tasks[prio], t, t_link);
+    atomic_dec(&tw->tw_num_tasks[prio]);
+    atomic_dec(&tasks_pending[prio]);
+  }
+  hts_mutex_unlock(&tw->tw_mutex);
+  return t;
+}
+
+
+/**
+ * Run the first task of the first runnable task group
+ *
+ * Returns 1 if a task was executed
+ */
+static int
+task_group_run_one(void)
+{
   task_group_t *tg;
+  task_t *t;
+
+  if(atomic_get(&tasks_pending[TASK_PRIO_INTERACTIVE]) == 0)
+    return 0;
 
   hts_mutex_lock(&task_mutex);
-  while(1) {
-    t = TAILQ_FIRST(&tasks);
-    tg = TAILQ_FIRST(&task_groups);
+  tg = TAILQ_FIRST(&task_groups);
+  if(tg == NULL) {
+    hts_mutex_unlock(&task_mutex);
+    return 0;
+  }
 
-    if(t == NULL && tg == NULL) {
-      if(num_task_threads_avail == MAX_IDLE_TASK_THREADS)
-        break;
+  // Remove task group while processing as we don't want anyone
+  // else to dispatch from this group
+  TAILQ_REMOVE(&task_groups, tg, tg_link);
+  atomic_dec(&tasks_pending[TASK_PRIO_INTERACTIVE]);
 
-      num_task_threads_avail++;
-      hts_cond_wait(&task_cond, &task_mutex);
-      num_task_threads_avail--;
-      continue;
-    }
+  t = TAILQ_FIRST(&tg->tg_tasks);
+  hts_mutex_unlock(&task_mutex);
+  task_execute(t);
+  hts_mutex_lock(&task_mutex);
+
+  // Note that we remove _after_ execution because we don't want
+  // any newly inserted task in this group to cause the group
+  // to activate (ie, get inserted in task_groups)
+  TAILQ_REMOVE(&tg->tg_tasks, t, t_link);
+  free(t);
 
+  int more = TAILQ_FIRST(&tg->tg_tasks) != NULL;
+  if(more) {
+    // Still more tasks to work on in this group
+    // Reinsert group at tail to maintain fairness between groups
+    TAILQ_INSERT_TAIL(&task_groups, tg, tg_link);
+    atomic_inc(&tasks_pending[TASK_PRIO_INTERACTIVE]);
+  }
+  hts_mutex_unlock(&task_mutex);
+
+  if(more)
+    task_schedule();
+
+  // Decrease refcount owned by task
+  task_group_release(tg);
+  return 1;
+}
+
+
+/**
+ * Find a task of the given priority. Own queue first (newest task),
+ * then the global queue and finally steal from other workers
+ */
+static task_t *
+task_dequeue(task_worker_t *self, int prio)
+{
+  task_t *t = NULL;
+
+  if(atomic_get(&tasks_pending[prio]) == 0)
+    return NULL;
+
+  if(atomic_get(&self->tw_num_tasks[prio])) {
+    hts_mutex_lock(&self->tw_mutex);
+    t = TAILQ_LAST(&self->tw_tasks[prio], task_queue);
     if(t != NULL) {
-      TAILQ_REMOVE(&tasks, t, t_link);
-      hts_mutex_unlock(&task_mutex);
-      t->t_fn(t->t_opaque);
-      free(t);
-      hts_mutex_lock(&task_mutex);
-      // Released lock, must recheck for task groups
-      tg = TAILQ_FIRST(&task_groups);
+      TAILQ_REMOVE(&self->tw_tasks[prio], t, t_link);
+      atomic_dec(&self->tw_num_tasks[prio]);
+      atomic_dec(&tasks_pending[prio]);
     }
+    hts_mutex_unlock(&self->tw_mutex);
+    if(t != NULL)
+      return t;
+  }
 
-    if(tg != NULL) {
-      // Remove task group while processing as we don't want anyone
-      // else to dispatch from this group
-      TAILQ_REMOVE(&task_groups, tg, tg_link);
+  hts_mutex_lock(&task_mutex);
+  t = TAILQ_FIRST(&tasks[prio]);
+  if(t != NULL) {
+    TAILQ_REMOVE(&tasks[prio], t, t_link);
+    atomic_dec(&tasks_pending[prio]);
+  }
+  hts_mutex_unlock(&task_mutex);
+  if(t != NULL)
+    return t;
+
+  const int me = self - task_workers;
+  for(int i = 1; i < MAX_TASK_THREADS; i++) {
+    t = task_steal(&task_workers[(me + i) % MAX_TASK_THREADS], prio);
+    if(t != NULL)
+      return t;
+  }
+  return NULL;
+}
 
-      t = TAILQ_FIRST(&tg->tg_tasks);
-      hts_mutex_unlock(&task_mutex);
-      t->t_fn(t->t_opaque);
-      hts_mutex_lock(&task_mutex);
 
-      // Note that we remove _after_ execution because we don't want
-      // any newly inserted task in this group to cause the group
-      // to activate (ie, get inserted in task_groups)
-      TAILQ_REMOVE(&tg->tg_tasks, t, t_link);
+/**
+ * Reserve a slot for running a background task
+ */
+static int
+task_background_acquire(void)
+{
+  while(1) {
+    int v = atomic_get(&num_background_running);
+    if(v >= MAX_BACKGROUND_TASK_THREADS)
+      return 0;
+    if(atomic_cas(&num_background_running, v, v + 1))
+      return 1;
+  }
+}
+
+
+/**
+ *
+ */
+static void *
+task_thread(void *aux)
+{
+  task_worker_t *self = aux;
+  task_t *t;
+
+  self->tw_thread = hts_thread_current();
+  self->tw_active = 1;
+
+  while(1) {
+
+    if((t = task_dequeue(self, TASK_PRIO_INTERACTIVE)) != NULL) {
+      task_execute(t);
       free(t);
+      continue;
+    }
 
-      if(TAILQ_FIRST(&tg->tg_tasks) != NULL) {
-        // Still more tasks to work on in this group
-        // Reinsert group at tail to maintain fairness between groups
-        TAILQ_INSERT_TAIL(&task_groups, tg, tg_link);
+    if(task_group_run_one())
+      continue;
+
+    if(task_background_acquire()) {
+      t = task_dequeue(self, TASK_PRIO_BACKGROUND);
+      if(t != NULL)
+        task_execute(t);
+      atomic_dec(&num_background_running);
+      if(t != NULL) {
+        free(t);
+        // Someone else may have been waiting for a background slot
+        if(atomic_get(&tasks_pending[TASK_PRIO_BACKGROUND]))
+          task_schedule();
+        continue;
       }
+    }
+
+    hts_mutex_lock(&task_mutex);
 
-      // Decrease refcount owned by task
-      task_group_release(tg);
+    if(task_runnable()) {
+      hts_mutex_unlock(&task_mutex);
+      continue;
     }
+
+    if(atomic_get(&num_task_threads_avail) == MAX_IDLE_TASK_THREADS)
+      break;
+
+    atomic_inc(&num_task_threads_avail);
+    while(!task_runnable())
+      hts_cond_wait(&task_cond, &task_mutex);
+    atomic_dec(&num_task_threads_avail);
+    hts_mutex_unlock(&task_mutex);
   }
 
-  num_task_threads--;
+  // Tasks left on our own queues (if any) will be stolen by others
+  self->tw_active = 0;
+  self->tw_used = 0;
+  atomic_dec(&num_task_threads);
   hts_mutex_unlock(&task_mutex);
   return NULL;
 }
@@ -137,18 +410,24 @@ task_thread(void *aux)
 /**
  *
  */
-static void
-task_schedule()
+void
+task_run_prio(task_fn_t *fn, void *opaque, int prio)
 {
-  if(num_task_threads_avail > 0) {
-    hts_cond_signal(&task_cond);
+  task_t *t = task_create(fn, opaque, prio);
+  task_worker_t *tw = task_current_worker();
+
+  if(tw != NULL) {
+    hts_mutex_lock(&tw->tw_mutex);
+    TAILQ_INSERT_TAIL(&tw->tw_tasks[prio], t, t_link);
+    atomic_inc(&tw->tw_num_tasks[prio]);
+    hts_mutex_unlock(&tw->tw_mutex);
   } else {
-    if(num_task_threads < MAX_TASK_THREADS) {
-      num_task_threads++;
-      hts_thread_create_detached("tasks", task_thread, NULL,
-                                 THREAD_PRIO_BGTASK);
-    }
+    hts_mutex_lock(&task_mutex);
+    TAILQ_INSERT_TAIL(&tasks[prio], t, t_link);
+    hts_mutex_unlock(&task_mutex);
   }
+  atomic_inc(&tasks_pending[prio]);
+  task_schedule();
 }
 
 
@@ -158,13 +437,7 @@ task_schedule()
 void
 task_run(task_fn_t *fn, void *opaque)
 {
-  task_t *t = calloc(1, sizeof(task_t));
-  t->t_fn = fn;
-  t->t_opaque = opaque;
-  hts_mutex_lock(&task_mutex);
-  TAILQ_INSERT_TAIL(&tasks, t, t_link);
-  task_schedule();
-  hts_mutex_unlock(&task_mutex);
+  task_run_prio(fn, opaque, TASK_PRIO_INTERACTIVE);
 }
 
 
@@ -198,18 +471,18 @@ task_group_destroy(task_group_t *tg)
 void
 task_run_in_group(task_fn_t *fn, void *opaque, task_group_t *tg)
 {
-  task_t *t = calloc(1, sizeof(task_t));
-  t->t_fn = fn;
-  t->t_opaque = opaque;
+  task_t *t = task_create(fn, opaque, TASK_PRIO_INTERACTIVE);
   t->t_group = tg;
   atomic_inc(&tg->tg_refcount);
   hts_mutex_lock(&task_mutex);
-  if(TAILQ_FIRST(&tg->tg_tasks) == NULL)
+  if(TAILQ_FIRST(&tg->tg_tasks) == NULL) {
     TAILQ_INSERT_TAIL(&task_groups, tg, tg_link);
+    atomic_inc(&tasks_pending[TASK_PRIO_INTERACTIVE]);
+  }
 
   TAILQ_INSERT_TAIL(&tg->tg_tasks, t, t_link);
-  task_schedule();
   hts_mutex_unlock(&task_mutex);
+  task_schedule();
 }
 
 
@@ -220,4 +493,75 @@ INITIALIZER(taskinit)
 {
   hts_mutex_init(&task_mutex);
   hts_cond_init(&task_cond, &task_mutex);
+  for(int i = 0; i < TASK_PRIO_num; i++)
+    TAILQ_INIT(&tasks[i]);
+
+  for(int i = 0; i < MAX_TASK_THREADS; i++) {
+    task_worker_t *tw = &task_workers[i];
+    hts_mutex_init(&tw->tw_mutex);
+    for(int j = 0; j < TASK_PRIO_num; j++)
+      TAILQ_INIT(&tw->tw_tasks[j]);
+  }
+}
+
+
+/**
+ * Statistics exposed in global.system.tasks
+ */
+static prop_t *task_stats_threads;
+static prop_t *task_stats_queued[TASK_PRIO_num];
+static prop_t *task_stats_executed[TASK_PRIO_num];
+static prop_t *task_stats_latency[TASK_PRIO_num][TASK_LATENCY_BUCKETS];
+
+static const char *task_prio_names[TASK_PRIO_num] = {
+  "interactive", "background"
+};
+
+static const char *task_latency_names[TASK_LATENCY_BUCKETS] = {
+  "1ms", "10ms", "100ms", "1s", "slow"
+};
+
+
+/**
+ *
+ */
+static void
+task_stats_update(void)
+{
+  prop_set_int(task_stats_threads, atomic_get(&num_task_threads));
+
+  for(int i = 0; i < TASK_PRIO_num; i++) {
+    prop_set_int(task_stats_queued[i], atomic_get(&tasks_pending[i]));
+    prop_set_int(task_stats_executed[i], atomic_get(&tasks_executed[i]));
+    for(int j = 0; j < TASK_LATENCY_BUCKETS; j++)
+      prop_set_int(task_stats_latency[i][j],
+                   atomic_get(&task_latency[i][j]));
+  }
 }
+
+
+/**
+ *
+ */
+static void
+task_stats_init(void)
+{
+  prop_t *root = prop_create(prop_create(prop_get_global(), "system"),
+                             "tasks");
+
+  task_stats_threads = prop_create(root, "threads");
+
+  for(int i = 0; i < TASK_PRIO_num; i++) {
+    prop_t *p = prop_create(root, task_prio_names[i]);
+    task_stats_queued[i] = prop_create(p, "queued");
+    task_stats_executed[i] = prop_create(p, "executed");
+
+    // Number of tasks that started within each latency limit
+    prop_t *l = prop_create(p, "latency");
+    for(int j = 0; j < TASK_LATENCY_BUCKETS; j++)
+      task_stats_latency[i][j] = prop_create(l, task_latency_names[j]);
+  }
+  callout_stats_register(task_stats_update);
+}
+
+INITME(INIT_GROUP_API, task_stats_init, NULL, 0);
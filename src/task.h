@@ -23,8 +23,19 @@ typedef struct task_group task_group_t;
 
 typedef void (task_fn_t)(void *opaque);
 
+/**
+ * Interactive tasks are always picked before background tasks and only
+ * a few threads may run background tasks at the same time so a burst
+ * of background work can't starve the user facing parts
+ */
+#define TASK_PRIO_INTERACTIVE 0
+#define TASK_PRIO_BACKGROUND  1
+#define TASK_PRIO_num         2
+
 void task_run(task_fn_t *fn, void *opaque);
 
+void task_run_prio(task_fn_t *fn, void *opaque, int prio);
+
 task_group_t *task_group_create(void);
 
 void task_group_destroy(task_group_t *tg);
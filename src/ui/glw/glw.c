@@ -764,6 +764,9 @@ void
 glw_post_scene(glw_root_t *gr)
 {
   glw_renderer_render(gr);
+
+  if(unlikely(gr->gr_frames == 1))
+    startup_profile_mark("First frame rendered");
 #if CONFIG_GLW_REC
   if(gr->gr_rec != NULL) {
     pixmap_t *pm = gr->gr_br_read_pixels(gr);
@@ -146,7 +146,7 @@ typedef struct token {
   union {
     int  ival;
 
-    rstr_t *pnvec[TOKEN_PROPERTY_NAME_VEC_SIZE];
+    prop_atom_t *pnvec[TOKEN_PROPERTY_NAME_VEC_SIZE];
 
     struct {
       float value;
@@ -342,4 +342,6 @@ void glw_view_loader_flush(glw_root_t *gr);
 
 void glw_propname_to_array(const char *pname[16], const token_t *a);
 
+void glw_propname_to_atoms(prop_atom_t *pname[16], const token_t *a);
+
 #endif /* GLW_VIEW_H */
@@ -38,6 +38,9 @@
 #include "glw_text_bitmap.h"
 #include "prop/prop_window.h"
 #include "glw_texture.h"
+#if ENABLE_METADATA
+#include "metadata/metadata.h"
+#endif
 
 LIST_HEAD(clone_list, glw_clone);
 TAILQ_HEAD(vectorizer_element_queue, vectorizer_element);
@@ -837,7 +840,7 @@ resolve_property_name(glw_view_eval_context_t *ec, token_t *a,
   a->child = NULL;
 
   for(j = 0; j < a->t_elements; j++)
-    rstr_release(a->t_pnvec[j]);
+    prop_atom_release(a->t_pnvec[j]);
   a->type = TOKEN_PROPERTY_REF;
   a->t_prop = p;
   return 0;
@@ -1307,6 +1310,9 @@ clone_sig_handler(glw_t *w, void *opaque, glw_signal_t signal, void *extra)
   glw_root_t *gr;
   switch(signal) {
   case GLW_SIGNAL_ACTIVE:
+#if ENABLE_METADATA
+    metadata_visibility_hint(c->c_prop, 1);
+#endif
     if(!(sc->sc_sub.gps_widget->glw_class->gc_flags & GLW_DRIVE_PAGINATION))
       break;
 
@@ -1323,6 +1329,9 @@ clone_sig_handler(glw_t *w, void *opaque, glw_signal_t signal, void *extra)
     break;
 
   case GLW_SIGNAL_INACTIVE:
+#if ENABLE_METADATA
+    metadata_visibility_hint(c->c_prop, 0);
+#endif
     if(!(sc->sc_sub.gps_widget->glw_class->gc_flags & GLW_DRIVE_PAGINATION))
       break;
 
@@ -1343,6 +1352,10 @@ clone_sig_handler(glw_t *w, void *opaque, glw_signal_t signal, void *extra)
     return 1;
 
   case GLW_SIGNAL_DESTROY:
+#if ENABLE_METADATA
+    if(w->glw_flags & GLW_ACTIVE)
+      metadata_visibility_hint(c->c_prop, 0);
+#endif
     gr = w->glw_root;
     sc->sc_entries--;
     if(TAILQ_NEXT(w, glw_parent_link) != NULL)
@@ -2397,7 +2410,7 @@ subscribe_prop(glw_view_eval_context_t *ec, struct token *self, int type)
   prop_sub_t *s;
   glw_t *w = ec->w;
   int j;
-  const char *propname[16];
+  prop_atom_t *propname[16];
   prop_callback_t *cb;
   prop_t *prop = NULL;
 
@@ -2427,7 +2440,7 @@ subscribe_prop(glw_view_eval_context_t *ec, struct token *self, int type)
 
   switch(self->type) {
   case TOKEN_PROPERTY_NAME:
-    glw_propname_to_array(propname, self);
+    glw_propname_to_atoms(propname, self);
     break;
 
   case TOKEN_PROPERTY_REF:
@@ -2444,7 +2457,10 @@ subscribe_prop(glw_view_eval_context_t *ec, struct token *self, int type)
   case GPS_VALUE:
     gps = calloc(1, sizeof(glw_prop_sub_t));
     cb = prop_callback_value;
-    f |= PROP_SUB_DIRECT_UPDATE;
+    // Only the last value is rendered, so there is no point in
+    // evaluating every playback position or rate update that arrived
+    // since the last frame
+    f |= PROP_SUB_DIRECT_UPDATE | PROP_SUB_COALESCE;
     break;
 
   case GPS_CLONER: do {
@@ -2515,7 +2531,7 @@ subscribe_prop(glw_view_eval_context_t *ec, struct token *self, int type)
 
     s = prop_subscribe(f,
 		       PROP_TAG_CALLBACK, cb, gps,
-		       PROP_TAG_NAME_VECTOR, propname,
+		       PROP_TAG_ATOM_VECTOR, propname,
 		       PROP_TAG_COURIER, w->glw_root->gr_courier,
                        PROP_TAG_ROOT_VECTOR,
                        ec->scope->gs_roots, ec->scope->gs_num_roots,
@@ -2538,7 +2554,7 @@ subscribe_prop(glw_view_eval_context_t *ec, struct token *self, int type)
  done:
   if(self->type == TOKEN_PROPERTY_NAME) {
     for(j = 0; j < self->t_elements; j++)
-      rstr_release(self->t_pnvec[j]);
+      prop_atom_release(self->t_pnvec[j]);
     glw_view_free_chain(ec->gr, self->child);
     self->child = NULL;
   }
@@ -354,15 +354,12 @@ optimize_attribute_assignment(token_t *t, token_t *prev, glw_root_t *gr)
  *
  */
 static int
-propnamecmp(const char *a[16], const char *b[16])
+propnamecmp(prop_atom_t *a[16], prop_atom_t *b[16])
 {
   for(int i = 0; i < 16; i++) {
     if(a[i] == NULL && b[i] == NULL)
       return 1;
-    if(a[i] == NULL || b[i] == NULL)
-      return 0;
-
-    if(strcmp(a[i], b[i]))
+    if(a[i] != b[i])
       return 0;
   }
   abort();
@@ -386,18 +383,18 @@ scan_prop_names(token_t *rpn, token_t *prev, glw_root_t *gr)
 
   for(t = rpn->child; t != NULL; t = t->next) {
     if(t->type == TOKEN_PROPERTY_NAME) {
-      const char *tname[16];
+      prop_atom_t *tname[16];
       int tname_is_set = 0; // Call propname_to_array lazy
 
       for(u = rpn->child; u != t; u = u->next) {
         if(u->type == TOKEN_PROPERTY_NAME) {
           if(!tname_is_set) {
-            glw_propname_to_array(tname, t);
+            glw_propname_to_atoms(tname, t);
             tname_is_set = 1;
           }
 
-          const char *uname[16];
-          glw_propname_to_array(uname, u);
+          prop_atom_t *uname[16];
+          glw_propname_to_atoms(uname, u);
           if(propnamecmp(tname, uname))
             break;
         }
@@ -442,8 +439,7 @@ parse_prep_expression(token_t *expr, errorinfo_t *ei, glw_root_t *gr)
 
       t0->next = t1->next;
       t0->t_elements = 1;
-      t0->t_pnvec[0] = t1->t_rstring;
-      t1->t_rstring = NULL;
+      t0->t_pnvec[0] = prop_atom_get(rstr_get(t1->t_rstring));
 
       glw_view_token_free(gr, t1);
 
@@ -459,14 +455,17 @@ parse_prep_expression(token_t *expr, errorinfo_t *ei, glw_root_t *gr)
 
         if(t2->t_elements < TOKEN_PROPERTY_NAME_VEC_SIZE) {
           // Can still fit stuff in previous token
-          t2->t_pnvec[t2->t_elements++] = t1->t_rstring;
-          t1->t_rstring = NULL;
+          t2->t_pnvec[t2->t_elements++] =
+            prop_atom_get(rstr_get(t1->t_rstring));
           glw_view_token_free(gr, t);
           glw_view_token_free(gr, t1);
         } else {
+          rstr_t *name = t1->t_rstring;
           t1->next = NULL;
           t1->type = TOKEN_PROPERTY_NAME;
           t1->t_elements = 1;
+          t1->t_pnvec[0] = prop_atom_get(rstr_get(name));
+          rstr_release(name);
           glw_view_token_free(gr, t);
           t2->child = t1;
           t2 = t1;
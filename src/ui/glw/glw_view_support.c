@@ -121,7 +121,7 @@ glw_view_token_free(glw_root_t *gr, token_t *t)
     break;
   case TOKEN_PROPERTY_NAME:
     for(i = 0; i < t->t_elements; i++)
-      rstr_release(t->t_pnvec[i]);
+      prop_atom_release(t->t_pnvec[i]);
     break;
 
   case TOKEN_GEM:
@@ -213,7 +213,7 @@ glw_view_token_copy(glw_root_t *gr, token_t *src)
 
   case TOKEN_PROPERTY_NAME:
     for(i = 0; i < src->t_elements; i++)
-      dst->t_pnvec[i] = rstr_dup(src->t_pnvec[i]);
+      dst->t_pnvec[i] = prop_atom_dup(src->t_pnvec[i]);
     dst->t_elements = src->t_elements;
     break;
 
@@ -387,7 +387,7 @@ token2name(token_t *t)
     snprintf(buf, sizeof(buf), "<property> ");
     for(i = 0; i < t->t_elements; i++)
       snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "%s ",
-               rstr_get(t->t_pnvec[i]));
+               prop_atom_str(t->t_pnvec[i]));
     return buf;
 
   case TOKEN_RESOLVED_ATTRIBUTE:
@@ -503,6 +503,21 @@ glw_propname_to_array(const char *pname[16], const token_t *a)
   int i, j;
   for(i = 0, t = a; t != NULL && i < 16 - 1; t = t->child)
     for(j = 0; j < t->t_elements && i < 16 - 1; j++)
-      pname[i++]  = rstr_get(t->t_pnvec[j]);
+      pname[i++]  = prop_atom_str(t->t_pnvec[j]);
+  pname[i] = NULL;
+}
+
+
+/**
+ *
+ */
+void
+glw_propname_to_atoms(prop_atom_t *pname[16], const token_t *a)
+{
+  const token_t *t;
+  int i, j;
+  for(i = 0, t = a; t != NULL && i < 16 - 1; t = t->child)
+    for(j = 0; j < t->t_elements && i < 16 - 1; j++)
+      pname[i++]  = t->t_pnvec[j];
   pname[i] = NULL;
 }
@@ -516,7 +516,7 @@ gu_playdeck_add(gu_window_t *gw, GtkWidget *parent)
   
   /* Subscribe to current track position */
   pd->sub_pos = 
-    prop_subscribe(0,
+    prop_subscribe(PROP_SUB_COALESCE,
 		   PROP_TAG_NAME("global", "media", "current", "currenttime"),
 		   PROP_TAG_CALLBACK_FLOAT, update_curtime, pd,
 		   PROP_TAG_COURIER, glibcourier,
@@ -216,4 +216,13 @@ video_settings_init(void)
                  SETTING_STORE("videoplayback", "videobuffersize"),
                  SETTING_WRITE_INT(&video_settings.video_buffer_size),
                  NULL);
+
+  setting_create(SETTING_INT, s, SETTINGS_INITIAL_UPDATE,
+                 SETTING_TITLE(_p("Segments to prefetch for HLS streams")),
+                 SETTING_VALUE(3),
+                 SETTING_RANGE(0, 8),
+                 SETTING_ZERO_TEXT(_p("Off")),
+                 SETTING_STORE("videoplayback", "hlsprefetch"),
+                 SETTING_WRITE_INT(&video_settings.hls_prefetch_segments),
+                 NULL);
 }
@@ -53,6 +53,8 @@ struct video_settings {
   int seek_fwd_step;
 
   int video_buffer_size;
+
+  int hls_prefetch_segments;
 };
 
 extern struct video_settings video_settings;
@@ -0,0 +1,156 @@
+#!/usr/bin/env python
+#
+# Serve a directory containing an HLS stream over HTTP with injected
+# per-request latency and an optional bandwidth cap. If a movian
+# binary is given it is started on the stream and the startup time and
+# rebuffer count reported by the HLS backend are collected.
+#
+# Example:
+#
+#   support/hlstest.py --latency 300 --rate 4000 \
+#       --movian build.linux/movian /path/to/stream master.m3u8
+#
+
+import sys
+import os
+import re
+import time
+import argparse
+import threading
+import subprocess
+
+try:
+    from http.server import HTTPServer, SimpleHTTPRequestHandler
+    from socketserver import ThreadingMixIn
+except ImportError:
+    from BaseHTTPServer import HTTPServer
+    from SimpleHTTPServer import SimpleHTTPRequestHandler
+    from SocketServer import ThreadingMixIn
+
+
+STARTUP = re.compile('Startup time ([0-9]+) ms')
+REBUFFER = re.compile('Rebuffering \(([0-9]+) times so far\)')
+ENDED = re.compile('Playback ended after ([0-9]+) s, ([0-9]+) rebuffers')
+
+
+class Server(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+
+
+class Handler(SimpleHTTPRequestHandler):
+    latency = 0.0
+    rate = 0
+    requests = 0
+    lock = threading.Lock()
+
+    def log_message(self, fmt, *args):
+        if self.server.verbose:
+            SimpleHTTPRequestHandler.log_message(self, fmt, *args)
+
+    def send_head(self):
+        with Handler.lock:
+            Handler.requests += 1
+        time.sleep(self.latency)
+        return SimpleHTTPRequestHandler.send_head(self)
+
+    def copyfile(self, src, dst):
+        if not self.rate:
+            return SimpleHTTPRequestHandler.copyfile(self, src, dst)
+
+        chunk = max(1024, self.rate // 20)
+        start = time.time()
+        sent = 0
+        while True:
+            buf = src.read(chunk)
+            if not buf:
+                break
+            dst.write(buf)
+            sent += len(buf)
+            delay = start + float(sent) / self.rate - time.time()
+            if delay > 0:
+                time.sleep(delay)
+
+
+def run_movian(args, url):
+    cmd = [args.movian, '-d', '--no-ui', 'hls:' + url]
+    p = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                         universal_newlines=True)
+
+    startup = None
+    rebuffers = 0
+    deadline = time.time() + args.duration
+
+    def kill():
+        p.terminate()
+
+    timer = threading.Timer(args.duration, kill)
+    timer.start()
+    try:
+        for line in p.stdout:
+            if args.verbose:
+                sys.stdout.write(line)
+            m = STARTUP.search(line)
+            if m:
+                startup = int(m.group(1))
+            m = REBUFFER.search(line)
+            if m:
+                rebuffers = int(m.group(1))
+            m = ENDED.search(line)
+            if m:
+                rebuffers = int(m.group(2))
+            if time.time() > deadline:
+                break
+    finally:
+        timer.cancel()
+        p.terminate()
+        p.wait()
+
+    return startup, rebuffers
+
+
+def main():
+    ap = argparse.ArgumentParser(description='HLS latency test harness')
+    ap.add_argument('directory', help='Directory to serve')
+    ap.add_argument('playlist', nargs='?', default='index.m3u8',
+                    help='Playlist relative to directory')
+    ap.add_argument('--port', type=int, default=8642)
+    ap.add_argument('--latency', type=int, default=0,
+                    help='Delay in ms before each response')
+    ap.add_argument('--rate', type=int, default=0,
+                    help='Per-connection bandwidth cap in kbit/s')
+    ap.add_argument('--movian', help='Path to movian binary')
+    ap.add_argument('--duration', type=int, default=60,
+                    help='Seconds to play before stopping movian')
+    ap.add_argument('-v', '--verbose', action='store_true')
+    args = ap.parse_args()
+
+    os.chdir(args.directory)
+
+    Handler.latency = args.latency / 1000.0
+    Handler.rate = args.rate * 1000 // 8
+
+    httpd = Server(('127.0.0.1', args.port), Handler)
+    httpd.verbose = args.verbose
+    url = 'http://127.0.0.1:%d/%s' % (args.port, args.playlist)
+
+    if not args.movian:
+        print('Serving %s with %d ms latency' % (url, args.latency))
+        httpd.serve_forever()
+        return
+
+    t = threading.Thread(target=httpd.serve_forever)
+    t.daemon = True
+    t.start()
+
+    startup, rebuffers = run_movian(args, url)
+    httpd.shutdown()
+
+    print('latency:   %d ms' % args.latency)
+    print('requests:  %d' % Handler.requests)
+    print('startup:   %s' % ('%d ms' % startup if startup is not None
+                             else 'never started'))
+    print('rebuffers: %d' % rebuffers)
+
+
+if __name__ == '__main__':
+    main()